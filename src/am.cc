@@ -2,6 +2,7 @@
 
 #include "am.h"
 
+#include <algorithm>
 #include "status.h"
 #include "matrix.h"
 #include "math.h"
@@ -14,7 +15,10 @@ AcousticModel::AcousticModel() :
     left_context_(0),
     right_context_(0),
     num_pdfs_(0),
-    chunk_size_(0) {
+    chunk_size_(0),
+    incremental_(false),
+    prior_fused_(false),
+    frame_subsampling_factor_(1) {
 }
 
 AcousticModel::~AcousticModel() {
@@ -23,39 +27,107 @@ AcousticModel::~AcousticModel() {
   num_pdfs_ = 0;
 }
 
-Status AcousticModel::Read(const Configuration &conf) {
+Status AcousticModel::Read(const Configuration &conf, const Bundle *bundle) {
   Status status;
 
-  // Read nnet
-  std::string nnet_filename;
-  status = conf.GetPath("nnet", &nnet_filename);
-  if (!status.ok()) return status;
-
+  // Read nnet. It is copied into heap even in bundle since the layers own
+  // their weights
   util::ReadableFile fd;
-  PK_CHECK_STATUS(fd.Open(nnet_filename));
+  PK_CHECK_STATUS(OpenModelFile(conf, bundle, "nnet", &fd));
   PK_CHECK_STATUS(nnet_.Read(&fd));
   fd.Close();
 
-  // Read prior
-  std::string prior_filename;
-  PK_CHECK_STATUS(conf.GetPath("prior", &prior_filename));
-  PK_CHECK_STATUS(fd.Open(prior_filename));
-  PK_CHECK_STATUS(log_prior_.Read(&fd));
-  log_prior_.ApplyLog();
-  fd.Close();
+  // Read prior. It is optional, chain models output log-likelihood directly
+  bool has_prior = (bundle && bundle->Has("prior")) ||
+                   !conf.GetPathOrElse("prior", "").empty();
+  if (has_prior) {
+    PK_CHECK_STATUS(OpenModelFile(conf, bundle, "prior", &fd));
+    PK_CHECK_STATUS(log_prior_.Read(&fd));
+    log_prior_.ApplyLog();
+    fd.Close();
+  }
 
   // Read left and right context
   PK_CHECK_STATUS(conf.GetInteger("left_context", &left_context_));
   PK_CHECK_STATUS(conf.GetInteger("right_context", &right_context_));
   PK_CHECK_STATUS(conf.GetInteger("chunk_size", &chunk_size_));
 
+  // Fuse the layers of nnet unless nnet_fuse is 0. If the prior is fused into
+  // the last layer, it is not subtracted in ApplyPrior()
+  if (conf.GetIntegerOrElse("nnet_fuse", 1) != 0) {
+    prior_fused_ = nnet_.Fuse(has_prior ? &log_prior_ : nullptr);
+  }
+
+  // Output one of frame_subsampling_factor frames. The first frame of each
+  // batch should be an output frame
+  frame_subsampling_factor_ = conf.GetIntegerOrElse(
+      "frame_subsampling_factor",
+      1);
+  if (frame_subsampling_factor_ < 1 ||
+      chunk_size_ % frame_subsampling_factor_ != 0) {
+    return Status::Corruption(util::Format(
+        "chunk_size {} should be a multiple of frame_subsampling_factor {}: {}",
+        chunk_size_,
+        frame_subsampling_factor_,
+        conf.filename()));
+  }
+  if (!nnet_.SetFrameSubsampling(frame_subsampling_factor_)) {
+    return Status::Corruption(util::Format(
+        "nnet could not be subsampled by {}: {}",
+        frame_subsampling_factor_,
+        conf.filename()));
+  }
+
+  // With nnet_int8, the float linear layers are quantized into 8-bit after
+  // loading. Layers quantized offline are always 8-bit
+  if (conf.GetIntegerOrElse("nnet_int8", 0) != 0) {
+    nnet_.Quantize();
+  }
+
+  // The float SpliceLayer and LinearLayer after it are fused into a TdnnLayer,
+  // which never materializes the spliced frames
+  if (conf.GetIntegerOrElse("nnet_fuse", 1) != 0) {
+    nnet_.FuseTdnn();
+  }
+
+  // With gemm_threads > 0, the float and 8-bit GEMMs of nnet run with exactly
+  // gemm_threads threads, instead of the threads of OpenBLAS. Side effect:
+  // gemm_threads > 1 sets OpenBLAS to one thread for the whole process
+  int gemm_threads = conf.GetIntegerOrElse("gemm_threads", 0);
+  if (gemm_threads > 0) {
+    gemm_context_.reset(new GemmContext(gemm_threads));
+    nnet_.set_gemm_context(gemm_context_.get());
+  }
+  PK_DEBUG(util::Format("nnet: {}", nnet_.Plan()));
+
+  // Incremental propagation is used when the nnet supports it, unless
+  // nnet_incremental is 0
+  incremental_ = conf.GetIntegerOrElse("nnet_incremental", 1) != 0 &&
+                 nnet_.SupportsIncremental() &&
+                 nnet_.left_context() == left_context_ &&
+                 nnet_.right_context() == right_context_;
+
+  // The recurrent layers need the frames of a stream in order, instead of
+  // the overlapped batches
+  if (!incremental_ && nnet_.HasRecurrentLayer()) {
+    return Status::Corruption(util::Format(
+        "recurrent nnet requires incremental propagation: {}",
+        conf.filename()));
+  }
+
+  // With am_batch_streams > 1, the chunks of at most am_batch_streams
+  // concurrent streams are propagated in one batch
+  int batch_streams = conf.GetIntegerOrElse("am_batch_streams", 1);
+  if (batch_streams > 1 && !incremental_) {
+    PK_WARN("am_batch_streams requires incremental propagation of nnet");
+  } else if (batch_streams > 1) {
+    scheduler_.reset(new Scheduler(this, batch_streams));
+  }
+
   // Read tid2pdf_
-  std::string tid2pdf_filename;
   status = conf.GetInteger("num_pdfs", &num_pdfs_);
   if (!status.ok()) return status;
-  status = conf.GetPath("tid2pdf", &tid2pdf_filename);
-  if (!status.ok()) return status;
-  status = fd.Open(tid2pdf_filename);
+  status = OpenModelFile(conf, bundle, "tid2pdf", &fd);
   if (!status.ok()) return status;
   status = tid2pdf_.Read(&fd);
   if (!status.ok()) return status;
@@ -65,13 +137,30 @@ Status AcousticModel::Read(const Configuration &conf) {
 
 void AcousticModel::AppendFrame(Instance *inst,
                                 const VectorBase<float> &frame_feat) const {
-  Vector<float> frame(frame_feat.Dim());
-  frame.CopyFromVec(frame_feat);
-  inst->feats_buffer.emplace_back(std::move(frame));
+  // Resize() keeps the frames in buffer (see Matrix::Resize())
+  Matrix<float> &feats = inst->feats_buffer;
+  int num_frames = feats.NumRows();
+  feats.Reserve(num_frames + 1, frame_feat.Dim());
+  feats.Resize(num_frames + 1, frame_feat.Dim(), Matrix<float>::kUndefined);
+  feats.Row(num_frames).CopyFromVec(frame_feat);
+}
+
+void AcousticModel::DropFrames(Instance *inst, int num_frames) const {
+  Matrix<float> &feats = inst->feats_buffer;
+  int num_left = feats.NumRows() - num_frames;
+  assert(num_left >= 0 && "DropFrames: insufficient data");
+  if (num_left == 0) {
+    feats.Resize(0, 0);
+    return;
+  }
+  for (int i = 0; i < num_left; ++i) {
+    feats.Row(i).CopyFromVec(feats.Row(num_frames + i));
+  }
+  feats.Resize(num_left, feats.NumCols(), Matrix<float>::kUndefined);
 }
 
 bool AcousticModel::BatchAvailable(Instance *inst) const {
-  int frames_available = inst->feats_buffer.size();
+  int frames_available = inst->feats_buffer.NumRows();
   if (frames_available >= left_context_ + right_context_ + chunk_size_) {
     return true;
   } else {
@@ -83,7 +172,7 @@ void AcousticModel::ComputeBatch(Instance *inst,
                                  int batch_size,
                                  Matrix<float> *log_prob) const {
   if (batch_size == kBatchSizeAll) {
-    batch_size = inst->feats_buffer.size() - left_context_ - right_context_;
+    batch_size = inst->feats_buffer.NumRows() - left_context_ - right_context_;
     assert(batch_size > 0 && "ComputeBatch: insufficient data");
   }
   if (batch_size == 0) {
@@ -91,21 +180,41 @@ void AcousticModel::ComputeBatch(Instance *inst,
     return;
   }
 
-  // Prepare input matrix
+  // The first frames in buffer are the input
   int batch_input_size = batch_size + left_context_ + right_context_;
-  assert(inst->feats_buffer.size() >= batch_input_size &&
+  assert(inst->feats_buffer.NumRows() >= batch_input_size &&
          "ComputeBatch: insufficient data");
-  int feat_dim = inst->feats_buffer[0].Dim();
-  Matrix<float> batch_input(batch_input_size, feat_dim);
-  for (int i = 0; i < batch_input_size; ++i) {
-    batch_input.Row(i).CopyFromVec(inst->feats_buffer[i]);
-  }
+  SubMatrix<float> batch_input(
+      inst->feats_buffer,
+      0,
+      batch_input_size,
+      0,
+      inst->feats_buffer.NumCols());
 
   // Propogate through nn
-  nnet_.Propagate(batch_input, log_prob);
-  assert(log_prob->NumRows() == batch_size && "invalid nnet");
+  nnet_.Propagate(&inst->nnet_inst, batch_input, log_prob);
+  assert(log_prob->NumRows() ==
+             (batch_size - 1) / frame_subsampling_factor_ + 1 &&
+         "invalid nnet");
 
   // Compute log-likelihood
+  ApplyPrior(log_prob);
+}
+
+void AcousticModel::ComputeIncremental(Instance *inst,
+                                       Matrix<float> *log_prob) const {
+  if (inst->feats_buffer.NumRows() == 0) {
+    log_prob->Resize(0, 0);
+    return;
+  }
+
+  nnet_.PropagateIncremental(&inst->nnet_inst, inst->feats_buffer, log_prob);
+  inst->feats_buffer.Resize(0, 0);
+  ApplyPrior(log_prob);
+}
+
+void AcousticModel::ApplyPrior(Matrix<float> *log_prob) const {
+  if (prior_fused_ || log_prior_.Dim() == 0) return;
   for (int r = 0; r < log_prob->NumRows(); ++r) {
     SubVector<float> row = log_prob->Row(r);
     row.AddVec(-1.0f, log_prior_);
@@ -117,6 +226,11 @@ void AcousticModel::Process(Instance *inst,
                             Matrix<float> *log_prob) const {
   // Add left padding frames
   if (!inst->started) {
+    // The largest batch is the last one, which has the right padding frames
+    int max_rows = chunk_size_ + left_context_ + 2 * right_context_;
+    inst->feats_buffer.Reserve(max_rows, frame_feat.Dim());
+    nnet_.Reserve(&inst->nnet_inst, max_rows, frame_feat.Dim());
+
     for (int i = 0; i < left_context_; ++i) {
       AppendFrame(inst, frame_feat);
     }
@@ -126,6 +240,22 @@ void AcousticModel::Process(Instance *inst,
   // Add current frame
   AppendFrame(inst, frame_feat);
 
+  // In incremental propagation, the context frames are in the nnet state, so
+  // only chunk_size new frames are needed
+  if (incremental_) {
+    if (inst->feats_buffer.NumRows() < chunk_size_) {
+      log_prob->Resize(0, 0);
+      return;
+    }
+    inst->last_frame.Resize(frame_feat.Dim());
+    inst->last_frame.CopyFromVec(frame_feat);
+    if (scheduler_) {
+      scheduler_->Compute(inst, log_prob);
+    } else {
+      ComputeIncremental(inst, log_prob);
+    }
+    return;
+  }
   
   if (!BatchAvailable(inst)) {
     log_prob->Resize(0, 0);
@@ -136,26 +266,45 @@ void AcousticModel::Process(Instance *inst,
   ComputeBatch(inst, chunk_size_, log_prob);
 
   // Remove useless frames
-  for (int i = 0; i < chunk_size_; ++i) {
-    inst->feats_buffer.pop_front();
-  }
+  DropFrames(inst, chunk_size_);
 }
 
 void AcousticModel::EndOfStream(Instance *inst, Matrix<float> *log_prob) const {
+  if (incremental_) {
+    if (!inst->started) {
+      log_prob->Resize(0, 0);
+      return;
+    }
+
+    // Add right padding frames
+    const Matrix<float> &feats = inst->feats_buffer;
+    if (feats.NumRows() != 0) {
+      inst->last_frame.Resize(feats.NumCols());
+      inst->last_frame.CopyFromVec(feats.Row(feats.NumRows() - 1));
+    }
+    for (int i = 0; i < right_context_; ++i) {
+      AppendFrame(inst, inst->last_frame);
+    }
+    ComputeIncremental(inst, log_prob);
+    return;
+  }
+
   // Do nothing if feature buffer is empty
-  if (inst->feats_buffer.empty()) {
+  const Matrix<float> &feats = inst->feats_buffer;
+  if (feats.NumRows() == 0) {
     log_prob->Resize(0, 0);
     return;
   }
 
   // Add right padding frames
-  const VectorBase<float> &last_frame = inst->feats_buffer.back();
+  inst->last_frame.Resize(feats.NumCols());
+  inst->last_frame.CopyFromVec(feats.Row(feats.NumRows() - 1));
   for (int i = 0; i < right_context_; ++i) {
-    AppendFrame(inst, last_frame);
+    AppendFrame(inst, inst->last_frame);
   }
 
   // Do nothing when no enough frames to compute
-  if (inst->feats_buffer.size() <= left_context_ + right_context_) {
+  if (feats.NumRows() <= left_context_ + right_context_) {
     log_prob->Resize(0, 0);
     return;
   }
@@ -163,4 +312,92 @@ void AcousticModel::EndOfStream(Instance *inst, Matrix<float> *log_prob) const {
   ComputeBatch(inst, kBatchSizeAll, log_prob);
 }
 
+AcousticModel::Scheduler::Scheduler(const AcousticModel *am, int max_streams):
+    am_(am),
+    max_streams_(max_streams),
+    leading_(false) {
+}
+
+void AcousticModel::Scheduler::Compute(Instance *inst,
+                                       Matrix<float> *log_prob) {
+  Request request{inst, log_prob, false};
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_.push_back(&request);
+  while (!request.done) {
+    if (leading_) {
+      done_cond_.wait(lock);
+      continue;
+    }
+
+    // Become the leader. request may not be in this batch when there are more
+    // than max_streams_ requests before it
+    leading_ = true;
+    int batch_size = std::min<int>(max_streams_, pending_.size());
+    batch_.assign(pending_.begin(), pending_.begin() + batch_size);
+    pending_.erase(pending_.begin(), pending_.begin() + batch_size);
+    lock.unlock();
+    ComputeBatch();
+    lock.lock();
+
+    for (Request *batch_request : batch_) batch_request->done = true;
+    leading_ = false;
+    done_cond_.notify_all();
+  }
+}
+
+void AcousticModel::Scheduler::ComputeBatch() {
+  // Collect the frames of all streams
+  streams_.clear();
+  num_rows_.clear();
+  int total_rows = 0;
+  for (const Request *request : batch_) {
+    streams_.push_back(&request->inst->nnet_inst);
+    num_rows_.push_back(request->inst->feats_buffer.NumRows());
+    total_rows += request->inst->feats_buffer.NumRows();
+  }
+  int feat_dim = batch_[0]->inst->feats_buffer.NumCols();
+  int max_rows = max_streams_ * (am_->chunk_size_ + am_->right_context_);
+  nnet_input_.Reserve(max_rows, feat_dim);
+  am_->nnet_.Reserve(&nnet_inst_, max_rows, feat_dim);
+
+  nnet_input_.Resize(total_rows, feat_dim, Matrix<float>::kUndefined);
+  int row = 0;
+  for (const Request *request : batch_) {
+    Matrix<float> &feats = request->inst->feats_buffer;
+    if (feats.NumRows() == 0) continue;
+    nnet_input_.Range(row, feats.NumRows(), 0, feat_dim).CopyFromMat(feats);
+    row += feats.NumRows();
+    feats.Resize(0, 0);
+  }
+
+  am_->nnet_.PropagateIncremental(
+      &nnet_inst_,
+      streams_,
+      nnet_input_,
+      &num_rows_,
+      &nnet_output_);
+  am_->ApplyPrior(&nnet_output_);
+
+  // Scatter the log-likelihood to each stream
+  row = 0;
+  for (int i = 0; i < batch_.size(); ++i) {
+    Matrix<float> *log_prob = batch_[i]->log_prob;
+    if (num_rows_[i] == 0) {
+      log_prob->Resize(0, 0);
+      continue;
+    }
+    log_prob->Resize(
+        num_rows_[i],
+        nnet_output_.NumCols(),
+        Matrix<float>::kUndefined);
+    log_prob->CopyFromMat(SubMatrix<float>(
+        nnet_output_,
+        row,
+        num_rows_[i],
+        0,
+        nnet_output_.NumCols()));
+    row += num_rows_[i];
+  }
+}
+
 }  // namespace pocketkaldi
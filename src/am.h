@@ -3,11 +3,15 @@
 #ifndef POCKETKALDI_AM_H_
 #define POCKETKALDI_AM_H_
 
+#include <condition_variable>
 #include <deque>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include "nnet.h"
 #include "util.h"
 #include "configuration.h"
+#include "bundle.h"
 
 #define PK_AM_SECTION "AM~0"
 
@@ -24,14 +28,18 @@ class AcousticModel {
   // Stores the instance data of AM
   class Instance;
 
+  // Batches the chunks of concurrent streams
+  class Scheduler;
+
   // Indicates using all available frames as a batch
   static constexpr int kBatchSizeAll = -1;
 
   AcousticModel();
   ~AcousticModel();
 
-  // Read AcousticModel from configuration file
-  Status Read(const Configuration &conf);
+  // Read AcousticModel from configuration file. If bundle is not nullptr, the
+  // model files in it are used instead of the paths in conf
+  Status Read(const Configuration &conf, const Bundle *bundle = nullptr);
 
   // Gets the map from transition-id to pdf-id
   const Vector<int32_t> &TransitionPdfIdMap() const {
@@ -49,6 +57,12 @@ class AcousticModel {
   // Number of PDFs in this AM
   int num_pdfs() const { return num_pdfs_; }
 
+  // The AM outputs one frame for each frame_subsampling_factor() input frames
+  int frame_subsampling_factor() const { return frame_subsampling_factor_; }
+
+  // Layers of nnet after fusion, like "Linear+ReLU -> Splice"
+  std::string NnetPlan() const { return nnet_.Plan(); }
+
  private:
   Nnet nnet_;
   Vector<float> log_prior_;
@@ -58,10 +72,29 @@ class AcousticModel {
   int num_pdfs_;
   Vector<int32_t> tid2pdf_;
 
+  // If true, the frames are propagated incrementally and the context frames
+  // are not recomputed in each chunk
+  bool incremental_;
+
+  // If true, log_prior_ is subtracted in the last layer of nnet_
+  bool prior_fused_;
+
+  int frame_subsampling_factor_;
+
+  // Batches the chunks of streams in incremental propagation, nullptr if
+  // am_batch_streams is 1
+  std::unique_ptr<Scheduler> scheduler_;
+
+  // Runs the GEMMs of nnet_, nullptr if gemm_threads is 0
+  std::unique_ptr<GemmContext> gemm_context_;
 
   // Add a frame of featue into the back of feats_buffer
   void AppendFrame(Instance *inst, const VectorBase<float> &frame_feat) const;
 
+  // Removes the first num_frames frames of feats_buffer, the rest frames are
+  // moved to the front
+  void DropFrames(Instance *inst, int num_frames) const;
+
   // Returns true if a batch is available to compute
   bool BatchAvailable(Instance *inst) const;
 
@@ -70,6 +103,12 @@ class AcousticModel {
   void ComputeBatch(Instance *inst,
                     int batch_size,
                     Matrix<float> *log_prob) const;
+
+  // Propagates all the frames in buffer incrementally, then clears the buffer
+  void ComputeIncremental(Instance *inst, Matrix<float> *log_prob) const;
+
+  // Subtracts log-prior from the log-posterior of each frame
+  void ApplyPrior(Matrix<float> *log_prob) const;
 };
 
 // Stores the instance data of AM
@@ -79,12 +118,68 @@ class AcousticModel::Instance {
 
  private:
   bool started;
-  std::deque<Vector<float>> feats_buffer;
+
+  // Frames to propagate, one frame in each row. It is the input batch of
+  // nnet. Both of them are reserved for the largest batch when stream starts,
+  // so that frames are appended and dropped in place
+  Matrix<float> feats_buffer;
+
+  // Workspace of nnet
+  Nnet::Instance nnet_inst;
+
+  // For incremental propagation, the last frame of stream
+  Vector<float> last_frame;
 
   friend class AcousticModel;
   DISALLOW_COPY_AND_ASSIGN(Instance);
 };
 
+// Scheduler batches the chunks of the streams processed in different threads,
+// so that the nnet is propagated once for them and the weights are read from
+// memory once per batch instead of once per stream. The threads with a ready
+// chunk queue it up. If no thread is computing, one of them becomes the
+// leader, takes at most max_streams chunks from the queue, propagates them in
+// one batch and wakes up their threads. The chunks queued when the leader is
+// busy make the next batch, so a single stream is never delayed by waiting for
+// others
+class AcousticModel::Scheduler {
+ public:
+  Scheduler(const AcousticModel *am, int max_streams);
+
+  // Computes the log-likelihood of the frames in the buffer of inst, together
+  // with the chunks from other threads. It returns when the chunk of inst is
+  // computed
+  void Compute(Instance *inst, Matrix<float> *log_prob);
+
+ private:
+  struct Request {
+    Instance *inst;
+    Matrix<float> *log_prob;
+    bool done;
+  };
+
+  // Propagates the requests in batch_, called by the leader without lock
+  void ComputeBatch();
+
+  const AcousticModel *am_;
+  int max_streams_;
+
+  std::mutex mutex_;
+  std::condition_variable done_cond_;
+  std::deque<Request *> pending_;
+  bool leading_;
+
+  // The batch and the workspace of leader
+  std::vector<Request *> batch_;
+  std::vector<Nnet::Instance *> streams_;
+  std::vector<int> num_rows_;
+  Nnet::Instance nnet_inst_;
+  Matrix<float> nnet_input_;
+  Matrix<float> nnet_output_;
+
+  DISALLOW_COPY_AND_ASSIGN(Scheduler);
+};
+
 
 }  // namespace pocketkaldi
 
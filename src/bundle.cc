@@ -0,0 +1,268 @@
+// Created at 2026-10-18
+
+#include "bundle.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include "configuration.h"
+
+namespace pocketkaldi {
+
+const char *Bundle::kSectionName = "pk::bundle_0";
+
+namespace {
+
+// Size of one entry in section
+constexpr int kEntrySize = Bundle::kNameSize + sizeof(int64_t) * 2;
+
+// Writes n bytes into fd
+Status WriteBytes(FILE *fd, const void *data, int64_t n) {
+  if (n > 0 && fwrite(data, 1, n, fd) != n) {
+    return Status::IOError("failed to write bundle");
+  }
+  return Status::OK();
+}
+
+// Writes zeros to pad the file to alignment
+Status WritePadding(FILE *fd, int64_t *pos, int alignment) {
+  std::array<char, 4096> zeros;
+  zeros.fill(0);
+  while (*pos % alignment != 0) {
+    int64_t n = std::min<int64_t>(
+        zeros.size(),
+        alignment - *pos % alignment);
+    PK_CHECK_STATUS(WriteBytes(fd, zeros.data(), n));
+    *pos += n;
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+Bundle::Bundle(): data_(nullptr), size_(0) {}
+
+Bundle::~Bundle() {
+  if (data_) munmap(data_, size_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+Status Bundle::Open(const std::string &filename) {
+  filename_ = filename;
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Status::IOError(util::Format("Unable to open {}", filename));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return Status::IOError(util::Format("Unable to stat {}", filename));
+  }
+  size_ = st.st_size;
+
+  // MAP_SHARED: pages are shared with the other processes mapping this file
+  void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    size_ = 0;
+    return Status::IOError(util::Format("Unable to mmap {}", filename));
+  }
+  data_ = static_cast<char *>(data);
+
+  // Section header
+  constexpr int kHeaderSize = kNameSize + sizeof(int32_t) * 2;
+  if (size_ < kHeaderSize) {
+    return Status::Corruption(util::Format("{}: file too small", filename));
+  }
+  std::array<char, kNameSize> section_name;
+  memcpy(section_name.data(), data_, kNameSize);
+  section_name.back() = '\0';
+  if (std::string(section_name.data()) != kSectionName) {
+    return Status::Corruption(util::Format(
+        "{}: section {} expected",
+        filename,
+        kSectionName));
+  }
+  int32_t section_size, num_entries;
+  memcpy(&section_size, data_ + kNameSize, sizeof(int32_t));
+  memcpy(&num_entries, data_ + kNameSize + sizeof(int32_t), sizeof(int32_t));
+  int64_t expected_section_size =
+      sizeof(int32_t) + static_cast<int64_t>(num_entries) * kEntrySize;
+  if (num_entries < 0 ||
+      section_size != expected_section_size ||
+      kNameSize + sizeof(int32_t) + section_size > size_) {
+    return Status::Corruption(util::Format(
+        "section_size == {} expected, but {} found",
+        expected_section_size,
+        section_size));
+  }
+
+  // Entries
+  entries_.clear();
+  const char *entry = data_ + kHeaderSize;
+  for (int i = 0; i < num_entries; ++i) {
+    std::array<char, kNameSize + 1> name;
+    memcpy(name.data(), entry, kNameSize);
+    name.back() = '\0';
+    int64_t offset, size;
+    memcpy(&offset, entry + kNameSize, sizeof(int64_t));
+    memcpy(&size, entry + kNameSize + sizeof(int64_t), sizeof(int64_t));
+    if (offset < 0 || size < 0 || offset + size > size_) {
+      return Status::Corruption(util::Format(
+          "{}: invalid entry {}",
+          filename,
+          name.data()));
+    }
+    entries_[name.data()] = std::make_pair(offset, size);
+    entry += kEntrySize;
+  }
+
+  return Status::OK();
+}
+
+Status Bundle::Get(const std::string &name,
+                   const char **data,
+                   int64_t *size) const {
+  auto it = entries_.find(name);
+  if (it == entries_.end()) {
+    return Status::Corruption(util::Format(
+        "Unable to find entry '{}' in '{}'",
+        name,
+        filename_));
+  }
+
+  *data = data_ + it->second.first;
+  *size = it->second.second;
+  return Status::OK();
+}
+
+Status Bundle::Offset(const std::string &name, int64_t *offset) const {
+  auto it = entries_.find(name);
+  if (it == entries_.end()) {
+    return Status::Corruption(util::Format(
+        "Unable to find entry '{}' in '{}'",
+        name,
+        filename_));
+  }
+
+  *offset = it->second.first;
+  return Status::OK();
+}
+
+Status Bundle::OpenFile(const std::string &name,
+                        util::ReadableFile *fd) const {
+  const char *data = nullptr;
+  int64_t size = 0;
+  PK_CHECK_STATUS(Get(name, &data, &size));
+  return fd->OpenMemory(data, size, util::Format("{}:{}", filename_, name));
+}
+
+Status Bundle::Write(
+    const std::string &filename,
+    const std::vector<std::pair<std::string, std::string>> &files) {
+  // Get size of each file
+  std::vector<int64_t> sizes;
+  for (const std::pair<std::string, std::string> &file : files) {
+    if (file.first.size() >= kNameSize) {
+      return Status::RuntimeError(util::Format(
+          "entry name too long: {}",
+          file.first));
+    }
+    struct stat st;
+    if (stat(file.second.c_str(), &st) != 0) {
+      return Status::IOError(util::Format("Unable to open {}", file.second));
+    }
+    sizes.push_back(st.st_size);
+  }
+
+  // Offset of each entry
+  int64_t section_size = sizeof(int32_t) + files.size() * kEntrySize;
+  int64_t pos = kNameSize + sizeof(int32_t) + section_size;
+  std::vector<int64_t> offsets;
+  for (int64_t size : sizes) {
+    pos = (pos + kAlignment - 1) / kAlignment * kAlignment;
+    offsets.push_back(pos);
+    pos += size;
+  }
+
+  FILE *fd = fopen(filename.c_str(), "wb");
+  if (fd == NULL) {
+    return Status::IOError(util::Format("Unable to open {}", filename));
+  }
+  std::unique_ptr<FILE, int(*)(FILE *)> fd_guard(fd, fclose);
+
+  // Header and entries
+  std::array<char, kNameSize> name;
+  name.fill(0);
+  strncpy(name.data(), kSectionName, kNameSize - 1);
+  PK_CHECK_STATUS(WriteBytes(fd, name.data(), kNameSize));
+  int32_t section_size_i32 = section_size;
+  int32_t num_entries = files.size();
+  PK_CHECK_STATUS(WriteBytes(fd, &section_size_i32, sizeof(int32_t)));
+  PK_CHECK_STATUS(WriteBytes(fd, &num_entries, sizeof(int32_t)));
+  for (int i = 0; i < files.size(); ++i) {
+    name.fill(0);
+    strncpy(name.data(), files[i].first.c_str(), kNameSize - 1);
+    PK_CHECK_STATUS(WriteBytes(fd, name.data(), kNameSize));
+    PK_CHECK_STATUS(WriteBytes(fd, &offsets[i], sizeof(int64_t)));
+    PK_CHECK_STATUS(WriteBytes(fd, &sizes[i], sizeof(int64_t)));
+  }
+  pos = kNameSize + sizeof(int32_t) + section_size;
+
+  // Data of entries
+  std::vector<char> buffer(1024 * 1024);
+  for (int i = 0; i < files.size(); ++i) {
+    PK_CHECK_STATUS(WritePadding(fd, &pos, kAlignment));
+    assert(pos == offsets[i]);
+
+    FILE *fd_input = fopen(files[i].second.c_str(), "rb");
+    if (fd_input == NULL) {
+      return Status::IOError(util::Format("Unable to open {}", files[i].second));
+    }
+    int64_t bytes_copied = 0;
+    while (!feof(fd_input)) {
+      size_t n = fread(buffer.data(), 1, buffer.size(), fd_input);
+      if (n == 0) break;
+      Status status = WriteBytes(fd, buffer.data(), n);
+      if (!status.ok()) {
+        fclose(fd_input);
+        return status;
+      }
+      bytes_copied += n;
+    }
+    fclose(fd_input);
+    if (bytes_copied != sizes[i]) {
+      return Status::IOError(util::Format(
+          "failed to read: {}",
+          files[i].second));
+    }
+    pos += bytes_copied;
+  }
+  if (fflush(fd) != 0) {
+    return Status::IOError(util::Format("failed to write: {}", filename));
+  }
+
+  return Status::OK();
+}
+
+Status OpenModelFile(const Configuration &conf,
+                     const Bundle *bundle,
+                     const std::string &key,
+                     util::ReadableFile *fd) {
+  if (bundle && bundle->Has(key)) {
+    return bundle->OpenFile(key, fd);
+  }
+
+  std::string filename;
+  PK_CHECK_STATUS(conf.GetPath(key, &filename));
+  return fd->Open(filename);
+}
+
+}  // namespace pocketkaldi
@@ -0,0 +1,85 @@
+// Created at 2026-10-18
+
+#ifndef POCKETKALDI_BUNDLE_H_
+#define POCKETKALDI_BUNDLE_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "status.h"
+#include "util.h"
+
+namespace pocketkaldi {
+
+class Configuration;
+
+// Bundle is a single file containing all model files of recognizer. Each entry
+// is named by its key in configuration ("fst", "nnet", "large_lm", ...) and
+// stores the original file (pk::fst_0, NN02, MAT0, VEC0 or text) as-is.
+//
+// Format:
+//   section name "pk::bundle_0" (32 bytes) and section size (int32)
+//   num_entries (int32)
+//   entries: name (32 bytes), offset (int64), size (int64)
+//   data of entries, each aligned to kAlignment
+//
+// The whole file is mapped by one mmap with MAP_SHARED, so components could use
+// the data in place and all processes opening the same bundle share one
+// physical copy in page cache.
+class Bundle {
+ public:
+  static const char *kSectionName;
+  static constexpr int kAlignment = 4096;
+  static constexpr int kNameSize = 32;
+
+  Bundle();
+  ~Bundle();
+
+  // Open and map a bundle file
+  Status Open(const std::string &filename);
+
+  // Returns true if entry exists
+  bool Has(const std::string &name) const {
+    return entries_.find(name) != entries_.end();
+  }
+
+  // Get the data and size of entry. data is valid during the lifetime of
+  // bundle
+  Status Get(const std::string &name, const char **data, int64_t *size) const;
+
+  // Offset of entry in bundle file. It is used for readers that map the file by
+  // themselves, like OpenFST
+  Status Offset(const std::string &name, int64_t *offset) const;
+
+  // Open entry as a ReadableFile
+  Status OpenFile(const std::string &name, util::ReadableFile *fd) const;
+
+  // Write files into a bundle. Each item in files is (entry name, filename)
+  static Status Write(
+      const std::string &filename,
+      const std::vector<std::pair<std::string, std::string>> &files);
+
+  const std::string &filename() const { return filename_; }
+
+ private:
+  std::string filename_;
+  char *data_;
+  int64_t size_;
+
+  // Map from entry name to (offset, size)
+  std::unordered_map<std::string, std::pair<int64_t, int64_t>> entries_;
+};
+
+// Open the model file of key in conf. If bundle is not nullptr and has an
+// entry of key, the entry in bundle is opened. Otherwise, the path of key in
+// conf is opened
+Status OpenModelFile(const Configuration &conf,
+                     const Bundle *bundle,
+                     const std::string &key,
+                     util::ReadableFile *fd);
+
+}  // namespace pocketkaldi
+
+#endif  // POCKETKALDI_BUNDLE_H_
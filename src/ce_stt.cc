@@ -7,12 +7,20 @@
 #include <time.h>
 #include <string.h>
 #include <algorithm>
+#include <fstream>
+#include <mutex>
 #include <string>
 #include "am.h"
+#include "bundle.h"
 #include "cmvn.h"
 #include "decoder.h"
 #include "fbank.h"
 #include "fst.h"
+#include "grammar.h"
+#include "graph_order.h"
+#include "hclg_fst.h"
+#include "kws.h"
+#include "lm_pager.h"
 #include "nnet.h"
 #include "symbol_table.h"
 #include "pcm_reader.h"
@@ -29,23 +37,80 @@ using pocketkaldi::VectorBase;
 using pocketkaldi::Matrix;
 using pocketkaldi::SubVector;
 using pocketkaldi::AcousticModel;
+using pocketkaldi::Bundle;
 using pocketkaldi::SymbolTable;
 using pocketkaldi::LmFst;
+using pocketkaldi::LmCache;
 using pocketkaldi::DeltaLmFst;
+using pocketkaldi::ClassWordMap;
+using pocketkaldi::GraphOrder;
+using pocketkaldi::Grammar;
+using pocketkaldi::LmPager;
+using pocketkaldi::HclLookAheadFst;
+using pocketkaldi::KwsGraph;
+using pocketkaldi::KeywordSpotter;
 using pocketkaldi::util::Format;
 using pocketkaldi::util::ReadableFile;
 using pocketkaldi::ReadPcmHeader;
 using pocketkaldi::WaveReader;
 
 
+// Collects visits of HCLG states from all utterances. They will be written to
+// `filename` when recognizer destroyed
+struct StateProfile {
+  std::string filename;
+  std::mutex mutex;
+  std::vector<int64_t> visits;
+
+  // Order applied to HCLG at load time. Visits are mapped back to the
+  // original state ids before writing
+  std::vector<int32_t> order;
+};
+
+// Large LMs used in DeltaLmFst. When there are more than one LM, they are
+// interpolated with weights, which could be changed in each utterance by
+// ce_utt_set_lm_weights(). With lm_paging = lazy, each LM is served from its
+// mapping in pagers, which should be destroyed after lms. caches are the memo
+// of each LM shared by all utterances, empty if lm_cache_mb is 0
+struct LargeLm {
+  std::vector<std::unique_ptr<LmPager>> pagers;
+  std::vector<std::unique_ptr<LmFst>> lms;
+  std::vector<std::unique_ptr<LmCache>> caches;
+  std::vector<float> weights;
+};
+
+// Keyword+filler graph for keyword spotting (kws_fst), and the thresholds of
+// keywords
+struct KwsModel {
+  KwsGraph graph;
+  std::vector<std::pair<int, float>> thresholds;
+  float default_threshold;
+};
+
 typedef struct ce_stt_t {
-  fst::ConstFst<fst::StdArc> *fst;
-  pocketkaldi::LmFst *large_lm_fst;
-  pocketkaldi::DeltaLmFst *delta_lm_fst;
+  Bundle *bundle;
+  fst::Fst<fst::StdArc> *fst;
+
+  // HCL for dynamic composition and alignment, nullptr if hcl_fst is not
+  // specified. fst is nullptr when there is only HCL for alignment
+  HclLookAheadFst *hcl;
+  int64_t compose_cache_bytes;
+  float align_beam;
+
+  StateProfile *state_profile;
+  LargeLm *large_lm;
   pocketkaldi::Vector<float> *original_lm;
   pocketkaldi::AcousticModel *am;
+  float am_scale;
   pocketkaldi::Fbank *fbank;
   pocketkaldi::SymbolTable *symbol_table;
+
+  // Nonterminals of HCLG (symbols with "#nonterm:" prefix) without sub-graph,
+  // nullptr if there is no nonterminal
+  Grammar *grammar;
+
+  // Keyword spotting model, nullptr if not in keyword spotting mode
+  KwsModel *kws;
 } ce_stt_t;
 
 // The internal version of an utterance. It stores the intermediate state in
@@ -56,7 +121,41 @@ typedef struct ce_utt_internal_t {
   WaveReader wave_reader;
   Fbank::Instance fbank_inst;
   AcousticModel::Instance am_inst;
+  std::unique_ptr<DeltaLmFst> delta_lm_fst;
   std::unique_ptr<Decoder> decoder;
+
+  // Copy of the lazy HCL o G for this utterance with its own state cache, or
+  // HCL composed with the transcript in alignment. nullptr when decoding with
+  // HCLG
+  std::unique_ptr<fst::Fst<fst::StdArc>> fst;
+
+  // In alignment (ce_utt_set_transcript() called), decoder searches only the
+  // transcript. After end of stream, aligned is set if any path reaches the end
+  // of transcript, and the alignment of it is stored
+  bool aligning;
+  bool aligned;
+  std::vector<int> transition_ids;
+  std::vector<Decoder::WordAlignment> word_alignment;
+
+  // Interpolation weights of large LMs and the class words in this utterance.
+  // After changing them, decoder_stale is set and the decoder will be created
+  // again before processing
+  std::vector<float> lm_weights;
+  ClassWordMap class_words;
+  bool decoder_stale;
+
+  // Sub-graphs of nonterminals in this utterance, copied from the recognizer
+  // and set by ce_utt_set_subgraph()
+  Grammar grammar;
+
+  // Keyword spotter used instead of decoder in keyword spotting mode, and the
+  // keywords detected but not got by ce_utt_get_keywords() yet
+  std::unique_ptr<KeywordSpotter> kws;
+  std::vector<KeywordSpotter::Detection> detections;
+
+  // Visits of HCLG states in this utterance, only used when state profile is
+  // enabled
+  std::vector<int64_t> state_visits;
 } ce_utt_internal_t;
 
 namespace {
@@ -66,70 +165,464 @@ char error_message[2048] = "";
 
 // Read symbol table
 Status ReadSymbolTable(ce_stt_t *self, const Configuration &conf) {
-  std::string filename = conf.GetPathOrElse("symbol_table", "");
-  if (filename == "") {
-    return pocketkaldi::Status::Corruption(pocketkaldi::util::Format(
-        "Unable to find key 'symbol_table' in {}",
-        filename));
-  }
+  ReadableFile fd;
+  PK_CHECK_STATUS(pocketkaldi::OpenModelFile(
+      conf,
+      self->bundle,
+      "symbol_table",
+      &fd));
   self->symbol_table = new SymbolTable();
-  PK_CHECK_STATUS(self->symbol_table->Read(filename)); 
+  PK_CHECK_STATUS(self->symbol_table->Read(&fd)); 
 
   return Status::OK();
 }
 
-// Read and initialize delta lm fst
-Status ReadDeltaLmFst(ce_stt_t *self, const Configuration &conf) {
-  std::string large_lm_file = conf.GetPathOrElse("large_lm", "");
+// Returns true if model file of key exists in bundle or conf
+bool HasModelFile(const ce_stt_t *self,
+                  const Configuration &conf,
+                  const std::string &key) {
+  if (self->bundle && self->bundle->Has(key)) return true;
+  return conf.GetPathOrElse(key, "") != "";
+}
 
-  // If delta_lm_fst is not enables
-  if (large_lm_file == "") return Status::OK();
+// Read the large LM of key and initialize its indices. The LM in bundle is
+// used in place
+Status ReadLargeLm(const ce_stt_t *self,
+                   const Configuration &conf,
+                   const std::string &key,
+                   LmFst *lm_fst,
+                   std::unique_ptr<LmPager> *pager) {
+  // lm_paging = lazy: the LM is demand-paged from its mapping. Indices
+  // touching all the arcs are disabled by default in this mode
+  std::string paging = conf.GetStringOrElse("lm_paging", "resident");
+  if (paging != "resident" && paging != "lazy") {
+    return Status::Corruption(Format(
+        "unexpected lm_paging: {}, resident or lazy expected",
+        paging));
+  }
+  bool lazy = paging == "lazy";
+
+  if (lazy) {
+    pager->reset(new LmPager());
+    if (self->bundle && self->bundle->Has(key)) {
+      const char *data = nullptr;
+      int64_t size = 0;
+      PK_CHECK_STATUS(self->bundle->Get(key, &data, &size));
+      PK_CHECK_STATUS((*pager)->Attach(data, size, lm_fst));
+    } else {
+      std::string filename;
+      PK_CHECK_STATUS(conf.GetPath(key, &filename));
+      PK_CHECK_STATUS((*pager)->Open(filename, lm_fst));
+    }
+    (*pager)->AdviseHot(conf.GetIntegerOrElse("lm_hot_order", 2));
+    PK_DEBUG(Format("large_lm: {} bytes of hot arcs", (*pager)->hot_bytes()));
+  } else if (self->bundle && self->bundle->Has(key)) {
+    const char *data = nullptr;
+    int64_t size = 0;
+    PK_CHECK_STATUS(self->bundle->Get(key, &data, &size));
+    PK_CHECK_STATUS(lm_fst->Map(data, size));
+  } else {
+    std::string filename;
+    PK_CHECK_STATUS(conf.GetPath(key, &filename));
+    pocketkaldi::util::ReadableFile fd_large_lm;
+    PK_CHECK_STATUS(fd_large_lm.Open(filename));
+    PK_CHECK_STATUS(lm_fst->Read(&fd_large_lm));
+  }
 
-  // Origianl LM in HCLG
-  std::string original_lm_file = conf.GetPathOrElse("original_lm", "");
-  if (original_lm_file == "") {
-    return pocketkaldi::Status::Corruption(pocketkaldi::util::Format(
-        "Unable to find key 'original_lm' in {}",
-        original_lm_file));
+  // Label index for the arc search in the states without direct-index table.
+  // It is off by default: it takes private memory besides the mapped LM, and
+  // is not faster than binary search when lookups miss the cache
+  if (conf.GetIntegerOrElse("lm_label_index", 0) != 0) {
+    lm_fst->InitLabelIndex(LmFst::kDefaultLinearScanMax);
+    PK_DEBUG(Format(
+        "large_lm: label index {} bytes",
+        lm_fst->label_index_bytes()));
   }
 
+  // Direct-index tables for the high-fanout states of large LM
+  int direct_index_states = conf.GetIntegerOrElse(
+      "lm_direct_index_states",
+      LmFst::kDefaultDirectIndexStates);
+  int direct_index_mb = conf.GetIntegerOrElse(
+      "lm_direct_index_mb",
+      LmFst::kDefaultDirectIndexMemoryMb);
+  lm_fst->InitDirectIndex(
+      direct_index_states,
+      static_cast<int64_t>(direct_index_mb) * 1024 * 1024);
+  PK_DEBUG(Format(
+      "large_lm: {} states with direct-index table, {} bytes",
+      lm_fst->num_direct_index_states(),
+      lm_fst->direct_index_bytes()));
+
+  // Bloom filter of arcs in large LM, disabled by default
+  int filter_bits = conf.GetIntegerOrElse("lm_filter_bits_per_arc", 0);
+  int filter_mb = conf.GetIntegerOrElse(
+      "lm_filter_mb",
+      LmFst::kDefaultFilterMemoryMb);
+  lm_fst->InitFilter(
+      filter_bits,
+      static_cast<int64_t>(filter_mb) * 1024 * 1024);
+  PK_DEBUG(Format(
+      "large_lm: filter {} bytes, false positive rate {}",
+      lm_fst->filter_bytes(),
+      lm_fst->filter_false_positive_rate()));
+
+  return Status::OK();
+}
+
+// Checks the interpolation weights of large LMs
+Status CheckLmWeights(const std::vector<float> &weights, int num_lms) {
+  if (weights.size() != num_lms) {
+    return Status::Corruption(Format(
+        "{} LM weights expected, but {} found",
+        num_lms,
+        weights.size()));
+  }
+
+  float sum_weights = 0.0f;
+  for (float weight : weights) {
+    if (!(weight >= 0.0f)) {
+      return Status::Corruption(Format("invalid LM weight: {}", weight));
+    }
+    sum_weights += weight;
+  }
+  if (sum_weights <= 0.0f) {
+    return Status::Corruption("sum of LM weights should be positive");
+  }
+
+  return Status::OK();
+}
+
+// Read large LMs for delta lm fst. Additional LMs are large_lm_2,
+// large_lm_3, ... and they are interpolated with large_lm_weights
+Status ReadDeltaLmFst(ce_stt_t *self, const Configuration &conf) {
+  // If delta_lm_fst is not enables
+  if (!HasModelFile(self, conf, "large_lm")) return Status::OK();
+
+  // Origianl LM in HCLG
   pocketkaldi::util::ReadableFile fd_original_lm;
-  PK_CHECK_STATUS(fd_original_lm.Open(original_lm_file));
+  PK_CHECK_STATUS(pocketkaldi::OpenModelFile(
+      conf,
+      self->bundle,
+      "original_lm",
+      &fd_original_lm));
   self->original_lm = new Vector<float>();
   PK_CHECK_STATUS(self->original_lm->Read(&fd_original_lm));
 
-  // Large LM
-  pocketkaldi::util::ReadableFile fd_large_lm;
-  PK_CHECK_STATUS(fd_large_lm.Open(large_lm_file));
-  self->large_lm_fst = new LmFst();
-  PK_CHECK_STATUS(self->large_lm_fst->Read(&fd_large_lm));
-  self->large_lm_fst->InitBucket0();
-  
-  // Build DeltaLmFst
+  // Large LMs
+  self->large_lm = new LargeLm();
+  std::string large_lm_key = "large_lm";
+  for (int lm_idx = 1; HasModelFile(self, conf, large_lm_key); ++lm_idx) {
+    std::unique_ptr<LmFst> lm_fst(new LmFst());
+    std::unique_ptr<LmPager> pager;
+    PK_CHECK_STATUS(ReadLargeLm(
+        self,
+        conf,
+        large_lm_key,
+        lm_fst.get(),
+        &pager));
+    self->large_lm->lms.emplace_back(std::move(lm_fst));
+    self->large_lm->pagers.emplace_back(std::move(pager));
+
+    large_lm_key = Format("large_lm_{}", lm_idx + 1);
+  }
+
+  // Interpolation weights, default is uniform
+  int num_lms = self->large_lm->lms.size();
+  std::string weights_str = conf.GetStringOrElse("large_lm_weights", "");
+  std::vector<float> &weights = self->large_lm->weights;
+  if (weights_str == "") {
+    weights.assign(num_lms, 1.0f / num_lms);
+  } else {
+    for (const std::string &field : pocketkaldi::util::Split(weights_str, " ")) {
+      if (pocketkaldi::util::Trim(field) == "") continue;
+      float weight = 0.0f;
+      PK_CHECK_STATUS(pocketkaldi::util::StringToFloat(field, &weight));
+      weights.push_back(weight);
+    }
+  }
+  PK_CHECK_STATUS(CheckLmWeights(weights, num_lms));
+
+  // Memo of LM transitions shared by utterances. It is off by default until it
+  // is shown faster than the lookups in the mapped LM
+  int cache_mb = conf.GetIntegerOrElse("lm_cache_mb", 0);
+  if (cache_mb > 0) {
+    for (const std::unique_ptr<LmFst> &lm : self->large_lm->lms) {
+      self->large_lm->caches.emplace_back(new LmCache(
+          lm.get(),
+          static_cast<int64_t>(cache_mb) * 1024 * 1024));
+    }
+  }
+
   assert(self->symbol_table != nullptr);
-  self->delta_lm_fst = new DeltaLmFst(self->original_lm,
-                                      self->large_lm_fst,
-                                      self->symbol_table);
+  return Status::OK();
+}
+
+// Creates DeltaLmFst and decoder for utterance from its LM weights and class
+// words
+void InitUttDecoder(ce_utt_internal_t *utt) {
+  const ce_stt_t *recognizer = utt->recognizer;
+
+  utt->decoder = nullptr;
+  utt->delta_lm_fst = nullptr;
+  const fst::Fst<fst::StdArc> *fst = utt->fst ? utt->fst.get()
+                                              : recognizer->fst;
+  if (fst == nullptr) {
+    // Only HCL is loaded, waiting for transcript
+    utt->decoder_stale = false;
+    return;
+  }
+
+  if (utt->aligning) {
+    utt->decoder = std::unique_ptr<Decoder>(new Decoder(
+        fst,
+        recognizer->am->TransitionPdfIdMap(),
+        recognizer->am_scale));
+    utt->decoder->set_alignment(true);
+    utt->decoder->set_beam(recognizer->align_beam);
+    utt->decoder->Initialize();
+    utt->decoder_stale = false;
+    return;
+  }
+
+  if (recognizer->large_lm) {
+    std::vector<const LmFst *> lms;
+    for (const std::unique_ptr<LmFst> &lm : recognizer->large_lm->lms) {
+      lms.push_back(lm.get());
+    }
+    utt->delta_lm_fst = std::unique_ptr<DeltaLmFst>(new DeltaLmFst(
+        recognizer->original_lm,
+        lms,
+        utt->lm_weights,
+        recognizer->symbol_table));
+    if (utt->class_words.num_words() > 0) {
+      utt->class_words.Seal();
+      utt->delta_lm_fst->set_class_words(&utt->class_words);
+    }
+    std::vector<const LmCache *> caches;
+    for (const std::unique_ptr<LmCache> &cache : recognizer->large_lm->caches) {
+      caches.push_back(cache.get());
+    }
+    utt->delta_lm_fst->set_lm_caches(caches);
+  }
+
+  utt->decoder = std::unique_ptr<Decoder>(new Decoder(
+      fst,
+      recognizer->am->TransitionPdfIdMap(),
+      recognizer->am_scale,
+      utt->delta_lm_fst.get()));
+  if (recognizer->state_profile) {
+    utt->state_visits.assign(recognizer->state_profile->visits.size(), 0);
+    utt->decoder->set_state_visits(&utt->state_visits);
+  }
+  if (recognizer->grammar) utt->decoder->set_grammar(&utt->grammar);
+  utt->decoder->Initialize();
+  utt->decoder_stale = false;
+}
+
+// Checks if the LM settings of utterance could be changed. On success return
+// 0, on failed return CE_STT_FAILED and copy error string into error_message
+int32_t CheckUttLmChangeable(ce_utt_internal_t *utt) {
+  Status status;
+  if (utt->recognizer->large_lm == nullptr) {
+    status = Status::RuntimeError("large_lm is not enabled");
+  } else if (utt->aligning) {
+    status = Status::RuntimeError("LM settings are not used in alignment");
+  } else if (utt->decoder && utt->decoder->NumFramesDecoded() > 0) {
+    status = Status::RuntimeError(
+        "LM settings could only be changed before decoding");
+  }
+  if (!status.ok()) {
+    pasco_strlcpy(error_message, status.what().c_str(), sizeof(error_message));
+    return CE_STT_FAILED;
+  }
 
+  return 0;
+}
+
+// Opens the OpenFST file of key, from bundle or the path in conf. Let OpenFST
+// map the fst in bundle. It is mapped only when the fst was written with
+// alignment (fstconvert --fst_align), otherwise OpenFST reads it into heap
+Status OpenFstStream(const ce_stt_t *self,
+                     const Configuration &conf,
+                     const std::string &key,
+                     std::ifstream *strm,
+                     fst::FstReadOptions *opts) {
+  std::string filename;
+  int64_t offset = 0;
+  fst::FstReadOptions::FileReadMode mode = fst::FstReadOptions::READ;
+  if (self->bundle && self->bundle->Has(key)) {
+    PK_CHECK_STATUS(self->bundle->Offset(key, &offset));
+    filename = self->bundle->filename();
+    mode = fst::FstReadOptions::MAP;
+  } else {
+    PK_CHECK_STATUS(conf.GetPath(key, &filename));
+  }
+
+  strm->open(filename, std::ios_base::in | std::ios_base::binary);
+  if (!strm->is_open()) {
+    return Status::IOError(Format("Unable to open {}", filename));
+  }
+  strm->seekg(offset);
+  *opts = fst::FstReadOptions(filename);
+  opts->mode = mode;
   return Status::OK();
 }
 
-// Reads the HCLG fst
-Status ReadHclgFst(ce_stt_t *self, const Configuration &conf) {
-  std::string filename = conf.GetPathOrElse("fst", "");
-  if (filename == "") {
-    return Status::Corruption(
-        Format("Unable to find key 'fst' in {}", filename));
+// Creates the lazy composition of HCL (hcl_fst) and G (g_fst) with lookahead
+// as the decoding graph, instead of a precompiled HCLG. Each utterance expands
+// its own copy of it, and the states cached in a copy is bounded by
+// compose_cache_mb. Without g_fst, only HCL is loaded for alignment
+Status ReadHclAndG(ce_stt_t *self, const Configuration &conf) {
+  if (conf.GetStringOrElse("fst_state_order", "none") != "none" ||
+      conf.GetPathOrElse("fst_profile_output", "") != "") {
+    return Status::NotImplemented(
+        "fst_state_order and fst_profile_output are not supported with "
+        "hcl_fst");
   }
-  fst::ConstFst<fst::StdArc> *fst = fst::ConstFst<fst::StdArc>::Read(filename);
+
+  std::ifstream hcl_strm;
+  fst::FstReadOptions hcl_opts;
+  PK_CHECK_STATUS(OpenFstStream(self, conf, "hcl_fst", &hcl_strm, &hcl_opts));
+  self->hcl = pocketkaldi::ReadLookAheadHcl(hcl_strm, hcl_opts);
+  if (!self->hcl) {
+    return Status::IOError(Format("failed to read fst: {}", hcl_opts.source));
+  }
+  int cache_mb = conf.GetIntegerOrElse("compose_cache_mb", 64);
+  self->compose_cache_bytes = static_cast<int64_t>(cache_mb) * 1024 * 1024;
+  if (!HasModelFile(self, conf, "g_fst")) return Status::OK();
+
+  std::ifstream g_strm;
+  fst::FstReadOptions g_opts;
+  PK_CHECK_STATUS(OpenFstStream(self, conf, "g_fst", &g_strm, &g_opts));
+  std::unique_ptr<fst::StdVectorFst> g(pocketkaldi::ReadG(g_strm, g_opts));
+  if (!g) {
+    return Status::IOError(Format("failed to read fst: {}", g_opts.source));
+  }
+
+  self->fst = pocketkaldi::ComposeHclG(
+      *self->hcl,
+      g.get(),
+      self->compose_cache_bytes);
+  if (self->fst->Start() == fst::kNoStateId) {
+    return Status::Corruption("HCL o G has no start state");
+  }
+
+  return Status::OK();
+}
+
+// Reads the keyword+filler graph (kws_fst) for keyword spotting. Thresholds of
+// keywords are read from kws_keywords (lines of "<keyword> <threshold>") if
+// exists, the others use kws_threshold (default 0)
+Status ReadKws(ce_stt_t *self, const Configuration &conf) {
+  std::ifstream strm;
+  fst::FstReadOptions opts;
+  PK_CHECK_STATUS(OpenFstStream(self, conf, "kws_fst", &strm, &opts));
+  std::unique_ptr<fst::ExpandedFst<fst::StdArc>> fst(
+      pocketkaldi::ReadHclg(strm, opts));
   if (!fst) {
-    return Status::IOError(filename);
+    return Status::IOError(Format("failed to read fst: {}", opts.source));
+  }
+
+  self->kws = new KwsModel();
+  PK_CHECK_STATUS(self->kws->graph.Init(*fst));
+  PK_CHECK_STATUS(pocketkaldi::util::StringToFloat(
+      conf.GetStringOrElse("kws_threshold", "0"),
+      &self->kws->default_threshold));
+
+  std::string keywords_file = conf.GetPathOrElse("kws_keywords", "");
+  if (keywords_file == "") return Status::OK();
+  ReadableFile fd;
+  PK_CHECK_STATUS(fd.Open(keywords_file));
+  Status status;
+  std::string line;
+  while (fd.ReadLine(&line, &status) && status.ok()) {
+    std::vector<std::string> fields = pocketkaldi::util::Split(line, " ");
+    if (fields.size() != 2) {
+      return Status::Corruption(Format(
+          "unexpected line in {}: {}",
+          keywords_file,
+          line));
+    }
+    int keyword = self->symbol_table->GetId(fields[0]);
+    if (keyword == SymbolTable::kNotExist) {
+      return Status::Corruption(Format("keyword not exist: {}", fields[0]));
+    }
+    float threshold = 0.0f;
+    PK_CHECK_STATUS(pocketkaldi::util::StringToFloat(fields[1], &threshold));
+    self->kws->thresholds.emplace_back(keyword, threshold);
+  }
+  return status;
+}
+
+// Reads the HCLG fst, in ConstFst or HclgCompactFst format. Its states will be
+// renumbered if fst_state_order is specified. If hcl_fst exists, HCL and G are
+// composed dynamically instead
+Status ReadHclgFst(ce_stt_t *self, const Configuration &conf) {
+  if (HasModelFile(self, conf, "hcl_fst")) return ReadHclAndG(self, conf);
+
+  std::ifstream strm;
+  fst::FstReadOptions opts;
+  PK_CHECK_STATUS(OpenFstStream(self, conf, "fst", &strm, &opts));
+  fst::ExpandedFst<fst::StdArc> *fst = pocketkaldi::ReadHclg(strm, opts);
+  if (!fst) {
+    return Status::IOError(Format("failed to read fst: {}", opts.source));
   }
   self->fst = fst;
 
+  // Renumber states for cache locality
+  int order_type = GraphOrder::kNone;
+  std::string order_name = conf.GetStringOrElse("fst_state_order", "none");
+  PK_CHECK_STATUS(GraphOrder::ParseName(order_name, &order_type));
+  std::vector<int32_t> order;
+  if (order_type == GraphOrder::kBfs) {
+    GraphOrder::Bfs(*fst, &order);
+  } else if (order_type == GraphOrder::kDfs) {
+    GraphOrder::Dfs(*fst, &order);
+  } else if (order_type == GraphOrder::kProfile) {
+    std::string profile_file;
+    PK_CHECK_STATUS(conf.GetPath("fst_profile", &profile_file));
+    std::vector<int64_t> visits;
+    PK_CHECK_STATUS(GraphOrder::ReadVisits(profile_file, &visits));
+    GraphOrder::Profile(*fst, visits, &order);
+  }
+  if (order_type != GraphOrder::kNone) {
+    // Apply() creates a ConstFst, it would lose the compact format
+    if (fst->Type() != "const") {
+      return Status::NotImplemented(Format(
+          "fst_state_order is not supported for {} fst, reorder it with "
+          "reorder_graph before compacting",
+          fst->Type()));
+    }
+    self->fst = GraphOrder::Apply(*fst, order);
+    delete fst;
+  }
+
+  // Collect the profile for GraphOrder::Profile
+  std::string profile_output = conf.GetPathOrElse("fst_profile_output", "");
+  if (profile_output != "") {
+    self->state_profile = new StateProfile();
+    self->state_profile->filename = profile_output;
+    self->state_profile->visits.resize(fst::CountStates(*self->fst), 0);
+    self->state_profile->order = std::move(order);
+  }
+
   return Status::OK();
 }
 
+// Writes the visits of HCLG states collected in all utterances
+Status WriteStateProfile(const StateProfile &profile) {
+  if (profile.order.empty()) {
+    return GraphOrder::WriteVisits(profile.filename, profile.visits);
+  }
+
+  std::vector<int64_t> visits(profile.visits.size());
+  for (int state = 0; state < visits.size(); ++state) {
+    visits[state] = profile.visits[profile.order[state]];
+  }
+  return GraphOrder::WriteVisits(profile.filename, visits);
+}
+
 // Checks if parameter utt is correct. On success return 0, on failed return
 // CE_STT_FAILED and copy error string into error_message
 int32_t CheckParamUtt(ce_utt_t *utt) {
@@ -200,22 +693,52 @@ ce_stt_t *ce_stt_init(const char *config_file) {
   status = conf.Read(config_file);
   if (!status.ok()) goto pasco_init_failed;
 
-  // FST
-  status = ReadHclgFst(recognizer, conf);
-  if (!status.ok()) goto pasco_init_failed;
+  // Bundle of model files (if available)
+  if (conf.GetPathOrElse("bundle", "") != "") {
+    recognizer->bundle = new Bundle();
+    status = recognizer->bundle->Open(conf.GetPathOrElse("bundle", ""));
+    if (!status.ok()) goto pasco_init_failed;
+  }
 
   // AM
   recognizer->am = new AcousticModel();
-  status = recognizer->am->Read(conf);
+  status = recognizer->am->Read(conf, recognizer->bundle);
+  if (!status.ok()) goto pasco_init_failed;
+
+  // Scale of AM log-likelihood in search, chain models use 1.0
+  status = pocketkaldi::util::StringToFloat(
+      conf.GetStringOrElse("acoustic_scale", "0.1"),
+      &recognizer->am_scale);
   if (!status.ok()) goto pasco_init_failed;
 
   // SYMBOL TABLE
   status = ReadSymbolTable(recognizer, conf);
   if (!status.ok()) goto pasco_init_failed;
 
-  // DelteLmFst (if available)
-  status = ReadDeltaLmFst(recognizer, conf);
-  if (!status.ok()) goto pasco_init_failed;
+  // FST, or the keyword graph in keyword spotting mode
+  if (HasModelFile(recognizer, conf, "kws_fst")) {
+    status = ReadKws(recognizer, conf);
+    if (!status.ok()) goto pasco_init_failed;
+  } else {
+    status = ReadHclgFst(recognizer, conf);
+    if (!status.ok()) goto pasco_init_failed;
+    status = pocketkaldi::util::StringToFloat(
+        conf.GetStringOrElse("align_beam", "10.0"),
+        &recognizer->align_beam);
+    if (!status.ok()) goto pasco_init_failed;
+
+    // Nonterminals of grammar (if available)
+    recognizer->grammar = new Grammar();
+    recognizer->grammar->AddNonterminals(*recognizer->symbol_table);
+    if (recognizer->grammar->num_nonterminals() == 0) {
+      delete recognizer->grammar;
+      recognizer->grammar = nullptr;
+    }
+
+    // DelteLmFst (if available)
+    status = ReadDeltaLmFst(recognizer, conf);
+    if (!status.ok()) goto pasco_init_failed;
+  }
 
   // Initialize fbank feature extractor
   recognizer->fbank = new Fbank();
@@ -234,11 +757,21 @@ void ce_stt_destroy(ce_stt_t *recognizer) {
   delete recognizer->fst;
   recognizer->fst = nullptr;
 
-  delete recognizer->large_lm_fst;
-  recognizer->large_lm_fst = nullptr;
+  delete recognizer->hcl;
+  recognizer->hcl = nullptr;
 
-  delete recognizer->delta_lm_fst;
-  recognizer->delta_lm_fst = nullptr;
+  delete recognizer->kws;
+  recognizer->kws = nullptr;
+
+  if (recognizer->state_profile) {
+    Status status = WriteStateProfile(*recognizer->state_profile);
+    if (!status.ok()) PK_WARN(status.what());
+  }
+  delete recognizer->state_profile;
+  recognizer->state_profile = nullptr;
+
+  delete recognizer->large_lm;
+  recognizer->large_lm = nullptr;
 
   delete recognizer->original_lm;
   recognizer->original_lm = nullptr;
@@ -249,20 +782,85 @@ void ce_stt_destroy(ce_stt_t *recognizer) {
   delete recognizer->symbol_table;
   recognizer->symbol_table = nullptr;
 
+  delete recognizer->grammar;
+  recognizer->grammar = nullptr;
+
   delete recognizer->fbank;
   recognizer->fbank = NULL;
+
+  // Other components may point to the data in bundle, so it is the last one
+  delete recognizer->bundle;
+  recognizer->bundle = nullptr;
+}
+
+int32_t ce_stt_lm_paging_stats(ce_stt_t *recognizer,
+                               char *buffer,
+                               int32_t size) {
+  if (recognizer->large_lm == nullptr ||
+      recognizer->large_lm->pagers.empty() ||
+      recognizer->large_lm->pagers[0] == nullptr) {
+    pasco_strlcpy(error_message,
+                  "large LM is not loaded with lm_paging = lazy",
+                  sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+
+  int64_t minor_faults = 0, major_faults = 0;
+  LmPager::GetPageFaults(&minor_faults, &major_faults);
+  std::string text = Format(
+      "page_faults: minor {} major {}\n",
+      minor_faults,
+      major_faults);
+  const std::vector<std::unique_ptr<LmPager>> &pagers =
+      recognizer->large_lm->pagers;
+  for (int lm_idx = 0; lm_idx < pagers.size(); ++lm_idx) {
+    for (const LmPager::SectionStats &stats : pagers[lm_idx]->Residency()) {
+      text += Format(
+          "lm {} {}: {} bytes, {} resident\n",
+          lm_idx + 1,
+          stats.name,
+          stats.bytes,
+          stats.resident_bytes);
+    }
+  }
+
+  if (size <= 0) return text.size();
+  pasco_strlcpy(buffer, text.c_str(), size);
+  return std::min<int32_t>(text.size(), size - 1);
+}
+
+int32_t ce_stt_nnet_plan(ce_stt_t *recognizer, char *buffer, int32_t size) {
+  std::string text = recognizer->am->NnetPlan();
+  if (size <= 0) return text.size();
+  pasco_strlcpy(buffer, text.c_str(), size);
+  return std::min<int32_t>(text.size(), size - 1);
 }
 
 ce_utt_t *ce_utt_init(ce_stt_t *recognizer, const ce_wave_format_t *format) {
   ce_utt_t *c_utt = new ce_utt_t;
   ce_utt_internal_t *utt = new ce_utt_internal_t;
+  utt->recognizer = recognizer;
 
-  utt->decoder = std::unique_ptr<Decoder>(new Decoder(
-      recognizer->fst,
-      recognizer->am->TransitionPdfIdMap(),
-      0.1,
-      recognizer->delta_lm_fst));
-  utt->decoder->Initialize();
+  if (recognizer->large_lm) utt->lm_weights = recognizer->large_lm->weights;
+  if (recognizer->grammar) utt->grammar = *recognizer->grammar;
+  utt->aligning = false;
+  utt->aligned = false;
+  if (recognizer->fst && recognizer->fst->Type() == "compose") {
+    utt->fst = std::unique_ptr<fst::Fst<fst::StdArc>>(
+        recognizer->fst->Copy(true));
+  }
+  if (recognizer->kws) {
+    utt->kws = std::unique_ptr<KeywordSpotter>(new KeywordSpotter(
+        &recognizer->kws->graph,
+        &recognizer->am->TransitionPdfIdMap(),
+        recognizer->am_scale));
+    utt->kws->set_default_threshold(recognizer->kws->default_threshold);
+    for (const std::pair<int, float> &threshold :
+         recognizer->kws->thresholds) {
+      utt->kws->set_threshold(threshold.first, threshold.second);
+    }
+  }
+  InitUttDecoder(utt);
 
   c_utt->hyp = new char[1];
   *(c_utt->hyp) = '\0';
@@ -277,8 +875,6 @@ ce_utt_t *ce_utt_init(ce_stt_t *recognizer, const ce_wave_format_t *format) {
     return nullptr;
   }
 
-  utt->recognizer = recognizer;
-
   return c_utt;
 }
 
@@ -288,10 +884,260 @@ void ce_utt_destroy(ce_utt_t *c_utt) {
 
   c_utt->loglikelihood_per_frame = 0.0f;
 
+  // Merge visits of HCLG states into recognizer
+  ce_utt_internal_t *utt = c_utt->internal;
+  if (utt->recognizer->state_profile) {
+    StateProfile *profile = utt->recognizer->state_profile;
+    std::lock_guard<std::mutex> lock(profile->mutex);
+    for (int state = 0; state < utt->state_visits.size(); ++state) {
+      profile->visits[state] += utt->state_visits[state];
+    }
+  }
+
   delete c_utt->internal;
   delete c_utt;
 }
 
+int32_t ce_utt_set_lm_weights(ce_utt_t *c_utt,
+                              const float *weights,
+                              int32_t num_weights) {
+  if (CE_STT_FAILED == CheckParamUtt(c_utt)) {
+    return CE_STT_FAILED;
+  }
+  ce_utt_internal_t *utt = c_utt->internal;
+  if (CE_STT_FAILED == CheckUttLmChangeable(utt)) {
+    return CE_STT_FAILED;
+  }
+
+  Status status;
+  std::vector<float> lm_weights;
+  if (weights == nullptr || num_weights <= 0) {
+    status = Status::RuntimeError("weights is empty");
+  } else {
+    lm_weights.assign(weights, weights + num_weights);
+    status = CheckLmWeights(
+        lm_weights,
+        utt->recognizer->large_lm->lms.size());
+  }
+  if (!status.ok()) {
+    pasco_strlcpy(error_message, status.what().c_str(), sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+
+  utt->lm_weights = lm_weights;
+  utt->decoder_stale = true;
+  return 0;
+}
+
+int32_t ce_utt_add_class_word(ce_utt_t *c_utt,
+                              const char *class_name,
+                              const char *word,
+                              float weight) {
+  if (CE_STT_FAILED == CheckParamUtt(c_utt)) {
+    return CE_STT_FAILED;
+  }
+  ce_utt_internal_t *utt = c_utt->internal;
+  if (CE_STT_FAILED == CheckUttLmChangeable(utt)) {
+    return CE_STT_FAILED;
+  }
+
+  Status status;
+  const SymbolTable *symbol_table = utt->recognizer->symbol_table;
+  int class_label = SymbolTable::kNotExist;
+  int word_id = SymbolTable::kNotExist;
+  if (class_name == nullptr || word == nullptr) {
+    status = Status::RuntimeError("class_name or word is NULL");
+  } else {
+    class_label = symbol_table->GetId(class_name);
+    word_id = symbol_table->GetId(word);
+    if (class_label == SymbolTable::kNotExist) {
+      status = Status::RuntimeError(Format("class not exist: {}", class_name));
+    } else if (word_id == SymbolTable::kNotExist) {
+      status = Status::RuntimeError(Format("word not exist: {}", word));
+    } else {
+      status = utt->class_words.Add(class_label, word_id, weight);
+    }
+  }
+  if (!status.ok()) {
+    pasco_strlcpy(error_message, status.what().c_str(), sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+
+  utt->decoder_stale = true;
+  return 0;
+}
+
+int32_t ce_utt_set_subgraph(ce_utt_t *c_utt,
+                            const char *nonterminal,
+                            const char *filename) {
+  if (CE_STT_FAILED == CheckParamUtt(c_utt)) {
+    return CE_STT_FAILED;
+  }
+  ce_utt_internal_t *utt = c_utt->internal;
+
+  Status status;
+  const SymbolTable *symbol_table = utt->recognizer->symbol_table;
+  int label = SymbolTable::kNotExist;
+  std::ifstream strm;
+  std::shared_ptr<const fst::Fst<fst::StdArc>> subgraph;
+  if (utt->recognizer->grammar == nullptr) {
+    status = Status::RuntimeError("HCLG has no nonterminal");
+  } else if (utt->aligning) {
+    status = Status::RuntimeError("sub-graphs are not used in alignment");
+  } else if (utt->decoder && utt->decoder->NumFramesDecoded() > 0) {
+    status = Status::RuntimeError(
+        "sub-graphs could only be changed before decoding");
+  } else if (nonterminal == nullptr || filename == nullptr) {
+    status = Status::RuntimeError("nonterminal or filename is NULL");
+  } else if ((label = symbol_table->GetId(nonterminal)) ==
+             SymbolTable::kNotExist) {
+    status = Status::RuntimeError(Format(
+        "nonterminal not exist: {}",
+        nonterminal));
+  } else {
+    strm.open(filename, std::ios::binary);
+    if (strm) {
+      subgraph.reset(pocketkaldi::ReadHclg(
+          strm,
+          fst::FstReadOptions(filename)));
+    }
+    if (subgraph == nullptr) {
+      status = Status::IOError(Format("failed to read fst: {}", filename));
+    } else {
+      status = utt->grammar.SetSubGraph(label, subgraph);
+    }
+  }
+  if (!status.ok()) {
+    pasco_strlcpy(error_message, status.what().c_str(), sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+
+  utt->decoder_stale = true;
+  return 0;
+}
+
+int32_t ce_utt_set_transcript(ce_utt_t *c_utt, const char *transcript) {
+  if (CE_STT_FAILED == CheckParamUtt(c_utt)) {
+    return CE_STT_FAILED;
+  }
+  ce_utt_internal_t *utt = c_utt->internal;
+  const ce_stt_t *recognizer = utt->recognizer;
+
+  // Linear G of the words in transcript
+  Status status;
+  fst::StdVectorFst g;
+  g.AddState();
+  g.SetStart(0);
+  if (recognizer->hcl == nullptr) {
+    status = Status::RuntimeError("hcl_fst is required in alignment");
+  } else if (utt->decoder && utt->decoder->NumFramesDecoded() > 0) {
+    status = Status::RuntimeError(
+        "transcript could only be set before decoding");
+  } else if (transcript == nullptr) {
+    status = Status::RuntimeError("transcript is NULL");
+  } else {
+    for (const std::string &word : pocketkaldi::util::Split(transcript, " ")) {
+      if (word.empty()) continue;
+      int word_id = recognizer->symbol_table->GetId(word);
+      if (word_id == SymbolTable::kNotExist) {
+        status = Status::RuntimeError(Format("word not exist: {}", word));
+        break;
+      }
+      int next_state = g.AddState();
+      g.AddArc(next_state - 1, fst::StdArc(word_id, word_id, 0.0f, next_state));
+    }
+  }
+  if (!status.ok()) {
+    pasco_strlcpy(error_message, status.what().c_str(), sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+  g.SetFinal(g.NumStates() - 1, fst::TropicalWeight::One());
+
+  utt->fst = std::unique_ptr<fst::Fst<fst::StdArc>>(pocketkaldi::ComposeHclG(
+      *recognizer->hcl,
+      &g,
+      recognizer->compose_cache_bytes,
+      false));
+  utt->aligning = true;
+  utt->aligned = false;
+  utt->decoder_stale = true;
+  return 0;
+}
+
+int32_t ce_utt_get_alignment(ce_utt_t *c_utt,
+                             int32_t *transition_ids,
+                             int32_t size) {
+  if (CE_STT_FAILED == CheckParamUtt(c_utt)) {
+    return CE_STT_FAILED;
+  }
+  ce_utt_internal_t *utt = c_utt->internal;
+  if (!utt->aligned) {
+    pasco_strlcpy(error_message,
+                  "utterance is not aligned",
+                  sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+
+  int num_frames = utt->transition_ids.size();
+  for (int i = 0; i < std::min(num_frames, size); ++i) {
+    transition_ids[i] = utt->transition_ids[i];
+  }
+  return num_frames;
+}
+
+int32_t ce_utt_get_word_alignment(ce_utt_t *c_utt,
+                                  ce_word_alignment_t *words,
+                                  int32_t size) {
+  if (CE_STT_FAILED == CheckParamUtt(c_utt)) {
+    return CE_STT_FAILED;
+  }
+  ce_utt_internal_t *utt = c_utt->internal;
+  if (!utt->aligned) {
+    pasco_strlcpy(error_message,
+                  "utterance is not aligned",
+                  sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+
+  int num_words = utt->word_alignment.size();
+  for (int i = 0; i < std::min(num_words, size); ++i) {
+    const Decoder::WordAlignment &word = utt->word_alignment[i];
+    words[i].word = utt->recognizer->symbol_table->Get(word.word);
+    words[i].begin_frame = word.begin_frame;
+    words[i].num_frames = word.num_frames;
+  }
+  return num_words;
+}
+
+int32_t ce_utt_get_keywords(ce_utt_t *c_utt,
+                            ce_keyword_t *keywords,
+                            int32_t size) {
+  if (CE_STT_FAILED == CheckParamUtt(c_utt)) {
+    return CE_STT_FAILED;
+  }
+  ce_utt_internal_t *utt = c_utt->internal;
+  if (utt->kws == nullptr) {
+    pasco_strlcpy(error_message,
+                  "keyword spotting is not enabled",
+                  sizeof(error_message));
+    return CE_STT_FAILED;
+  }
+
+  int num_keywords = std::min<int>(utt->detections.size(), size);
+  for (int i = 0; i < num_keywords; ++i) {
+    const KeywordSpotter::Detection &detection = utt->detections[i];
+    keywords[i].keyword = utt->recognizer->symbol_table->Get(
+        detection.keyword);
+    keywords[i].score = detection.score;
+    keywords[i].begin_frame = detection.begin_frame;
+    keywords[i].end_frame = detection.end_frame;
+  }
+  utt->detections.erase(
+      utt->detections.begin(),
+      utt->detections.begin() + num_keywords);
+  return num_keywords;
+}
+
 int32_t ce_stt_process(ce_utt_t *c_utt, const char *data, int32_t size) {
   Vector<float> samples;
   Matrix<float> feats;
@@ -302,9 +1148,15 @@ int32_t ce_stt_process(ce_utt_t *c_utt, const char *data, int32_t size) {
   }
   const ce_stt_t *recognizer = c_utt->internal->recognizer;
   ce_utt_internal_t *utt = c_utt->internal;
+  if (utt->decoder_stale) InitUttDecoder(utt);
+  Status status;
+  if (utt->decoder == nullptr && utt->kws == nullptr) {
+    status = Status::RuntimeError("transcript is required without g_fst");
+    goto pasco_process_failed;
+  }
 
   // Bytes to samples
-  Status status = utt->wave_reader.Process(data, size, &samples);
+  status = utt->wave_reader.Process(data, size, &samples);
   PK_DEBUG(Format("{} samples read", samples.Dim()));
   if (!status.ok()) goto pasco_process_failed;
   if (samples.Dim() == 0) return 0;
@@ -320,6 +1172,10 @@ int32_t ce_stt_process(ce_utt_t *c_utt, const char *data, int32_t size) {
     if (log_prob.NumRows() != 0) {
       PK_DEBUG(Format("get {} frames of log_prob", log_prob.NumRows()));
       for (int r = 0; r < log_prob.NumRows(); ++r) {
+        if (utt->kws) {
+          utt->kws->Process(log_prob.Row(r), &utt->detections);
+          continue;
+        }
         utt->decoder->Process(log_prob.Row(r));
 
         // Update hypothesis
@@ -347,10 +1203,19 @@ void ce_stt_end_of_stream(ce_utt_t *c_utt) {
     return;
   }
   const ce_stt_t *recognizer = c_utt->internal->recognizer;
+  if (utt->decoder_stale) InitUttDecoder(utt);
+  if (utt->decoder == nullptr && utt->kws == nullptr) return;
 
   // Process remained frames in AM
   Matrix<float> log_prob;
   recognizer->am->EndOfStream(&utt->am_inst, &log_prob);
+  if (utt->kws) {
+    for (int r = 0; r < log_prob.NumRows(); ++r) {
+      utt->kws->Process(log_prob.Row(r), &utt->detections);
+    }
+    utt->kws->EndOfStream(&utt->detections);
+    return;
+  }
   if (log_prob.NumRows() != 0) {
     for (int r = 0; r < log_prob.NumRows(); ++r) {
       utt->decoder->Process(log_prob.Row(r));
@@ -359,6 +1224,11 @@ void ce_stt_end_of_stream(ce_utt_t *c_utt) {
   utt->decoder->EndOfStream();
 
   StoreHypText(c_utt);
+  if (utt->aligning) {
+    utt->aligned = utt->decoder->BestAlignment(
+        &utt->transition_ids,
+        &utt->word_alignment);
+  }
 }
 
 ce_wave_format_t *ce_read_pcm_header(FILE *fp, ce_wave_format_t *format) {
@@ -30,6 +30,24 @@ typedef struct ce_stt_t ce_stt_t;
 // Internal struct of utterance
 typedef struct ce_utt_internal_t ce_utt_internal_t;
 
+// A word in alignment, the frames are the output frames of AM. word points to
+// the symbol table of recognizer
+typedef struct ce_word_alignment_t {
+  const char *word;
+  int32_t begin_frame;
+  int32_t num_frames;
+} ce_word_alignment_t;
+
+// A keyword detected in keyword spotting, from begin_frame to end_frame
+// (exclusive) of AM output frames. score is the log-likelihood ratio per frame
+// of keyword against filler. keyword points to the symbol table of recognizer
+typedef struct ce_keyword_t {
+  const char *keyword;
+  float score;
+  int32_t begin_frame;
+  int32_t end_frame;
+} ce_keyword_t;
+
 // Store intermediate data and hypothesis of an utterance in decoding
 typedef struct ce_utt_t {
   ce_utt_internal_t *internal;
@@ -45,6 +63,20 @@ ce_stt_t *ce_stt_init(const char *config_file);
 CE_STT_EXPORT
 void ce_stt_destroy(ce_stt_t *r);
 
+// Write the paging statistics of large LMs into buffer as text: the page faults
+// of this process and the size and resident size of each section of each LM.
+// It is only available when lm_paging = lazy. On success return the length of
+// text (truncated to size - 1), on failed return CE_STT_FAILED and the error
+// could be got by last_error()
+CE_STT_EXPORT
+int32_t ce_stt_lm_paging_stats(ce_stt_t *r, char *buffer, int32_t size);
+
+// Write the layers of AM after fusion into buffer as text, like
+// "Linear+ReLU -> Splice -> NarrowLayer". Returns the length of text
+// (truncated to size - 1)
+CE_STT_EXPORT
+int32_t ce_stt_nnet_plan(ce_stt_t *r, char *buffer, int32_t size);
+
 // Initialize and create a new instance of utterance. If error occured, it will
 // return NULL and the error could be got by last_error()
 CE_STT_EXPORT
@@ -54,6 +86,73 @@ ce_utt_t *ce_utt_init(ce_stt_t *r, const ce_wave_format_t *format);
 CE_STT_EXPORT
 void ce_utt_destroy(ce_utt_t *utt);
 
+// Set the interpolation weights of large LMs (large_lm, large_lm_2, ...) for
+// this utterance. It should be called before ce_stt_process(). weights will
+// be normalized to sum to 1. On success return 0, on failed return
+// CE_STT_FAILED and the error could be got by last_error()
+CE_STT_EXPORT
+int32_t ce_utt_set_lm_weights(ce_utt_t *utt,
+                              const float *weights,
+                              int32_t num_weights);
+
+// Add word into class nonterminal (like $CONTACT) of large LM for this
+// utterance. Both class_name and word should be in the symbol table. Weights of
+// words in the same class are normalized to probabilities. It should be called
+// before ce_stt_process(). On success return 0, on failed return CE_STT_FAILED
+// and the error could be got by last_error()
+CE_STT_EXPORT
+int32_t ce_utt_add_class_word(ce_utt_t *utt,
+                              const char *class_name,
+                              const char *word,
+                              float weight);
+
+// Load the sub-graph of nonterminal (like #nonterm:menu) in HCLG from
+// filename for this utterance, the previous one is replaced. The sub-graph is
+// an HCLG (ConstFst or compact format) built with the same transition-ids and
+// symbol table. It should be called before ce_stt_process(). On success return
+// 0, on failed return CE_STT_FAILED and the error could be got by last_error()
+CE_STT_EXPORT
+int32_t ce_utt_set_subgraph(ce_utt_t *utt,
+                            const char *nonterminal,
+                            const char *filename);
+
+// Align this utterance to transcript (words separated by space) instead of
+// decoding it. The decoder searches HCL (hcl_fst) composed with the words of
+// transcript in a narrow beam (align_beam). It should be called before
+// ce_stt_process(). On success return 0, on failed return CE_STT_FAILED and the
+// error could be got by last_error()
+CE_STT_EXPORT
+int32_t ce_utt_set_transcript(ce_utt_t *utt, const char *transcript);
+
+// Get the transition-id of each frame after ce_stt_end_of_stream() of an
+// aligned utterance. At most size ids are copied into transition_ids. On
+// success return the number of frames, on failed (like no path reaches the end
+// of transcript) return CE_STT_FAILED and the error could be got by
+// last_error()
+CE_STT_EXPORT
+int32_t ce_utt_get_alignment(ce_utt_t *utt,
+                             int32_t *transition_ids,
+                             int32_t size);
+
+// Get the frames of each word after ce_stt_end_of_stream() of an aligned
+// utterance. The silence after a word is counted in that word. At most size
+// words are copied. On success return the number of words, on failed return
+// CE_STT_FAILED and the error could be got by last_error()
+CE_STT_EXPORT
+int32_t ce_utt_get_word_alignment(ce_utt_t *utt,
+                                  ce_word_alignment_t *words,
+                                  int32_t size);
+
+// Get the keywords detected so far in keyword spotting mode (kws_fst in
+// config), and remove them from utterance. It could be called after each
+// ce_stt_process() of a stream. At most size keywords are copied. On success
+// return the number of keywords copied, on failed return CE_STT_FAILED and the
+// error could be got by last_error()
+CE_STT_EXPORT
+int32_t ce_utt_get_keywords(ce_utt_t *utt,
+                            ce_keyword_t *keywords,
+                            int32_t size);
+
 // Process data from wave stream. it will returns the number of samples read.
 // If any error occured, it will return PASCO_FAILED and error message could
 // be got by last_error()
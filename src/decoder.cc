@@ -11,15 +11,23 @@
 
 namespace pocketkaldi {
 
-Decoder::State::State(int32_t hclg_state, int32_t lm_state):
+Decoder::State::State(int32_t hclg_state, int32_t lm_state, int32_t instance):
     hclg_state_(hclg_state),
-    lm_state_(lm_state) {}
+    lm_state_(lm_state),
+    instance_(instance) {}
 
-Decoder::State::State(): hclg_state_(0), lm_state_(0) {}
+Decoder::State::State(): hclg_state_(0), lm_state_(0), instance_(0) {}
 
-Decoder::Token::Token(State state, float cost, OLabel *olabel):
+Decoder::Token::Token(State state, float cost, OLabel *olabel, Trace *trace):
     state_(state),
     cost_(cost),
+    olabel_(olabel),
+    trace_(trace) {
+}
+
+Decoder::Trace::Trace(Trace *previous, int transition_id, int olabel):
+    previous_(previous),
+    transition_id_(transition_id),
     olabel_(olabel) {
 }
 
@@ -52,11 +60,17 @@ Decoder::Decoder(
     float am_scale,
     const DeltaLmFst *delta_lm_fst):
         fst_(fst),
-        beam_(16.0),
+        const_fst_(dynamic_cast<const fst::ConstFst<fst::StdArc> *>(fst)),
+        compact_fst_(dynamic_cast<const HclgCompactFst *>(fst)),
+        compose_fst_(dynamic_cast<const fst::ComposeFst<fst::StdArc> *>(fst)),
+        beam_(kDefaultBeam),
         state_idx_(kBeamSize * 4),
         transtion_pdf_id_map_(transtion_pdf_id_map),
         am_scale_(am_scale),
-        is_end_of_stream_(false) {
+        is_end_of_stream_(false),
+        state_visits_(nullptr),
+        grammar_(nullptr),
+        alignment_(false) {
   if (delta_lm_fst) {
     delta_lm_fst_ = std::unique_ptr<CachedFst>(
         new CachedFst(delta_lm_fst, 1000000));
@@ -88,6 +102,14 @@ bool Decoder::Process(const VectorBase<float> &frame_logp) {
       if (tok->olabel()) olabel_root.push_back(tok->olabel());
     }
     olabels_pool_.GC(olabel_root);
+
+    if (alignment_) {
+      std::vector<Trace *> trace_root;
+      for (Token *tok : toks_) {
+        if (tok->trace()) trace_root.push_back(tok->trace());
+      }
+      traces_pool_.GC(trace_root);
+    }
   }
 
   num_frames_decoded_++;
@@ -115,7 +137,12 @@ void Decoder::Initialize() {
     lm_start_state = delta_lm_fst_->StartState();
   }
 
-  InsertTok(State(start_state, lm_start_state), 0, nullptr, 0.0f);
+  // Instance 0 is the carrier HCLG
+  instances_.clear();
+  instance_idx_.clear();
+  instances_.push_back(Instance{fst_, const_fst_, -1});
+
+  InsertTok(State(start_state, lm_start_state), 0, 0, nullptr, 0.0f);
   num_frames_decoded_ = 0;
   ProcessNonemitting(INFINITY);
 }
@@ -140,13 +167,38 @@ int32_t Decoder::PropogateLm(int32_t lm_state, int ilabel, float *weight) {
   return lm_state;
 }
 
+int32_t Decoder::EnterSubGraph(int nonterminal,
+                               const fst::Fst<fst::StdArc> *subgraph,
+                               int32_t return_state) {
+  int64_t key = (static_cast<int64_t>(nonterminal) << 32) |
+                static_cast<uint32_t>(return_state);
+  std::unordered_map<int64_t, int32_t>::iterator it = instance_idx_.find(key);
+  if (it != instance_idx_.end()) return it->second;
+
+  int32_t instance = instances_.size();
+  instances_.push_back(Instance{
+      subgraph,
+      dynamic_cast<const fst::ConstFst<fst::StdArc> *>(subgraph),
+      return_state});
+  instance_idx_.emplace(key, instance);
+  return instance;
+}
+
+float Decoder::FinalCost(const State &state) const {
+  if (state.instance() != kCarrierInstance) return INFINITY;
+  return fst_->Final(state.hclg_state()).Value();
+}
+
 bool Decoder::InsertTok(
     State next_state,
+    int input_label,
     int output_label,
-    OLabel *prev_olabel,
+    const Token *from_tok,
     float cost) {
   // PK_DEBUG(util::Format("insert state = {}", next_state));
   int tok_idx = state_idx_.Find(next_state, kNotExist);
+  if (tok_idx != kNotExist && toks_[tok_idx]->cost() <= cost) return false;
+  OLabel *prev_olabel = from_tok ? from_tok->olabel() : nullptr;
   
   // Create the olabel for next tok when the output_label of arc
   // is not 0 (epsilon)
@@ -161,19 +213,21 @@ bool Decoder::InsertTok(
     next_olabel = prev_olabel;
   }
 
-  // Insert new or update existing token in the beam
+  // Extend the trace with the arc in alignment
+  Trace *next_trace = from_tok ? from_tok->trace() : nullptr;
+  if (alignment_ && (input_label != 0 || output_label != 0)) {
+    next_trace = traces_pool_.Alloc(next_trace, input_label, output_label);
+  }
+
+  // Insert new or update existing token in the beam. The existing token with
+  // less cost is already checked above
+  Token *tok = toks_pool_.Alloc(next_state, cost, next_olabel, next_trace);
   if (tok_idx == kNotExist) {
     int num_toks = toks_.size();
-    toks_.push_back(toks_pool_.Alloc(next_state, cost, next_olabel));
+    toks_.push_back(tok);
     state_idx_.Insert(next_state, num_toks);
   } else {
-    // If the cost of existing token is less than the new one, just discard
-    // inserting and return false
-    if (toks_[tok_idx]->cost() > cost) {
-      toks_[tok_idx] = toks_pool_.Alloc(next_state, cost, next_olabel);
-    } else {
-      return false;
-    }
+    toks_[tok_idx] = tok;
   }
   return true;
 }
@@ -236,6 +290,57 @@ double Decoder::GetCutoff(float *adaptive_beam, Token **best_tok) {
 }
 
 
+template<typename F>
+void Decoder::ForEachArc(const State &hclg_state, F f) const {
+  int state = hclg_state.hclg_state();
+  if (hclg_state.instance() != kCarrierInstance) {
+    // Sub-graphs are small, only ConstFst has the fast path
+    const Instance &instance = instances_[hclg_state.instance()];
+    if (instance.const_fst) {
+      for (fst::ArcIterator<fst::ConstFst<fst::StdArc>> arc_iter(
+               *instance.const_fst,
+               state);
+           !arc_iter.Done();
+           arc_iter.Next()) {
+        f(arc_iter.Value());
+      }
+    } else {
+      for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(*instance.fst,
+                                                             state);
+           !arc_iter.Done();
+           arc_iter.Next()) {
+        f(arc_iter.Value());
+      }
+    }
+  } else if (compact_fst_) {
+    for (fst::ArcIterator<HclgCompactFst> arc_iter(*compact_fst_, state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      f(arc_iter.Value());
+    }
+  } else if (compose_fst_) {
+    for (fst::ArcIterator<fst::ComposeFst<fst::StdArc>> arc_iter(*compose_fst_,
+                                                                 state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      f(arc_iter.Value());
+    }
+  } else if (const_fst_) {
+    for (fst::ArcIterator<fst::ConstFst<fst::StdArc>> arc_iter(*const_fst_,
+                                                               state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      f(arc_iter.Value());
+    }
+  } else {
+    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(*fst_, state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      f(arc_iter.Value());
+    }
+  }
+}
+
 // Processes nonemitting arcs for one frame.  Propagates within cur_toks_.
 void Decoder::ProcessNonemitting(double cutoff) {
   PK_DEBUG("ProcessNonemitting()");
@@ -255,38 +360,65 @@ void Decoder::ProcessNonemitting(double cutoff) {
     // PK_DEBUG(util::Format("state_idx_.Find({}, kNotExist)", state));
     int tok_idx = state_idx_.Find(state, kNotExist);
     assert(tok_idx != kNotExist);
+    if (state_visits_ && state.instance() == kCarrierInstance) {
+      ++(*state_visits_)[state.hclg_state()];
+    }
 
-    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(*fst_, state.hclg_state());
-         !arc_iter.Done();
-         arc_iter.Next()) {
+    ForEachArc(state, [&] (const fst::StdArc &arc) {
       // propagate nonemitting only...
-      fst::StdArc arc = arc_iter.Value();
-      if (arc.ilabel != 0) continue;
+      if (arc.ilabel != 0) return;
 
       const float ac_cost = 0.0;
       const Token *from_tok = toks_[tok_idx];
       double total_cost = from_tok->cost() + arc.weight.Value() + ac_cost;
 
-      // Online compose with G' when available
+      // A nonterminal arc of carrier HCLG jumps into the start state of its
+      // sub-graph, and the nonterminal itself is not outputted. It is not
+      // followed when the nonterminal has no sub-graph
       State state = from_tok->state();
+      int32_t olabel = arc.olabel;
+      int32_t next_hclg_state = arc.nextstate;
+      int32_t next_instance = state.instance();
+      const fst::Fst<fst::StdArc> *subgraph = nullptr;
+      if (grammar_ &&
+          olabel != 0 &&
+          state.instance() == kCarrierInstance &&
+          grammar_->Lookup(olabel, &subgraph)) {
+        if (subgraph == nullptr) return;
+        next_hclg_state = subgraph->Start();
+        next_instance = EnterSubGraph(olabel, subgraph, arc.nextstate);
+        olabel = 0;
+      }
+
+      // Online compose with G' when available
       int32_t lm_state = state.lm_state();
       if (delta_lm_fst_) {
         float lm_weight = 0.0f;
-        lm_state = PropogateLm(lm_state, arc.olabel, &lm_weight);
+        lm_state = PropogateLm(lm_state, olabel, &lm_weight);
         total_cost += lm_weight;
       }
 
-      if (total_cost > cutoff) continue;
+      if (total_cost > cutoff) return;
 
       // Create and insert tok into beam
       // If the token successfully inserted or updated in the beam, `inserted`
       // will be true and then we will push the new state into `queue`
-      bool inserted = InsertTok(
-          State(arc.nextstate, lm_state),
-          arc.olabel,
-          from_tok->olabel(),
-          total_cost);
-      if (inserted) queue.push_back(State(arc.nextstate, lm_state));
+      State next_state(next_hclg_state, lm_state, next_instance);
+      bool inserted = InsertTok(next_state, 0, olabel, from_tok, total_cost);
+      if (inserted) queue.push_back(next_state);
+    });
+
+    // Final states of a sub-graph return to carrier HCLG
+    if (state.instance() != kCarrierInstance) {
+      const Instance &instance = instances_[state.instance()];
+      float final_cost = instance.fst->Final(state.hclg_state()).Value();
+      const Token *from_tok = toks_[tok_idx];
+      double total_cost = from_tok->cost() + final_cost;
+      if (final_cost == INFINITY || total_cost > cutoff) continue;
+
+      State next_state(instance.return_state, state.lm_state());
+      bool inserted = InsertTok(next_state, 0, 0, from_tok, total_cost);
+      if (inserted) queue.push_back(next_state);
     }
   }
 }
@@ -318,11 +450,8 @@ float Decoder::ProcessEmitting(const VectorBase<float> &frame_logp) {
   // reasonably tight bound on the next cutoff.
   State best_state = best_tok->state();
   PK_DEBUG(util::Format("best_state = {}", best_state));
-    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(*fst_, best_state.hclg_state());
-         !arc_iter.Done();
-         arc_iter.Next()) {
-    fst::StdArc arc = arc_iter.Value();
-    if (arc.ilabel == 0) continue;
+  ForEachArc(best_state, [&] (const fst::StdArc &arc) {
+    if (arc.ilabel == 0) return;
 
     float acoustic_cost = -LogLikelihood(frame_logp, arc.ilabel);
     double total_cost = best_tok->cost() + arc.weight.Value() + acoustic_cost;
@@ -330,7 +459,7 @@ float Decoder::ProcessEmitting(const VectorBase<float> &frame_logp) {
     if (total_cost + adaptive_beam < next_weight_cutoff) {
       next_weight_cutoff = total_cost + adaptive_beam;
     }
-  }
+  });
   
   // Ok, we iterate each token in prev_tok_ and add new tokens into toks_ with
   // the emitting arcs of them.
@@ -340,18 +469,18 @@ float Decoder::ProcessEmitting(const VectorBase<float> &frame_logp) {
     // weight_cutoff is computed according to beam size
     // So there are only top beam_size toks less than weight_cutoff
     if (from_tok->cost() > weight_cutoff) continue;
+    if (state_visits_ && state.instance() == kCarrierInstance) {
+      ++(*state_visits_)[state.hclg_state()];
+    }
 
-    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(*fst_, state.hclg_state());
-         !arc_iter.Done();
-         arc_iter.Next()) {
-      fst::StdArc arc = arc_iter.Value();
-      if (arc.ilabel == 0) continue;
+    ForEachArc(state, [&] (const fst::StdArc &arc) {
+      if (arc.ilabel == 0) return;
 
       float ac_cost = -LogLikelihood(frame_logp, arc.ilabel);
       double total_cost = from_tok->cost() + arc.weight.Value() + ac_cost;
       
       // Prune the toks whose cost is too high
-      if (total_cost > next_weight_cutoff) continue;
+      if (total_cost > next_weight_cutoff) return;
       if (total_cost + adaptive_beam < next_weight_cutoff) {
         next_weight_cutoff = total_cost + adaptive_beam;
       }
@@ -367,11 +496,12 @@ float Decoder::ProcessEmitting(const VectorBase<float> &frame_logp) {
       // Create and insert the tok into toks_
       assert(arc.nextstate >= 0 && lm_state >= 0);
       InsertTok(
-          State(arc.nextstate, lm_state),
+          State(arc.nextstate, lm_state, state.instance()),
+          arc.ilabel,
           arc.olabel,
-          from_tok->olabel(),
+          from_tok,
           total_cost);
-    }
+    });
 
     toks_pool_.Dealloc(from_tok);
   }
@@ -396,7 +526,7 @@ Decoder::Hypothesis Decoder::BestPath() {
     double cost = tok->cost();
 
     if (is_end_of_stream_) {
-      cost += fst_->Final(state.hclg_state()).Value();
+      cost += FinalCost(state);
     }
     if (delta_lm_fst_ && is_end_of_stream_) {
       float lm_weight = delta_lm_fst_->Final(tok->state().lm_state());
@@ -425,9 +555,59 @@ Decoder::Hypothesis Decoder::BestPath() {
   }
 
   weight = best_cost;
-  weight += fst_->Final(best_tok->state().hclg_state()).Value();
+  weight += FinalCost(best_tok->state());
 
   return Hypothesis(words, weight);
 }
 
+bool Decoder::BestAlignment(std::vector<int> *transition_ids,
+                            std::vector<WordAlignment> *words) {
+  transition_ids->clear();
+  words->clear();
+  if (!alignment_) return false;
+
+  // Best token in final state
+  const Token *best_tok = nullptr;
+  double best_cost = INFINITY;
+  for (const Token *tok : toks_) {
+    double cost = tok->cost() + FinalCost(tok->state());
+    if (delta_lm_fst_) cost += delta_lm_fst_->Final(tok->state().lm_state());
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_tok = tok;
+    }
+  }
+  if (best_tok == nullptr) return false;
+
+  std::vector<const Trace *> traces;
+  for (const Trace *trace = best_tok->trace();
+       trace != nullptr;
+       trace = trace->previous()) {
+    traces.push_back(trace);
+  }
+  std::reverse(traces.begin(), traces.end());
+
+  for (const Trace *trace : traces) {
+    if (trace->olabel() != 0) {
+      if (!words->empty()) {
+        WordAlignment &last_word = words->back();
+        last_word.num_frames = transition_ids->size() - last_word.begin_frame;
+      }
+      words->push_back(WordAlignment{
+          trace->olabel(),
+          static_cast<int>(transition_ids->size()),
+          0});
+    }
+    if (trace->transition_id() != 0) {
+      transition_ids->push_back(trace->transition_id());
+    }
+  }
+  if (!words->empty()) {
+    WordAlignment &last_word = words->back();
+    last_word.num_frames = transition_ids->size() - last_word.begin_frame;
+  }
+
+  return true;
+}
+
 }  // namespace pocketkaldi
@@ -35,6 +35,8 @@
 #undef DISALLOW_COPY_AND_ASSIGN
 #include "fst/fstlib.h"
 #include "am.h"
+#include "grammar.h"
+#include "hclg_fst.h"
 
 namespace pocketkaldi {
 
@@ -49,6 +51,9 @@ namespace pocketkaldi {
 // In online composition mode, G' should be a backoff LM. ilabel of backoff arc
 // should be epsilon (aka 0) and symbols of BOS/EOS (<s> and </s>) should be
 // exist.
+//
+// In both modes, the nonterminal arcs of HCLG could jump into the sub-graphs
+// of Grammar (see set_grammar()).
 class Decoder {
  public:
   static constexpr int kBeamSize = 30000;
@@ -57,6 +62,8 @@ class Decoder {
   static constexpr int kNotExist = -1;
   static constexpr int kCutoffSamples = 200;
   static constexpr int kCutoffRandSeed = 0x322;
+  static constexpr int kCarrierInstance = 0;
+  static constexpr float kDefaultBeam = 16.0;
 
   // State stores the states of each FST for decoding.
   class State;
@@ -64,6 +71,13 @@ class Decoder {
   // Stores the decoding result
   class Hypothesis;
 
+  // Word of best path and its frames in alignment
+  struct WordAlignment {
+    int word;
+    int begin_frame;
+    int num_frames;
+  };
+
   // Initialize the decoder with the FST graph fst. It just borrows the pointer
   // of fst and not own it.
   Decoder(const fst::Fst<fst::StdArc> *fst,
@@ -85,9 +99,37 @@ class Decoder {
   // Get best hypothesis from lattice.
   Hypothesis BestPath();
 
+  // Gets the transition-id of each frame and the frames of each word in the
+  // best path that reaches a final state. The word of an alignment begins at
+  // the frame where its output label appears and ends before the next word, so
+  // the optional silence after a word belongs to it. Returns false if
+  // alignment is not enabled or no token reaches a final state
+  bool BestAlignment(std::vector<int> *transition_ids,
+                     std::vector<WordAlignment> *words);
+
   // Returns number of frames decoded
   int NumFramesDecoded() const { return num_frames_decoded_; }
 
+  // If visits is not nullptr, the number of expansions of each HCLG state will
+  // be accumulated into (*visits)[state]. It is used to collect profile for
+  // GraphOrder. visits should be large enough to hold all states
+  void set_state_visits(std::vector<int64_t> *visits) {
+    state_visits_ = visits;
+  }
+
+  // Enables recording the transition-ids of each token for BestAlignment(). It
+  // should be called before Initialize()
+  void set_alignment(bool alignment) { alignment_ = alignment; }
+
+  // Sets the beam of cost, the default is kDefaultBeam. A narrow beam is enough
+  // for alignment since the graph only contains the transcript
+  void set_beam(float beam) { beam_ = beam; }
+
+  // Sets the sub-graphs of the nonterminals in HCLG. It just borrows the
+  // pointer, grammar should not be changed until the decoder is destroyed. It
+  // should be called before Initialize()
+  void set_grammar(const Grammar *grammar) { grammar_ = grammar; }
+
  private:
   // Token represents a state in the viterbi lattice. olabel_idx is the index
   // of its corresponded outpu label link-list in the list impl->olabels
@@ -97,6 +139,30 @@ class Decoder {
   // previous pointes to the previous OLabel like a link list.
   class OLabel;
 
+  // Trace records the transition-ids and words along the path of a token, only
+  // used in alignment
+  class Trace;
+
+  // An entrance into a sub-graph of grammar. Tokens in the sub-graph return to
+  // return_state of carrier HCLG from final states of it. const_fst is set when
+  // fst is a ConstFst
+  struct Instance {
+    const fst::Fst<fst::StdArc> *fst;
+    const fst::ConstFst<fst::StdArc> *const_fst;
+    int32_t return_state;
+  };
+
+  // Returns the instance id of entering subgraph of nonterminal from an arc of
+  // carrier HCLG to return_state. The same entrance gets the same id within an
+  // utterance, so that the tokens in it could be recombined
+  int32_t EnterSubGraph(int nonterminal,
+                        const fst::Fst<fst::StdArc> *subgraph,
+                        int32_t return_state);
+
+  // Final cost of state. States in sub-graphs are never final, they should
+  // return to carrier HCLG first
+  float FinalCost(const State &state) const;
+
   // Get the weight cutoff from prev_toks_. We won't go throuth all the toks in
   // beam here to calculate cutoff, Since it takes a long time. Instead, we
   // randomly sample N costs from the beam and GUESS the cutoff value.
@@ -108,10 +174,14 @@ class Decoder {
 
   // Insert tok into self->toks_ with next_state and its output_label. And it
   // will either insert a new token or update existing token in the beam.
+  // from_tok is the token where the arc starts, nullptr for the start state.
   // return true if successfully inserted. Otherwise, when the cost of
   // existing tok is less than new one, return false
-  bool InsertTok(
-      State next_state, int output_label, OLabel *prev_olabel, float cost);
+  bool InsertTok(State next_state,
+                 int input_label,
+                 int output_label,
+                 const Token *from_tok,
+                 float cost);
 
   // Processes nonemitting arcs for one frame. Propagates within cur_toks_.
   void ProcessNonemitting(double cutoff);
@@ -127,11 +197,21 @@ class Decoder {
   // Get log likelihood of transition-id in current frame
   float LogLikelihood(const VectorBase<float> &frame_logp, int trans_id) const;
 
+  // Calls f(arc) for each out-going arc of state in HCLG or in the sub-graph of
+  // its instance. ConstFst, HclgCompactFst and ComposeFst are iterated by their
+  // own ArcIterator without virtual calls or extra arc cache
+  template<typename F>
+  void ForEachArc(const State &state, F f) const;
+
   // Only used in get_cutoff()
   std::vector<float> costs_;
 
-  // FST graph used for decoding
+  // FST graph used for decoding. const_fst_, compact_fst_ or compose_fst_ is
+  // set when fst_ is of that type
   const fst::Fst<fst::StdArc> *fst_;
+  const fst::ConstFst<fst::StdArc> *const_fst_;
+  const HclgCompactFst *compact_fst_;
+  const fst::ComposeFst<fst::StdArc> *compose_fst_;
 
   // Additional graph F = G^{-1} o G', where G^{-1} is the same as G in HCLG
   // graph except that all the weights are negative. G' is a big language model
@@ -154,6 +234,10 @@ class Decoder {
   // Storea all output-label nodes
   GCPool<OLabel> olabels_pool_;
 
+  // Stores all trace nodes when alignment_ is true
+  GCPool<Trace> traces_pool_;
+  bool alignment_;
+
   // Scale for AM
   float am_scale_;
 
@@ -165,38 +249,62 @@ class Decoder {
 
   // Beam threshold
   float beam_;
+
+  // Accumulates visits of HCLG states when not nullptr
+  std::vector<int64_t> *state_visits_;
+
+  // Sub-graphs of nonterminals, nullptr if not used
+  const Grammar *grammar_;
+
+  // Instances of sub-graphs entered in this utterance. instances_[0] is the
+  // carrier HCLG itself. instance_idx_ maps the (nonterminal, return_state)
+  // of an entrance to its index
+  std::vector<Instance> instances_;
+  std::unordered_map<int64_t, int32_t> instance_idx_;
 };
 
 
-// Stores the state of each FST
+// Stores the state of each FST. instance is the sub-graph instance that
+// hclg_state belongs to, kCarrierInstance for HCLG itself
 class Decoder::State {
  public:
-  State(int32_t hclg_state, int32_t lm_state);
+  State(int32_t hclg_state,
+        int32_t lm_state,
+        int32_t instance = kCarrierInstance);
   State();
 
   int32_t hclg_state() const { return hclg_state_; }
   int32_t lm_state() const { return lm_state_; }
+  int32_t instance() const { return instance_; }
 
   bool operator==(const State &s) const {
-    return hclg_state_ == s.hclg_state_ && lm_state_ == s.lm_state_;
+    return hclg_state_ == s.hclg_state_ && lm_state_ == s.lm_state_ &&
+           instance_ == s.instance_;
   }
  
  private:
   int32_t hclg_state_;
   int32_t lm_state_;
+  int32_t instance_;
 };
 
-// Hash fucntions for state
+// Hash fucntions for state. instance is mixed into the high bits of
+// hclg_state, which keeps the hash as cheap as before and is 0 in carrier HCLG
 inline int32_t hash(Decoder::State s) {
   int32_t h = 19;
-  h = h * 31 + s.hclg_state();
+  h = h * 31 + (s.hclg_state() ^ static_cast<int32_t>(
+      static_cast<uint32_t>(s.instance()) << 20));
   h = h * 31 + s.lm_state();
 
   return h;
 }
 
 inline std::string ToString(const Decoder::State &state) {
-  return util::Format("State({}, {})", state.hclg_state(), state.lm_state());
+  return util::Format(
+      "State({}, {}, {})",
+      state.hclg_state(),
+      state.lm_state(),
+      state.instance());
 }
 
 // Stores the decoding result
@@ -217,7 +325,7 @@ class Decoder::Hypothesis {
 
 class Decoder::Token {
  public:
-  Token(State state, float cost, OLabel *olabel);
+  Token(State state, float cost, OLabel *olabel, Trace *trace);
 
   // The state in FST
   State state() const { return state_; }
@@ -228,8 +336,12 @@ class Decoder::Token {
   // Head of output label chain
   OLabel *olabel() const { return olabel_; }
 
+  // Head of trace chain, nullptr if alignment is not enabled
+  Trace *trace() const { return trace_; }
+
  private:
   OLabel *olabel_;
+  Trace *trace_;
   State state_;
   float cost_;
 };
@@ -267,6 +379,25 @@ class Decoder::OLabel : public Collectable {
   std::unordered_map<int, OLabel *> nexts_;
 };
 
+// Each node is an emitting arc (transition_id > 0) or a nonemitting arc with
+// output label (transition_id = 0)
+class Decoder::Trace : public Collectable {
+ public:
+  Trace(Trace *previous, int transition_id, int olabel);
+
+  // Called when Trace is garbage collected
+  void OnCollect() override { previous_ = nullptr; }
+
+  Trace *previous() const { return previous_; }
+  int transition_id() const { return transition_id_; }
+  int olabel() const { return olabel_; }
+
+ private:
+  Trace *previous_;
+  int32_t transition_id_;
+  int32_t olabel_;
+};
+
 }  // namespace pocketkaldi
 
 
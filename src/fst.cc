@@ -9,6 +9,10 @@
 #include <cmath>
 #include <array>
 #include <algorithm>
+#include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
 #include "symbol_table.h"
 
 namespace pocketkaldi {
@@ -23,7 +27,14 @@ FstArc::FstArc(int next_state, int ilabel, int olabel, float weight):
     weight(weight) {}
 
 
-Fst::Fst(): start_state_(0) {}
+Fst::Fst():
+    start_state_(0),
+    num_states_(0),
+    num_arcs_(0),
+    arcs_(nullptr),
+    state_idx_(nullptr),
+    final_(nullptr),
+    linear_scan_max_(0) {}
 Fst::~Fst() {}
 
 Fst::ArcIterator::ArcIterator(int base, int total, const FstArc *arcs) :
@@ -44,12 +55,21 @@ int Fst::StartState() const {
 }
 
 float Fst::Final(int state_id) const {
-  assert(state_id < final_.size());
+  assert(state_id < num_states_);
   return final_[state_id];
 }
 
+int64_t Fst::SectionSize(int64_t state_number, int64_t arc_number) {
+  return sizeof(int32_t) * 3 +
+         state_number * (sizeof(float) + sizeof(int32_t)) +
+         arc_number * sizeof(FstArc);
+}
+
 Status Fst::Read(util::ReadableFile *fd) {
   Status status;
+  label_index_.clear();
+  labels_.clear();
+  eytzinger_pos_.clear();
 
   // Checks section name
   int section_size;
@@ -76,12 +96,7 @@ Status Fst::Read(util::ReadableFile *fd) {
   start_state_ = start_state;
 
   // Check section size
-  int expected_section_size =
-      sizeof(state_number) +
-      sizeof(arc_number) +
-      sizeof(start_state) +
-      state_number * (sizeof(final_.front()) + sizeof(state_idx_.front())) +
-      arc_number * sizeof(FstArc);
+  int64_t expected_section_size = SectionSize(state_number, arc_number);
   if (expected_section_size != section_size) {
     return Status::Corruption(util::Format(
         "section_size == {} expected, but {} found",
@@ -90,27 +105,90 @@ Status Fst::Read(util::ReadableFile *fd) {
   }
 
   // Final weight
-  final_.resize(state_number);
-  status = fd->Read(final_.data(), sizeof(final_.front()) * final_.size());
+  final_data_.resize(state_number);
+  status = fd->Read(
+      final_data_.data(),
+      sizeof(final_data_.front()) * final_data_.size());
   if (!status.ok()) return status; 
 
   // State idx
-  state_idx_.resize(state_number);
+  state_idx_data_.resize(state_number);
   status = fd->Read(
-      state_idx_.data(),
-      sizeof(state_idx_.front()) * state_idx_.size());
+      state_idx_data_.data(),
+      sizeof(state_idx_data_.front()) * state_idx_data_.size());
   if (!status.ok()) return status;
 
   // Arcs
-  arcs_.resize(arc_number);
-  status = fd->Read(arcs_.data(), sizeof(arcs_.front()) * arcs_.size());
+  arcs_data_.resize(arc_number);
+  status = fd->Read(
+      arcs_data_.data(),
+      sizeof(arcs_data_.front()) * arcs_data_.size());
   if (!status.ok()) return status;
 
+  num_states_ = state_number;
+  num_arcs_ = arc_number;
+  final_ = final_data_.data();
+  state_idx_ = state_idx_data_.data();
+  arcs_ = arcs_data_.data();
+
   // Success
   return status;
 }
 
+Status Fst::Map(const char *data, int64_t size) {
+  // Header is the same as Read()
+  constexpr int kHeaderSize = 32 + sizeof(int32_t) * 4;
+  if (size < kHeaderSize) {
+    return Status::Corruption("Fst::Map: unexpected end of data");
+  }
+  if (reinterpret_cast<uintptr_t>(data) % alignof(FstArc) != 0) {
+    return Status::Corruption("Fst::Map: data is not aligned");
+  }
+  std::array<char, 32> section_name;
+  memcpy(section_name.data(), data, 32);
+  section_name.back() = '\0';
+  if (std::string(section_name.data()) != kSectionName) {
+    return Status::Corruption("Fst::Map: unexpected section name");
+  }
+
+  int32_t header[4];
+  memcpy(header, data + 32, sizeof(header));
+  int32_t section_size = header[0],
+          state_number = header[1],
+          arc_number = header[2],
+          start_state = header[3];
+  int64_t expected_section_size = SectionSize(state_number, arc_number);
+  if (expected_section_size != section_size ||
+      32 + sizeof(int32_t) + expected_section_size > size) {
+    return Status::Corruption(util::Format(
+        "section_size == {} expected, but {} found",
+        expected_section_size,
+        section_size));
+  }
+
+  // Points to data directly
+  const char *body = data + kHeaderSize;
+  label_index_.clear();
+  labels_.clear();
+  eytzinger_pos_.clear();
+  final_data_.clear();
+  state_idx_data_.clear();
+  arcs_data_.clear();
+  start_state_ = start_state;
+  num_states_ = state_number;
+  num_arcs_ = arc_number;
+  final_ = reinterpret_cast<const float *>(body);
+  body += sizeof(float) * state_number;
+  state_idx_ = reinterpret_cast<const int32_t *>(body);
+  body += sizeof(int32_t) * state_number;
+  arcs_ = reinterpret_cast<const FstArc *>(body);
+
+  return Status::OK();
+}
+
 int Fst::CountArcs(int state) const {
+  if (!label_index_.empty()) return label_index_[state].num_arcs;
+
   int state_idx = state_idx_[state];
   if (state_idx < 0) return 0;
 
@@ -118,17 +196,165 @@ int Fst::CountArcs(int state) const {
   int next_state = -1;
 
   // Find the next state that have outcoming arcs
-  for (int chk_state = state + 1; chk_state < state_idx_.size(); ++chk_state) {
+  for (int chk_state = state + 1; chk_state < num_states_; ++chk_state) {
     if (state_idx_[chk_state] > 0) {
       next_state = chk_state;
       break;
     }
   }
-  int next_idx = next_state >= 0 ? state_idx_[next_state] : arcs_.size();
+  int next_idx = next_state >= 0 ? state_idx_[next_state] : num_arcs_;
   return next_idx - state_idx;
 }
 
+namespace {
+
+// Fill labels and positions of arcs (sorted by ilabel) in Eytzinger order.
+// Returns the next sorted position to fill
+int FillEytzinger(const FstArc *arcs,
+                  int num_arcs,
+                  int sorted_pos,
+                  int k,
+                  int32_t *labels,
+                  int32_t *positions) {
+  if (k > num_arcs) return sorted_pos;
+  sorted_pos = FillEytzinger(arcs, num_arcs, sorted_pos, 2 * k, labels,
+                             positions);
+  labels[k] = arcs[sorted_pos].input_label;
+  positions[k] = sorted_pos;
+  ++sorted_pos;
+  return FillEytzinger(arcs, num_arcs, sorted_pos, 2 * k + 1, labels,
+                       positions);
+}
+
+// Find ilabel in labels[0 .. n) by linear scan. Return its position or -1
+inline int LinearScan(const int32_t *labels, int n, int ilabel) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128i key = _mm_set1_epi32(ilabel);
+  for (; i + 4 <= n; i += 4) {
+    __m128i block = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(labels + i));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, key)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif  // __SSE2__
+  for (; i < n; ++i) {
+    if (labels[i] == ilabel) return i;
+  }
+  return -1;
+}
+
+}  // namespace
+
+void Fst::InitLabelIndex(int linear_scan_max) {
+  label_index_.clear();
+  labels_.clear();
+  eytzinger_pos_.clear();
+  linear_scan_max_ = linear_scan_max;
+
+  // Fanout of each state
+  std::vector<int32_t> fanout(num_states_, 0);
+  int next_idx = num_arcs_;
+  for (int state = num_states_ - 1; state >= 0; --state) {
+    if (state_idx_[state] < 0) continue;
+    fanout[state] = next_idx - state_idx_[state];
+    next_idx = state_idx_[state];
+  }
+
+  std::vector<LabelIndex> label_index(num_states_);
+  for (int state = 0; state < num_states_; ++state) {
+    LabelIndex &index = label_index[state];
+    index.arc_offset = state_idx_[state];
+    index.offset = labels_.size();
+    index.num_arcs = fanout[state];
+    index.pos_offset = -1;
+    if (fanout[state] == 0) continue;
+
+    const FstArc *arcs = arcs_ + state_idx_[state];
+    if (fanout[state] <= linear_scan_max) {
+      for (int i = 0; i < fanout[state]; ++i) {
+        labels_.push_back(arcs[i].input_label);
+      }
+    } else {
+      index.pos_offset = eytzinger_pos_.size();
+      labels_.resize(labels_.size() + fanout[state] + 1, -1);
+      eytzinger_pos_.resize(eytzinger_pos_.size() + fanout[state] + 1, -1);
+      FillEytzinger(
+          arcs,
+          fanout[state],
+          0,
+          1,
+          labels_.data() + index.offset,
+          eytzinger_pos_.data() + index.pos_offset);
+    }
+  }
+
+  // Set label_index_ at last since CountArcs() depends on it
+  label_index_ = std::move(label_index);
+}
+
+int64_t Fst::label_index_bytes() const {
+  return label_index_.size() * sizeof(LabelIndex) +
+         labels_.size() * sizeof(int32_t) +
+         eytzinger_pos_.size() * sizeof(int32_t);
+}
+
+const FstArc *Fst::FindArcByIndex(int state, int ilabel) const {
+  const LabelIndex &index = label_index_[state];
+  int num_arcs = index.num_arcs;
+  const int32_t *labels = labels_.data() + index.offset;
+  if (num_arcs <= linear_scan_max_) {
+    int pos = LinearScan(labels, num_arcs, ilabel);
+    return pos >= 0 ? arcs_ + index.arc_offset + pos : nullptr;
+  }
+
+  // Eytzinger search, the children of k are 2k and 2k + 1. The block of 16
+  // labels at 16k are the descendants 4 levels below k, prefetch them
+  uint32_t k = 1;
+  while (k <= static_cast<uint32_t>(num_arcs)) {
+    __builtin_prefetch(labels + 16 * k);
+    k = 2 * k + (labels[k] < ilabel);
+  }
+  k >>= __builtin_ffs(~k);
+  if (k == 0 || labels[k] != ilabel) return nullptr;
+
+  int pos = eytzinger_pos_[index.pos_offset + k];
+  return arcs_ + index.arc_offset + pos;
+}
+
+Fst::Region Fst::final_region() const {
+  return Region{
+      reinterpret_cast<const char *>(final_),
+      static_cast<int64_t>(num_states_ * sizeof(float))};
+}
+
+Fst::Region Fst::state_idx_region() const {
+  return Region{
+      reinterpret_cast<const char *>(state_idx_),
+      static_cast<int64_t>(num_states_ * sizeof(int32_t))};
+}
+
+Fst::Region Fst::arcs_region() const {
+  return Region{
+      reinterpret_cast<const char *>(arcs_),
+      static_cast<int64_t>(num_arcs_ * sizeof(FstArc))};
+}
+
+Fst::Region Fst::arcs_region(int state) const {
+  int num_arcs = CountArcs(state);
+  if (num_arcs == 0) return Region{nullptr, 0};
+  return Region{
+      reinterpret_cast<const char *>(arcs_ + state_idx_[state]),
+      static_cast<int64_t>(num_arcs * sizeof(FstArc))};
+}
+
 bool Fst::GetArc(int state, int ilabel, FstArc *arc) const {
+  if (!label_index_.empty()) {
+    const FstArc *found_arc = FindArcByIndex(state, ilabel);
+    if (found_arc) *arc = *found_arc;
+    return found_arc != nullptr;
+  }
+
   int num_arcs = CountArcs(state);
   if (num_arcs == 0) return false;
 
@@ -154,12 +380,12 @@ bool Fst::GetArc(int state, int ilabel, FstArc *arc) const {
 }
 
 Fst::ArcIterator Fst::IterateArcs(int state) const {
-  assert(state < state_idx_.size() && state >= 0);
+  assert(state < num_states_ && state >= 0);
   int total_arcs = CountArcs(state);
   return ArcIterator(
     state_idx_[state],
     total_arcs,
-    arcs_.data());
+    arcs_);
 }
 
 const FstArc *Fst::ArcIterator::Next() {
@@ -172,28 +398,219 @@ const FstArc *Fst::ArcIterator::Next() {
   }
 }
 
-void LmFst::InitBucket0() {
-  // Optimize for special state 0
-  ArcIterator arc_iter = IterateArcs(0);
-  const FstArc *arc = nullptr;
-  int max_ilabel = 0;
-  while ((arc = arc_iter.Next()) != nullptr) {
-    if (arc->input_label > max_ilabel) {
-      max_ilabel = arc->input_label;
+LmFst::LmFst():
+    direct_index_bytes_(0),
+    filter_num_blocks_(0),
+    filter_num_hashes_(0),
+    filter_fp_rate_(1.0) {}
+
+void LmFst::InitDirectIndex(int max_states, int64_t memory_budget) {
+  table_idx_.clear();
+  tables_.clear();
+  table_arcs_.clear();
+  direct_index_bytes_ = 0;
+
+  // Get fanout of each state in one pass over state_idx_
+  int num_states = num_states_;
+  std::vector<int32_t> fanout(num_states, 0);
+  int next_idx = num_arcs_;
+  for (int state = num_states - 1; state >= 0; --state) {
+    if (state_idx_[state] < 0) continue;
+    fanout[state] = next_idx - state_idx_[state];
+    next_idx = state_idx_[state];
+  }
+
+  // Candidates are states ordered by fanout in descending order (and by state
+  // for ties). Only the prefix visited below is sorted, block by block
+  std::vector<int32_t> candidates;
+  for (int state = 0; state < num_states; ++state) {
+    if (fanout[state] > 0) candidates.push_back(state);
+  }
+  auto by_fanout = [&fanout] (int32_t l, int32_t r) {
+    return fanout[l] > fanout[r] || (fanout[l] == fanout[r] && l < r);
+  };
+  size_t sorted_end = 0;
+
+  // Select states and decide the kind of table for each of them. table_idx_
+  // is extended to the largest state selected, its size is also counted in
+  // memory_budget
+  std::vector<std::pair<int32_t, ArcTable>> selected;
+  int64_t total_bytes = 0;
+  int max_state = -1;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (selected.size() >= max_states) break;
+
+    // Even the smallest table does not fit into the rest of budget
+    if (memory_budget - total_bytes < static_cast<int64_t>(sizeof(FstArc))) {
+      break;
+    }
+
+    // Sort the next block of candidates, the block size doubles each time
+    if (i == sorted_end) {
+      sorted_end = std::min(candidates.size(), std::max<size_t>(1024, i * 2));
+      std::nth_element(
+          candidates.begin() + i,
+          candidates.begin() + sorted_end - 1,
+          candidates.end(),
+          by_fanout);
+      std::sort(
+          candidates.begin() + i,
+          candidates.begin() + sorted_end - 1,
+          by_fanout);
+    }
+    int32_t state = candidates[i];
+
+    int max_ilabel = 0;
+    ArcIterator arc_iter = IterateArcs(state);
+    const FstArc *arc = nullptr;
+    while ((arc = arc_iter.Next()) != nullptr) {
+      max_ilabel = std::max(max_ilabel, arc->input_label);
+    }
+
+    // Hashed table is used when dense table is too sparse. Since hashed
+    // lookup needs probing, prefer dense table when the cost is comparable
+    int hashed_size = 1;
+    while (hashed_size < fanout[state] * 2) hashed_size *= 2;
+    ArcTable table;
+    table.offset = 0;
+    table.hashed = max_ilabel + 1 > hashed_size * 2;
+    table.size = table.hashed ? hashed_size : max_ilabel + 1;
+
+    int64_t table_bytes = static_cast<int64_t>(table.size) * sizeof(FstArc);
+    int64_t index_bytes = 0;
+    if (state > max_state) {
+      index_bytes = static_cast<int64_t>(state - max_state) * sizeof(int32_t);
+    }
+    if (total_bytes + table_bytes + index_bytes > memory_budget) continue;
+
+    total_bytes += table_bytes + index_bytes;
+    max_state = std::max(max_state, static_cast<int>(state));
+    selected.emplace_back(state, table);
+  }
+
+  // Build the tables. Empty slots have input_label == -1
+  table_idx_.resize(max_state + 1, -1);
+  for (std::pair<int32_t, ArcTable> &item : selected) {
+    int32_t state = item.first;
+    ArcTable &table = item.second;
+    table.offset = table_arcs_.size();
+    table_arcs_.resize(
+        table_arcs_.size() + table.size,
+        FstArc(kNoState, -1, 0, 0.0f));
+
+    ArcIterator arc_iter = IterateArcs(state);
+    const FstArc *arc = nullptr;
+    while ((arc = arc_iter.Next()) != nullptr) {
+      int idx = arc->input_label;
+      if (table.hashed) {
+        uint32_t mask = table.size - 1;
+        idx = HashLabel(arc->input_label) & mask;
+        while (table_arcs_[table.offset + idx].input_label != -1) {
+          idx = (idx + 1) & mask;
+        }
+      }
+      table_arcs_[table.offset + idx] = *arc;
+    }
+
+    table_idx_[state] = tables_.size();
+    tables_.push_back(table);
+  }
+  direct_index_bytes_ = total_bytes;
+}
+
+const FstArc *LmFst::FindInTable(const ArcTable &table, int ilabel) const {
+  const FstArc *arcs = table_arcs_.data() + table.offset;
+  if (!table.hashed) {
+    if (ilabel >= table.size || arcs[ilabel].input_label != ilabel) {
+      return nullptr;
+    }
+    return &arcs[ilabel];
+  }
+
+  uint32_t mask = table.size - 1;
+  uint32_t idx = HashLabel(ilabel) & mask;
+  while (arcs[idx].input_label != -1) {
+    if (arcs[idx].input_label == ilabel) return &arcs[idx];
+    idx = (idx + 1) & mask;
+  }
+  return nullptr;
+}
+
+void LmFst::InitFilter(int bits_per_arc, int64_t memory_budget) {
+  filter_.clear();
+  filter_num_blocks_ = 0;
+  filter_num_hashes_ = 0;
+  filter_fp_rate_ = 1.0;
+  if (bits_per_arc <= 0 || num_arcs_ == 0) return;
+
+  // Size of filter. Number of hashes is optimal for bits_per_arc even when
+  // filter is shrinked by memory_budget
+  int64_t num_bits = static_cast<int64_t>(num_arcs_) * bits_per_arc;
+  num_bits = std::min(num_bits, memory_budget * 8);
+  int64_t num_blocks = num_bits / kFilterBlockBits;
+  if (num_blocks <= 0) return;
+  num_blocks = std::min(
+      num_blocks,
+      static_cast<int64_t>(std::numeric_limits<int32_t>::max()));
+  filter_num_blocks_ = num_blocks;
+  filter_num_hashes_ = std::max(1, static_cast<int>(round(
+      bits_per_arc * log(2.0))));
+  filter_.resize(num_blocks * kFilterBlockWords, 0);
+
+  int num_states = num_states_;
+  for (int state = 0; state < num_states; ++state) {
+    ArcIterator arc_iter = IterateArcs(state);
+    const FstArc *arc = nullptr;
+    while ((arc = arc_iter.Next()) != nullptr) {
+      AddToFilter(state, arc->input_label);
     }
   }
 
-  // Initalize bucket_0_
-  bucket_0_.resize(max_ilabel + 1);
-  for (FstArc &arc : bucket_0_) {
-    arc.input_label = -1;
+  // Measure the false positive rate with random (state, ilabel) pairs that
+  // not exist in fst
+  int max_ilabel = 0;
+  for (int arc_idx = 0; arc_idx < num_arcs_; ++arc_idx) {
+    max_ilabel = std::max(max_ilabel, arcs_[arc_idx].input_label);
+  }
+  uint64_t seed = 0x2545f4914f6cdd1dull;
+  int num_queries = 0, num_false_positives = 0;
+  for (int i = 0; i < 65536; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    int state = (seed >> 33) % num_states;
+    int ilabel = 1 + (seed >> 11) % std::max(1, max_ilabel);
+    FstArc arc;
+    if (Fst::GetArc(state, ilabel, &arc)) continue;
+    ++num_queries;
+    if (MayHaveArc(state, ilabel)) ++num_false_positives;
+  }
+  if (num_queries > 0) {
+    filter_fp_rate_ = static_cast<double>(num_false_positives) / num_queries;
+  }
+}
+
+void LmFst::AddToFilter(int state, int ilabel) {
+  uint64_t h = HashArc(state, ilabel);
+  uint64_t block = ((h >> 32) * filter_num_blocks_) >> 32;
+  uint64_t *words = filter_.data() + block * kFilterBlockWords;
+  uint32_t h1 = static_cast<uint32_t>(h);
+  uint32_t h2 = static_cast<uint32_t>(h >> 41) | 1;
+  for (int i = 0; i < filter_num_hashes_; ++i) {
+    uint32_t bit = (h1 + i * h2) % kFilterBlockBits;
+    words[bit / 64] |= 1ull << (bit % 64);
   }
+}
 
-  // Fill bucket_0_
-  arc_iter = IterateArcs(0);
-  while ((arc = arc_iter.Next()) != nullptr) {
-    bucket_0_[arc->input_label] = *arc;
+bool LmFst::MayHaveArc(int state, int ilabel) const {
+  uint64_t h = HashArc(state, ilabel);
+  uint64_t block = ((h >> 32) * filter_num_blocks_) >> 32;
+  const uint64_t *words = filter_.data() + block * kFilterBlockWords;
+  uint32_t h1 = static_cast<uint32_t>(h);
+  uint32_t h2 = static_cast<uint32_t>(h >> 41) | 1;
+  for (int i = 0; i < filter_num_hashes_; ++i) {
+    uint32_t bit = (h1 + i * h2) % kFilterBlockBits;
+    if ((words[bit / 64] & (1ull << (bit % 64))) == 0) return false;
   }
+  return true;
 }
 
 const FstArc *LmFst::GetBackoffArc(int state) const {
@@ -210,15 +627,18 @@ const FstArc *LmFst::GetBackoffArc(int state) const {
 bool LmFst::GetArc(int state, int ilabel, FstArc *arc) const {
   assert(ilabel != 0 && "invalid ilabel");
 
-  // We have special optimize for state 0
-  if (state == 0 && ilabel < bucket_0_.size()) {
-    if (bucket_0_[ilabel].input_label == ilabel) {
-      *arc = bucket_0_[ilabel];
-      return true;
-    }
+  // States with direct-index table need no binary search. A miss in the table
+  // means the arc not exist, so go to the back-off arc directly
+  bool found = false;
+  if (HasDirectIndex(state)) {
+    const FstArc *table_arc = FindInTable(tables_[table_idx_[state]], ilabel);
+    if (table_arc) *arc = *table_arc;
+    found = table_arc != nullptr;
+  } else if (filter_.empty() || MayHaveArc(state, ilabel)) {
+    found = Fst::GetArc(state, ilabel, arc);
   }
 
-  if (Fst::GetArc(state, ilabel, arc)) {
+  if (found) {
     return true;
   } else {
     const FstArc *backoff_arc = GetBackoffArc(state);
@@ -250,30 +670,198 @@ float LmFst::Final(int state_id) const {
   }
 }
 
+Status ClassWordMap::Add(int class_label, int word, float weight) {
+  if (class_label <= 0 || word <= 0) {
+    return Status::RuntimeError(util::Format(
+        "invalid class or word: {} {}",
+        class_label,
+        word));
+  }
+  if (!(weight > 0.0f)) {
+    return Status::RuntimeError(util::Format("invalid weight: {}", weight));
+  }
+
+  if (word >= word_class_.size()) {
+    word_class_.resize(word + 1, -1);
+    word_weight_.resize(word + 1, 0.0f);
+    word_cost_.resize(word + 1, INFINITY);
+  }
+  if (word_class_[word] >= 0 && word_class_[word] != class_label) {
+    return Status::RuntimeError(util::Format(
+        "word {} already in class {}",
+        word,
+        word_class_[word]));
+  }
+  if (word_class_[word] < 0) words_.push_back(word);
+  word_class_[word] = class_label;
+  word_weight_[word] += weight;
+  class_weight_[class_label] += weight;
+  sealed_ = false;
+
+  return Status::OK();
+}
+
+void ClassWordMap::Seal() {
+  for (int32_t word : words_) {
+    double sum_weights = class_weight_[word_class_[word]];
+    word_cost_[word] = -log(word_weight_[word] / sum_weights);
+  }
+  sealed_ = true;
+}
+
 DeltaLmFst::DeltaLmFst(
     const Vector<float> *small_lm,
     const LmFst *lm,
+    const SymbolTable *symbol_table):
+        DeltaLmFst(small_lm,
+                   std::vector<const LmFst *>{lm},
+                   std::vector<float>{1.0f},
+                   symbol_table) {
+}
+
+DeltaLmFst::DeltaLmFst(
+    const Vector<float> *small_lm,
+    const std::vector<const LmFst *> &lms,
+    const std::vector<float> &weights,
     const SymbolTable *symbol_table):
         small_lm_(small_lm),
-        lm_(lm) {
+        class_words_(nullptr),
+        lms_(lms),
+        start_state_(Fst::kNoState) {
+  assert(!lms.empty() && lms.size() == weights.size());
   bos_symbol_ = symbol_table->bos_id();
   eos_symbol_ = symbol_table->eos_id();
+
+  double sum_weights = 0.0;
+  for (float weight : weights) {
+    assert(weight >= 0.0f);
+    sum_weights += weight;
+  }
+  assert(sum_weights > 0.0);
+  for (float weight : weights) {
+    log_weights_.push_back(log(weight / sum_weights));
+  }
+
+  // Follow the back-off arcs from start state to get the null state
+  for (const LmFst *lm : lms_) {
+    int state = lm->StartState();
+    Fst::ArcIterator arc_iter = lm->IterateArcs(state);
+    const FstArc *arc = arc_iter.Next();
+    while (arc && arc->input_label == 0) {
+      state = arc->next_state;
+      arc_iter = lm->IterateArcs(state);
+      arc = arc_iter.Next();
+    }
+    null_states_.push_back(state);
+  }
+}
+
+void DeltaLmFst::set_lm_caches(const std::vector<const LmCache *> &caches) {
+  assert(caches.empty() || caches.size() == lms_.size());
+  lm_caches_ = caches;
+}
+
+bool DeltaLmFst::LmGetArc(int lm_idx,
+                          int state,
+                          int ilabel,
+                          FstArc *arc) const {
+  if (lm_caches_.empty()) return lms_[lm_idx]->GetArc(state, ilabel, arc);
+  return lm_caches_[lm_idx]->GetArc(state, ilabel, arc, &lm_cache_stats_);
+}
+
+float DeltaLmFst::LmFinal(int lm_idx, int state) const {
+  if (lm_caches_.empty()) return lms_[lm_idx]->Final(state);
+  return lm_caches_[lm_idx]->Final(state, &lm_cache_stats_);
 }
 
 int DeltaLmFst::StartState() const {
-  int start_state = lm_->StartState();
-  FstArc arc;
-  if (lm_->GetArc(start_state, bos_symbol_, &arc)) {
-    return arc.next_state;
-  } else {
-    PK_WARN("lm_ didn't have symbol <s> as input");
-    return start_state;
+  if (start_state_ != Fst::kNoState) return start_state_;
+
+  tuple_buffer_.resize(lms_.size());
+  for (int i = 0; i < lms_.size(); ++i) {
+    int start_state = lms_[i]->StartState();
+    FstArc arc;
+    if (LmGetArc(i, start_state, bos_symbol_, &arc)) {
+      tuple_buffer_[i] = arc.next_state;
+    } else {
+      PK_WARN(util::Format("lm {} didn't have symbol <s> as input", i));
+      tuple_buffer_[i] = start_state;
+    }
+  }
+  start_state_ = lms_.size() == 1 ? tuple_buffer_[0]
+                                  : TupleStateId(tuple_buffer_);
+  return start_state_;
+}
+
+int DeltaLmFst::TupleStateId(const std::vector<int32_t> &tuple) const {
+  auto it = tuple_ids_.find(tuple);
+  if (it != tuple_ids_.end()) return it->second;
+
+  int32_t tuple_id = tuple_states_.size() / lms_.size();
+  tuple_states_.insert(tuple_states_.end(), tuple.begin(), tuple.end());
+  tuple_ids_.emplace(tuple, tuple_id);
+  return tuple_id;
+}
+
+float DeltaLmFst::InterpolateCosts(const std::vector<float> &costs) const {
+  // log-sum-exp of (log_weights_[i] - costs[i])
+  float max_logp = -INFINITY;
+  for (int i = 0; i < costs.size(); ++i) {
+    max_logp = std::max(max_logp, log_weights_[i] - costs[i]);
+  }
+  if (!std::isfinite(max_logp)) return INFINITY;
+
+  double sum = 0.0;
+  for (int i = 0; i < costs.size(); ++i) {
+    sum += exp(log_weights_[i] - costs[i] - max_logp);
   }
+  return -(max_logp + log(sum));
+}
+
+bool DeltaLmFst::GetInterpolatedArc(int state, int ilabel, FstArc *arc) const {
+  int num_lms = lms_.size();
+  tuple_buffer_.resize(num_lms);
+  cost_buffer_.resize(num_lms);
+
+  bool found = false;
+  const int32_t *tuple = tuple_states_.data() + state * num_lms;
+  for (int i = 0; i < num_lms; ++i) {
+    FstArc lm_arc;
+    if (LmGetArc(i, tuple[i], ilabel, &lm_arc)) {
+      tuple_buffer_[i] = lm_arc.next_state;
+      cost_buffer_[i] = lm_arc.weight;
+      found = true;
+    } else {
+      tuple_buffer_[i] = null_states_[i];
+      cost_buffer_[i] = INFINITY;
+    }
+  }
+  if (!found) return false;
+
+  arc->input_label = ilabel;
+  arc->output_label = ilabel;
+  arc->weight = InterpolateCosts(cost_buffer_);
+  arc->next_state = TupleStateId(tuple_buffer_);
+  return true;
 }
 
 bool DeltaLmFst::GetArc(int state, int ilabel, FstArc *arc) const {
-  if (lm_->GetArc(state, ilabel, arc)) {
-    arc->weight -= (*small_lm_)(ilabel);
+  // Words in class are scored by the class nonterminal
+  int lm_ilabel = ilabel;
+  float class_cost = 0.0f;
+  if (class_words_) class_words_->Lookup(ilabel, &lm_ilabel, &class_cost);
+
+  bool found = false;
+  if (lms_.size() == 1) {
+    found = LmGetArc(0, state, lm_ilabel, arc);
+  } else {
+    found = GetInterpolatedArc(state, lm_ilabel, arc);
+  }
+
+  if (found) {
+    arc->input_label = ilabel;
+    arc->output_label = ilabel;
+    arc->weight += class_cost - (*small_lm_)(ilabel);
     return true;
   } else {
     return false;
@@ -281,12 +869,29 @@ bool DeltaLmFst::GetArc(int state, int ilabel, FstArc *arc) const {
 }
 
 float DeltaLmFst::Final(int state_id) const {
-  FstArc arc;
-  if (lm_->GetArc(state_id, eos_symbol_, &arc)) {
-    return lm_->Final(arc.next_state) + arc.weight - (*small_lm_)(eos_symbol_);
-  } else {
-    return INFINITY;
+  if (lms_.size() == 1) {
+    FstArc arc;
+    if (LmGetArc(0, state_id, eos_symbol_, &arc)) {
+      return LmFinal(0, arc.next_state) + arc.weight - (*small_lm_)(eos_symbol_);
+    } else {
+      return INFINITY;
+    }
+  }
+
+  // Final cost of each LM is the cost of </s> plus final weight of the state
+  // after </s>
+  int num_lms = lms_.size();
+  std::vector<float> costs(num_lms, INFINITY);
+  const int32_t *tuple = tuple_states_.data() + state_id * num_lms;
+  for (int i = 0; i < num_lms; ++i) {
+    FstArc arc;
+    if (LmGetArc(i, tuple[i], eos_symbol_, &arc)) {
+      costs[i] = LmFinal(i, arc.next_state) + arc.weight;
+    }
   }
+  float cost = InterpolateCosts(costs);
+  if (!std::isfinite(cost)) return INFINITY;
+  return cost - (*small_lm_)(eos_symbol_);
 }
 
 CachedFst::CachedFst(const IFst *fst, int bucket_size) : fst_(fst) {
@@ -305,8 +910,8 @@ float CachedFst::Final(int state) const {
 }
 
 bool CachedFst::GetArc(int state, int ilabel, FstArc *arc) {
-  // Do nothing when state is 0, we have special optimize for it
-  if (state == 0) {
+  // Do nothing when state have direct-index table, it is fast enough
+  if (fst_->HasDirectIndex(state)) {
     return fst_->GetArc(state, ilabel, arc);
   }
 
@@ -326,4 +931,103 @@ bool CachedFst::GetArc(int state, int ilabel, FstArc *arc) {
   return success;
 }
 
+LmCache::LmCache(const LmFst *lm, int64_t memory_budget):
+    lm_(lm),
+    num_buckets_(1) {
+  // Number of buckets is power of 2
+  while (num_buckets_ * 2 * static_cast<int64_t>(sizeof(Slot)) <=
+         memory_budget) {
+    num_buckets_ *= 2;
+  }
+  buckets_ = std::unique_ptr<Slot[]>(new Slot[num_buckets_]);
+  for (int64_t i = 0; i < num_buckets_; ++i) {
+    Slot &slot = buckets_[i];
+    slot.version.store(0, std::memory_order_relaxed);
+    slot.state.store(Fst::kNoState, std::memory_order_relaxed);
+    slot.ilabel.store(0, std::memory_order_relaxed);
+    slot.next_state.store(Fst::kNoState, std::memory_order_relaxed);
+    slot.weight.store(0.0f, std::memory_order_relaxed);
+  }
+}
+
+bool LmCache::Find(int state, int ilabel, Entry *entry) const {
+  const Slot &slot = buckets_[Bucket(state, ilabel)];
+  uint32_t version = slot.version.load(std::memory_order_acquire);
+  if (version & 1) return false;
+
+  entry->state = slot.state.load(std::memory_order_relaxed);
+  entry->ilabel = slot.ilabel.load(std::memory_order_relaxed);
+  entry->next_state = slot.next_state.load(std::memory_order_relaxed);
+  entry->weight = slot.weight.load(std::memory_order_relaxed);
+
+  // The entry is torn if it is written since version is read
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.version.load(std::memory_order_relaxed) != version) return false;
+  return entry->state == state && entry->ilabel == ilabel;
+}
+
+void LmCache::Store(const Entry &entry) const {
+  Slot &slot = buckets_[Bucket(entry.state, entry.ilabel)];
+  uint32_t version = slot.version.load(std::memory_order_relaxed);
+  if (version & 1) return;
+  if (!slot.version.compare_exchange_strong(
+          version,
+          version + 1,
+          std::memory_order_relaxed)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.state.store(entry.state, std::memory_order_relaxed);
+  slot.ilabel.store(entry.ilabel, std::memory_order_relaxed);
+  slot.next_state.store(entry.next_state, std::memory_order_relaxed);
+  slot.weight.store(entry.weight, std::memory_order_relaxed);
+  slot.version.store(version + 2, std::memory_order_release);
+}
+
+bool LmCache::GetArc(int state,
+                     int ilabel,
+                     FstArc *arc,
+                     Stats *stats) const {
+  // Do nothing when state have direct-index table, it is fast enough
+  if (lm_->HasDirectIndex(state)) return lm_->GetArc(state, ilabel, arc);
+
+  Entry entry;
+  if (Find(state, ilabel, &entry)) {
+    if (stats) ++stats->hits;
+  } else {
+    if (stats) ++stats->misses;
+    FstArc lm_arc;
+    bool found = lm_->GetArc(state, ilabel, &lm_arc);
+    entry.state = state;
+    entry.ilabel = ilabel;
+    entry.next_state = found ? lm_arc.next_state : Fst::kNoState;
+    entry.weight = found ? lm_arc.weight : 0.0f;
+    Store(entry);
+  }
+
+  if (entry.next_state == Fst::kNoState) return false;
+  arc->next_state = entry.next_state;
+  arc->input_label = ilabel;
+  arc->output_label = ilabel;
+  arc->weight = entry.weight;
+  return true;
+}
+
+float LmCache::Final(int state, Stats *stats) const {
+  Entry entry;
+  if (Find(state, kFinalLabel, &entry)) {
+    if (stats) ++stats->hits;
+    return entry.weight;
+  }
+
+  if (stats) ++stats->misses;
+  entry.state = state;
+  entry.ilabel = kFinalLabel;
+  entry.next_state = Fst::kNoState;
+  entry.weight = lm_->Final(state);
+  Store(entry);
+  return entry.weight;
+}
+
 }  // namespace pocketkaldi
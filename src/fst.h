@@ -3,9 +3,14 @@
 #ifndef POCKETKALDI_FST_H_
 #define POCKETKALDI_FST_H_
 
+#include <assert.h>
 #include <stdint.h>
+#include <atomic>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "util.h"
 #include "status.h"
 #include "ce_stt.h"
@@ -37,6 +42,10 @@ class IFst {
 
   // Get the final score of state. If the state is non-terminal, returns 0
   virtual float Final(int state_id) const = 0;
+
+  // Returns true if GetArc() of state is already a direct table lookup. Caches
+  // in front of this Fst could bypass these states
+  virtual bool HasDirectIndex(int state) const { return false; }
 };
 
 class Fst : public IFst {
@@ -62,12 +71,24 @@ public:
   static const char *kSectionName;
   static constexpr int kNoState = -1;
 
+  // Default max fanout of states using linear scan in InitLabelIndex()
+  static constexpr int kDefaultLinearScanMax = 16;
+
   Fst();
   virtual ~Fst();
 
   // Read fst from binary file.
   Status Read(util::ReadableFile *fd);
 
+  // Use the fst in memory directly without copying, like the data mapped from
+  // a file. data should be aligned to 4 bytes and alive during the lifetime of
+  // this Fst
+  Status Map(const char *data, int64_t size);
+
+  // Size of the kSectionName section with state_number states and arc_number
+  // arcs, it does not include the section header
+  static int64_t SectionSize(int64_t state_number, int64_t arc_number);
+
   // Start state of this Fst
   int StartState() const override;
 
@@ -84,15 +105,71 @@ public:
   // Return the type of this fst
   std::string fst_type() const { return fst_type_; }
 
+  // Builds label index so that GetArc() needs not touch the 16-byte arcs when
+  // searching. For states with at most linear_scan_max arcs, their labels are
+  // stored contiguously and scanned with SIMD compares. For larger states,
+  // labels are stored in Eytzinger (BFS) order and searched with prefetching.
+  // It costs 4 bytes per arc for small states, 8 bytes per arc for large
+  // states and 16 bytes per state
+  void InitLabelIndex(int linear_scan_max);
+
+  // Bytes used by label index, 0 if it is not built
+  int64_t label_index_bytes() const;
+
+  // A memory region of fst data
+  struct Region {
+    const char *data;
+    int64_t size;
+  };
+
+  // Regions of final weights, state index and all arcs. For the fst from Map()
+  // they point to the mapped memory
+  Region final_region() const;
+  Region state_idx_region() const;
+  Region arcs_region() const;
+
+  // Region of the out-going arcs of state
+  Region arcs_region(int state) const;
+
  protected:
+  // Index of labels for a state. If num_arcs <= linear_scan_max_, labels are
+  // labels_[offset .. offset + num_arcs). Otherwise, labels_[offset] is a
+  // placeholder and labels_[offset + 1 .. offset + num_arcs] are in Eytzinger
+  // order, eytzinger_pos_[pos_offset + k] is the position of the k-th label
+  // in arcs of this state. arc_offset is a copy of state_idx_[state] so that
+  // a search touches one less cache line
+  struct LabelIndex {
+    int32_t arc_offset;
+    int32_t offset;
+    int32_t num_arcs;
+    int32_t pos_offset;
+  };
+
   // Calcuate the number of outcoming arcs for state
   int CountArcs(int state) const;
 
+  // Find arc of ilabel in state using label index, return nullptr if not exist
+  const FstArc *FindArcByIndex(int state, int ilabel) const;
+
   int start_state_;
   std::string fst_type_;
-  std::vector<FstArc> arcs_;
-  std::vector<int32_t> state_idx_;
-  std::vector<float> final_;
+  int32_t num_states_;
+  int32_t num_arcs_;
+
+  // Points to *_data_ after Read(), or the memory in Map()
+  const FstArc *arcs_;
+  const int32_t *state_idx_;
+  const float *final_;
+
+  std::vector<FstArc> arcs_data_;
+  std::vector<int32_t> state_idx_data_;
+  std::vector<float> final_data_;
+
+  // Label index, empty if not built
+  std::vector<LabelIndex> label_index_;
+  std::vector<int32_t> labels_;
+  std::vector<int32_t> eytzinger_pos_;
+  int linear_scan_max_;
 };
 
 // Fst for language model, including deterministic on demand for back-off arcs,
@@ -100,6 +177,15 @@ class LmFst : public Fst {
  public:
   static constexpr char kLmFst[] = "pk::fst_lm";
 
+  // Default parameters for InitDirectIndex()
+  static constexpr int kDefaultDirectIndexStates = 64;
+  static constexpr int kDefaultDirectIndexMemoryMb = 16;
+
+  // Default memory budget for InitFilter()
+  static constexpr int kDefaultFilterMemoryMb = 64;
+
+  LmFst();
+
   // Get out-going arc of state with ilabel. For LM, we will follow the back-off
   // arc automatically when there is no arc of ilabel in current state
   // If no matched arc even follow the back-off arc, return false. 
@@ -109,15 +195,205 @@ class LmFst : public Fst {
   // will flollow the back-off arc automatically
   float Final(int state_id) const override;
 
-  // Initialize bucket for state 0 optimization
-  void InitBucket0();
+  // Implements interface IFst
+  bool HasDirectIndex(int state) const override {
+    return state < static_cast<int>(table_idx_.size()) && table_idx_[state] >= 0;
+  }
+
+  // Builds direct-index arc tables for at most max_states states with the
+  // largest fanout, so that GetArc() of them needs no binary search. States
+  // whose ilabels are dense get a table indexed by ilabel, the others get an
+  // open-addressing hash table. Total memory of tables will not exceed
+  // memory_budget bytes
+  void InitDirectIndex(int max_states, int64_t memory_budget);
+
+  // Number of states having direct-index table and the bytes they used
+  int num_direct_index_states() const { return tables_.size(); }
+  int64_t direct_index_bytes() const { return direct_index_bytes_; }
+
+  // Builds a blocked Bloom filter over (state, ilabel) of all arcs. GetArc()
+  // checks it before binary search, so most of the misses in back-off walk go
+  // to back-off arc directly. bits_per_arc controls the false positive rate
+  // (about 0.6185^bits_per_arc), the filter will be shrinked to fit in
+  // memory_budget bytes. bits_per_arc == 0 disables the filter
+  void InitFilter(int bits_per_arc, int64_t memory_budget);
+
+  // Size of filter in bytes and its false positive rate measured by random
+  // queries when building
+  int64_t filter_bytes() const { return filter_.size() * sizeof(uint64_t); }
+  double filter_false_positive_rate() const { return filter_fp_rate_; }
 
  private:
+  // Bloom filter is splitted into blocks of 512 bits (a cache line), all the
+  // bits of one key are in the same block
+  static constexpr int kFilterBlockWords = 8;
+  static constexpr int kFilterBlockBits = kFilterBlockWords * 64;
+
+  // Location of direct-index table for a state in table_arcs_. If hashed is
+  // true, size is power of 2 and the table is an open-addressing hash table
+  // keyed by ilabel. Otherwise it is indexed by ilabel directly
+  struct ArcTable {
+    int32_t offset;
+    int32_t size;
+    bool hashed;
+  };
+
   // Get the backoff arc for given state. If there is no back-off arc return
   // nullptr
   const FstArc *GetBackoffArc(int state) const;
 
-  std::vector<FstArc> bucket_0_;
+  // Find arc of ilabel in direct-index table. Return nullptr if not exist
+  const FstArc *FindInTable(const ArcTable &table, int ilabel) const;
+
+  // Hash function of ilabel for hashed ArcTable
+  static inline uint32_t HashLabel(int ilabel) {
+    return static_cast<uint32_t>(ilabel) * 2654435761u;
+  }
+
+  // Hash function of (state, ilabel) for Bloom filter
+  static inline uint64_t HashArc(int state, int ilabel) {
+    uint64_t h = (static_cast<uint64_t>(state) << 32) |
+                 static_cast<uint32_t>(ilabel);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+  }
+
+  // Add (state, ilabel) into filter_ or check if it may exist
+  void AddToFilter(int state, int ilabel);
+  bool MayHaveArc(int state, int ilabel) const;
+
+  // Map from state to index of tables_, -1 if the state has no table
+  std::vector<int32_t> table_idx_;
+  std::vector<ArcTable> tables_;
+  std::vector<FstArc> table_arcs_;
+  int64_t direct_index_bytes_;
+
+  // Bloom filter of arcs, empty if it is disabled
+  std::vector<uint64_t> filter_;
+  int filter_num_blocks_;
+  int filter_num_hashes_;
+  double filter_fp_rate_;
+};
+
+// Maps words to class nonterminals in large LM, like $CONTACT. In DeltaLmFst,
+// a word in this map is scored as the arc of its class in LM plus the cost of
+// the word in class. Word lists are small and usually different in each
+// utterance, so they are stored in a dense vector indexed by word id, the
+// lookup is one memory access in the hot path
+class ClassWordMap {
+ public:
+  ClassWordMap(): sealed_(true) {}
+
+  // Add word to class with weight. A word could only belong to one class
+  Status Add(int class_label, int word, float weight);
+
+  // Normalizes the weights of words in each class to probabilities. It should
+  // be called after the words are added and before Lookup()
+  void Seal();
+
+  // Get the class of word and the cost of word in class. Return false if the
+  // word is not in any class
+  inline bool Lookup(int word, int *class_label, float *cost) const {
+    assert(sealed_ && "ClassWordMap: Seal() is not called after Add()");
+    if (word >= word_class_.size() || word_class_[word] < 0) return false;
+    *class_label = word_class_[word];
+    *cost = word_cost_[word];
+    return true;
+  }
+
+  // Number of words in map
+  int num_words() const { return words_.size(); }
+
+ private:
+  // Class of each word, -1 if not exist
+  std::vector<int32_t> word_class_;
+  std::vector<float> word_weight_;
+  std::vector<float> word_cost_;
+
+  // Sum of the weights of words in each class
+  std::unordered_map<int32_t, double> class_weight_;
+
+  // Words added so far
+  std::vector<int32_t> words_;
+
+  // False if words are added after the last Seal()
+  bool sealed_;
+};
+
+// Memo of resolved transitions and final weights of a LmFst. GetArc() and
+// Final() of LmFst follow the back-off arcs, the results (including misses)
+// are stored here so that the same back-off walks are not repeated. It is
+// shared by all the utterances of recognizer and is thread-safe.
+//
+// The memo is a direct-mapped table whose size is bounded by memory_budget, a
+// new entry replaces the old one in its bucket. Lookups take no lock: each
+// bucket is a seqlock, its version is odd while an entry is being written, and
+// a reader that sees the version changed treats it as a miss. A writer skips
+// the store when another thread is writing the same bucket
+class LmCache {
+ public:
+  // Hits and misses of lookups. They are counted by the caller (like one
+  // utterance), so that the lookups of threads write no shared counter
+  struct Stats {
+    Stats(): hits(0), misses(0) {}
+    int64_t hits;
+    int64_t misses;
+  };
+
+  LmCache(const LmFst *lm, int64_t memory_budget);
+
+  // The same as GetArc() and Final() in lm. If stats is not nullptr, the hit
+  // or miss of the lookup is added into it
+  bool GetArc(int state, int ilabel, FstArc *arc, Stats *stats = nullptr) const;
+  float Final(int state, Stats *stats = nullptr) const;
+
+  // Bytes of the table
+  int64_t bytes() const { return num_buckets_ * sizeof(Slot); }
+
+ private:
+  // ilabel of the entries for Final()
+  static constexpr int kFinalLabel = -1;
+
+  // A resolved transition. next_state == kNoState means no arc for ilabel.
+  // For Final(), ilabel is kFinalLabel and weight is the final weight. state
+  // is kNoState for empty bucket
+  struct Entry {
+    int32_t state;
+    int32_t ilabel;
+    int32_t next_state;
+    float weight;
+  };
+
+  // Bucket of the table holding an Entry, version is the seqlock
+  struct Slot {
+    std::atomic<uint32_t> version;
+    std::atomic<int32_t> state;
+    std::atomic<int32_t> ilabel;
+    std::atomic<int32_t> next_state;
+    std::atomic<float> weight;
+  };
+
+  // Bucket of (state, ilabel)
+  inline uint32_t Bucket(int state, int ilabel) const {
+    uint64_t h = (static_cast<uint64_t>(state) << 32) |
+                 static_cast<uint32_t>(ilabel);
+    h *= 0x9e3779b97f4a7c15ull;
+    return static_cast<uint32_t>(h >> 32) & (num_buckets_ - 1);
+  }
+
+  // Find (state, ilabel) in table. Returns false if not cached
+  bool Find(int state, int ilabel, Entry *entry) const;
+
+  // Store entry into its bucket, unless the bucket is being written
+  void Store(const Entry &entry) const;
+
+  const LmFst *lm_;
+  int64_t num_buckets_;
+  std::unique_ptr<Slot[]> buckets_;
 };
 
 // DeltaLmFst is the composition of G^{-1} and G'. Where G^{-1} has the negative
@@ -129,12 +405,26 @@ class LmFst : public Fst {
 // DeltaLmFst will transduce <s> and </s> symbol automatically when calling
 // StartState() and Final(). To make it looks like a LM fst without EOS/BOS
 // symbols
+//
+// Words in ClassWordMap (if set) are looked up by their class nonterminal in
+// G' and then get the cost of word in class.
+//
+// G' could also be the linear interpolation of several LMs. In this case, the
+// state of DeltaLmFst is a tuple of states in each LM. Tuples are numbered on
+// demand, so an instance of DeltaLmFst with more than one LM is not thread-safe
+// and should be used by only one decoder (usually one per utterance)
 class DeltaLmFst : public IFst {
  public:
   DeltaLmFst(const Vector<float> *small_lm,
              const LmFst *lm,
              const SymbolTable *symbol_table);
 
+  // Interpolates lms with weights. Weights are normalized to sum to 1
+  DeltaLmFst(const Vector<float> *small_lm,
+             const std::vector<const LmFst *> &lms,
+             const std::vector<float> &weights,
+             const SymbolTable *symbol_table);
+
   // Start state of this Fst. It will transduce the <s> symbol and return the
   // state as start state.
   // Here we assuming weight of arc from start_state with input symbol <s> is
@@ -147,12 +437,73 @@ class DeltaLmFst : public IFst {
   // Get the final score from lm_ then minus the </s> weight in small_lm_. 
   float Final(int state_id) const override;
 
+  // Implements interface IFst
+  bool HasDirectIndex(int state) const override {
+    return lms_.size() == 1 && lms_[0]->HasDirectIndex(state);
+  }
+
+  // Set the class words for class nonterminals in LM, the map should be alive
+  // during the lifetime of this fst. nullptr to disable it
+  void set_class_words(const ClassWordMap *class_words) {
+    class_words_ = class_words;
+  }
+
+  // Set the shared memo of each LM, caches[i] is for the i-th LM. They should
+  // be alive during the lifetime of this fst. Empty to disable them
+  void set_lm_caches(const std::vector<const LmCache *> &caches);
+
+  // Hits and misses of the memos in this fst
+  const LmCache::Stats &lm_cache_stats() const { return lm_cache_stats_; }
+
+  // Number of LMs interpolated and number of tuple states created
+  int num_lms() const { return lms_.size(); }
+  int num_tuple_states() const { return tuple_states_.size() / lms_.size(); }
+
  private:
+  struct TupleHash {
+    size_t operator()(const std::vector<int32_t> &tuple) const {
+      size_t h = 19;
+      for (int32_t state : tuple) h = h * 31 + state;
+      return h;
+    }
+  };
+
+  // Get the arc of ilabel from tuple state in interpolated LM
+  bool GetInterpolatedArc(int state, int ilabel, FstArc *arc) const;
+
+  // Get the id of tuple state, creates it if not exist
+  int TupleStateId(const std::vector<int32_t> &tuple) const;
+
+  // -log(sum(exp(-costs[i]) * weights[i]))
+  float InterpolateCosts(const std::vector<float> &costs) const;
+
+  // GetArc() and Final() of the lm_idx-th LM, through its memo if exists
+  bool LmGetArc(int lm_idx, int state, int ilabel, FstArc *arc) const;
+  float LmFinal(int lm_idx, int state) const;
+
   const Vector<float> *small_lm_;
-  const LmFst *lm_;
+  const ClassWordMap *class_words_;
+  std::vector<const LmFst *> lms_;
+  std::vector<const LmCache *> lm_caches_;
+  mutable LmCache::Stats lm_cache_stats_;
+  std::vector<float> log_weights_;
+
+  // State in each LM used when it has no arc for the word (probability of the
+  // word is zero), it is the state without history
+  std::vector<int32_t> null_states_;
 
   int bos_symbol_;
   int eos_symbol_;
+
+  // Start state resolved by the first StartState(), kNoState before that
+  mutable int start_state_;
+
+  // Tuple states. States of tuple k are tuple_states_[k * N .. (k + 1) * N)
+  mutable std::vector<int32_t> tuple_states_;
+  mutable std::unordered_map<std::vector<int32_t>, int32_t, TupleHash>
+      tuple_ids_;
+  mutable std::vector<int32_t> tuple_buffer_;
+  mutable std::vector<float> cost_buffer_;
 };
 
 
@@ -0,0 +1,43 @@
+// Created at 2026-10-18
+
+#include "grammar.h"
+
+#include <string.h>
+#include "symbol_table.h"
+#include "util.h"
+
+namespace pocketkaldi {
+
+constexpr const char *Grammar::kNonterminalPrefix;
+
+void Grammar::AddNonterminals(const SymbolTable &symbol_table) {
+  int prefix_len = strlen(kNonterminalPrefix);
+  for (int label = 0; label < symbol_table.num_symbols(); ++label) {
+    if (strncmp(symbol_table.Get(label), kNonterminalPrefix, prefix_len) == 0) {
+      AddNonterminal(label);
+    }
+  }
+}
+
+void Grammar::AddNonterminal(int label) {
+  subgraphs_.emplace(label, SubGraph());
+}
+
+Status Grammar::SetSubGraph(int label, SubGraph subgraph) {
+  std::unordered_map<int, SubGraph>::iterator it = subgraphs_.find(label);
+  if (it == subgraphs_.end()) {
+    return Status::RuntimeError(util::Format(
+        "symbol {} is not a nonterminal",
+        label));
+  }
+  if (subgraph == nullptr || subgraph->Start() == fst::kNoStateId) {
+    return Status::RuntimeError(util::Format(
+        "sub-graph of nonterminal {} has no start state",
+        label));
+  }
+
+  it->second = subgraph;
+  return Status::OK();
+}
+
+}  // namespace pocketkaldi
@@ -0,0 +1,67 @@
+// Created at 2026-10-18
+
+#ifndef POCKETKALDI_GRAMMAR_H_
+#define POCKETKALDI_GRAMMAR_H_
+
+#include <memory>
+#include <unordered_map>
+#include "status.h"
+#undef DISALLOW_COPY_AND_ASSIGN
+#include "fst/fstlib.h"
+
+namespace pocketkaldi {
+
+class SymbolTable;
+
+// Grammar binds the nonterminals of a carrier HCLG to small sub-graphs, like
+// the menus or slot values of a voice command session. A nonterminal is a word
+// like "#nonterm:menu" on an epsilon-input arc of carrier HCLG. When decoder
+// reaches that arc it jumps into the start state of sub-graph, and returns to
+// the next state of that arc from the final states of sub-graph.
+//
+// Sub-graphs are HCLG compiled separately with the same transition-ids and
+// symbol table as the carrier. Since they are shared by pointer, copying a
+// Grammar and swapping sub-graphs of the copy is cheap and does not affect
+// decoders using the original one. Sub-graphs could not contain nonterminals
+// themselves
+class Grammar {
+ public:
+  typedef std::shared_ptr<const fst::Fst<fst::StdArc>> SubGraph;
+
+  // Prefix of nonterminal symbols in symbol table
+  static constexpr const char *kNonterminalPrefix = "#nonterm:";
+
+  Grammar() {}
+
+  // Registers all symbols with kNonterminalPrefix in symbol_table as
+  // nonterminals without sub-graph
+  void AddNonterminals(const SymbolTable &symbol_table);
+
+  // Registers label as a nonterminal without sub-graph. Arcs into a
+  // nonterminal without sub-graph are not followed in decoding
+  void AddNonterminal(int label);
+
+  // Binds subgraph to nonterminal label, the previous one is replaced. Returns
+  // error if label is not a nonterminal or subgraph has no start state
+  Status SetSubGraph(int label, SubGraph subgraph);
+
+  // Returns true if label is a nonterminal and stores its sub-graph (nullptr if
+  // not bound) into subgraph
+  inline bool Lookup(int label, const fst::Fst<fst::StdArc> **subgraph) const {
+    std::unordered_map<int, SubGraph>::const_iterator
+    it = subgraphs_.find(label);
+    if (it == subgraphs_.end()) return false;
+    *subgraph = it->second.get();
+    return true;
+  }
+
+  // Number of nonterminals
+  int num_nonterminals() const { return subgraphs_.size(); }
+
+ private:
+  std::unordered_map<int, SubGraph> subgraphs_;
+};
+
+}  // namespace pocketkaldi
+
+#endif  // POCKETKALDI_GRAMMAR_H_
@@ -0,0 +1,216 @@
+// Created at 2026-10-18
+
+#include "graph_order.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <deque>
+#include <utility>
+#include "util.h"
+
+namespace pocketkaldi {
+
+Status GraphOrder::ParseName(const std::string &name, int *order_type) {
+  std::string lower_name = util::Tolower(name);
+  if (lower_name == "none") {
+    *order_type = kNone;
+  } else if (lower_name == "bfs") {
+    *order_type = kBfs;
+  } else if (lower_name == "dfs") {
+    *order_type = kDfs;
+  } else if (lower_name == "profile") {
+    *order_type = kProfile;
+  } else {
+    return Status::Corruption(util::Format(
+        "unexpected state order: {}",
+        name));
+  }
+
+  return Status::OK();
+}
+
+void GraphOrder::Traverse(
+    const fst::Fst<fst::StdArc> &fst,
+    bool depth_first,
+    const std::vector<int64_t> *visits,
+    std::vector<int32_t> *order) {
+  int num_states = fst::CountStates(fst);
+  order->assign(num_states, -1);
+  int next_id = 0;
+
+  // Number of visits of state in profile
+  auto visits_of = [visits] (int state) -> int64_t {
+    if (visits == nullptr || state >= visits->size()) return 0;
+    return (*visits)[state];
+  };
+
+  int start_state = fst.Start();
+  std::deque<int32_t> queue;
+  std::vector<std::pair<int64_t, int32_t>> successors;
+  if (start_state != fst::kNoStateId) queue.push_back(start_state);
+  while (!queue.empty()) {
+    int32_t state;
+    if (depth_first) {
+      state = queue.back();
+      queue.pop_back();
+    } else {
+      state = queue.front();
+      queue.pop_front();
+    }
+    if ((*order)[state] >= 0) continue;
+    (*order)[state] = next_id++;
+
+    successors.clear();
+    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(fst, state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      int32_t next_state = arc_iter.Value().nextstate;
+      if ((*order)[next_state] >= 0) continue;
+
+      int64_t count = visits_of(next_state);
+      if (visits && count == 0) continue;
+      successors.emplace_back(count, next_state);
+    }
+    if (visits) {
+      std::stable_sort(
+          successors.begin(),
+          successors.end(),
+          [] (const std::pair<int64_t, int32_t> &l,
+              const std::pair<int64_t, int32_t> &r) {
+            return l.first > r.first;
+          });
+    }
+
+    // For DFS, the first successor should be on the top of stack
+    if (depth_first) {
+      for (int i = successors.size() - 1; i >= 0; --i) {
+        queue.push_back(successors[i].second);
+      }
+    } else {
+      for (const std::pair<int64_t, int32_t> &successor : successors) {
+        queue.push_back(successor.second);
+      }
+    }
+  }
+
+  // In profile mode, the states never visited are numbered in BFS order after
+  // the visited ones
+  if (visits && start_state != fst::kNoStateId) {
+    std::vector<bool> expanded(num_states, false);
+    queue.push_back(start_state);
+    expanded[start_state] = true;
+    while (!queue.empty()) {
+      int32_t state = queue.front();
+      queue.pop_front();
+      if ((*order)[state] < 0) (*order)[state] = next_id++;
+
+      for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(fst, state);
+           !arc_iter.Done();
+           arc_iter.Next()) {
+        int32_t next_state = arc_iter.Value().nextstate;
+        if (expanded[next_state]) continue;
+        expanded[next_state] = true;
+        queue.push_back(next_state);
+      }
+    }
+  }
+
+  // States unreachable from start state
+  for (int state = 0; state < num_states; ++state) {
+    if ((*order)[state] < 0) (*order)[state] = next_id++;
+  }
+  assert(next_id == num_states);
+}
+
+void GraphOrder::Bfs(const fst::Fst<fst::StdArc> &fst,
+                     std::vector<int32_t> *order) {
+  Traverse(fst, false, nullptr, order);
+}
+
+void GraphOrder::Dfs(const fst::Fst<fst::StdArc> &fst,
+                     std::vector<int32_t> *order) {
+  Traverse(fst, true, nullptr, order);
+}
+
+void GraphOrder::Profile(const fst::Fst<fst::StdArc> &fst,
+                         const std::vector<int64_t> &visits,
+                         std::vector<int32_t> *order) {
+  Traverse(fst, false, &visits, order);
+}
+
+Status GraphOrder::ReadVisits(const std::string &filename,
+                              std::vector<int64_t> *visits) {
+  util::ReadableFile fd;
+  PK_CHECK_STATUS(fd.Open(filename));
+
+  visits->clear();
+  Status status;
+  std::string line;
+  while (fd.ReadLine(&line, &status) && status.ok()) {
+    std::vector<std::string> fields = util::Split(line, " ");
+    if (fields.size() != 2) {
+      return Status::Corruption(util::Format(
+          "2 column expected but {} found: {}",
+          fields.size(),
+          line));
+    }
+
+    long state = 0, count = 0;
+    PK_CHECK_STATUS(util::StringToLong(fields[0], &state));
+    PK_CHECK_STATUS(util::StringToLong(fields[1], &count));
+    if (state < 0) {
+      return Status::Corruption(util::Format("invalid state: {}", line));
+    }
+    if (state >= visits->size()) visits->resize(state + 1, 0);
+    (*visits)[state] += count;
+  }
+
+  return status;
+}
+
+Status GraphOrder::WriteVisits(const std::string &filename,
+                               const std::vector<int64_t> &visits) {
+  FILE *fd = fopen(filename.c_str(), "w");
+  if (fd == NULL) {
+    return Status::IOError(util::Format("Unable to open {}", filename));
+  }
+  for (int state = 0; state < visits.size(); ++state) {
+    if (visits[state] == 0) continue;
+    fprintf(fd, "%d %lld\n", state, static_cast<long long>(visits[state]));
+  }
+  fclose(fd);
+
+  return Status::OK();
+}
+
+fst::ConstFst<fst::StdArc> *GraphOrder::Apply(
+    const fst::Fst<fst::StdArc> &fst,
+    const std::vector<int32_t> &order) {
+  fst::VectorFst<fst::StdArc> sorted_fst;
+  sorted_fst.ReserveStates(order.size());
+  for (int i = 0; i < order.size(); ++i) {
+    sorted_fst.AddState();
+  }
+
+  for (fst::StateIterator<fst::Fst<fst::StdArc>> state_iter(fst);
+       !state_iter.Done();
+       state_iter.Next()) {
+    int32_t state = state_iter.Value();
+    int32_t sorted_state = order[state];
+    sorted_fst.SetFinal(sorted_state, fst.Final(state));
+    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(fst, state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      fst::StdArc arc = arc_iter.Value();
+      arc.nextstate = order[arc.nextstate];
+      sorted_fst.AddArc(sorted_state, arc);
+    }
+  }
+  if (fst.Start() != fst::kNoStateId) {
+    sorted_fst.SetStart(order[fst.Start()]);
+  }
+
+  return new fst::ConstFst<fst::StdArc>(sorted_fst);
+}
+
+}  // namespace pocketkaldi
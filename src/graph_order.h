@@ -0,0 +1,78 @@
+// Created at 2026-10-18
+
+#ifndef POCKETKALDI_GRAPH_ORDER_H_
+#define POCKETKALDI_GRAPH_ORDER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "status.h"
+#undef DISALLOW_COPY_AND_ASSIGN
+#include "fst/fstlib.h"
+
+namespace pocketkaldi {
+
+// Renumbers the states of decoding graph for cache locality. HCLG state ids
+// follow the construction order of OpenFST, so the states visited together
+// in search are scattered in memory. After renumbering, the successors of a
+// state are usually close to it.
+//
+// An order is a vector where order[s] is the new id of state s.
+class GraphOrder {
+ public:
+  // Kinds of order
+  enum {
+    kNone = 0,
+    kBfs = 1,
+    kDfs = 2,
+    kProfile = 3
+  };
+
+  // Parse the name of order ("none", "bfs", "dfs" or "profile")
+  static Status ParseName(const std::string &name, int *order_type);
+
+  // Breadth-first order from start state. States unreachable from start state
+  // are put at the end in their original order
+  static void Bfs(const fst::Fst<fst::StdArc> &fst,
+                  std::vector<int32_t> *order);
+
+  // Depth-first (pre-order) from start state, the first arc of a state is
+  // followed first
+  static void Dfs(const fst::Fst<fst::StdArc> &fst,
+                  std::vector<int32_t> *order);
+
+  // Profile-guided order. It is breadth-first but only follows the states
+  // visited in profile, successors with more visits are numbered first. Then
+  // the remained states are put in BFS order. visits[s] is the number of
+  // visits of state s in sample decodes
+  static void Profile(const fst::Fst<fst::StdArc> &fst,
+                      const std::vector<int64_t> &visits,
+                      std::vector<int32_t> *order);
+
+  // Read visit counts from a text file where each line is "<state> <count>"
+  static Status ReadVisits(const std::string &filename,
+                           std::vector<int64_t> *visits);
+
+  // Write visit counts to a text file, states never visited are skipped
+  static Status WriteVisits(const std::string &filename,
+                            const std::vector<int64_t> &visits);
+
+  // Renumbers states of fst by order. Returns the new fst, the caller owns it
+  static fst::ConstFst<fst::StdArc> *Apply(
+      const fst::Fst<fst::StdArc> &fst,
+      const std::vector<int32_t> &order);
+
+ private:
+  // Traverse from start state and number the states in visiting order. If
+  // visits is not nullptr, only visited states are followed in the first pass
+  // and successors with more visits are numbered first
+  static void Traverse(
+      const fst::Fst<fst::StdArc> &fst,
+      bool depth_first,
+      const std::vector<int64_t> *visits,
+      std::vector<int32_t> *order);
+};
+
+}  // namespace pocketkaldi
+
+#endif  // POCKETKALDI_GRAPH_ORDER_H_
@@ -0,0 +1,84 @@
+// Created at 2026-10-18
+
+#include "hclg_fst.h"
+
+#include <memory>
+
+namespace pocketkaldi {
+
+const char kHclLookAheadFstType[] = "hcl_lookahead";
+
+fst::ExpandedFst<fst::StdArc> *ReadHclg(std::istream &strm,
+                                        const fst::FstReadOptions &opts) {
+  // Peek the fst type from header, then let the reader of that type read the
+  // header again
+  std::streampos pos = strm.tellg();
+  fst::FstHeader hdr;
+  if (!hdr.Read(strm, opts.source)) return nullptr;
+  strm.seekg(pos);
+
+  if (hdr.FstType() == "compact_" + HclgCompactor<fst::StdArc>::Type()) {
+    return HclgCompactFst::Read(strm, opts);
+  } else {
+    return fst::ConstFst<fst::StdArc>::Read(strm, opts);
+  }
+}
+
+HclLookAheadFst *ReadLookAheadHcl(std::istream &strm,
+                                  const fst::FstReadOptions &opts) {
+  std::streampos pos = strm.tellg();
+  fst::FstHeader hdr;
+  if (!hdr.Read(strm, opts.source)) return nullptr;
+  strm.seekg(pos);
+
+  if (hdr.FstType() == kHclLookAheadFstType) {
+    return HclLookAheadFst::Read(strm, opts);
+  }
+
+  std::unique_ptr<fst::Fst<fst::StdArc>> hcl;
+  if (hdr.FstType() == "const") {
+    hcl.reset(fst::ConstFst<fst::StdArc>::Read(strm, opts));
+  } else if (hdr.FstType() == "vector") {
+    hcl.reset(fst::StdVectorFst::Read(strm, opts));
+  }
+  if (!hcl) return nullptr;
+  return new HclLookAheadFst(*hcl);
+}
+
+fst::StdVectorFst *ReadG(std::istream &strm, const fst::FstReadOptions &opts) {
+  std::streampos pos = strm.tellg();
+  fst::FstHeader hdr;
+  if (!hdr.Read(strm, opts.source)) return nullptr;
+  strm.seekg(pos);
+
+  if (hdr.FstType() == "vector") {
+    return fst::StdVectorFst::Read(strm, opts);
+  } else if (hdr.FstType() == "const") {
+    std::unique_ptr<fst::ConstFst<fst::StdArc>> g(
+        fst::ConstFst<fst::StdArc>::Read(strm, opts));
+    if (!g) return nullptr;
+    return new fst::StdVectorFst(*g);
+  } else {
+    return nullptr;
+  }
+}
+
+fst::ComposeFst<fst::StdArc> *ComposeHclG(const HclLookAheadFst &hcl,
+                                          fst::StdVectorFst *g,
+                                          int64_t cache_bytes,
+                                          bool lookahead) {
+  // Relabel() also sorts arcs of g by ilabel
+  fst::LabelLookAheadRelabeler<fst::StdArc>::Relabel(g, hcl, true);
+
+  fst::CacheOptions opts(true, cache_bytes);
+  if (lookahead) {
+    return new fst::ComposeFst<fst::StdArc>(hcl, *g, opts);
+  } else {
+    return new fst::ComposeFst<fst::StdArc>(
+        hcl,
+        *g,
+        fst::ComposeFstOptions<fst::StdArc>(opts));
+  }
+}
+
+}  // namespace pocketkaldi
@@ -0,0 +1,144 @@
+// Created at 2026-10-18
+
+#ifndef POCKETKALDI_HCLG_FST_H_
+#define POCKETKALDI_HCLG_FST_H_
+
+#include <stdint.h>
+#include <istream>
+#include <limits>
+#include <string>
+#undef DISALLOW_COPY_AND_ASSIGN
+#include "fst/fstlib.h"
+
+namespace pocketkaldi {
+
+// Compacted arc of HCLG. Labels are stored in 16 bits, so it could be used
+// when both transition-ids and word ids are less than kMaxLabel. kNoLabel
+// (the element of final weight) is stored as kMaxLabel
+struct HclgCompactElement {
+  uint16_t ilabel;
+  uint16_t olabel;
+  float weight;
+  int32_t nextstate;
+};
+
+// ArcCompactor of OpenFST CompactFst for HCLG with 16-bit labels. An arc takes
+// 12 bytes instead of 16 bytes in ConstFst, and a state takes 4 bytes instead of
+// 20 bytes (plus 12 bytes for final states)
+template<class A>
+class HclgCompactor {
+ public:
+  using Arc = A;
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+  using Element = HclgCompactElement;
+
+  static constexpr Label kMaxLabel = std::numeric_limits<uint16_t>::max();
+
+  Element Compact(StateId s, const Arc &arc) const {
+    Element element;
+    element.ilabel = arc.ilabel == fst::kNoLabel ? kMaxLabel : arc.ilabel;
+    element.olabel = arc.olabel == fst::kNoLabel ? kMaxLabel : arc.olabel;
+    element.weight = arc.weight.Value();
+    element.nextstate = arc.nextstate;
+    return element;
+  }
+
+  Arc Expand(StateId s,
+             const Element &element,
+             uint32 f = fst::kArcValueFlags) const {
+    return Arc(
+        element.ilabel == kMaxLabel ? fst::kNoLabel : element.ilabel,
+        element.olabel == kMaxLabel ? fst::kNoLabel : element.olabel,
+        Weight(element.weight),
+        element.nextstate);
+  }
+
+  constexpr ssize_t Size() const { return -1; }
+
+  constexpr uint64 Properties() const { return 0ULL; }
+
+  // All labels should be less than kMaxLabel
+  bool Compatible(const fst::Fst<Arc> &fst) const {
+    for (fst::StateIterator<fst::Fst<Arc>> state_iter(fst);
+         !state_iter.Done();
+         state_iter.Next()) {
+      for (fst::ArcIterator<fst::Fst<Arc>> arc_iter(fst, state_iter.Value());
+           !arc_iter.Done();
+           arc_iter.Next()) {
+        const Arc &arc = arc_iter.Value();
+        if (arc.ilabel < 0 || arc.ilabel >= kMaxLabel) return false;
+        if (arc.olabel < 0 || arc.olabel >= kMaxLabel) return false;
+      }
+    }
+    return true;
+  }
+
+  static const std::string &Type() {
+    static const std::string *const type = new std::string("hclg16");
+    return *type;
+  }
+
+  bool Write(std::ostream &strm) const { return true; }
+
+  static HclgCompactor *Read(std::istream &strm) {
+    return new HclgCompactor;
+  }
+};
+
+// HCLG in compact format, its type is "compact_hclg16"
+typedef fst::CompactFst<fst::StdArc, HclgCompactor<fst::StdArc>, uint32>
+    HclgCompactFst;
+
+// Reads HCLG from strm. Both ConstFst and HclgCompactFst are supported, the
+// type is decided by the fst header. Returns nullptr on failure
+fst::ExpandedFst<fst::StdArc> *ReadHclg(std::istream &strm,
+                                        const fst::FstReadOptions &opts);
+
+// Type name of HclLookAheadFst
+extern const char kHclLookAheadFstType[];
+
+// HCL with the label-reachability data of its olabels, its type is
+// "hcl_lookahead". It is the same as fst::StdOLabelLookAheadFst except the
+// word relabeling data is kept (and saved), since G is relabeled by it when
+// decoder starts rather than when HCL is converted
+typedef fst::MatcherFst<
+    fst::ConstFst<fst::StdArc>,
+    fst::LabelLookAheadMatcher<
+        fst::SortedMatcher<fst::ConstFst<fst::StdArc>>,
+        fst::olabel_lookahead_flags | fst::kLookAheadKeepRelabelData,
+        fst::FastLogAccumulator<fst::StdArc>>,
+    kHclLookAheadFstType,
+    fst::LabelLookAheadRelabeler<fst::StdArc>> HclLookAheadFst;
+
+// Reads HCL for dynamic composition. An HclLookAheadFst (from
+// make_lookahead_hcl) is read directly, for ConstFst or VectorFst the
+// label-reachability data of its olabels is computed here. Returns nullptr on
+// failure
+HclLookAheadFst *ReadLookAheadHcl(std::istream &strm,
+                                  const fst::FstReadOptions &opts);
+
+// Reads G for dynamic composition, in VectorFst or ConstFst format. Returns
+// nullptr on failure
+fst::StdVectorFst *ReadG(std::istream &strm, const fst::FstReadOptions &opts);
+
+// Creates the lazy composition HCL o G. The ilabels of g are relabeled in
+// place to match the reachability data of hcl, then sorted. Since hcl is a
+// lookahead fst, composition uses the label-lookahead filter, so that paths of
+// HCL that could not reach a word of current G state are never expanded.
+// Expanded states are cached, the cache is garbage collected when it exceeds
+// cache_bytes. hcl and g could be deleted after that.
+//
+// The lookahead filter also pushes the output labels of HCL toward the start
+// once the word is decided. When lookahead is false, the plain sequence filter
+// is used, so that the words stay where they are in HCL. It is used for the
+// word boundaries in alignment, where G is small enough
+fst::ComposeFst<fst::StdArc> *ComposeHclG(const HclLookAheadFst &hcl,
+                                          fst::StdVectorFst *g,
+                                          int64_t cache_bytes,
+                                          bool lookahead = true);
+
+}  // namespace pocketkaldi
+
+#endif  // POCKETKALDI_HCLG_FST_H_
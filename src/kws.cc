@@ -0,0 +1,212 @@
+// Created at 2026-10-18
+
+#include "kws.h"
+
+#include <math.h>
+#include <algorithm>
+#include "util.h"
+
+namespace pocketkaldi {
+
+Status KwsGraph::Init(const fst::Fst<fst::StdArc> &fst) {
+  start_state_ = fst.Start();
+  if (start_state_ == fst::kNoStateId) {
+    return Status::Corruption("keyword graph has no start state");
+  }
+
+  int num_states = fst::CountStates(fst);
+  arc_offset_.assign(1, 0);
+  arcs_.clear();
+  for (int state = 0; state < num_states; ++state) {
+    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(fst, state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      const fst::StdArc &arc = arc_iter.Value();
+      arcs_.push_back(Arc{
+          arc.ilabel,
+          arc.olabel,
+          arc.nextstate,
+          arc.weight.Value()});
+    }
+    arc_offset_.push_back(arcs_.size());
+  }
+
+  return Status::OK();
+}
+
+KeywordSpotter::KeywordSpotter(const KwsGraph *graph,
+                               const Vector<int32_t> *transtion_pdf_id_map,
+                               float am_scale):
+    graph_(graph),
+    transtion_pdf_id_map_(transtion_pdf_id_map),
+    am_scale_(am_scale),
+    beam_(kDefaultBeam),
+    max_keyword_frames_(kDefaultMaxKeywordFrames),
+    default_threshold_(0.0f),
+    num_frames_decoded_(0) {
+  int num_states = graph_->num_states();
+  toks_.assign(num_states, Token{INFINITY, 0, 0});
+  prev_toks_.assign(num_states, Token{INFINITY, 0, 0});
+  active_.reserve(num_states);
+  prev_active_.reserve(num_states);
+  queue_.reserve(num_states);
+  in_queue_.assign(num_states, false);
+  Reset();
+}
+
+void KeywordSpotter::set_threshold(int keyword, float threshold) {
+  if (keyword >= thresholds_.size()) thresholds_.resize(keyword + 1, NAN);
+  thresholds_[keyword] = threshold;
+}
+
+float KeywordSpotter::Threshold(int keyword) const {
+  if (keyword < thresholds_.size() && !std::isnan(thresholds_[keyword])) {
+    return thresholds_[keyword];
+  } else {
+    return default_threshold_;
+  }
+}
+
+void KeywordSpotter::Reset() {
+  for (int32_t state : active_) toks_[state].cost = INFINITY;
+  active_.clear();
+  pending_.keyword = 0;
+
+  Relax(graph_->start_state(), Token{0.0f, 0, num_frames_decoded_});
+  ProcessNonemitting(INFINITY);
+  ended_.clear();
+}
+
+bool KeywordSpotter::Relax(int state, const Token &tok) {
+  Token &to_tok = toks_[state];
+  if (tok.cost >= to_tok.cost) return false;
+
+  if (to_tok.cost == INFINITY) active_.push_back(state);
+  to_tok = tok;
+  return true;
+}
+
+void KeywordSpotter::FollowArc(const Token &tok,
+                               const KwsGraph::Arc &arc,
+                               float cost,
+                               int begin_frame) {
+  Token next_tok = tok;
+  next_tok.cost = cost + arc.weight;
+  if (tok.keyword == 0 && arc.olabel != 0) {
+    next_tok.keyword = arc.olabel;
+    next_tok.begin_frame = begin_frame;
+  }
+
+  // Keyword ends at the hub
+  if (next_tok.keyword != 0 && arc.nextstate == graph_->start_state()) {
+    ended_.push_back(next_tok);
+    return;
+  }
+
+  if (Relax(arc.nextstate, next_tok) && arc.ilabel == 0 &&
+      !in_queue_[arc.nextstate]) {
+    queue_.push_back(arc.nextstate);
+    in_queue_[arc.nextstate] = true;
+  }
+}
+
+void KeywordSpotter::ProcessNonemitting(float cutoff) {
+  // Keywords starting from epsilon arcs begin at next frame
+  int begin_frame = num_frames_decoded_;
+
+  queue_.assign(active_.begin(), active_.end());
+  for (int32_t state : queue_) in_queue_[state] = true;
+  while (!queue_.empty()) {
+    int32_t state = queue_.back();
+    queue_.pop_back();
+    in_queue_[state] = false;
+
+    Token tok = toks_[state];
+    if (tok.cost > cutoff) continue;
+    for (const KwsGraph::Arc *arc = graph_->ArcBegin(state);
+         arc != graph_->ArcEnd(state);
+         ++arc) {
+      if (arc->ilabel != 0) continue;
+      FollowArc(tok, *arc, tok.cost, begin_frame);
+    }
+  }
+}
+
+void KeywordSpotter::Process(const VectorBase<float> &frame_logp,
+                             std::vector<Detection> *detections) {
+  int frame = num_frames_decoded_;
+
+  // Tokens of previous frame are moved into prev_toks_, and toks_ is cleared
+  toks_.swap(prev_toks_);
+  active_.swap(prev_active_);
+  for (int32_t state : active_) toks_[state].cost = INFINITY;
+  active_.clear();
+  ended_.clear();
+
+  // Costs are normalized by the best cost in each frame, so they are bounded
+  // in an endless stream
+  float best_cost = INFINITY;
+  for (int32_t state : prev_active_) {
+    best_cost = std::min(best_cost, prev_toks_[state].cost);
+  }
+  float cutoff = best_cost + beam_;
+
+  for (int32_t state : prev_active_) {
+    const Token &tok = prev_toks_[state];
+    if (tok.cost > cutoff) continue;
+    if (tok.keyword != 0 && frame - tok.begin_frame > max_keyword_frames_) {
+      continue;
+    }
+
+    for (const KwsGraph::Arc *arc = graph_->ArcBegin(state);
+         arc != graph_->ArcEnd(state);
+         ++arc) {
+      if (arc->ilabel == 0) continue;
+      int pdf_id = (*transtion_pdf_id_map_)(arc->ilabel);
+      float ac_cost = -am_scale_ * frame_logp(pdf_id);
+      FollowArc(tok, *arc, tok.cost - best_cost + ac_cost, frame);
+    }
+  }
+  ++num_frames_decoded_;
+
+  float next_best_cost = INFINITY;
+  for (int32_t state : active_) {
+    next_best_cost = std::min(next_best_cost, toks_[state].cost);
+  }
+  ProcessNonemitting(next_best_cost + beam_);
+
+  // Check keywords ended in this frame against the filler in hub
+  float filler_cost = toks_[graph_->start_state()].cost;
+  for (const Token &tok : ended_) {
+    int num_frames = num_frames_decoded_ - tok.begin_frame;
+    if (filler_cost == INFINITY || num_frames <= 0) continue;
+
+    float score = (filler_cost - tok.cost) / num_frames;
+    if (score < Threshold(tok.keyword)) continue;
+
+    // A later end with the same score extends the keyword
+    if (pending_.keyword == 0 || score >= pending_.score) {
+      pending_ = Detection{
+          tok.keyword,
+          score,
+          tok.begin_frame,
+          num_frames_decoded_};
+    }
+  }
+
+  // Report the candidate when there is no better one in kDelayFrames
+  if (pending_.keyword != 0 &&
+      num_frames_decoded_ - pending_.end_frame >= kDelayFrames) {
+    detections->push_back(pending_);
+    Reset();
+  }
+}
+
+void KeywordSpotter::EndOfStream(std::vector<Detection> *detections) {
+  if (pending_.keyword != 0) {
+    detections->push_back(pending_);
+    Reset();
+  }
+}
+
+}  // namespace pocketkaldi
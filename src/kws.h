@@ -0,0 +1,166 @@
+// Created at 2026-10-18
+
+#ifndef POCKETKALDI_KWS_H_
+#define POCKETKALDI_KWS_H_
+
+#include <stdint.h>
+#include <vector>
+#include "status.h"
+#include "vector.h"
+#undef DISALLOW_COPY_AND_ASSIGN
+#include "fst/fstlib.h"
+
+namespace pocketkaldi {
+
+// KwsGraph is the keyword+filler graph for KeywordSpotter, flattened from an
+// OpenFST graph into arrays. The start state is the hub of graph:
+//   - Filler paths (like a phone loop) leave the hub and return to it with
+//     epsilon output labels.
+//   - Keyword paths leave the hub with an arc whose output label is the
+//     keyword, and return to it when the keyword ends.
+// Input labels are transition-ids, final weights are not used. A graph is
+// shared by the KeywordSpotter of all streams
+class KwsGraph {
+ public:
+  struct Arc {
+    int32_t ilabel;
+    int32_t olabel;
+    int32_t nextstate;
+    float weight;
+  };
+
+  // Flattens fst. Returns error if fst has no start state
+  Status Init(const fst::Fst<fst::StdArc> &fst);
+
+  int num_states() const { return arc_offset_.size() - 1; }
+  int start_state() const { return start_state_; }
+
+  // Arcs of state are in [ArcBegin(state), ArcEnd(state))
+  const Arc *ArcBegin(int state) const {
+    return arcs_.data() + arc_offset_[state];
+  }
+  const Arc *ArcEnd(int state) const {
+    return arcs_.data() + arc_offset_[state + 1];
+  }
+
+ private:
+  std::vector<int32_t> arc_offset_;
+  std::vector<Arc> arcs_;
+  int32_t start_state_;
+};
+
+// KeywordSpotter runs viterbi search of a KwsGraph over the log-probabilities
+// of AM frames, and reports keywords as they are detected. Memory is
+// allocated once per graph state, and no traceback is kept.
+//
+// Keyword tokens never merge back into the hub, so the hub always holds the
+// best filler-only path. When a keyword path reaches the hub at frame t, its
+// score is the per-frame log-likelihood ratio of keyword against filler over
+// the frames of keyword:
+//   score = (cost of filler at t - cost of keyword at t) / frames of keyword
+// The best candidate above threshold is reported after kDelayFrames without a
+// better one, then the search is reset to the hub (sliding-window reset), so
+// that one keyword is reported once.
+class KeywordSpotter {
+ public:
+  static constexpr float kDefaultBeam = 12.0;
+  static constexpr int kDefaultMaxKeywordFrames = 300;
+  static constexpr int kDelayFrames = 10;
+
+  // A detected keyword, from begin_frame to end_frame (exclusive)
+  struct Detection {
+    int keyword;
+    float score;
+    int begin_frame;
+    int end_frame;
+  };
+
+  // It just borrows the pointers of graph and transtion_pdf_id_map
+  KeywordSpotter(const KwsGraph *graph,
+                 const Vector<int32_t> *transtion_pdf_id_map,
+                 float am_scale);
+
+  // Threshold of score for keyword. Keywords without threshold use the
+  // default threshold, which is 0 if not set
+  void set_threshold(int keyword, float threshold);
+  void set_default_threshold(float threshold) {
+    default_threshold_ = threshold;
+  }
+
+  // Keyword paths longer than it are pruned
+  void set_max_keyword_frames(int frames) { max_keyword_frames_ = frames; }
+
+  // Resets the search to the hub, pending detection is dropped
+  void Reset();
+
+  // Processes one frame of log-probabilities and appends the keywords detected
+  // into detections
+  void Process(const VectorBase<float> &frame_logp,
+               std::vector<Detection> *detections);
+
+  // Reports the pending detection at the end of stream
+  void EndOfStream(std::vector<Detection> *detections);
+
+  // Number of frames processed
+  int NumFramesDecoded() const { return num_frames_decoded_; }
+
+ private:
+  // Token of a state. keyword is 0 on filler paths, and begin_frame is the
+  // frame where keyword begins
+  struct Token {
+    float cost;
+    int32_t keyword;
+    int32_t begin_frame;
+  };
+
+  // Relaxes the token of state in toks with tok. Adds state into active if it
+  // was inactive. Returns true if the token is updated
+  bool Relax(int state, const Token &tok);
+
+  // Follows the arc from tok with cost (not including arc weight). When it is
+  // the end of keyword, it is checked as candidate instead of relaxing the hub
+  void FollowArc(const Token &tok,
+                 const KwsGraph::Arc &arc,
+                 float cost,
+                 int begin_frame);
+
+  // Epsilon closure of the tokens in active_
+  void ProcessNonemitting(float cutoff);
+
+  // Threshold of keyword
+  float Threshold(int keyword) const;
+
+  const KwsGraph *graph_;
+  const Vector<int32_t> *transtion_pdf_id_map_;
+  float am_scale_;
+  float beam_;
+  int max_keyword_frames_;
+
+  std::vector<float> thresholds_;
+  float default_threshold_;
+
+  // Tokens of current and previous frame, indexed by state. A state is active
+  // if its cost is not INFINITY. The active states are listed in active_ and
+  // prev_active_
+  std::vector<Token> toks_;
+  std::vector<Token> prev_toks_;
+  std::vector<int32_t> active_;
+  std::vector<int32_t> prev_active_;
+
+  // Queue for epsilon closure, in_queue_ marks the states in queue_
+  std::vector<int32_t> queue_;
+  std::vector<bool> in_queue_;
+
+  // Keyword candidates that reach the hub in current frame
+  std::vector<Token> ended_;
+
+  // Best candidate above threshold not reported yet, pending_.keyword is 0 if
+  // there is no candidate
+  Detection pending_;
+
+  int num_frames_decoded_;
+};
+
+}  // namespace pocketkaldi
+
+#endif  // POCKETKALDI_KWS_H_
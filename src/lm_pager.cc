@@ -0,0 +1,208 @@
+// Created at 2026-10-18
+
+#include "lm_pager.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_set>
+
+namespace pocketkaldi {
+
+LmPager::LmPager():
+    mapped_(nullptr),
+    mapped_size_(0),
+    lm_fst_(nullptr),
+    page_size_(sysconf(_SC_PAGESIZE)) {}
+
+LmPager::~LmPager() {
+  if (mapped_) munmap(mapped_, mapped_size_);
+  mapped_ = nullptr;
+  mapped_size_ = 0;
+}
+
+Status LmPager::Open(const std::string &filename, LmFst *lm_fst) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Status::IOError(util::Format("Unable to open {}", filename));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return Status::IOError(util::Format("Unable to stat {}", filename));
+  }
+
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return Status::IOError(util::Format("Unable to mmap {}", filename));
+  }
+  mapped_ = static_cast<char *>(data);
+  mapped_size_ = st.st_size;
+
+  return Attach(mapped_, mapped_size_, lm_fst);
+}
+
+Status LmPager::Attach(const char *data, int64_t size, LmFst *lm_fst) {
+  PK_CHECK_STATUS(lm_fst->Map(data, size));
+  lm_fst_ = lm_fst;
+  hot_ranges_.clear();
+
+  // No readahead for the whole LM
+  Advise(data, size, MADV_RANDOM);
+  return Status::OK();
+}
+
+void LmPager::Advise(const char *data, int64_t size, int advice) const {
+  if (size <= 0) return;
+  uintptr_t begin = reinterpret_cast<uintptr_t>(data) / page_size_ * page_size_;
+  uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+  madvise(reinterpret_cast<void *>(begin), end - begin, advice);
+}
+
+void LmPager::AdviseHot(int hot_order) {
+  assert(lm_fst_ != nullptr && "LmPager not opened");
+  hot_ranges_.clear();
+
+  Fst::Region final_region = lm_fst_->final_region();
+  Fst::Region state_idx_region = lm_fst_->state_idx_region();
+  Advise(final_region.data, final_region.size, MADV_WILLNEED);
+  Advise(state_idx_region.data, state_idx_region.size, MADV_WILLNEED);
+  if (hot_order <= 0) return;
+
+  // Unigram state has the arcs of all words in vocabulary, it is the state
+  // with largest fanout. Finding it only touches the state index
+  int unigram_state = lm_fst_->StartState();
+  int64_t max_arcs_bytes = 0;
+  int num_states = state_idx_region.size / sizeof(int32_t);
+  for (int state = 0; state < num_states; ++state) {
+    int64_t arcs_bytes = lm_fst_->arcs_region(state).size;
+    if (arcs_bytes > max_arcs_bytes) {
+      max_arcs_bytes = arcs_bytes;
+      unigram_state = state;
+    }
+  }
+
+  // States of order n + 1 are the next states of the word arcs from states of
+  // order n
+  std::vector<int> states = {unigram_state};
+  std::unordered_set<int> visited = {unigram_state};
+  std::vector<std::pair<const char *, const char *>> ranges;
+  for (int order = 1; order <= hot_order && !states.empty(); ++order) {
+    std::vector<int> next_states;
+    for (int state : states) {
+      Fst::Region region = lm_fst_->arcs_region(state);
+      if (region.size == 0) continue;
+      ranges.emplace_back(region.data, region.data + region.size);
+      if (order == hot_order) continue;
+
+      Fst::ArcIterator arc_iter = lm_fst_->IterateArcs(state);
+      const FstArc *arc = nullptr;
+      while ((arc = arc_iter.Next()) != nullptr) {
+        if (arc->input_label == 0) continue;
+        if (visited.insert(arc->next_state).second) {
+          next_states.push_back(arc->next_state);
+        }
+      }
+    }
+    states.swap(next_states);
+  }
+
+  // Extends ranges to page boundary and merge them, so that there is one
+  // madvise() for contiguous pages
+  for (std::pair<const char *, const char *> &range : ranges) {
+    uintptr_t begin = reinterpret_cast<uintptr_t>(range.first);
+    uintptr_t end = reinterpret_cast<uintptr_t>(range.second);
+    begin = begin / page_size_ * page_size_;
+    end = (end + page_size_ - 1) / page_size_ * page_size_;
+    range.first = reinterpret_cast<const char *>(begin);
+    range.second = reinterpret_cast<const char *>(end);
+  }
+  std::sort(ranges.begin(), ranges.end());
+  for (const std::pair<const char *, const char *> &range : ranges) {
+    if (!hot_ranges_.empty() && range.first <= hot_ranges_.back().second) {
+      hot_ranges_.back().second = std::max(hot_ranges_.back().second,
+                                           range.second);
+    } else {
+      hot_ranges_.push_back(range);
+    }
+  }
+  for (const std::pair<const char *, const char *> &range : hot_ranges_) {
+    Advise(range.first, range.second - range.first, MADV_WILLNEED);
+  }
+}
+
+int64_t LmPager::hot_bytes() const {
+  int64_t bytes = 0;
+  for (const std::pair<const char *, const char *> &range : hot_ranges_) {
+    bytes += range.second - range.first;
+  }
+  return bytes;
+}
+
+int64_t LmPager::ResidentBytes(const char *data, int64_t size) const {
+  if (size <= 0) return 0;
+  uintptr_t begin = reinterpret_cast<uintptr_t>(data) / page_size_ * page_size_;
+  uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+  int64_t num_pages = (end - begin + page_size_ - 1) / page_size_;
+  std::vector<unsigned char> residency(num_pages);
+  if (mincore(reinterpret_cast<void *>(begin),
+              end - begin,
+              residency.data()) != 0) {
+    return 0;
+  }
+
+  int64_t resident_pages = 0;
+  for (unsigned char page : residency) {
+    resident_pages += page & 1;
+  }
+  return std::min(resident_pages * page_size_, size);
+}
+
+std::vector<LmPager::SectionStats> LmPager::Residency() const {
+  assert(lm_fst_ != nullptr && "LmPager not opened");
+  std::vector<SectionStats> stats;
+  Fst::Region final_region = lm_fst_->final_region();
+  Fst::Region state_idx_region = lm_fst_->state_idx_region();
+  Fst::Region arcs_region = lm_fst_->arcs_region();
+  stats.push_back(SectionStats{
+      "final",
+      final_region.size,
+      ResidentBytes(final_region.data, final_region.size)});
+  stats.push_back(SectionStats{
+      "state_idx",
+      state_idx_region.size,
+      ResidentBytes(state_idx_region.data, state_idx_region.size)});
+  stats.push_back(SectionStats{
+      "arcs",
+      arcs_region.size,
+      ResidentBytes(arcs_region.data, arcs_region.size)});
+
+  SectionStats hot_stats{"hot_arcs", 0, 0};
+  for (const std::pair<const char *, const char *> &range : hot_ranges_) {
+    hot_stats.bytes += range.second - range.first;
+    hot_stats.resident_bytes += ResidentBytes(
+        range.first,
+        range.second - range.first);
+  }
+  stats.push_back(hot_stats);
+
+  return stats;
+}
+
+void LmPager::GetPageFaults(int64_t *minor_faults, int64_t *major_faults) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    *minor_faults = 0;
+    *major_faults = 0;
+    return;
+  }
+  *minor_faults = usage.ru_minflt;
+  *major_faults = usage.ru_majflt;
+}
+
+}  // namespace pocketkaldi
@@ -0,0 +1,79 @@
+// Created at 2026-10-18
+
+#ifndef POCKETKALDI_LM_PAGER_H_
+#define POCKETKALDI_LM_PAGER_H_
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "fst.h"
+#include "status.h"
+
+namespace pocketkaldi {
+
+// LmPager lets a large LmFst be demand-paged from its file instead of being
+// fully resident. The LM file is mapped read-only and LmFst serves GetArc()
+// from the mapping directly, so only the pages touched by decoding are loaded
+// and the kernel could drop them again under memory pressure.
+//
+// The whole mapping is advised MADV_RANDOM since LM lookups have no locality
+// for readahead. The final weights, the state index and the arcs of low-order
+// states (unigram state, bigram states, ...) are hot in every utterance, they
+// are advised MADV_WILLNEED by AdviseHot().
+class LmPager {
+ public:
+  // Resident statistics of a section in LM
+  struct SectionStats {
+    std::string name;
+    int64_t bytes;
+    int64_t resident_bytes;
+  };
+
+  LmPager();
+  ~LmPager();
+
+  // Maps the LM file and lets lm_fst use it in place. lm_fst should not be used
+  // after this pager destroyed
+  Status Open(const std::string &filename, LmFst *lm_fst);
+
+  // Lets lm_fst use the mapped memory owned by others, like an entry of Bundle.
+  // data should be alive during the lifetime of this pager
+  Status Attach(const char *data, int64_t size, LmFst *lm_fst);
+
+  // Advises the regions of lm_fst. Arcs of the states of order <= hot_order
+  // are prefetched, hot_order == 0 prefetches nothing but the state index and
+  // final weights
+  void AdviseHot(int hot_order);
+
+  // Bytes of the hot arcs given by AdviseHot()
+  int64_t hot_bytes() const;
+
+  // Size and resident size of sections "final", "state_idx", "arcs" and
+  // "hot_arcs" (a subset of "arcs"). Resident size is measured by mincore()
+  std::vector<SectionStats> Residency() const;
+
+  // Page faults of this process so far. The major ones need disk I/O
+  static void GetPageFaults(int64_t *minor_faults, int64_t *major_faults);
+
+ private:
+  // Applies advice to [data, data + size) extended to page boundary
+  void Advise(const char *data, int64_t size, int advice) const;
+
+  // Resident bytes in [data, data + size)
+  int64_t ResidentBytes(const char *data, int64_t size) const;
+
+  // Mapping owned by this pager, nullptr when attached
+  char *mapped_;
+  int64_t mapped_size_;
+
+  const LmFst *lm_fst_;
+  int64_t page_size_;
+
+  // Page aligned and merged ranges of hot arcs as (begin, end)
+  std::vector<std::pair<const char *, const char *>> hot_ranges_;
+};
+
+}  // namespace pocketkaldi
+
+#endif  // POCKETKALDI_LM_PAGER_H_
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
 #include "ce_stt.h"
 #include "status.h"
 #include "util.h"
@@ -24,8 +27,11 @@ void CheckStatus(const Status &status) {
   }
 }
 
-// Process one utterance and return its hyp
-std::string ProcessAudio(ce_stt_t *recognizer, const std::string &filename) {
+// Process one utterance and return its hyp. If audio_seconds is not nullptr,
+// adds the duration of audio to it
+std::string ProcessAudio(ce_stt_t *recognizer,
+                         const std::string &filename,
+                         double *audio_seconds = nullptr) {
   ce_wave_format_t wav_fmt;
 
   FILE *fd = fopen(filename.c_str(), "r");
@@ -36,14 +42,21 @@ std::string ProcessAudio(ce_stt_t *recognizer, const std::string &filename) {
   if (NULL == utt) Fatal(ce_stt_last_error());
 
   char buffer[1024];
+  int64_t total_bytes = 0;
   while (!feof(fd)) {
     int bytes_read = fread(buffer, 1, sizeof(buffer), fd);
     if (bytes_read == 0) break;
 
     ce_stt_process(utt, buffer, bytes_read);
+    total_bytes += bytes_read;
   }
 
   ce_stt_end_of_stream(utt);
+  if (audio_seconds != nullptr) {
+    int bytes_per_second = wav_fmt.sample_rate * wav_fmt.num_channels *
+                           wav_fmt.bits_per_sample / 8;
+    *audio_seconds += static_cast<double>(total_bytes) / bytes_per_second;
+  }
   std::string hyp = utt->hyp;
   ce_utt_destroy(utt);
   fclose(fd);
@@ -51,8 +64,124 @@ std::string ProcessAudio(ce_stt_t *recognizer, const std::string &filename) {
   return hyp;
 }
 
-// Process a list of utterances
-void process_scp(ce_stt_t *recognizer, const char *filename) {
+// Align one utterance to transcript. Writes its transition-ids to stdout in
+// Kaldi text format and its word alignment (<utt> <word> <begin-frame>
+// <num-frames>) to word_ali_fd. Returns false if it failed to align
+bool AlignAudio(ce_stt_t *recognizer,
+                const std::string &name,
+                const std::string &filename,
+                const std::string &transcript,
+                FILE *word_ali_fd) {
+  ce_wave_format_t wav_fmt;
+
+  FILE *fd = fopen(filename.c_str(), "r");
+  if (NULL == fd) Fatal("unable to open: " + filename);
+  if (NULL == ce_read_pcm_header(fd, &wav_fmt)) Fatal(ce_stt_last_error());
+
+  ce_utt_t *utt = ce_utt_init(recognizer, &wav_fmt);
+  if (NULL == utt) Fatal(ce_stt_last_error());
+  if (ce_utt_set_transcript(utt, transcript.c_str()) == CE_STT_FAILED) {
+    Fatal(ce_stt_last_error());
+  }
+
+  char buffer[1024];
+  while (!feof(fd)) {
+    int bytes_read = fread(buffer, 1, sizeof(buffer), fd);
+    if (bytes_read == 0) break;
+
+    ce_stt_process(utt, buffer, bytes_read);
+  }
+  ce_stt_end_of_stream(utt);
+  fclose(fd);
+
+  int num_frames = ce_utt_get_alignment(utt, nullptr, 0);
+  int num_words = ce_utt_get_word_alignment(utt, nullptr, 0);
+  if (num_frames == CE_STT_FAILED || num_words == CE_STT_FAILED) {
+    ce_utt_destroy(utt);
+    return false;
+  }
+
+  std::vector<int32_t> transition_ids(num_frames);
+  ce_utt_get_alignment(utt, transition_ids.data(), num_frames);
+  printf("%s", name.c_str());
+  for (int32_t transition_id : transition_ids) printf(" %d", transition_id);
+  printf("\n");
+
+  std::vector<ce_word_alignment_t> words(num_words);
+  ce_utt_get_word_alignment(utt, words.data(), num_words);
+  for (const ce_word_alignment_t &word : words) {
+    fprintf(word_ali_fd,
+            "%s %s %d %d\n",
+            name.c_str(),
+            word.word,
+            word.begin_frame,
+            word.num_frames);
+  }
+
+  ce_utt_destroy(utt);
+  return true;
+}
+
+// Align the utterances listed in scp file to their transcripts in text file
+// (<utt> <word> <word> ...)
+void align_scp(ce_stt_t *recognizer,
+               const char *scp_file,
+               const char *text_file,
+               const char *word_ali_file) {
+  ReadableFile text_fd;
+  Status status = text_fd.Open(text_file);
+  CheckStatus(status);
+
+  std::unordered_map<std::string, std::string> transcripts;
+  std::string line;
+  while (text_fd.ReadLine(&line, &status) && status.ok()) {
+    size_t pos = line.find(' ');
+    std::string name = line.substr(0, pos);
+    transcripts[name] = pos == std::string::npos ? "" : line.substr(pos + 1);
+  }
+  CheckStatus(status);
+
+  FILE *word_ali_fd = fopen(word_ali_file, "w");
+  if (NULL == word_ali_fd) Fatal(std::string("unable to open: ") + word_ali_file);
+
+  ReadableFile scp_fd;
+  status = scp_fd.Open(scp_file);
+  CheckStatus(status);
+  int num_failed = 0;
+  while (scp_fd.ReadLine(&line, &status) && status.ok()) {
+    std::vector<std::string> fields = Split(line, " ");
+    if (fields.size() != 2) {
+      printf("scp: unexpected line: %s\n", line.c_str());
+      exit(22);
+    }
+
+    std::string name = fields[0];
+    std::string wav_file = fields[1];
+    if (transcripts.find(name) == transcripts.end()) {
+      fprintf(stderr, "align: no transcript for %s\n", name.c_str());
+      ++num_failed;
+      continue;
+    }
+    if (!AlignAudio(recognizer,
+                    name,
+                    wav_file,
+                    transcripts[name],
+                    word_ali_fd)) {
+      fprintf(stderr, "align: failed to align %s\n", name.c_str());
+      ++num_failed;
+    }
+  }
+  CheckStatus(status);
+  fclose(word_ali_fd);
+
+  if (num_failed) fprintf(stderr, "align: %d utterances failed\n", num_failed);
+}
+
+// Process a list of utterances. If audio_seconds is not nullptr, adds the
+// duration of all audios to it
+void process_scp(ce_stt_t *recognizer,
+                 const char *filename,
+                 double *audio_seconds = nullptr) {
   // Read each line in scp file
   ReadableFile fd;
   Status status = fd.Open(filename);
@@ -68,22 +197,69 @@ void process_scp(ce_stt_t *recognizer, const char *filename) {
 
     std::string name = fields[0];
     std::string wav_file = fields[1];
-    std::string hyp = ProcessAudio(recognizer, wav_file);
+    std::string hyp = ProcessAudio(recognizer, wav_file, audio_seconds);
     printf("%s %s\n", name.c_str(), hyp.c_str());
   }
   CheckStatus(status);
 }
 
+// Decode the utterances listed in scp file like process_scp, and write the
+// time of loading model and decoding to stderr. It is used to compare the
+// options of recognizer (like fst_state_order) on the same audios
+void benchmark_scp(const char *model_file, const char *scp_file) {
+  typedef std::chrono::steady_clock Clock;
+
+  Clock::time_point t0 = Clock::now();
+  ce_stt_t *recognizer = ce_stt_init(model_file);
+  if (NULL == recognizer) Fatal(ce_stt_last_error());
+  Clock::time_point t1 = Clock::now();
+
+  double audio_seconds = 0.0;
+  process_scp(recognizer, scp_file, &audio_seconds);
+  Clock::time_point t2 = Clock::now();
+  ce_stt_destroy(recognizer);
+
+  double load_seconds = std::chrono::duration<double>(t1 - t0).count();
+  double decode_seconds = std::chrono::duration<double>(t2 - t1).count();
+  fprintf(stderr,
+          "benchmark: load %.3fs, decode %.3fs, audio %.3fs, RTF %.4f\n",
+          load_seconds,
+          decode_seconds,
+          audio_seconds,
+          audio_seconds > 0 ? decode_seconds / audio_seconds : 0.0);
+}
+
 // Print the usage of this program and exit
 void print_usage() {
   puts("Usage: pocketkaldi <model-file> <input-file>");
   puts("  Input-file:");
   puts("    *.wav: decode this file.");
   puts("    *.scp: decode audios listed in it.");
+  puts("");
+  puts("Usage: pocketkaldi --align <model-file> <scp-file> <text-file> "
+       "<word-ali-file>");
+  puts("  Align audios in scp file to the transcripts in text file. The");
+  puts("  transition-ids are written to stdout, and the frames of words are");
+  puts("  written to word-ali-file.");
+  puts("");
+  puts("Usage: pocketkaldi --benchmark <model-file> <scp-file>");
+  puts("  Decode audios in scp file, and write the time of loading model");
+  puts("  and decoding to stderr.");
   exit(1);
 }
 
 int main(int argc, char **argv) {
+  if (argc == 6 && strcmp(argv[1], "--align") == 0) {
+    ce_stt_t *recognizer = ce_stt_init(argv[2]);
+    if (NULL == recognizer) Fatal(ce_stt_last_error());
+    align_scp(recognizer, argv[3], argv[4], argv[5]);
+    ce_stt_destroy(recognizer);
+    return 0;
+  }
+  if (argc == 4 && strcmp(argv[1], "--benchmark") == 0) {
+    benchmark_scp(argv[2], argv[3]);
+    return 0;
+  }
   if (argc != 3) print_usage();
 
   const char *model_file = argv[1];
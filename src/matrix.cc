@@ -7,16 +7,15 @@
 #include <string.h>
 #include <math.h>
 #include <cblas.h>
+#include <algorithm>
 #include <limits>
+#include <vector>
 #include "util.h"
 
-#include "gemmlowp/eight_bit_int_gemm/eight_bit_int_gemm.h"
+#include "gemmlowp/public/gemmlowp.h"
 
 namespace pocketkaldi {
 
-using gemmlowp::eight_bit_int_gemm::BitDepthSetting;
-using gemmlowp::eight_bit_int_gemm::EightBitIntGemm;
-
 template<typename Real>
 void MatrixBase<Real>::CopyFromMat(const MatrixBase<Real> &M, int trans) {
   if (trans == kNoTrans) {
@@ -43,6 +42,7 @@ void Matrix<Real>::Swap(Matrix<Real> *other) {
   std::swap(this->num_cols_, other->num_cols_);
   std::swap(this->num_rows_, other->num_rows_);
   std::swap(this->stride_, other->stride_);
+  std::swap(capacity_, other->capacity_);
 }
 
 template<typename Real>
@@ -68,23 +68,23 @@ void Matrix<Real>::Init(
     this->num_cols_ = 0;
     this->stride_ = 0;
     this->data_ = NULL;
+    capacity_ = 0;
     return;
   }
   assert(rows > 0 && cols > 0);
-  int skip, stride;
+  int stride;
   size_t size;
   void *data;  // aligned memory block
 
   // compute the size of skip and real cols
-  skip = ((16 / sizeof(Real)) - cols % (16 / sizeof(Real)))
-      % (16 / sizeof(Real));
-  stride = cols + skip;
+  stride = DefaultStride(cols);
   size = static_cast<size_t>(rows) * static_cast<size_t>(stride)
       * sizeof(Real);
 
   // allocate the memory and set the right dimensions and parameters
   if (posix_memalign(&data, 32, size) == 0) {
     MatrixBase<Real>::data_ = static_cast<Real *> (data);
+    capacity_ = static_cast<size_t>(rows) * static_cast<size_t>(stride);
     MatrixBase<Real>::num_rows_ = rows;
     MatrixBase<Real>::num_cols_ = cols;
     MatrixBase<Real>::stride_  = (stride_type == kDefaultStride ? 
@@ -133,13 +133,55 @@ void Matrix<Real>::Resize(int rows,
         this->SetZero();
       return;
     }
-    else
-      Destroy();
+
+    // Reuse the memory block if it is large enough, the block of an empty
+    // matrix is also kept
+    int stride = stride_type == kDefaultStride ? DefaultStride(cols) : cols;
+    if (rows * cols == 0) {
+      assert(rows == 0 && cols == 0);
+      stride = 0;
+    }
+    if (static_cast<size_t>(rows) * static_cast<size_t>(stride) <=
+        capacity_) {
+      MatrixBase<Real>::num_rows_ = rows;
+      MatrixBase<Real>::num_cols_ = cols;
+      MatrixBase<Real>::stride_ = stride;
+      if (resize_type == kSetZero) MatrixBase<Real>::SetZero();
+      return;
+    }
+
+    Destroy();
   }
   Init(rows, cols, stride_type);
   if (resize_type == kSetZero) MatrixBase<Real>::SetZero();
 }
 
+template<typename Real>
+void Matrix<Real>::Reserve(int rows, int cols) {
+  size_t size = static_cast<size_t>(rows) *
+                static_cast<size_t>(DefaultStride(cols));
+  if (size <= capacity_) return;
+
+  // Move the data into a larger block
+  void *data;
+  if (posix_memalign(&data, 32, size * sizeof(Real)) != 0) {
+    throw std::bad_alloc();
+  }
+  if (MatrixBase<Real>::data_ != NULL) {
+    memcpy(data, MatrixBase<Real>::data_, capacity_ * sizeof(Real));
+    free(MatrixBase<Real>::data_);
+  }
+  MatrixBase<Real>::data_ = static_cast<Real *>(data);
+  capacity_ = size;
+}
+
+template<typename Real>
+int Matrix<Real>::DefaultStride(int cols) {
+  int skip = ((16 / sizeof(Real)) - cols % (16 / sizeof(Real)))
+      % (16 / sizeof(Real));
+  return cols + skip;
+}
+
 template<typename Real>
 void Matrix<Real>::Destroy() {
   // we need to free the data block if it was defined
@@ -149,6 +191,7 @@ void Matrix<Real>::Destroy() {
   MatrixBase<Real>::data_ = NULL;
   MatrixBase<Real>::num_rows_ = MatrixBase<Real>::num_cols_
       = MatrixBase<Real>::stride_ = 0;
+  capacity_ = 0;
 }
 
 template<typename Real>
@@ -297,46 +340,117 @@ void SimpleMatMat<float>(
     const MatrixBase<float> &B,
     MatrixBase<float> *C);
 
-void MatMat(
-    const MatrixBase<float> &A,
-    const MatrixBase<float> &B,
-    MatrixBase<float> *C) {
-  assert(A.NumCols() == B.NumRows() &&
-         A.NumRows() == C->NumRows() &&
-         B.NumCols() == C->NumCols());
+namespace {
 
+// C[:, col_begin : col_begin + num_cols] <- A * B[:, col_begin : ...] +
+//                                           beta * C[:, col_begin : ...]
+void Sgemm(const MatrixBase<float> &A,
+           const MatrixBase<float> &B,
+           int col_begin,
+           int num_cols,
+           float beta,
+           MatrixBase<float> *C) {
   cblas_sgemm(
       CblasRowMajor,
       CblasNoTrans,
       CblasNoTrans,
       A.NumRows(),
-      B.NumCols(),
+      num_cols,
       A.NumCols(),
       1.0f,
       A.Data(),
       A.Stride(),
-      B.Data(),
+      B.Data() + col_begin,
       B.Stride(),
-      0.0f,
-      C->Data(),
+      beta,
+      C->Data() + col_begin,
       C->Stride());
 }
 
+// Single-threaded gemmlowp context of the calling thread, so that the 8-bit
+// GEMMs from different threads do not wait for each other
+gemmlowp::GemmContext *LocalGemmlowpContext() {
+  static thread_local gemmlowp::GemmContext context;
+  return &context;
+}
+
+// C <- (A + offset_A) * (B + offset_B) * scale in the gemmlowp context. The
+// int32 product is kept in a buffer of the calling thread
+template<typename Context>
+void GemmlowpMatMat(Context *context,
+                    const MatrixBase<uint8_t> &A,
+                    int32_t offset_A,
+                    const MatrixBase<uint8_t> &B,
+                    int32_t offset_B,
+                    float scale,
+                    MatrixBase<float> *C) {
+  static thread_local std::vector<int32_t> buffer;
+  int m = A.NumRows(), n = B.NumCols(), k = A.NumCols();
+  buffer.resize(static_cast<size_t>(m) * n);
+
+  gemmlowp::MatrixMap<const uint8_t, gemmlowp::MapOrder::RowMajor> lhs(
+      A.Data(), m, k, A.Stride());
+  gemmlowp::MatrixMap<const uint8_t, gemmlowp::MapOrder::RowMajor> rhs(
+      B.Data(), k, n, B.Stride());
+  gemmlowp::MatrixMap<int32_t, gemmlowp::MapOrder::RowMajor> result(
+      buffer.data(), m, n, n);
+  gemmlowp::GemmWithOutputPipeline<
+      uint8_t,
+      int32_t,
+      gemmlowp::DefaultL8R8BitDepthParams>(
+          context,
+          lhs,
+          rhs,
+          &result,
+          offset_A,
+          offset_B,
+          std::make_tuple());
+
+  for (int row_idx = 0; row_idx < m; ++row_idx) {
+    const int32_t *src_row = buffer.data() + row_idx * n;
+    float *dest_row = C->Data() + row_idx * C->Stride();
+    for (int col_idx = 0; col_idx < n; ++col_idx) {
+      dest_row[col_idx] = static_cast<float>(src_row[col_idx]) * scale;
+    }
+  }
+}
+
+}  // namespace
+
+void MatMat(
+    const MatrixBase<float> &A,
+    const MatrixBase<float> &B,
+    MatrixBase<float> *C,
+    GemmContext *context,
+    float beta) {
+  assert(A.NumCols() == B.NumRows() &&
+         A.NumRows() == C->NumRows() &&
+         B.NumCols() == C->NumCols());
+
+  if (context != nullptr) {
+    context->MatMat(A, B, beta, C);
+  } else {
+    Sgemm(A, B, 0, B.NumCols(), beta, C);
+  }
+}
+
 namespace {
 
-// Find min and max value in Matrix. Assuming data in src was continuous
-// (src.Stride() == src.NumCols())
+// Find min and max value in Matrix
 void FindMinMax(const MatrixBase<float> &src, float *pmin, float *pmax) {
   float min = std::numeric_limits<float>::max(),
-        max = std::numeric_limits<float>::min();
-
-  for (int i = 0; i < src.NumCols() * src.NumRows(); ++i) {
-    float val = src.Data()[i];
-    if (val > max) {
-      max = val;
-    }
-    if (val < min) {
-      min = val;
+        max = std::numeric_limits<float>::lowest();
+
+  for (int row_idx = 0; row_idx < src.NumRows(); ++row_idx) {
+    const float *row = src.Data() + row_idx * src.Stride();
+    for (int col_idx = 0; col_idx < src.NumCols(); ++col_idx) {
+      float val = row[col_idx];
+      if (val > max) {
+        max = val;
+      }
+      if (val < min) {
+        min = val;
+      }
     }
   }
 
@@ -347,11 +461,15 @@ void FindMinMax(const MatrixBase<float> &src, float *pmin, float *pmax) {
 // Compute the 8-bit quantization parameters for matrix
 void ComputeQuantizationParams(const MatrixBase<float> &src,
                                QuantizationParams *quant_params) {
-  // Find min and max value in matrix
+  // Find min and max value in matrix. The range always contains 0, so that 0
+  // is exactly representable and zero_point is in [0, 255]
   float min, max;
   FindMinMax(src, &min, &max);
+  min = std::min(min, 0.0f);
+  max = std::max(max, 0.0f);
 
   double scale = (max - min) / 255.0;
+  if (scale == 0.0) scale = 1.0;
 
   // Find zero-point
   double f_zero_point = -min / scale;
@@ -365,7 +483,6 @@ void ComputeQuantizationParams(const MatrixBase<float> &src,
 
 void Quantize(const MatrixBase<float> &src, Matrix<uint8_t> *dest,
               QuantizationParams *params) {
-  assert(src.Stride() == src.NumCols());
   assert(src.NumCols() != 0 && src.NumRows() != 0);
 
   ComputeQuantizationParams(src, params);
@@ -374,15 +491,18 @@ void Quantize(const MatrixBase<float> &src, Matrix<uint8_t> *dest,
   if (dest->NumCols() != src.NumCols() || dest->NumRows() != src.NumRows()) {
     dest->Resize(src.NumRows(), src.NumCols(), Matrix<uint8_t>::kUndefined);
   }
+  assert(dest->Stride() == dest->NumCols());
 
   // Quantize
-  const float *src_data = src.Data();
-  uint8_t *dest_data = dest->Data();
-  for (int i = 0; i < src.NumCols() * src.NumRows(); ++i) {
-    float val = src_data[i];
-    val = val / params->scale + params->zero_point;
-    val = std::max(0.0f, std::min(val, 255.0f));
-    dest_data[i] = static_cast<uint8_t>(roundf(val));
+  for (int row_idx = 0; row_idx < src.NumRows(); ++row_idx) {
+    const float *src_data = src.Data() + row_idx * src.Stride();
+    uint8_t *dest_data = dest->Data() + row_idx * dest->Stride();
+    for (int col_idx = 0; col_idx < src.NumCols(); ++col_idx) {
+      float val = src_data[col_idx];
+      val = val / params->scale + params->zero_point;
+      val = std::max(0.0f, std::min(val, 255.0f));
+      dest_data[col_idx] = static_cast<uint8_t>(roundf(val));
+    }
   }
 }
 
@@ -391,7 +511,8 @@ void MatMat_U8U8F32(
     const QuantizationParams &quant_params_A,
     const MatrixBase<uint8_t> &B,
     const QuantizationParams &quant_params_B,
-    MatrixBase<float> *C) {
+    MatrixBase<float> *C,
+    GemmContext *context) {
   assert(A.NumCols() == B.NumRows() &&
          A.NumRows() == C->NumRows() &&
          B.NumCols() == C->NumCols());
@@ -399,24 +520,98 @@ void MatMat_U8U8F32(
            B.NumCols() * B.NumRows() > 1);
   int32_t offset_A = -quant_params_A.zero_point;
   int32_t offset_B = -quant_params_B.zero_point;
+  float scale = quant_params_A.scale * quant_params_B.scale;
+
+  if (context != nullptr) {
+    context->MatMat_U8U8F32(A, offset_A, B, offset_B, scale, C);
+  } else {
+    GemmlowpMatMat(LocalGemmlowpContext(), A, offset_A, B, offset_B, scale, C);
+  }
+}
+
+struct GemmContext::SgemmTask : public gemmlowp::Task {
+  const MatrixBase<float> *A;
+  const MatrixBase<float> *B;
+  MatrixBase<float> *C;
+  int col_begin;
+  int num_cols;
+  float beta;
+
+  void Run() override {
+    Sgemm(*A, *B, col_begin, num_cols, beta, C);
+  }
+};
+
+GemmContext::GemmContext(int num_threads): num_threads_(num_threads) {
+  assert(num_threads_ >= 1);
+
+  if (num_threads_ > 1) {
+    // The threads of OpenBLAS would oversubscribe the cores together with the
+    // workers here. It is a process-wide setting of OpenBLAS
+#ifdef OPENBLAS_VERSION
+    openblas_set_num_threads(1);
+#endif  // OPENBLAS_VERSION
 
-  float offset_C = quant_params_A.scale * quant_params_B.scale;
-  EightBitIntGemm(true,
-                  true,
-                  true,
-                  A.NumRows(),
-                  B.NumCols(),
-                  A.NumCols(),
-                  A.Data(),
-                  offset_A,
-                  A.NumCols(),
-                  B.Data(),
-                  offset_B,
-                  B.NumCols(),
-                  C->Data(),
-                  offset_C,
-                  C->NumCols(),
-                  BitDepthSetting::A8B8);
+    gemmlowp_context_.reset(new gemmlowp::GemmContext());
+    gemmlowp_context_->set_max_num_threads(num_threads_);
+  }
+}
+
+GemmContext::~GemmContext() {}
+
+void GemmContext::MatMat(
+    const MatrixBase<float> &A,
+    const MatrixBase<float> &B,
+    float beta,
+    MatrixBase<float> *C) {
+  // Columns of C are split into blocks of multiple kBlockAlign columns, one
+  // block per task
+  const int kBlockAlign = 16;
+  int num_cols = B.NumCols();
+  int num_tasks = std::min(num_threads_, num_cols / kBlockAlign);
+  if (num_tasks <= 1 || A.NumRows() == 0) {
+    Sgemm(A, B, 0, num_cols, beta, C);
+    return;
+  }
+
+  int block_size = (num_cols + num_tasks - 1) / num_tasks;
+  block_size = (block_size + kBlockAlign - 1) / kBlockAlign * kBlockAlign;
+  num_tasks = (num_cols + block_size - 1) / block_size;
+
+  std::vector<SgemmTask> tasks(num_tasks);
+  for (int i = 0; i < num_tasks; ++i) {
+    tasks[i].A = &A;
+    tasks[i].B = &B;
+    tasks[i].C = C;
+    tasks[i].col_begin = i * block_size;
+    tasks[i].num_cols = std::min(block_size, num_cols - i * block_size);
+    tasks[i].beta = beta;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  gemmlowp_context_->workers_pool()->Execute(num_tasks, tasks.data());
+}
+
+void GemmContext::MatMat_U8U8F32(
+    const MatrixBase<uint8_t> &A,
+    int32_t offset_A,
+    const MatrixBase<uint8_t> &B,
+    int32_t offset_B,
+    float scale,
+    MatrixBase<float> *C) {
+  if (num_threads_ == 1) {
+    GemmlowpMatMat(LocalGemmlowpContext(), A, offset_A, B, offset_B, scale, C);
+  } else {
+    std::lock_guard<std::mutex> lock(mutex_);
+    GemmlowpMatMat(
+        gemmlowp_context_.get(),
+        A,
+        offset_A,
+        B,
+        offset_B,
+        scale,
+        C);
+  }
 }
 
 
@@ -10,12 +10,20 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include "ce_stt.h"
 #include "util.h"
 #include "vector.h"
 
+namespace gemmlowp {
+class GemmContext;
+}  // namespace gemmlowp
+
 namespace pocketkaldi {
 
+class GemmContext;
+
 template<typename Real>
 class SubMatrix;
 
@@ -148,7 +156,7 @@ class Matrix : public MatrixBase<Real> {
   };
 
   /// Empty constructor.
-  Matrix() {
+  Matrix(): capacity_(0) {
     this->data_ = nullptr;
     this->num_cols_ = 0;
     this->num_rows_ = 0;
@@ -159,7 +167,7 @@ class Matrix : public MatrixBase<Real> {
   Matrix(int r,
          int c,
          int resize_type = kSetZero,
-         int stride_type = kStrideEqualNumCols) { 
+         int stride_type = kStrideEqualNumCols): capacity_(0) { 
     Resize(r, c, resize_type, stride_type); 
   }
 
@@ -181,11 +189,21 @@ class Matrix : public MatrixBase<Real> {
   /// in bytes is a multiple of 16.
   ///
   /// This function takes time proportional to the number of data elements.
+  ///
+  /// Like std::vector, the memory block is reused (without allocation) when
+  /// the new size fits in it, unless resize_type is kCopyData. With kUndefined,
+  /// if the block is reused and the stride is not changed (the same number of
+  /// columns and stride_type), the rows shared with the old matrix keep their
+  /// data. Together with Reserve(), rows could be appended or dropped in place
   void Resize(int r,
               int c,
               int resize_type = kSetZero,
               int stride_type = kStrideEqualNumCols);
 
+  /// Makes sure that Resize() to at most r x c (with any stride type) does
+  /// not allocate memory. The size and data of matrix is not changed.
+  void Reserve(int r, int c);
+
   // Read matrix from ReadableFile
   Status Read(util::ReadableFile *fd);
 
@@ -201,6 +219,11 @@ class Matrix : public MatrixBase<Real> {
             int c,
             int stride_type);
 
+  /// Stride of a matrix with c columns for kDefaultStride
+  static int DefaultStride(int c);
+
+  /// Number of elements in the memory block
+  size_t capacity_;
 };
 
 template<typename Real>
@@ -234,7 +257,8 @@ struct QuantizationParams {
 };
 
 // Quantize float matrix into 8-bit. Output 8-bit matrix and quantization
-// parameters
+// parameters. The quantization range of src is extended to contain 0, the
+// stride of dest is always its number of columns
 void Quantize(const MatrixBase<float> &src, Matrix<uint8_t> *dest,
               QuantizationParams *params);
 
@@ -245,19 +269,84 @@ void SimpleMatMat(
     const MatrixBase<Real> &B,
     MatrixBase<Real> *C);
 
-// C <- A * B
+// C <- A * B + beta * C. It runs in context if context is not nullptr,
+// otherwise in the threads of OpenBLAS
 void MatMat(
     const MatrixBase<float> &A,
     const MatrixBase<float> &B,
-    MatrixBase<float> *C);
+    MatrixBase<float> *C,
+    GemmContext *context = nullptr,
+    float beta = 0.0f);
 
-// Multiplies 8-bit quant matrix A and B, then store and float32 retulr into C
+// Multiplies 8-bit quant matrix A and B, then store and float32 retulr into C.
+// It runs in context if context is not nullptr, otherwise in the calling
+// thread
 void MatMat_U8U8F32(
     const MatrixBase<uint8_t> &A,
     const QuantizationParams &quant_params_A,
     const MatrixBase<uint8_t> &B,
     const QuantizationParams &quant_params_B,
-    MatrixBase<float> *C);
+    MatrixBase<float> *C,
+    GemmContext *context = nullptr);
+
+// GemmContext runs the float and 8-bit GEMMs of a recognizer with a fixed
+// number of threads:
+//   - With num_threads > 1, a GEMM is split into num_threads tasks, which run
+//     on a pool of num_threads - 1 workers and the calling thread. The float
+//     and 8-bit GEMMs share the pool, and the GEMMs from different threads
+//     take turns on it. It is for offline jobs with large batches.
+//   - With num_threads == 1, the GEMMs run in the calling thread without lock.
+//     It is for servers running each stream in its own thread, so that the
+//     streams do not block each other or oversubscribe the cores.
+// Creating a GemmContext with num_threads > 1 sets OpenBLAS to one thread for
+// the whole process, including the GEMMs outside of the context
+class GemmContext {
+ public:
+  explicit GemmContext(int num_threads);
+  ~GemmContext();
+
+  int num_threads() const { return num_threads_; }
+
+ private:
+  // Float GEMM of C[:, col_begin : col_begin + num_cols]
+  struct SgemmTask;
+
+  void MatMat(
+      const MatrixBase<float> &A,
+      const MatrixBase<float> &B,
+      float beta,
+      MatrixBase<float> *C);
+
+  void MatMat_U8U8F32(
+      const MatrixBase<uint8_t> &A,
+      int32_t offset_A,
+      const MatrixBase<uint8_t> &B,
+      int32_t offset_B,
+      float scale,
+      MatrixBase<float> *C);
+
+  int num_threads_;
+
+  // The worker pool and the 8-bit GEMM of gemmlowp for num_threads_ > 1, the
+  // GEMMs on it are serialized by mutex_
+  std::unique_ptr<gemmlowp::GemmContext> gemmlowp_context_;
+  std::mutex mutex_;
+
+  friend void MatMat(
+      const MatrixBase<float> &A,
+      const MatrixBase<float> &B,
+      MatrixBase<float> *C,
+      GemmContext *context,
+      float beta);
+  friend void MatMat_U8U8F32(
+      const MatrixBase<uint8_t> &A,
+      const QuantizationParams &quant_params_A,
+      const MatrixBase<uint8_t> &B,
+      const QuantizationParams &quant_params_B,
+      MatrixBase<float> *C,
+      GemmContext *context);
+  DISALLOW_COPY_AND_ASSIGN(GemmContext);
+};
 
 }  // namespace pocketkaldi
 
@@ -4,13 +4,43 @@
 
 #include <assert.h>
 #include <math.h>
+#include <algorithm>
+#include "simd.h"
 
 namespace pocketkaldi {
 
-LinearLayer::LinearLayer() {}
+namespace {
+
+// Adds b to each row of out, then applies ReLU in the same pass if relu is
+// true
+void AddBias(const VectorBase<float> &b, bool relu, MatrixBase<float> *out) {
+  assert(b.Dim() == out->NumCols());
+  const simd::Kernels &kernels = simd::Best();
+  for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
+    SubVector<float> row = out->Row(row_idx);
+    if (relu) {
+      kernels.add_relu(b.Data(), row.Data(), row.Dim());
+    } else {
+      kernels.axpy(1.0f, b.Data(), row.Data(), row.Dim());
+    }
+  }
+}
+
+// Returns the SpliceLayer of layer if it is a SpliceLayer or a TdnnLayer fused
+// from one, so their context and stride are checked in the same way. Returns
+// nullptr otherwise
+const SpliceLayer *GetSplice(const Layer *layer) {
+  const TdnnLayer *tdnn = dynamic_cast<const TdnnLayer *>(layer);
+  if (tdnn != nullptr) return &tdnn->splice();
+  return dynamic_cast<const SpliceLayer *>(layer);
+}
+
+}  // namespace
+
+LinearLayer::LinearLayer(): relu_(false), gemm_context_(nullptr) {}
 LinearLayer::LinearLayer(
     const MatrixBase<float> &W,
-    const VectorBase<float> &b) {
+    const VectorBase<float> &b): relu_(false), gemm_context_(nullptr) {
   assert(b.Dim() == W.NumRows() && 
          "linear layer: dimension mismatch in W and b");
   W_.Resize(W.NumCols(), W.NumRows());
@@ -23,16 +53,13 @@ void LinearLayer::Propagate(
     const MatrixBase<float> &in,
     Matrix<float> *out) const {
   assert(b_.Dim() != 0 && "LinearLayer is not initialized");
-  out->Resize(in.NumRows(), W_.NumCols());
+  out->Resize(in.NumRows(), W_.NumCols(), Matrix<float>::kUndefined);
 
   // xW
-  MatMat(in, W_, out);
+  MatMat(in, W_, out, gemm_context_);
 
   // + b
-  for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
-    SubVector<float> row = out->Row(row_idx);
-    row.AddVec(1.0f, b_);
-  }
+  AddBias(b_, relu_, out);
 }
 
 Status LinearLayer::Read(util::ReadableFile *fd) {
@@ -42,9 +69,313 @@ Status LinearLayer::Read(util::ReadableFile *fd) {
   return Status::OK();
 }
 
-SpliceLayer::SpliceLayer() {}
+std::unique_ptr<Layer> LinearLayer::Quantize() const {
+  Matrix<float> W(W_.NumCols(), W_.NumRows());
+  W.CopyFromMat(W_, MatrixBase<float>::kTrans);
+  QuantizedLinearLayer *layer = new QuantizedLinearLayer(W, b_);
+  layer->set_relu(relu_);
+  layer->set_gemm_context(gemm_context_);
+  return std::unique_ptr<Layer>(layer);
+}
+
+void LinearLayer::FoldOutputScale(const VectorBase<float> &scale,
+                                  const VectorBase<float> &offset) {
+  assert(scale.Dim() == W_.NumCols() && offset.Dim() == W_.NumCols());
+  for (int row_idx = 0; row_idx < W_.NumRows(); ++row_idx) {
+    W_.Row(row_idx).MulElements(scale);
+  }
+  b_.MulElements(scale);
+  b_.AddVec(1.0f, offset);
+}
+
+bool LinearLayer::FoldInputScale(const VectorBase<float> &scale,
+                                 const VectorBase<float> &offset) {
+  int dim = scale.Dim();
+  if (dim == 0 || W_.NumRows() % dim != 0 || offset.Dim() != dim) {
+    return false;
+  }
+
+  // (x * scale + offset)W + b = x(scale * W) + (offset W + b)
+  for (int row_idx = 0; row_idx < W_.NumRows(); ++row_idx) {
+    SubVector<float> row = W_.Row(row_idx);
+    b_.AddVec(offset(row_idx % dim), row);
+    row.Scale(scale(row_idx % dim));
+  }
+
+  return true;
+}
+
+QuantizedLinearLayer::QuantizedLinearLayer():
+    relu_(false),
+    gemm_context_(nullptr) {}
+QuantizedLinearLayer::QuantizedLinearLayer(
+    const MatrixBase<float> &W,
+    const VectorBase<float> &b): relu_(false), gemm_context_(nullptr) {
+  assert(b.Dim() == W.NumRows() && 
+         "quantized linear layer: dimension mismatch in W and b");
+  Matrix<float> W_trans(W.NumCols(), W.NumRows());
+  W_trans.CopyFromMat(W, MatrixBase<float>::kTrans);
+  pocketkaldi::Quantize(W_trans, &W_, &W_quant_params_);
+  b_.Resize(b.Dim());
+  b_.CopyFromVec(b);
+}
+
+void QuantizedLinearLayer::Propagate(
+    const MatrixBase<float> &in,
+    Matrix<float> *out) const {
+  assert(b_.Dim() != 0 && "QuantizedLinearLayer is not initialized");
+  out->Resize(in.NumRows(), W_.NumCols(), Matrix<float>::kUndefined);
+
+  // Quantize x into the buffer of the calling thread, it is resized in place
+  // once it is large enough
+  static thread_local Matrix<uint8_t> in_8bit;
+  QuantizationParams in_quant_params;
+  pocketkaldi::Quantize(in, &in_8bit, &in_quant_params);
+
+  // xW
+  MatMat_U8U8F32(
+      in_8bit,
+      in_quant_params,
+      W_,
+      W_quant_params_,
+      out,
+      gemm_context_);
+
+  // + b
+  AddBias(b_, relu_, out);
+}
+
+Status QuantizedLinearLayer::Read(util::ReadableFile *fd) {
+  float scale = 0.0f;
+  int32_t zero_point = 0;
+  PK_CHECK_STATUS(fd->ReadValue<float>(&scale));
+  PK_CHECK_STATUS(fd->ReadValue<int32_t>(&zero_point));
+  if (scale <= 0.0f || zero_point < 0 || zero_point > 255) {
+    return Status::Corruption(util::Format(
+        "QuantizedLinearLayer: unexpected quantization params: {}",
+        fd->filename()));
+  }
+  W_quant_params_.scale = scale;
+  W_quant_params_.zero_point = zero_point;
+
+  // W is stored as bytes in row-major order
+  int32_t num_rows = 0, num_cols = 0;
+  PK_CHECK_STATUS(fd->ReadValue<int32_t>(&num_rows));
+  PK_CHECK_STATUS(fd->ReadValue<int32_t>(&num_cols));
+  if (num_rows <= 0 || num_cols <= 0) {
+    return Status::Corruption(util::Format(
+        "QuantizedLinearLayer: unexpected size of W: {}",
+        fd->filename()));
+  }
+  W_.Resize(num_rows, num_cols, Matrix<uint8_t>::kUndefined);
+  PK_CHECK_STATUS(fd->Read(W_.Data(), num_rows * num_cols));
+
+  PK_CHECK_STATUS(b_.Read(fd));
+  if (b_.Dim() != num_cols) {
+    return Status::Corruption(util::Format(
+        "QuantizedLinearLayer: dimension mismatch in W and b: {}",
+        fd->filename()));
+  }
+
+  return Status::OK();
+}
+
+LSTMPLayer::LSTMPLayer():
+    delay_(1),
+    recurrent_scale_(1.0f),
+    gemm_context_(nullptr) {}
+LSTMPLayer::LSTMPLayer(const MatrixBase<float> &W_x,
+                       const MatrixBase<float> &W_r,
+                       const VectorBase<float> &b,
+                       const MatrixBase<float> &peephole,
+                       const MatrixBase<float> &W_p,
+                       const VectorBase<float> &b_p,
+                       int delay,
+                       float recurrent_scale):
+    delay_(delay),
+    recurrent_scale_(recurrent_scale),
+    gemm_context_(nullptr) {
+  W_x_.Resize(W_x.NumCols(), W_x.NumRows());
+  W_x_.CopyFromMat(W_x, MatrixBase<float>::kTrans);
+  W_r_.Resize(W_r.NumCols(), W_r.NumRows());
+  W_r_.CopyFromMat(W_r, MatrixBase<float>::kTrans);
+  W_p_.Resize(W_p.NumCols(), W_p.NumRows());
+  W_p_.CopyFromMat(W_p, MatrixBase<float>::kTrans);
+  b_.Resize(b.Dim());
+  b_.CopyFromVec(b);
+  b_p_.Resize(b_p.Dim());
+  b_p_.CopyFromVec(b_p);
+
+  assert(peephole.NumRows() == 3 && "LSTMPLayer: 3 rows of peephole expected");
+  int cell_dim = peephole.NumCols();
+  peephole_.Resize(3 * cell_dim);
+  for (int row_idx = 0; row_idx < 3; ++row_idx) {
+    peephole_.Range(row_idx * cell_dim, cell_dim)
+        .CopyFromVec(peephole.Row(row_idx));
+  }
+  assert(Verify() && "LSTMPLayer: dimension mismatch in parameters");
+}
+
+bool LSTMPLayer::Verify() const {
+  int gates_dim = 4 * cell_dim();
+  return cell_dim() > 0 &&
+         W_x_.NumCols() == gates_dim &&
+         W_r_.NumCols() == gates_dim &&
+         b_.Dim() == gates_dim &&
+         peephole_.Dim() == 3 * cell_dim() &&
+         W_p_.NumRows() == cell_dim() &&
+         b_p_.Dim() == W_p_.NumCols() &&
+         recurrent_dim() > 0 &&
+         recurrent_dim() <= W_p_.NumCols() &&
+         delay_ >= 1 &&
+         recurrent_scale_ > 0.0f;
+}
+
+void LSTMPLayer::Propagate(
+    const MatrixBase<float> &in,
+    Matrix<float> *out) const {
+  LayerHistory history;
+  PropagateIncremental(&history, in, out);
+}
+
+void LSTMPLayer::PropagateIncremental(
+    LayerHistory *history,
+    const MatrixBase<float> &in,
+    Matrix<float> *out) const {
+  assert(b_.Dim() != 0 && "LSTMPLayer is not initialized");
+  int cell_dim = this->cell_dim();
+  int recurrent_dim = this->recurrent_dim();
+  int output_dim = W_p_.NumCols();
+
+  // Row k of state is [c, r] of the last frame t with t % delay_ == k, it is
+  // zero at the beginning of stream
+  Matrix<float> &state = history->state;
+  if (state.NumRows() == 0) state.Resize(delay_, cell_dim + recurrent_dim);
+  if (in.NumRows() == 0) {
+    out->Resize(0, 0);
+    return;
+  }
+  out->Resize(in.NumRows(), output_dim, Matrix<float>::kUndefined);
+
+  // Rows of workspace are x W_x + b of the 4 gates for all frames, followed
+  // by the 4 gates and m of current frame
+  Matrix<float> &workspace = history->workspace;
+  int num_frames = in.NumRows();
+  workspace.Resize(num_frames + 2, 4 * cell_dim, Matrix<float>::kUndefined);
+  SubMatrix<float> gates(workspace, 0, num_frames, 0, 4 * cell_dim);
+  MatMat(in, W_x_, &gates, gemm_context_);
+  AddBias(b_, false, &gates);
+
+  const simd::Kernels &kernels = simd::Best();
+  SubMatrix<float> frame_gates(workspace, num_frames, 1, 0, 4 * cell_dim);
+  SubMatrix<float> m(workspace, num_frames + 1, 1, 0, cell_dim);
+  for (int t = 0; t < num_frames; ++t) {
+    int state_idx = (history->frame_index + t) % delay_;
+    SubVector<float> c = state.Row(state_idx).Range(0, cell_dim);
+    SubMatrix<float> r(state, state_idx, 1, cell_dim, recurrent_dim);
+
+    // + r(t - delay) W_r
+    MatMat(r, W_r_, &frame_gates, gemm_context_);
+    kernels.axpy(
+        1.0f,
+        gates.Row(t).Data(),
+        frame_gates.Data(),
+        4 * cell_dim);
+    kernels.lstm_cell(
+        frame_gates.Data(),
+        peephole_.Data(),
+        c.Data(),
+        m.Data(),
+        cell_dim);
+
+    // Projection, its first recurrent_dim dimensions are r(t)
+    SubMatrix<float> y(*out, t, 1, 0, output_dim);
+    MatMat(m, W_p_, &y, gemm_context_);
+    SubVector<float> y_row = y.Row(0);
+    y_row.AddVec(1.0f, b_p_);
+    r.Row(0).CopyFromVec(y_row.Range(0, recurrent_dim));
+
+    // c and r are scaled only in the recurrence, after y is output
+    if (recurrent_scale_ != 1.0f) {
+      kernels.scale(
+          recurrent_scale_,
+          state.Row(state_idx).Data(),
+          cell_dim + recurrent_dim);
+    }
+  }
+  history->frame_index += num_frames;
+}
+
+Status LSTMPLayer::Read(util::ReadableFile *fd) {
+  Matrix<float> peephole;
+  int32_t delay = 0;
+  PK_CHECK_STATUS(W_x_.Read(fd));
+  PK_CHECK_STATUS(W_r_.Read(fd));
+  PK_CHECK_STATUS(b_.Read(fd));
+  PK_CHECK_STATUS(peephole.Read(fd));
+  PK_CHECK_STATUS(W_p_.Read(fd));
+  PK_CHECK_STATUS(b_p_.Read(fd));
+  PK_CHECK_STATUS(fd->ReadValue<int32_t>(&delay));
+  PK_CHECK_STATUS(fd->ReadValue<float>(&recurrent_scale_));
+  delay_ = delay;
+
+  int cell_dim = peephole.NumCols();
+  if (peephole.NumRows() != 3) {
+    return Status::Corruption(util::Format(
+        "LSTMPLayer: 3 rows of peephole expected, but {} found: {}",
+        peephole.NumRows(),
+        fd->filename()));
+  }
+  peephole_.Resize(3 * cell_dim);
+  for (int row_idx = 0; row_idx < 3; ++row_idx) {
+    peephole_.Range(row_idx * cell_dim, cell_dim)
+        .CopyFromVec(peephole.Row(row_idx));
+  }
+
+  if (!Verify()) {
+    return Status::Corruption(util::Format(
+        "LSTMPLayer: dimension mismatch in parameters: {}",
+        fd->filename()));
+  }
+
+  return Status::OK();
+}
+
+SpliceLayer::SpliceLayer(): stride_(1) {}
 SpliceLayer::SpliceLayer(const std::vector<int> &indices):
-    indices_(indices) {
+    indices_(indices),
+    stride_(1) {
+}
+
+template<typename FrameFunc>
+void SpliceLayer::SpliceValid(int num_frames,
+                              int dim,
+                              int frame_index,
+                              FrameFunc frame,
+                              Matrix<float> *out) const {
+  int left_context = this->left_context();
+  int num_valid = num_frames - left_context - right_context();
+
+  // The first frame kept is the first frame_index + i that is divisible by
+  // stride_
+  int first = (stride_ - frame_index % stride_) % stride_;
+  int num_out = num_valid > first ? (num_valid - first - 1) / stride_ + 1 : 0;
+  if (num_out == 0) {
+    out->Resize(0, 0);
+    return;
+  }
+
+  out->Resize(num_out, indices_.size() * dim, Matrix<float>::kUndefined);
+  for (int row_idx = 0; row_idx < num_out; ++row_idx) {
+    SubVector<float> out_row = out->Row(row_idx);
+    int center = left_context + first + row_idx * stride_;
+    int offset = 0;
+    for (int c : indices_) {
+      SubVector<float> v = out_row.Range(offset, dim);
+      v.CopyFromVec(frame(center + c));
+      offset += dim;
+    }
+  }
 }
 
 void SpliceLayer::Propagate(
@@ -53,8 +384,19 @@ void SpliceLayer::Propagate(
   assert(indices_.size() != 0 && "SpliceLayer is not initialized");
   if (in.NumRows() == 0 || in.NumCols() == 0) return;
 
+  // Strided splice also narrows its context
+  if (stride_ > 1) {
+    SpliceValid(
+        in.NumRows(),
+        in.NumCols(),
+        0,
+        [&in](int i) { return in.Row(i); },
+        out);
+    return;
+  }
+
   int out_cols = indices_.size() * in.NumCols();
-  out->Resize(in.NumRows(), out_cols);
+  out->Resize(in.NumRows(), out_cols, Matrix<float>::kUndefined);
 
   for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
     SubVector<float> out_row = out->Row(row_idx);
@@ -74,6 +416,76 @@ void SpliceLayer::Propagate(
   }
 }
 
+int SpliceLayer::left_context() const {
+  return -std::min(*std::min_element(indices_.begin(), indices_.end()), 0);
+}
+
+int SpliceLayer::right_context() const {
+  return std::max(*std::max_element(indices_.begin(), indices_.end()), 0);
+}
+
+void SpliceLayer::PropagateIncremental(
+    LayerHistory *history,
+    const MatrixBase<float> &in,
+    Matrix<float> *out) const {
+  assert(indices_.size() != 0 && "SpliceLayer is not initialized");
+  Matrix<float> &frames = history->frames;
+  assert(frames.NumRows() == 0 || frames.NumCols() == in.NumCols());
+
+  int context = left_context() + right_context();
+  int history_rows = frames.NumRows();
+  int num_valid = history_rows + in.NumRows() - context;
+
+  // Before the history is filled up (at the beginning of stream), it is
+  // extended with the new frames
+  if (history_rows != context || num_valid <= 0) {
+    Matrix<float> extended(history_rows + in.NumRows(), in.NumCols());
+    if (history_rows != 0) {
+      extended.Range(0, history_rows, 0, in.NumCols()).CopyFromMat(frames);
+    }
+    extended.Range(history_rows, in.NumRows(), 0, in.NumCols())
+        .CopyFromMat(in);
+    frames.Swap(&extended);
+    if (num_valid <= 0) {
+      out->Resize(0, 0);
+      return;
+    }
+    history_rows = frames.NumRows();
+  }
+
+  // Frame i is the i-th frame of history followed by in
+  auto frame = [&](int i) -> const SubVector<float> {
+    return i < history_rows ? frames.Row(i) : in.Row(i - history_rows);
+  };
+
+  // Splice the frames with all their context
+  SpliceValid(
+      num_valid + context,
+      in.NumCols(),
+      history->frame_index,
+      frame,
+      out);
+  history->frame_index += num_valid;
+
+  // Keep the last frames as the context of next call. The source frame is
+  // never before the target, so it is copied in place
+  if (context == 0) {
+    frames.Resize(0, 0);
+  } else {
+    if (history_rows != context) {
+      // history was extended with in, so the frames are all in history
+      for (int i = 0; i < context; ++i) {
+        frames.Row(i).CopyFromVec(frames.Row(num_valid + i));
+      }
+      frames.Resize(context, in.NumCols(), Matrix<float>::kCopyData);
+    } else {
+      for (int i = 0; i < context; ++i) {
+        frames.Row(i).CopyFromVec(frame(num_valid + i));
+      }
+    }
+  }
+}
+
 Status SpliceLayer::Read(util::ReadableFile *fd) {
   // Clean indices_
   indices_.clear();
@@ -94,6 +506,158 @@ Status SpliceLayer::Read(util::ReadableFile *fd) {
   return Status::OK();
 }
 
+TdnnLayer::TdnnLayer(const SpliceLayer &splice, const LinearLayer &linear):
+    splice_(splice),
+    relu_(linear.relu()),
+    gemm_context_(nullptr) {
+  assert(linear.W().NumRows() % splice_.indices().size() == 0 &&
+         "TdnnLayer: dimension mismatch in SpliceLayer and LinearLayer");
+  W_.Resize(linear.W().NumRows(), linear.W().NumCols());
+  W_.CopyFromMat(linear.W());
+  b_.Resize(linear.b().Dim());
+  b_.CopyFromVec(linear.b());
+}
+
+std::string TdnnLayer::Type() const {
+  int stride = splice_.stride();
+  std::string type = stride > 1 ? util::Format("Tdnn/{}", stride) : "Tdnn";
+  return relu_ ? type + "+ReLU" : type;
+}
+
+Status TdnnLayer::Read(util::ReadableFile *fd) {
+  return Status::Corruption(util::Format(
+      "TdnnLayer could not be read: {}",
+      fd->filename()));
+}
+
+void TdnnLayer::PropagateFrames(const MatrixBase<float> &src,
+                                int begin,
+                                int step,
+                                int num_out,
+                                Matrix<float> *out) const {
+  int dim = src.NumCols();
+  int out_dim = W_.NumCols();
+  assert(W_.NumRows() == dim * splice_.indices().size() &&
+         "TdnnLayer: dimension mismatch in input and W");
+
+  out->Resize(num_out, out_dim, Matrix<float>::kUndefined);
+  for (int row_idx = 0; row_idx < num_out; ++row_idx) {
+    out->Row(row_idx).CopyFromVec(b_);
+  }
+
+  for (int k = 0; k < splice_.indices().size(); ++k) {
+    SubMatrix<float> W_k(W_, k * dim, dim, 0, out_dim);
+
+    // Output rows [first, last] have their frame at this offset in src
+    int offset = begin + splice_.indices()[k];
+    int first = offset >= 0 ? 0 : (-offset + step - 1) / step;
+    int last = offset <= src.NumRows() - 1 ?
+        std::min((src.NumRows() - 1 - offset) / step, num_out - 1) :
+        -1;
+    if (first <= last) {
+      SubMatrix<float> frames(
+          const_cast<float *>(src.Data()) +
+              static_cast<size_t>(offset + first * step) * src.Stride(),
+          last - first + 1,
+          dim,
+          src.Stride() * step);
+      SubMatrix<float> out_rows(*out, first, last - first + 1, 0, out_dim);
+      MatMat(frames, W_k, &out_rows, gemm_context_, 1.0f);
+    }
+
+    // The frames before src are clamped to the first frame, and the frames
+    // after src to the last frame. They are only at the edges of a batch,
+    // since in a stream the output frames have all their context
+    for (int row_idx = 0; row_idx < std::min(first, num_out); ++row_idx) {
+      SubMatrix<float> frame(src, 0, 1, 0, dim);
+      SubMatrix<float> out_row(*out, row_idx, 1, 0, out_dim);
+      MatMat(frame, W_k, &out_row, gemm_context_, 1.0f);
+    }
+    for (int row_idx = std::max(last + 1, 0); row_idx < num_out; ++row_idx) {
+      SubMatrix<float> frame(src, src.NumRows() - 1, 1, 0, dim);
+      SubMatrix<float> out_row(*out, row_idx, 1, 0, out_dim);
+      MatMat(frame, W_k, &out_row, gemm_context_, 1.0f);
+    }
+  }
+
+  if (relu_) {
+    const simd::Kernels &kernels = simd::Best();
+    for (int row_idx = 0; row_idx < num_out; ++row_idx) {
+      kernels.relu(out->Row(row_idx).Data(), out_dim);
+    }
+  }
+}
+
+void TdnnLayer::Propagate(
+    const MatrixBase<float> &in,
+    Matrix<float> *out) const {
+  if (in.NumRows() == 0 || in.NumCols() == 0) return;
+
+  // Strided splice also narrows its context
+  int stride = splice_.stride();
+  if (stride > 1) {
+    int left_context = splice_.left_context();
+    int num_valid = in.NumRows() - left_context - splice_.right_context();
+    int num_out = num_valid > 0 ? (num_valid - 1) / stride + 1 : 0;
+    if (num_out == 0) {
+      out->Resize(0, 0);
+      return;
+    }
+    PropagateFrames(in, left_context, stride, num_out, out);
+    return;
+  }
+
+  PropagateFrames(in, 0, 1, in.NumRows(), out);
+}
+
+void TdnnLayer::PropagateIncremental(
+    LayerHistory *history,
+    const MatrixBase<float> &in,
+    Matrix<float> *out) const {
+  Matrix<float> &frames = history->frames;
+  assert(frames.NumRows() == 0 || frames.NumCols() == in.NumCols());
+
+  // Append in after the frames kept in history. Reserve() and then Resize()
+  // with kUndefined and the same stride keep the frames in history (see
+  // Matrix::Resize())
+  int context = splice_.left_context() + splice_.right_context();
+  int history_rows = frames.NumRows();
+  int num_frames = history_rows + in.NumRows();
+  frames.Reserve(num_frames, in.NumCols());
+  frames.Resize(num_frames, in.NumCols(), Matrix<float>::kUndefined);
+  frames.Range(history_rows, in.NumRows(), 0, in.NumCols()).CopyFromMat(in);
+
+  int num_valid = num_frames - context;
+  if (num_valid <= 0) {
+    out->Resize(0, 0);
+    return;
+  }
+
+  // The first frame kept is the first frame_index + i that is divisible by
+  // stride
+  int stride = splice_.stride();
+  int frame_index = history->frame_index;
+  int first = (stride - frame_index % stride) % stride;
+  int num_out = num_valid > first ? (num_valid - first - 1) / stride + 1 : 0;
+  if (num_out == 0) {
+    out->Resize(0, 0);
+  } else {
+    int begin = splice_.left_context() + first;
+    PropagateFrames(frames, begin, stride, num_out, out);
+  }
+  history->frame_index += num_valid;
+
+  // Keep the last frames as the context of next call
+  for (int i = 0; i < context; ++i) {
+    frames.Row(i).CopyFromVec(frames.Row(num_valid + i));
+  }
+  if (context == 0) {
+    frames.Resize(0, 0);
+  } else {
+    frames.Resize(context, in.NumCols(), Matrix<float>::kUndefined);
+  }
+}
+
 BatchNormLayer::BatchNormLayer() {}
 BatchNormLayer::BatchNormLayer(const VectorBase<float> &scale,
                                const VectorBase<float> &offset) {
@@ -106,11 +670,15 @@ BatchNormLayer::BatchNormLayer(const VectorBase<float> &scale,
 void BatchNormLayer::Propagate(
     const MatrixBase<float> &in,
     Matrix<float> *out) const {
-  assert(scale_.Dim() > 0 && "BatchNormLayer is not initialized");
-  out->Resize(in.NumRows(), in.NumCols());
+  out->Resize(in.NumRows(), in.NumCols(), Matrix<float>::kUndefined);
   out->CopyFromMat(in);
-  for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
-    SubVector<float> row = out->Row(row_idx);
+  PropagateInPlace(out);
+}
+
+void BatchNormLayer::PropagateInPlace(MatrixBase<float> *in_out) const {
+  assert(scale_.Dim() > 0 && "BatchNormLayer is not initialized");
+  for (int row_idx = 0; row_idx < in_out->NumRows(); ++row_idx) {
+    SubVector<float> row = in_out->Row(row_idx);
     row.MulElements(scale_);
     row.AddVec(1.0, offset_);
   }
@@ -126,10 +694,14 @@ Status BatchNormLayer::Read(util::ReadableFile *fd) {
 void SoftmaxLayer::Propagate(
     const MatrixBase<float> &in,
     Matrix<float> *out) const {
-  out->Resize(in.NumRows(), in.NumCols());
+  out->Resize(in.NumRows(), in.NumCols(), Matrix<float>::kUndefined);
   out->CopyFromMat(in);
-  for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
-    SubVector<float> row = out->Row(row_idx);
+  PropagateInPlace(out);
+}
+
+void SoftmaxLayer::PropagateInPlace(MatrixBase<float> *in_out) const {
+  for (int row_idx = 0; row_idx < in_out->NumRows(); ++row_idx) {
+    SubVector<float> row = in_out->Row(row_idx);
     row.ApplySoftMax();
   }
 }
@@ -137,36 +709,53 @@ void SoftmaxLayer::Propagate(
 void LogSoftmaxLayer::Propagate(
     const MatrixBase<float> &in,
     Matrix<float> *out) const {
-  out->Resize(in.NumRows(), in.NumCols());
+  out->Resize(in.NumRows(), in.NumCols(), Matrix<float>::kUndefined);
   out->CopyFromMat(in);
-  for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
-    SubVector<float> row = out->Row(row_idx);
+  PropagateInPlace(out);
+}
+
+void LogSoftmaxLayer::PropagateInPlace(MatrixBase<float> *in_out) const {
+  for (int row_idx = 0; row_idx < in_out->NumRows(); ++row_idx) {
+    SubVector<float> row = in_out->Row(row_idx);
     row.ApplyLogSoftMax();
+    if (log_prior_.Dim() != 0) row.AddVec(-1.0f, log_prior_);
   }
 }
 
+void LogSoftmaxLayer::set_log_prior(const VectorBase<float> &log_prior) {
+  log_prior_.Resize(log_prior.Dim());
+  log_prior_.CopyFromVec(log_prior);
+}
+
 
 void ReLULayer::Propagate(
     const MatrixBase<float> &in,
     Matrix<float> *out) const {
-  out->Resize(in.NumRows(), in.NumCols());
+  out->Resize(in.NumRows(), in.NumCols(), Matrix<float>::kUndefined);
   out->CopyFromMat(in);
-  for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
-    SubVector<float> row = out->Row(row_idx);
-    for (int col_idx = 0; col_idx < row.Dim(); ++ col_idx) {
-      if (row(col_idx) < 0.0f) row(col_idx) = 0.0f;
-    }
+  PropagateInPlace(out);
+}
+
+void ReLULayer::PropagateInPlace(MatrixBase<float> *in_out) const {
+  const simd::Kernels &kernels = simd::Best();
+  for (int row_idx = 0; row_idx < in_out->NumRows(); ++row_idx) {
+    SubVector<float> row = in_out->Row(row_idx);
+    kernels.relu(row.Data(), row.Dim());
   }
 }
 
 void NormalizeLayer::Propagate(
     const MatrixBase<float> &in,
     Matrix<float> *out) const {
-  float D = in.NumCols();
-  out->Resize(in.NumRows(), in.NumCols());
+  out->Resize(in.NumRows(), in.NumCols(), Matrix<float>::kUndefined);
   out->CopyFromMat(in);
-  for (int row_idx = 0; row_idx < out->NumRows(); ++row_idx) {
-    SubVector<float> row = out->Row(row_idx);
+  PropagateInPlace(out);
+}
+
+void NormalizeLayer::PropagateInPlace(MatrixBase<float> *in_out) const {
+  float D = in_out->NumCols();
+  for (int row_idx = 0; row_idx < in_out->NumRows(); ++row_idx) {
+    SubVector<float> row = in_out->Row(row_idx);
 
     double squared_sum = row.VecVec(row);
     float scale = static_cast<float>(sqrt(D / squared_sum));
@@ -185,12 +774,13 @@ void NarrowLayer::Propagate(
   assert(narrow_left_ >= 0 && "NarrowLayer is not initialized");
   if (in.NumRows() <= narrow_left_ + narrow_right_) {
     // Do nothing if no enough rows to narrow
-    out->Resize(in.NumRows(), in.NumCols());
+    out->Resize(in.NumRows(), in.NumCols(), Matrix<float>::kUndefined);
     out->CopyFromMat(in);
   } else {
     out->Resize(
         in.NumRows() - narrow_left_ - narrow_right_,
-        in.NumCols());
+        in.NumCols(),
+        Matrix<float>::kUndefined);
     SubMatrix<float> narrow(
         in,
         narrow_left_,
@@ -201,6 +791,14 @@ void NarrowLayer::Propagate(
   }
 }
 
+void NarrowLayer::PropagateIncremental(
+    LayerHistory *history,
+    const MatrixBase<float> &in,
+    Matrix<float> *out) const {
+  out->Resize(in.NumRows(), in.NumCols(), Matrix<float>::kUndefined);
+  out->CopyFromMat(in);
+}
+
 Status NarrowLayer::Read(util::ReadableFile *fd) {
   int32_t narrow_left = 0;
   PK_CHECK_STATUS(fd->ReadValue<int32_t>(&narrow_left));
@@ -256,6 +854,12 @@ Status Nnet::ReadLayer(util::ReadableFile *fd) {
   case Layer::kNarrow:
     layer = std::unique_ptr<Layer>(new NarrowLayer());
     break;
+  case Layer::kQuantizedLinear:
+    layer = std::unique_ptr<Layer>(new QuantizedLinearLayer());
+    break;
+  case Layer::kLSTMP:
+    layer = std::unique_ptr<Layer>(new LSTMPLayer());
+    break;
   default:
     return Status::Corruption(util::Format(
         "read_layer: unexpected layer type: {} ({})",
@@ -265,11 +869,15 @@ Status Nnet::ReadLayer(util::ReadableFile *fd) {
 
   // Read the content of this layer (if have)
   PK_CHECK_STATUS(layer->Read(fd));
-  layers_.emplace_back(std::move(layer));
+  AddLayer(std::move(layer));
 
   return Status::OK();
 }
 
+void Nnet::AddLayer(std::unique_ptr<Layer> layer) {
+  layers_.emplace_back(std::move(layer));
+}
+
 Status Nnet::Read(util::ReadableFile *fd) {
   // Read section name
   PK_CHECK_STATUS(fd->ReadAndVerifyString(PK_NNET_SECTION));
@@ -292,18 +900,346 @@ Status Nnet::Read(util::ReadableFile *fd) {
   return Status::OK();
 }
 
+void Nnet::Quantize() {
+  for (std::unique_ptr<Layer> &layer : layers_) {
+    const LinearLayer *linear = dynamic_cast<const LinearLayer *>(layer.get());
+    if (linear != nullptr) layer = linear->Quantize();
+  }
+}
+
+void Nnet::set_gemm_context(GemmContext *context) {
+  for (std::unique_ptr<Layer> &layer : layers_) {
+    layer->set_gemm_context(context);
+  }
+}
+
+bool Nnet::Fuse(const VectorBase<float> *log_prior) {
+  // BatchNorm after Linear
+  for (int layer_idx = 1; layer_idx < layers_.size(); ++layer_idx) {
+    const BatchNormLayer *batch_norm = dynamic_cast<const BatchNormLayer *>(
+        layers_[layer_idx].get());
+    LinearLayer *linear = dynamic_cast<LinearLayer *>(
+        layers_[layer_idx - 1].get());
+    if (batch_norm == nullptr || linear == nullptr || linear->relu()) {
+      continue;
+    }
+    linear->FoldOutputScale(batch_norm->scale(), batch_norm->offset());
+    layers_.erase(layers_.begin() + layer_idx);
+    --layer_idx;
+  }
+
+  // BatchNorm before Linear, Splice and Narrow only move the frames
+  for (int layer_idx = 0; layer_idx < layers_.size(); ++layer_idx) {
+    const BatchNormLayer *batch_norm = dynamic_cast<const BatchNormLayer *>(
+        layers_[layer_idx].get());
+    if (batch_norm == nullptr) continue;
+
+    int next_idx = layer_idx + 1;
+    while (next_idx < layers_.size() &&
+           (dynamic_cast<const SpliceLayer *>(layers_[next_idx].get()) ||
+            dynamic_cast<const NarrowLayer *>(layers_[next_idx].get()))) {
+      ++next_idx;
+    }
+    if (next_idx == layers_.size()) continue;
+    LinearLayer *linear = dynamic_cast<LinearLayer *>(layers_[next_idx].get());
+    if (linear == nullptr) continue;
+
+    if (linear->FoldInputScale(batch_norm->scale(), batch_norm->offset())) {
+      layers_.erase(layers_.begin() + layer_idx);
+      --layer_idx;
+    }
+  }
+
+  // ReLU after Linear
+  for (int layer_idx = 1; layer_idx < layers_.size(); ++layer_idx) {
+    const ReLULayer *relu = dynamic_cast<const ReLULayer *>(
+        layers_[layer_idx].get());
+    LinearLayer *linear = dynamic_cast<LinearLayer *>(
+        layers_[layer_idx - 1].get());
+    if (relu == nullptr || linear == nullptr || linear->relu()) continue;
+    linear->set_relu(true);
+    layers_.erase(layers_.begin() + layer_idx);
+    --layer_idx;
+  }
+
+  // Prior in the last LogSoftmax
+  if (log_prior == nullptr || layers_.empty()) return false;
+  LogSoftmaxLayer *log_softmax = dynamic_cast<LogSoftmaxLayer *>(
+      layers_.back().get());
+  if (log_softmax == nullptr) return false;
+  log_softmax->set_log_prior(*log_prior);
+
+  return true;
+}
+
+bool Nnet::SetFrameSubsampling(int factor) {
+  if (factor == 1) return true;
+
+  for (int layer_idx = layers_.size() - 1; layer_idx >= 0; --layer_idx) {
+    const SpliceLayer *splice = GetSplice(layers_[layer_idx].get());
+    if (splice == nullptr) continue;
+
+    // The last SpliceLayer should be followed by its NarrowLayer
+    if (layer_idx + 1 == layers_.size()) return false;
+    const NarrowLayer *narrow = dynamic_cast<const NarrowLayer *>(
+        layers_[layer_idx + 1].get());
+    if (narrow == nullptr ||
+        narrow->narrow_left() != splice->left_context() ||
+        narrow->narrow_right() != splice->right_context()) {
+      return false;
+    }
+
+    // The LSTMPLayers after it run at the reduced frame rate, so their delay
+    // is in the subsampled frames
+    for (int next_idx = layer_idx + 2; next_idx < layers_.size(); ++next_idx) {
+      const LSTMPLayer *lstmp = dynamic_cast<const LSTMPLayer *>(
+          layers_[next_idx].get());
+      if (lstmp != nullptr && lstmp->delay() % factor != 0) return false;
+    }
+    for (int next_idx = layer_idx + 2; next_idx < layers_.size(); ++next_idx) {
+      LSTMPLayer *lstmp = dynamic_cast<LSTMPLayer *>(layers_[next_idx].get());
+      if (lstmp != nullptr) lstmp->set_delay(lstmp->delay() / factor);
+    }
+
+    TdnnLayer *tdnn = dynamic_cast<TdnnLayer *>(layers_[layer_idx].get());
+    if (tdnn != nullptr) {
+      tdnn->set_stride(factor);
+    } else {
+      static_cast<SpliceLayer *>(layers_[layer_idx].get())->set_stride(factor);
+    }
+    layers_.erase(layers_.begin() + layer_idx + 1);
+    return true;
+  }
+
+  return false;
+}
+
+void Nnet::FuseTdnn() {
+  for (int layer_idx = 0; layer_idx < layers_.size(); ++layer_idx) {
+    const SpliceLayer *splice = dynamic_cast<const SpliceLayer *>(
+        layers_[layer_idx].get());
+    if (splice == nullptr) continue;
+
+    // The NarrowLayer only removes frames, so it could be moved after the
+    // LinearLayer
+    int linear_idx = layer_idx + 1;
+    if (linear_idx < layers_.size() &&
+        dynamic_cast<const NarrowLayer *>(layers_[linear_idx].get())) {
+      ++linear_idx;
+    }
+    if (linear_idx >= layers_.size()) continue;
+    const LinearLayer *linear = dynamic_cast<const LinearLayer *>(
+        layers_[linear_idx].get());
+    if (linear == nullptr ||
+        linear->W().NumRows() % splice->indices().size() != 0) {
+      continue;
+    }
+
+    layers_[layer_idx].reset(new TdnnLayer(*splice, *linear));
+    layers_.erase(layers_.begin() + linear_idx);
+  }
+}
+
+bool Nnet::HasRecurrentLayer() const {
+  for (const std::unique_ptr<Layer> &layer : layers_) {
+    if (dynamic_cast<const LSTMPLayer *>(layer.get()) != nullptr) return true;
+  }
+
+  return false;
+}
+
+std::string Nnet::Plan() const {
+  std::string plan;
+  for (const std::unique_ptr<Layer> &layer : layers_) {
+    if (!plan.empty()) plan += " -> ";
+    plan += layer->Type();
+  }
+
+  return plan;
+}
+
 void Nnet::Propagate(const MatrixBase<float> &in, Matrix<float> *out) const {
-  Matrix<float> layer_input, layer_output;
-  
-  layer_input.Resize(in.NumRows(), in.NumCols());
-  layer_input.CopyFromMat(in);
+  Instance inst;
+  Propagate(&inst, in, out);
+}
+
+void Nnet::Propagate(Instance *inst,
+                     const MatrixBase<float> &in,
+                     Matrix<float> *out) const {
+  PropagateLayers(inst, 0, nullptr, nullptr, in, out);
+}
+
+void Nnet::PropagateIncremental(Instance *inst,
+                                const MatrixBase<float> &in,
+                                Matrix<float> *out) const {
+  int num_rows = in.NumRows();
+  PropagateLayers(inst, 1, &inst, &num_rows, in, out);
+}
+
+void Nnet::PropagateIncremental(Instance *inst,
+                                const std::vector<Instance *> &streams,
+                                const MatrixBase<float> &in,
+                                std::vector<int> *num_rows,
+                                Matrix<float> *out) const {
+  assert(streams.size() == num_rows->size());
+  assert(std::find(streams.begin(), streams.end(), inst) == streams.end());
+  PropagateLayers(
+      inst,
+      streams.size(),
+      streams.data(),
+      num_rows->data(),
+      in,
+      out);
+}
+
+void Nnet::Reserve(Instance *inst, int max_rows, int input_dim) const {
+  int max_dim = input_dim;
+  int dim = input_dim;
+  for (const std::unique_ptr<Layer> &layer : layers_) {
+    dim = layer->OutputDim(dim);
+    max_dim = std::max(max_dim, dim);
+  }
+
+  inst->workspace[0].Reserve(max_rows, max_dim);
+  inst->workspace[1].Reserve(max_rows, max_dim);
+}
+
+void Nnet::PropagateLayers(Instance *inst,
+                           int num_streams,
+                           Instance *const *streams,
+                           int *num_rows,
+                           const MatrixBase<float> &in,
+                           Matrix<float> *out) const {
+  for (int i = 0; i < num_streams; ++i) {
+    streams[i]->history.resize(layers_.size());
+  }
+  if (in.NumRows() == 0) {
+    out->Resize(0, 0);
+    return;
+  }
+
+  // The output of a layer is in the workspace buffer which is not its input,
+  // except the layers working in place
+  const MatrixBase<float> *layer_input = &in;
+  Matrix<float> *buffer = &inst->workspace[0];
+  for (int layer_idx = 0; layer_idx < layers_.size(); ++layer_idx) {
+    const Layer *layer = layers_[layer_idx].get();
+    if (layer->InPlace()) {
+      if (layer_input != buffer) {
+        buffer->Resize(
+            layer_input->NumRows(),
+            layer_input->NumCols(),
+            Matrix<float>::kUndefined);
+        buffer->CopyFromMat(*layer_input);
+        layer_input = buffer;
+      }
+      layer->PropagateInPlace(buffer);
+      continue;
+    }
+
+    if (layer_input == buffer) {
+      buffer = buffer == &inst->workspace[0] ? &inst->workspace[1]
+                                             : &inst->workspace[0];
+    }
+    if (num_streams > 1 && layer->HasHistory()) {
+      PropagateStreams(
+          layer_idx,
+          num_streams,
+          streams,
+          num_rows,
+          *layer_input,
+          &inst->stream_output,
+          buffer);
+    } else if (num_streams != 0) {
+      // The history is not used by the layers without history
+      layer->PropagateIncremental(
+          &streams[0]->history[layer_idx],
+          *layer_input,
+          buffer);
+      if (num_streams == 1) num_rows[0] = buffer->NumRows();
+    } else {
+      layer->Propagate(*layer_input, buffer);
+    }
+    layer_input = buffer;
+
+    // No frame has its context available yet
+    if (layer_input->NumRows() == 0) break;
+  }
+
+  out->Resize(
+      layer_input->NumRows(),
+      layer_input->NumCols(),
+      Matrix<float>::kUndefined);
+  out->CopyFromMat(*layer_input);
+}
+
+void Nnet::PropagateStreams(int layer_idx,
+                            int num_streams,
+                            Instance *const *streams,
+                            int *num_rows,
+                            const MatrixBase<float> &in,
+                            Matrix<float> *stream_output,
+                            Matrix<float> *out) const {
+  const Layer *layer = layers_[layer_idx].get();
+
+  // A layer never outputs more frames than its input in a stream
+  int out_dim = layer->OutputDim(in.NumCols());
+  out->Resize(in.NumRows(), out_dim, Matrix<float>::kUndefined);
+
+  int in_offset = 0;
+  int out_offset = 0;
+  for (int i = 0; i < num_streams; ++i) {
+    if (num_rows[i] == 0) continue;
+    SubMatrix<float> stream_in(in, in_offset, num_rows[i], 0, in.NumCols());
+    in_offset += num_rows[i];
+
+    layer->PropagateIncremental(
+        &streams[i]->history[layer_idx],
+        stream_in,
+        stream_output);
+    num_rows[i] = stream_output->NumRows();
+    if (num_rows[i] == 0) continue;
+    out->Range(out_offset, num_rows[i], 0, out_dim)
+        .CopyFromMat(*stream_output);
+    out_offset += num_rows[i];
+  }
+
+  // Shrinking the rows keeps the data, since the stride is not changed
+  if (out_offset == 0) {
+    out->Resize(0, 0);
+  } else {
+    out->Resize(out_offset, out_dim, Matrix<float>::kUndefined);
+  }
+}
+
+bool Nnet::SupportsIncremental() const {
+  // The SpliceLayer waiting for its NarrowLayer
+  const SpliceLayer *splice = nullptr;
   for (const std::unique_ptr<Layer> &layer : layers_) {
-    layer->Propagate(layer_input, &layer_output);
-    layer_input.Swap(&layer_output);
+    const NarrowLayer *narrow = dynamic_cast<const NarrowLayer *>(layer.get());
+    if (narrow != nullptr) {
+      if (splice == nullptr ||
+          narrow->narrow_left() != splice->left_context() ||
+          narrow->narrow_right() != splice->right_context()) {
+        return false;
+      }
+      splice = nullptr;
+      continue;
+    }
+
+    // A SpliceLayer with context should be narrowed immediately
+    if (splice != nullptr &&
+        splice->left_context() + splice->right_context() != 0) {
+      return false;
+    }
+    splice = GetSplice(layer.get());
+
+    // Strided SpliceLayer narrows itself
+    if (splice != nullptr && splice->stride() > 1) splice = nullptr;
   }
 
-  out->Resize(layer_input.NumRows(), layer_input.NumCols());
-  out->CopyFromMat(layer_input);
+  return splice == nullptr ||
+         splice->left_context() + splice->right_context() == 0;
 }
 
 }  // namespace pocketkaldi
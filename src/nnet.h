@@ -3,6 +3,7 @@
 #ifndef POCKETKALDI_NNET_H_
 #define POCKETKALDI_NNET_H_
 
+#include <assert.h>
 #include <vector>
 #include <memory>
 #include "matrix.h"
@@ -14,6 +15,24 @@
 
 namespace pocketkaldi {
 
+// State of a layer in a stream, for Layer::PropagateIncremental()
+struct LayerHistory {
+  LayerHistory(): frame_index(0) {}
+
+  // Last input frames kept by the layer
+  Matrix<float> frames;
+
+  // Recurrent state of the layer, like the cells and output of LSTM
+  Matrix<float> state;
+
+  // Temporary matrices of the layer. They are kept in the stream, so the
+  // memory is allocated in the first chunk only
+  Matrix<float> workspace;
+
+  // Index of the next output frame in stream, before subsampling
+  int frame_index;
+};
+
 // The base class for different type of layers
 class Layer {
  public:
@@ -26,7 +45,9 @@ class Layer {
     kSplice = 6,
     kBatchNorm = 7,
     kLogSoftmax = 8,
-    kNarrow = 9
+    kNarrow = 9,
+    kQuantizedLinear = 10,
+    kLSTMP = 11
   };
 
   // Propogate a batch of input vectors through this layer. And the batch of
@@ -35,6 +56,36 @@ class Layer {
       const MatrixBase<float> &in,
       Matrix<float> *out) const = 0;
 
+  // Returns true if the layer works on each element (or each row), so that it
+  // could propagate in place by PropagateInPlace()
+  virtual bool InPlace() const { return false; }
+
+  // Propagates in place for the layers whose InPlace() is true
+  virtual void PropagateInPlace(MatrixBase<float> *in_out) const {
+    assert(false && "layer could not propagate in place");
+  }
+
+  // Dimension of output for input_dim
+  virtual int OutputDim(int input_dim) const { return input_dim; }
+
+  // Returns true if PropagateIncremental() keeps frames in history, so the
+  // frames of different streams could not be propagated together
+  virtual bool HasHistory() const { return false; }
+
+  // Sets the context to run the GEMMs of this layer. nullptr is the default
+  // GEMM of MatMat()
+  virtual void set_gemm_context(GemmContext *context) {}
+
+  // Propagates the new frames of a stream. history is the state of this layer
+  // in the stream, it is empty at the beginning of stream. It is the same as
+  // Propagate() for the layers without context
+  virtual void PropagateIncremental(
+      LayerHistory *history,
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const {
+    Propagate(in, out);
+  }
+
   // Read layer from fd
   virtual Status Read(util::ReadableFile *fd) = 0;
 
@@ -63,11 +114,174 @@ class LinearLayer : public Layer {
   Status Read(util::ReadableFile *fd) override;
 
   // Implements interface Layer
-  std::string Type() const override { return "Linear"; }
+  std::string Type() const override {
+    return relu_ ? "Linear+ReLU" : "Linear";
+  }
+
+  // Implements interface Layer
+  int OutputDim(int input_dim) const override { return W_.NumCols(); }
+
+  // Returns the int8 quantized version of this layer
+  std::unique_ptr<Layer> Quantize() const;
+
+  // Implements interface Layer
+  void set_gemm_context(GemmContext *context) override {
+    gemm_context_ = context;
+  }
+
+  // Applies ReLU to the output in the same pass as adding b
+  void set_relu(bool relu) { relu_ = relu; }
+  bool relu() const { return relu_; }
+
+  // W is transposed into (input_dim, output_dim)
+  const Matrix<float> &W() const { return W_; }
+  const Vector<float> &b() const { return b_; }
+
+  // Folds y = y * scale + offset after this layer (like a BatchNormLayer)
+  // into W and b
+  void FoldOutputScale(const VectorBase<float> &scale,
+                       const VectorBase<float> &offset);
+
+  // Folds x = x * scale + offset before this layer into W and b. The input
+  // could be spliced from the scaled frames, so the dimension of scale could
+  // be a divisor of the input dimension. Returns false if the dimension
+  // mismatches
+  bool FoldInputScale(const VectorBase<float> &scale,
+                      const VectorBase<float> &offset);
 
  private:
   Matrix<float> W_;
   Vector<float> b_;
+  bool relu_;
+  GemmContext *gemm_context_;
+};
+
+// Linear layer with 8-bit quantized W. W is quantized offline (layer type
+// kQuantizedLinear) or when nnet is loaded (Nnet::Quantize), the input is
+// quantized on the fly for each batch, then they are multiplied by gemmlowp.
+// b is kept in float and added to the float output
+class QuantizedLinearLayer : public Layer {
+ public:
+  QuantizedLinearLayer();
+
+  // Initialize the layer with parameter W and b, like LinearLayer. W is
+  // quantized here
+  QuantizedLinearLayer(
+      const MatrixBase<float> &W,
+      const VectorBase<float> &b);
+
+  // Implements interface Layer
+  void Propagate(
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const override;
+
+  // Implements interface Layer
+  Status Read(util::ReadableFile *fd) override;
+
+  // Implements interface Layer
+  std::string Type() const override {
+    return relu_ ? "QuantizedLinear+ReLU" : "QuantizedLinear";
+  }
+
+  // Implements interface Layer
+  int OutputDim(int input_dim) const override { return W_.NumCols(); }
+
+  // Implements interface Layer
+  void set_gemm_context(GemmContext *context) override {
+    gemm_context_ = context;
+  }
+
+  // Applies ReLU to the output in the same pass as adding b
+  void set_relu(bool relu) { relu_ = relu; }
+
+ private:
+  Matrix<uint8_t> W_;
+  QuantizationParams W_quant_params_;
+  Vector<float> b_;
+  bool relu_;
+  GemmContext *gemm_context_;
+};
+
+// LSTM with peephole connections and a projection of its output (LSTMP):
+//   [i, f, g, o] = x W_x + r(t - delay) W_r + b
+//   c(t) = sigmoid(f + w_fc * c(t - delay)) * c(t - delay) +
+//          sigmoid(i + w_ic * c(t - delay)) * tanh(g)
+//   m = sigmoid(o + w_oc * c(t)) * tanh(c(t))
+//   y(t) = m W_p + b_p, r(t) = y(t)[0 : recurrent_dim]
+// x W_x of all the 4 gates is computed for all the frames in one GEMM, then
+// for each frame, the recurrent part of the 4 gates is one more GEMM, and the
+// cells are updated by simd::Kernels::lstm_cell. c and r of the last delay
+// frames are kept in LayerHistory::state, so the stream continues across
+// chunks. In Propagate(), the batch is a stream from the zero state
+class LSTMPLayer : public Layer {
+ public:
+  LSTMPLayer();
+
+  // Initialize the layer with the parameters in the shape of Kaldi: W_x is
+  // (4 * cell_dim, input_dim), W_r is (4 * cell_dim, recurrent_dim), b is
+  // (4 * cell_dim), the rows of 4 gates are in the order of i, f, g, o.
+  // peephole is (3, cell_dim) of w_ic, w_fc, w_oc. W_p is (output_dim,
+  // cell_dim) and b_p is (output_dim). recurrent_dim <= output_dim. c and r
+  // are scaled by recurrent_scale before the recurrence, as the scale of
+  // BackpropTruncationComponent (decay-time in xconfig)
+  LSTMPLayer(const MatrixBase<float> &W_x,
+             const MatrixBase<float> &W_r,
+             const VectorBase<float> &b,
+             const MatrixBase<float> &peephole,
+             const MatrixBase<float> &W_p,
+             const VectorBase<float> &b_p,
+             int delay,
+             float recurrent_scale = 1.0f);
+
+  // Implements interface Layer
+  void Propagate(
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const override;
+
+  // Implements interface Layer
+  void PropagateIncremental(
+      LayerHistory *history,
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const override;
+
+  // Implements interface Layer
+  bool HasHistory() const override { return true; }
+
+  // Implements interface Layer
+  Status Read(util::ReadableFile *fd) override;
+
+  // Implements interface Layer
+  std::string Type() const override { return "LSTMP"; }
+
+  // Implements interface Layer
+  int OutputDim(int input_dim) const override { return W_p_.NumCols(); }
+
+  // Implements interface Layer
+  void set_gemm_context(GemmContext *context) override {
+    gemm_context_ = context;
+  }
+
+  // The recurrence is from frame t - delay in the frame rate of this layer
+  int delay() const { return delay_; }
+  void set_delay(int delay) { delay_ = delay; }
+
+ private:
+  // Checks the dimensions of parameters
+  bool Verify() const;
+
+  int cell_dim() const { return W_x_.NumCols() / 4; }
+  int recurrent_dim() const { return W_r_.NumRows(); }
+
+  // Parameters are transposed as LinearLayer, peephole_ is [w_ic, w_fc, w_oc]
+  Matrix<float> W_x_;
+  Matrix<float> W_r_;
+  Vector<float> b_;
+  Vector<float> peephole_;
+  Matrix<float> W_p_;
+  Vector<float> b_p_;
+  int delay_;
+  float recurrent_scale_;
+  GemmContext *gemm_context_;
 };
 
 // SpliceLayer splices input matrix with each indcies. For example
@@ -87,14 +301,118 @@ class SpliceLayer : public Layer {
       const MatrixBase<float> &in,
       Matrix<float> *out) const override;
 
+  // In a stream, only the frames with all their context available are
+  // spliced, as the NarrowLayer after it in batch. history keeps the last
+  // left_context() + right_context() input frames for the next call
+  void PropagateIncremental(
+      LayerHistory *history,
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const override;
+
+  // Implements interface Layer
+  bool HasHistory() const override { return true; }
+
   // Implements interface Layer
   Status Read(util::ReadableFile *fd) override;
 
   // Implements interface Layer
-  std::string Type() const override { return "Splice"; }
+  std::string Type() const override {
+    return stride_ > 1 ? util::Format("Splice/{}", stride_) : "Splice";
+  }
+
+  // Implements interface Layer
+  int OutputDim(int input_dim) const override {
+    return input_dim * indices_.size();
+  }
+
+  // Context of the indices
+  int left_context() const;
+  int right_context() const;
+
+  const std::vector<int> &indices() const { return indices_; }
+
+  // With stride > 1, only the frames with all their context available are
+  // spliced, as the NarrowLayer after it, and then only one of stride frames
+  // is kept (frame 0, stride, 2 * stride, ... of stream). It is used for
+  // frame subsampling, the layers after it run at the reduced frame rate
+  void set_stride(int stride) { stride_ = stride; }
+  int stride() const { return stride_; }
 
  private:
+  // Splices the frames with all their context into out, keeps one of stride_
+  // frames from frame_index. frame(i) returns the i-th input frame
+  template<typename FrameFunc>
+  void SpliceValid(int num_frames,
+                   int dim,
+                   int frame_index,
+                   FrameFunc frame,
+                   Matrix<float> *out) const;
+
   std::vector<int> indices_;
+  int stride_;
+};
+
+// TdnnLayer is a SpliceLayer fused with the LinearLayer after it (Nnet::
+// FuseTdnn). Instead of copying each input frame into indices().size() rows
+// of the spliced matrix, it multiplies the rows of input at each offset of
+// indices() with the part of W for that offset, and sums them up. The rows at
+// an offset are a SubMatrix of input, so the spliced matrix is never
+// materialized. The edge frames are clamped as SpliceLayer, and the output is
+// the same as the SpliceLayer followed by the LinearLayer, including the
+// incremental and strided propagation. It is not a SpliceLayer, so the passes
+// of Nnet moving layers across a SpliceLayer never move them across it
+class TdnnLayer : public Layer {
+ public:
+  TdnnLayer(const SpliceLayer &splice, const LinearLayer &linear);
+
+  // Implements interface Layer
+  void Propagate(
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const override;
+
+  // Implements interface Layer. The last frames of stream are kept in history
+  // as SpliceLayer, and the new frames are appended after them, so that the
+  // frames are contiguous for the GEMMs
+  void PropagateIncremental(
+      LayerHistory *history,
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const override;
+
+  // Implements interface Layer
+  bool HasHistory() const override { return true; }
+
+  // TdnnLayer is fused when nnet is loaded, it could not be read from file
+  Status Read(util::ReadableFile *fd) override;
+
+  // Implements interface Layer
+  std::string Type() const override;
+
+  // Implements interface Layer
+  int OutputDim(int input_dim) const override { return W_.NumCols(); }
+
+  // Implements interface Layer
+  void set_gemm_context(GemmContext *context) override {
+    gemm_context_ = context;
+  }
+
+  // The SpliceLayer fused in it, for its context and stride
+  const SpliceLayer &splice() const { return splice_; }
+  void set_stride(int stride) { splice_.set_stride(stride); }
+
+ private:
+  // Computes num_out output rows from the frames of src. Output row i is
+  // centered at frame begin + i * step, its frames out of src are clamped
+  void PropagateFrames(const MatrixBase<float> &src,
+                       int begin,
+                       int step,
+                       int num_out,
+                       Matrix<float> *out) const;
+
+  SpliceLayer splice_;
+  Matrix<float> W_;
+  Vector<float> b_;
+  bool relu_;
+  GemmContext *gemm_context_;
 };
 
 // BatchNormLayer is a layer to apply batch normalization without affine,
@@ -116,6 +434,13 @@ class BatchNormLayer : public Layer {
   // Implements interface Layer
   std::string Type() const override { return "BatchNorm"; }
 
+  // Implements interface Layer
+  bool InPlace() const override { return true; }
+  void PropagateInPlace(MatrixBase<float> *in_out) const override;
+
+  const Vector<float> &scale() const { return scale_; }
+  const Vector<float> &offset() const { return offset_; }
+
  private:
   Vector<float> scale_;
   Vector<float> offset_;
@@ -133,6 +458,10 @@ class SoftmaxLayer : public Layer {
 
   // Implements interface Layer
   std::string Type() const override { return "Softmax"; }
+
+  // Implements interface Layer
+  bool InPlace() const override { return true; }
+  void PropagateInPlace(MatrixBase<float> *in_out) const override;
 };
 
 // LogSoftMax layer 
@@ -146,7 +475,20 @@ class LogSoftmaxLayer : public Layer {
   Status Read(util::ReadableFile *fd) override { return Status::OK(); };
 
   // Implements interface Layer
-  std::string Type() const override { return "LogSoftmax"; }
+  std::string Type() const override {
+    return log_prior_.Dim() != 0 ? "LogSoftmax-Prior" : "LogSoftmax";
+  }
+
+  // Implements interface Layer
+  bool InPlace() const override { return true; }
+  void PropagateInPlace(MatrixBase<float> *in_out) const override;
+
+  // Subtracts log_prior from the output in the same pass, so that the output
+  // is log-likelihood instead of log-posterior
+  void set_log_prior(const VectorBase<float> &log_prior);
+
+ private:
+  Vector<float> log_prior_;
 };
 
 // ReLU layer
@@ -161,6 +503,10 @@ class ReLULayer : public Layer {
 
   // Implements interface Layer
   std::string Type() const override { return "ReLU"; }
+
+  // Implements interface Layer
+  bool InPlace() const override { return true; }
+  void PropagateInPlace(MatrixBase<float> *in_out) const override;
 };
 
 // Normalize layer
@@ -175,6 +521,10 @@ class NormalizeLayer : public Layer {
 
   // Implements interface Layer
   std::string Type() const override { return "Normalize"; }
+
+  // Implements interface Layer
+  bool InPlace() const override { return true; }
+  void PropagateInPlace(MatrixBase<float> *in_out) const override;
 };
 
 class NarrowLayer : public Layer {
@@ -186,12 +536,22 @@ class NarrowLayer : public Layer {
       const MatrixBase<float> &in,
       Matrix<float> *out) const override;
 
+  // In a stream, the SpliceLayer before it has already removed the context,
+  // so it just copies in to out
+  void PropagateIncremental(
+      LayerHistory *history,
+      const MatrixBase<float> &in,
+      Matrix<float> *out) const override;
+
   // Implements interface Layer
   Status Read(util::ReadableFile *fd) override;
 
   // Implements interface Layer
   std::string Type() const override { return "NarrowLayer"; }
 
+  int narrow_left() const { return narrow_left_; }
+  int narrow_right() const { return narrow_right_; }
+
  private:
   int narrow_left_;
   int narrow_right_;
@@ -223,14 +583,99 @@ class ScaleLayer : public Layer {
 // network using `Propagate` method
 class Nnet {
  public:
+  // Stores the state of a stream in incremental propagation
+  class Instance;
+
   Nnet();
 
   // Read the nnet from file
   Status Read(util::ReadableFile *fd);
 
+  // Appends a layer to the nnet
+  void AddLayer(std::unique_ptr<Layer> layer);
+
   // Propogate batch matrix through this neural network
   void Propagate(const MatrixBase<float> &in, Matrix<float> *out) const;
 
+  // Propogate batch matrix through this neural network. The intermediate
+  // outputs are in the two workspace buffers of inst, and the layers whose
+  // InPlace() is true work in place. After Reserve(), it does not allocate
+  // memory for the batches within the reserved size
+  void Propagate(Instance *inst,
+                 const MatrixBase<float> &in,
+                 Matrix<float> *out) const;
+
+  // Reserves the workspace of inst for batches of at most max_rows frames with
+  // dimension input_dim. The size of workspace is computed from the output
+  // dimension of each layer
+  void Reserve(Instance *inst, int max_rows, int input_dim) const;
+
+  // Propagates the new frames of a stream, with the workspace of inst as
+  // Propagate(). Each SpliceLayer splices the new frames with its history in
+  // inst, so the context frames are computed only
+  // once. The output has one row for each input frame whose context is all
+  // available, so it could be less than the input, or even empty (0 x 0)
+  void PropagateIncremental(Instance *inst,
+                            const MatrixBase<float> &in,
+                            Matrix<float> *out) const;
+
+  // Propagates the new frames of several streams in one pass, with the
+  // workspace of inst. The rows of in are the frames of streams[0],
+  // streams[1], ..., and num_rows[i] is the number of frames of streams[i].
+  // The layers without history propagate the frames of all streams at once,
+  // so the weights are read once for the batch. Each SpliceLayer splices the
+  // frames of each stream with its history in streams[i]. The output of each
+  // stream is the same as PropagateIncremental(), they are in out in the same
+  // order, and num_rows[i] is updated to the number of output frames of
+  // streams[i]. inst should not be one of streams
+  void PropagateIncremental(Instance *inst,
+                            const std::vector<Instance *> &streams,
+                            const MatrixBase<float> &in,
+                            std::vector<int> *num_rows,
+                            Matrix<float> *out) const;
+
+  // Returns true if PropagateIncremental() gives the same output as
+  // Propagate(). It requires each NarrowLayer to follow a SpliceLayer and
+  // narrow exactly its context, as the nnet from convert_am.py
+  bool SupportsIncremental() const;
+
+  // Replaces all the linear layers with their int8 quantized version
+  void Quantize();
+
+  // Fuses layers for inference:
+  //   - BatchNorm after Linear is folded into W and b of the Linear
+  //   - BatchNorm before Linear (Splice and Narrow could be in between) is
+  //     folded into W and b of the Linear
+  //   - ReLU after Linear is applied when adding b of the Linear
+  //   - If log_prior is not nullptr and the last layer is LogSoftmax,
+  //     log_prior is subtracted in it. Returns true in this case
+  // It should be called before Quantize()
+  bool Fuse(const VectorBase<float> *log_prior);
+
+  // Runs the GEMMs of all layers in context, which should outlive the nnet.
+  // The layers created by Quantize() keep the context
+  void set_gemm_context(GemmContext *context);
+
+  // Fuses each SpliceLayer with the float LinearLayer after it (a NarrowLayer
+  // could be in between) into a TdnnLayer. Fuse() folds no layer across a
+  // TdnnLayer and Quantize() keeps it in float, so it should be called after
+  // them
+  void FuseTdnn();
+
+  // Returns the layers in propagation order, like "Linear+ReLU -> Splice"
+  std::string Plan() const;
+
+  // Outputs one of factor frames (frame 0, factor, 2 * factor, ...) by the
+  // strided last SpliceLayer (or TdnnLayer), whose NarrowLayer is removed.
+  // Returns false if there is no SpliceLayer followed by its NarrowLayer, or
+  // the delay of an LSTMPLayer after it is not a multiple of factor. In batch,
+  // frame 0 is the first output frame of the batch
+  bool SetFrameSubsampling(int factor);
+
+  // Returns true if nnet has recurrent layers, which could only propagate
+  // the frames of a stream in order by PropagateIncremental()
+  bool HasRecurrentLayer() const;
+
   // Returns the left and right context of nnet
   int left_context() const { return left_context_; }
   int right_context() const { return right_context_; }
@@ -241,10 +686,51 @@ class Nnet {
   // Read a layer from `fd` and store into layers_
   Status ReadLayer(util::ReadableFile *fd);
 
+  // Propagates in through the layers with the workspace of inst. If
+  // num_streams is not 0, the rows of in are the frames of num_streams
+  // streams, and the history of layers in streams[i] is used for num_rows[i]
+  // frames of them. num_rows is updated with the output
+  void PropagateLayers(Instance *inst,
+                       int num_streams,
+                       Instance *const *streams,
+                       int *num_rows,
+                       const MatrixBase<float> &in,
+                       Matrix<float> *out) const;
+
+  // Propagates the frames of each stream in in through the layer with
+  // history, whose output is in stream_output first and then appended into
+  // out. Arguments are the same as PropagateLayers()
+  void PropagateStreams(int layer_idx,
+                        int num_streams,
+                        Instance *const *streams,
+                        int *num_rows,
+                        const MatrixBase<float> &in,
+                        Matrix<float> *stream_output,
+                        Matrix<float> *out) const;
+
   int left_context_;
   int right_context_;
 };
 
+// Stores the state of a stream in incremental propagation
+class Nnet::Instance {
+ public:
+  Instance() {}
+
+ private:
+  // History of each layer
+  std::vector<LayerHistory> history;
+
+  // Buffers for the input and output of layers
+  Matrix<float> workspace[2];
+
+  // Output of a layer with history for one of the streams
+  Matrix<float> stream_output;
+
+  friend class Nnet;
+  DISALLOW_COPY_AND_ASSIGN(Instance);
+};
+
 }  // namespace pocketkaldi
 
 #endif
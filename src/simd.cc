@@ -0,0 +1,394 @@
+// Created at 2026-10-18
+
+#include "simd.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PK_SIMD_X86
+#endif  // defined(__x86_64__) || defined(__i386__)
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PK_SIMD_NEON
+#endif  // defined(__aarch64__) && defined(__ARM_NEON)
+
+namespace pocketkaldi {
+namespace simd {
+
+namespace {
+
+// The reference kernels with libm
+namespace scalar {
+
+float Dot(const float *x, const float *y, int n) {
+  float sum = 0.0f;
+  for (int i = 0; i < n; ++i) sum += x[i] * y[i];
+  return sum;
+}
+
+void Axpy(float alpha, const float *x, float *y, int n) {
+  for (int i = 0; i < n; ++i) y[i] += alpha * x[i];
+}
+
+void MulElements(const float *x, float *y, int n) {
+  for (int i = 0; i < n; ++i) y[i] *= x[i];
+}
+
+void Scale(float alpha, float *x, int n) {
+  for (int i = 0; i < n; ++i) x[i] *= alpha;
+}
+
+void AddConst(float alpha, float *x, int n) {
+  for (int i = 0; i < n; ++i) x[i] += alpha;
+}
+
+int Floor(float floor_val, float *x, int n) {
+  int num_floored = 0;
+  for (int i = 0; i < n; ++i) {
+    if (x[i] < floor_val) {
+      x[i] = floor_val;
+      ++num_floored;
+    }
+  }
+  return num_floored;
+}
+
+void Relu(float *x, int n) {
+  for (int i = 0; i < n; ++i) x[i] = std::max(x[i], 0.0f);
+}
+
+void AddRelu(const float *x, float *y, int n) {
+  for (int i = 0; i < n; ++i) y[i] = std::max(y[i] + x[i], 0.0f);
+}
+
+float Max(const float *x, int n) {
+  float max = x[0];
+  for (int i = 1; i < n; ++i) max = std::max(max, x[i]);
+  return max;
+}
+
+float ExpSum(float shift, float *x, int n) {
+  float sum = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    x[i] = expf(x[i] - shift);
+    sum += x[i];
+  }
+  return sum;
+}
+
+float SumExp(float shift, const float *x, int n) {
+  float sum = 0.0f;
+  for (int i = 0; i < n; ++i) sum += expf(x[i] - shift);
+  return sum;
+}
+
+void Log(float *x, int n) {
+  for (int i = 0; i < n; ++i) x[i] = logf(x[i]);
+}
+
+float Sigmoid(float x) {
+  return 1.0f / (1.0f + expf(-x));
+}
+
+void LstmCell(const float *gates,
+              const float *peephole,
+              float *c,
+              float *m,
+              int n) {
+  for (int i = 0; i < n; ++i) {
+    float input_gate = Sigmoid(gates[i] + peephole[i] * c[i]);
+    float forget_gate = Sigmoid(gates[n + i] + peephole[n + i] * c[i]);
+    c[i] = forget_gate * c[i] + input_gate * tanhf(gates[2 * n + i]);
+    float output_gate = Sigmoid(gates[3 * n + i] + peephole[2 * n + i] * c[i]);
+    m[i] = output_gate * tanhf(c[i]);
+  }
+}
+
+const Kernels kKernels = {
+  kScalar,
+  "scalar",
+  Dot,
+  Axpy,
+  MulElements,
+  Scale,
+  AddConst,
+  Floor,
+  Relu,
+  AddRelu,
+  Max,
+  ExpSum,
+  SumExp,
+  Log,
+  LstmCell
+};
+
+}  // namespace scalar
+
+#ifdef __SSE2__
+// SSE2 is the baseline of x86-64, so it needs no target options
+namespace sse2 {
+
+struct Ops {
+  typedef __m128 V;
+  typedef __m128 M;
+  static constexpr int kWidth = 4;
+  static constexpr Isa kIsa = kSse2;
+  static constexpr const char *kName = "sse2";
+
+  static V Load(const float *p) { return _mm_loadu_ps(p); }
+  static void Store(float *p, V v) { _mm_storeu_ps(p, v); }
+  static V Set1(float f) { return _mm_set1_ps(f); }
+  static V Add(V a, V b) { return _mm_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm_mul_ps(a, b); }
+  static V Div(V a, V b) { return _mm_div_ps(a, b); }
+  static V Fma(V a, V b, V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+  static V Max(V a, V b) { return _mm_max_ps(a, b); }
+  static V Min(V a, V b) { return _mm_min_ps(a, b); }
+
+  // Rounds to nearest in the default rounding mode of MXCSR
+  static V Round(V v) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(v)); }
+
+  static V Pow2n(V n) {
+    __m128i e = _mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127));
+    return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+  }
+
+  static void Frexp(V v, V *m, V *e) {
+    __m128i bits = _mm_castps_si128(v);
+    *e = _mm_cvtepi32_ps(_mm_sub_epi32(
+        _mm_srli_epi32(bits, 23),
+        _mm_set1_epi32(126)));
+    *m = _mm_castsi128_ps(_mm_or_si128(
+        _mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+        _mm_set1_epi32(0x3f000000)));
+  }
+
+  static M Less(V a, V b) { return _mm_cmplt_ps(a, b); }
+  static M Equal(V a, V b) { return _mm_cmpeq_ps(a, b); }
+  static V Select(M mask, V a, V b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+  }
+  static int CountTrue(M mask) {
+    return __builtin_popcount(_mm_movemask_ps(mask));
+  }
+};
+
+#include "simd_kernels.h"
+
+}  // namespace sse2
+#endif  // __SSE2__
+
+#ifdef PK_SIMD_X86
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace avx2 {
+
+struct Ops {
+  typedef __m256 V;
+  typedef __m256 M;
+  static constexpr int kWidth = 8;
+  static constexpr Isa kIsa = kAvx2;
+  static constexpr const char *kName = "avx2";
+
+  static V Load(const float *p) { return _mm256_loadu_ps(p); }
+  static void Store(float *p, V v) { _mm256_storeu_ps(p, v); }
+  static V Set1(float f) { return _mm256_set1_ps(f); }
+  static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static V Div(V a, V b) { return _mm256_div_ps(a, b); }
+  static V Fma(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+  static V Max(V a, V b) { return _mm256_max_ps(a, b); }
+  static V Min(V a, V b) { return _mm256_min_ps(a, b); }
+  static V Round(V v) {
+    return _mm256_round_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  }
+
+  static V Pow2n(V n) {
+    __m256i e = _mm256_add_epi32(
+        _mm256_cvtps_epi32(n),
+        _mm256_set1_epi32(127));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+  }
+
+  static void Frexp(V v, V *m, V *e) {
+    __m256i bits = _mm256_castps_si256(v);
+    *e = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+        _mm256_srli_epi32(bits, 23),
+        _mm256_set1_epi32(126)));
+    *m = _mm256_castsi256_ps(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+        _mm256_set1_epi32(0x3f000000)));
+  }
+
+  static M Less(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static M Equal(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+  static V Select(M mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+  static int CountTrue(M mask) {
+    return __builtin_popcount(_mm256_movemask_ps(mask));
+  }
+};
+
+#include "simd_kernels.h"
+
+}  // namespace avx2
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace avx512 {
+
+struct Ops {
+  typedef __m512 V;
+  typedef __mmask16 M;
+  static constexpr int kWidth = 16;
+  static constexpr Isa kIsa = kAvx512;
+  static constexpr const char *kName = "avx512";
+
+  static V Load(const float *p) { return _mm512_loadu_ps(p); }
+  static void Store(float *p, V v) { _mm512_storeu_ps(p, v); }
+  static V Set1(float f) { return _mm512_set1_ps(f); }
+  static V Add(V a, V b) { return _mm512_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm512_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm512_mul_ps(a, b); }
+  static V Div(V a, V b) { return _mm512_div_ps(a, b); }
+  static V Fma(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+  static V Max(V a, V b) { return _mm512_max_ps(a, b); }
+  static V Min(V a, V b) { return _mm512_min_ps(a, b); }
+  static V Round(V v) {
+    return _mm512_roundscale_ps(
+        v,
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  }
+
+  static V Pow2n(V n) {
+    __m512i e = _mm512_add_epi32(
+        _mm512_cvtps_epi32(n),
+        _mm512_set1_epi32(127));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(e, 23));
+  }
+
+  static void Frexp(V v, V *m, V *e) {
+    __m512i bits = _mm512_castps_si512(v);
+    *e = _mm512_cvtepi32_ps(_mm512_sub_epi32(
+        _mm512_srli_epi32(bits, 23),
+        _mm512_set1_epi32(126)));
+    *m = _mm512_castsi512_ps(_mm512_or_si512(
+        _mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)),
+        _mm512_set1_epi32(0x3f000000)));
+  }
+
+  static M Less(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  static M Equal(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+  static V Select(M mask, V a, V b) { return _mm512_mask_blend_ps(mask, b, a); }
+  static int CountTrue(M mask) { return __builtin_popcount(mask); }
+};
+
+#include "simd_kernels.h"
+
+}  // namespace avx512
+#pragma GCC pop_options
+#endif  // PK_SIMD_X86
+
+#ifdef PK_SIMD_NEON
+// NEON is the baseline of aarch64
+namespace neon {
+
+struct Ops {
+  typedef float32x4_t V;
+  typedef uint32x4_t M;
+  static constexpr int kWidth = 4;
+  static constexpr Isa kIsa = kNeon;
+  static constexpr const char *kName = "neon";
+
+  static V Load(const float *p) { return vld1q_f32(p); }
+  static void Store(float *p, V v) { vst1q_f32(p, v); }
+  static V Set1(float f) { return vdupq_n_f32(f); }
+  static V Add(V a, V b) { return vaddq_f32(a, b); }
+  static V Sub(V a, V b) { return vsubq_f32(a, b); }
+  static V Mul(V a, V b) { return vmulq_f32(a, b); }
+  static V Div(V a, V b) { return vdivq_f32(a, b); }
+  static V Fma(V a, V b, V c) { return vfmaq_f32(c, a, b); }
+  static V Max(V a, V b) { return vmaxq_f32(a, b); }
+  static V Min(V a, V b) { return vminq_f32(a, b); }
+  static V Round(V v) { return vrndnq_f32(v); }
+
+  static V Pow2n(V n) {
+    int32x4_t e = vaddq_s32(vcvtnq_s32_f32(n), vdupq_n_s32(127));
+    return vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+  }
+
+  static void Frexp(V v, V *m, V *e) {
+    uint32x4_t bits = vreinterpretq_u32_f32(v);
+    *e = vcvtq_f32_s32(vsubq_s32(
+        vreinterpretq_s32_u32(vshrq_n_u32(bits, 23)),
+        vdupq_n_s32(126)));
+    *m = vreinterpretq_f32_u32(vorrq_u32(
+        vandq_u32(bits, vdupq_n_u32(0x007fffff)),
+        vdupq_n_u32(0x3f000000)));
+  }
+
+  static M Less(V a, V b) { return vcltq_f32(a, b); }
+  static M Equal(V a, V b) { return vceqq_f32(a, b); }
+  static V Select(M mask, V a, V b) { return vbslq_f32(mask, a, b); }
+  static int CountTrue(M mask) { return vaddvq_u32(vshrq_n_u32(mask, 31)); }
+};
+
+#include "simd_kernels.h"
+
+}  // namespace neon
+#endif  // PK_SIMD_NEON
+
+const Kernels *DetectBest() {
+  for (Isa isa : {kAvx512, kAvx2, kSse2, kNeon}) {
+    const Kernels *kernels = Get(isa);
+    if (kernels != nullptr) return kernels;
+  }
+  return &scalar::kKernels;
+}
+
+}  // namespace
+
+const Kernels &Best() {
+  static const Kernels *best = DetectBest();
+  return *best;
+}
+
+const Kernels *Get(Isa isa) {
+#ifdef PK_SIMD_X86
+  // It could be called before the constructors of libgcc
+  __builtin_cpu_init();
+#endif  // PK_SIMD_X86
+
+  switch (isa) {
+    case kScalar:
+      return &scalar::kKernels;
+#ifdef __SSE2__
+    case kSse2:
+      return &sse2::kKernels;
+#endif  // __SSE2__
+#ifdef PK_SIMD_X86
+    case kAvx2:
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return &avx2::kKernels;
+      }
+      return nullptr;
+    case kAvx512:
+      if (__builtin_cpu_supports("avx512f")) return &avx512::kKernels;
+      return nullptr;
+#endif  // PK_SIMD_X86
+#ifdef PK_SIMD_NEON
+    case kNeon:
+      return &neon::kKernels;
+#endif  // PK_SIMD_NEON
+    default:
+      return nullptr;
+  }
+}
+
+}  // namespace simd
+}  // namespace pocketkaldi
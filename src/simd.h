@@ -0,0 +1,88 @@
+// Created at 2026-10-18
+
+#ifndef POCKETKALDI_SIMD_H_
+#define POCKETKALDI_SIMD_H_
+
+namespace pocketkaldi {
+namespace simd {
+
+// Instruction sets of the kernels
+enum Isa {
+  kScalar = 0,
+  kSse2 = 1,
+  kAvx2 = 2,
+  kAvx512 = 3,
+  kNeon = 4
+};
+
+// Element-wise kernels on float arrays of n elements for an instruction set.
+// Except kScalar, exp and log are computed by the polynomial approximations of
+// Cephes, whose relative error is about 1e-7 for normal floats. The arrays
+// need no alignment
+struct Kernels {
+  Isa isa;
+  const char *name;
+
+  // Returns the sum of x[i] * y[i]
+  float (*dot)(const float *x, const float *y, int n);
+
+  // y[i] += alpha * x[i]
+  void (*axpy)(float alpha, const float *x, float *y, int n);
+
+  // y[i] *= x[i]
+  void (*mul)(const float *x, float *y, int n);
+
+  // x[i] *= alpha
+  void (*scale)(float alpha, float *x, int n);
+
+  // x[i] += alpha
+  void (*add)(float alpha, float *x, int n);
+
+  // x[i] = max(x[i], floor_val). Returns the number of x[i] < floor_val
+  int (*floor)(float floor_val, float *x, int n);
+
+  // x[i] = max(x[i], 0)
+  void (*relu)(float *x, int n);
+
+  // y[i] = max(y[i] + x[i], 0)
+  void (*add_relu)(const float *x, float *y, int n);
+
+  // Returns the max of x[i], n should be greater than 0
+  float (*max)(const float *x, int n);
+
+  // x[i] = exp(x[i] - shift), returns the sum of them. The exp of vectorized
+  // kernels is clamped into [exp(-87.3), exp(88)]
+  float (*exp_sum)(float shift, float *x, int n);
+
+  // Returns the sum of exp(x[i] - shift), clamped as exp_sum
+  float (*sum_exp)(float shift, const float *x, int n);
+
+  // x[i] = log(x[i]). log(0) is -inf and log of negative is NaN. Denormals
+  // are treated as FLT_MIN by the vectorized kernels
+  void (*log)(float *x, int n);
+
+  // Updates n LSTM cells with peephole connections:
+  //   i = sigmoid(gates_i + w_ic * c), f = sigmoid(gates_f + w_fc * c)
+  //   c = f * c + i * tanh(gates_g)
+  //   o = sigmoid(gates_o + w_oc * c), m = o * tanh(c)
+  // gates are [gates_i, gates_f, gates_g, gates_o] and peephole is
+  // [w_ic, w_fc, w_oc], n floats each. c is updated in place
+  void (*lstm_cell)(const float *gates,
+                    const float *peephole,
+                    float *c,
+                    float *m,
+                    int n);
+};
+
+// Kernels of the best instruction set supported by CPU (AVX-512, AVX2+FMA,
+// SSE2 on x86, NEON on aarch64). It is detected at the first call
+const Kernels &Best();
+
+// Kernels of isa. Returns nullptr if isa is not built in or not supported by
+// CPU
+const Kernels *Get(Isa isa);
+
+}  // namespace simd
+}  // namespace pocketkaldi
+
+#endif  // POCKETKALDI_SIMD_H_
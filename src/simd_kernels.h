@@ -0,0 +1,283 @@
+// Created at 2026-10-18
+//
+// Kernels of simd::Kernels on top of the vector operations in struct Ops. It
+// is included by simd.cc in the namespace of each instruction set, after Ops
+// is defined, and compiled with the target options of that instruction set.
+// So it has no include guard. Ops has:
+//   V, M: types of the vector of kWidth floats and the mask of comparison
+//   kIsa, kName: the instruction set
+//   Load(p), Store(p, v), Set1(f)
+//   Add(a, b), Sub(a, b), Mul(a, b), Div(a, b), Fma(a, b, c) = a * b + c
+//   Max(a, b), Min(a, b), Round(v) to the nearest integer
+//   Pow2n(n) = 2^n for integer n in [-126, 127]
+//   Frexp(v, &m, &e): v = m * 2^e with m in [0.5, 1) for positive normal v
+//   Less(a, b), Equal(a, b), Select(mask, a, b) = mask ? a : b
+//   CountTrue(mask)
+
+typedef Ops::V V;
+typedef Ops::M M;
+
+float HorizontalAdd(V v) {
+  float buf[Ops::kWidth];
+  Ops::Store(buf, v);
+  float sum = 0.0f;
+  for (int i = 0; i < Ops::kWidth; ++i) sum += buf[i];
+  return sum;
+}
+
+float HorizontalMax(V v) {
+  float buf[Ops::kWidth];
+  Ops::Store(buf, v);
+  float max = buf[0];
+  for (int i = 1; i < Ops::kWidth; ++i) max = std::max(max, buf[i]);
+  return max;
+}
+
+// exp(x) of Cephes expf. x is clamped into [-87.3, 88], so that 2^n is a
+// normal float
+V VecExp(V x) {
+  x = Ops::Min(Ops::Max(x, Ops::Set1(-87.33654f)), Ops::Set1(88.0f));
+
+  // x = n * ln2 + r, |r| <= ln2 / 2. ln2 is split into 2 parts for precision
+  V n = Ops::Round(Ops::Mul(x, Ops::Set1(1.44269504088896341f)));
+  V r = Ops::Fma(n, Ops::Set1(-0.693359375f), x);
+  r = Ops::Fma(n, Ops::Set1(2.12194440e-4f), r);
+
+  V y = Ops::Set1(1.9875691500e-4f);
+  y = Ops::Fma(y, r, Ops::Set1(1.3981999507e-3f));
+  y = Ops::Fma(y, r, Ops::Set1(8.3334519073e-3f));
+  y = Ops::Fma(y, r, Ops::Set1(4.1665795894e-2f));
+  y = Ops::Fma(y, r, Ops::Set1(1.6666665459e-1f));
+  y = Ops::Fma(y, r, Ops::Set1(5.0000001201e-1f));
+  y = Ops::Fma(y, Ops::Mul(r, r), Ops::Add(r, Ops::Set1(1.0f)));
+  return Ops::Mul(y, Ops::Pow2n(n));
+}
+
+// log(x) of Cephes logf
+V VecLog(V x) {
+  M zero = Ops::Equal(x, Ops::Set1(0.0f));
+  M negative = Ops::Less(x, Ops::Set1(0.0f));
+
+  // x = m * 2^e with m in [sqrt(0.5), sqrt(2)), then m -= 1
+  V m, e;
+  Ops::Frexp(Ops::Max(x, Ops::Set1(FLT_MIN)), &m, &e);
+  M small = Ops::Less(m, Ops::Set1(0.707106781186547524f));
+  e = Ops::Sub(e, Ops::Select(small, Ops::Set1(1.0f), Ops::Set1(0.0f)));
+  m = Ops::Add(m, Ops::Select(small, m, Ops::Set1(0.0f)));
+  m = Ops::Sub(m, Ops::Set1(1.0f));
+
+  V z = Ops::Mul(m, m);
+  V y = Ops::Set1(7.0376836292e-2f);
+  y = Ops::Fma(y, m, Ops::Set1(-1.1514610310e-1f));
+  y = Ops::Fma(y, m, Ops::Set1(1.1676998740e-1f));
+  y = Ops::Fma(y, m, Ops::Set1(-1.2420140846e-1f));
+  y = Ops::Fma(y, m, Ops::Set1(1.4249322787e-1f));
+  y = Ops::Fma(y, m, Ops::Set1(-1.6668057665e-1f));
+  y = Ops::Fma(y, m, Ops::Set1(2.0000714765e-1f));
+  y = Ops::Fma(y, m, Ops::Set1(-2.4999993993e-1f));
+  y = Ops::Fma(y, m, Ops::Set1(3.3333331174e-1f));
+  y = Ops::Mul(Ops::Mul(y, m), z);
+  y = Ops::Fma(e, Ops::Set1(-2.12194440e-4f), y);
+  y = Ops::Fma(z, Ops::Set1(-0.5f), y);
+
+  V log_x = Ops::Fma(e, Ops::Set1(0.693359375f), Ops::Add(m, y));
+  log_x = Ops::Select(zero, Ops::Set1(-INFINITY), log_x);
+  return Ops::Select(negative, Ops::Set1(NAN), log_x);
+}
+
+// 1 / (1 + exp(-x)), exp is clamped as VecExp
+V VecSigmoid(V x) {
+  V one = Ops::Set1(1.0f);
+  return Ops::Div(one, Ops::Add(one, VecExp(Ops::Sub(Ops::Set1(0.0f), x))));
+}
+
+// tanh(x) = 2 * sigmoid(2x) - 1, its absolute error is about 1e-7
+V VecTanh(V x) {
+  V sigmoid = VecSigmoid(Ops::Add(x, x));
+  return Ops::Sub(Ops::Add(sigmoid, sigmoid), Ops::Set1(1.0f));
+}
+
+float Dot(const float *x, const float *y, int n) {
+  V sum = Ops::Set1(0.0f);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    sum = Ops::Fma(Ops::Load(x + i), Ops::Load(y + i), sum);
+  }
+  float tail_sum = HorizontalAdd(sum);
+  for (; i < n; ++i) tail_sum += x[i] * y[i];
+  return tail_sum;
+}
+
+void Axpy(float alpha, const float *x, float *y, int n) {
+  V va = Ops::Set1(alpha);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    Ops::Store(y + i, Ops::Fma(va, Ops::Load(x + i), Ops::Load(y + i)));
+  }
+  for (; i < n; ++i) y[i] += alpha * x[i];
+}
+
+void MulElements(const float *x, float *y, int n) {
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    Ops::Store(y + i, Ops::Mul(Ops::Load(x + i), Ops::Load(y + i)));
+  }
+  for (; i < n; ++i) y[i] *= x[i];
+}
+
+void Scale(float alpha, float *x, int n) {
+  V va = Ops::Set1(alpha);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    Ops::Store(x + i, Ops::Mul(va, Ops::Load(x + i)));
+  }
+  for (; i < n; ++i) x[i] *= alpha;
+}
+
+void AddConst(float alpha, float *x, int n) {
+  V va = Ops::Set1(alpha);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    Ops::Store(x + i, Ops::Add(va, Ops::Load(x + i)));
+  }
+  for (; i < n; ++i) x[i] += alpha;
+}
+
+int Floor(float floor_val, float *x, int n) {
+  V vf = Ops::Set1(floor_val);
+  int num_floored = 0;
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    V v = Ops::Load(x + i);
+    num_floored += Ops::CountTrue(Ops::Less(v, vf));
+    Ops::Store(x + i, Ops::Max(v, vf));
+  }
+  for (; i < n; ++i) {
+    if (x[i] < floor_val) {
+      x[i] = floor_val;
+      ++num_floored;
+    }
+  }
+  return num_floored;
+}
+
+void Relu(float *x, int n) {
+  V zero = Ops::Set1(0.0f);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    Ops::Store(x + i, Ops::Max(Ops::Load(x + i), zero));
+  }
+  for (; i < n; ++i) x[i] = std::max(x[i], 0.0f);
+}
+
+void AddRelu(const float *x, float *y, int n) {
+  V zero = Ops::Set1(0.0f);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    V v = Ops::Add(Ops::Load(x + i), Ops::Load(y + i));
+    Ops::Store(y + i, Ops::Max(v, zero));
+  }
+  for (; i < n; ++i) y[i] = std::max(y[i] + x[i], 0.0f);
+}
+
+float Max(const float *x, int n) {
+  float max = x[0];
+  int i = 0;
+  if (n >= Ops::kWidth) {
+    V vmax = Ops::Load(x);
+    for (i = Ops::kWidth; i + Ops::kWidth <= n; i += Ops::kWidth) {
+      vmax = Ops::Max(vmax, Ops::Load(x + i));
+    }
+    max = HorizontalMax(vmax);
+  }
+  for (; i < n; ++i) max = std::max(max, x[i]);
+  return max;
+}
+
+float ExpSum(float shift, float *x, int n) {
+  V vs = Ops::Set1(shift);
+  V sum = Ops::Set1(0.0f);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    V v = VecExp(Ops::Sub(Ops::Load(x + i), vs));
+    Ops::Store(x + i, v);
+    sum = Ops::Add(sum, v);
+  }
+  float tail_sum = HorizontalAdd(sum);
+  for (; i < n; ++i) {
+    x[i] = expf(x[i] - shift);
+    tail_sum += x[i];
+  }
+  return tail_sum;
+}
+
+float SumExp(float shift, const float *x, int n) {
+  V vs = Ops::Set1(shift);
+  V sum = Ops::Set1(0.0f);
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    sum = Ops::Add(sum, VecExp(Ops::Sub(Ops::Load(x + i), vs)));
+  }
+  float tail_sum = HorizontalAdd(sum);
+  for (; i < n; ++i) tail_sum += expf(x[i] - shift);
+  return tail_sum;
+}
+
+void Log(float *x, int n) {
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    Ops::Store(x + i, VecLog(Ops::Load(x + i)));
+  }
+  for (; i < n; ++i) x[i] = logf(x[i]);
+}
+
+void LstmCell(const float *gates,
+              const float *peephole,
+              float *c,
+              float *m,
+              int n) {
+  const float *gates_i = gates, *gates_f = gates + n;
+  const float *gates_g = gates + 2 * n, *gates_o = gates + 3 * n;
+  const float *w_ic = peephole, *w_fc = peephole + n, *w_oc = peephole + 2 * n;
+  int i = 0;
+  for (; i + Ops::kWidth <= n; i += Ops::kWidth) {
+    V c_prev = Ops::Load(c + i);
+    V input_gate = VecSigmoid(
+        Ops::Fma(Ops::Load(w_ic + i), c_prev, Ops::Load(gates_i + i)));
+    V forget_gate = VecSigmoid(
+        Ops::Fma(Ops::Load(w_fc + i), c_prev, Ops::Load(gates_f + i)));
+    V c_next = Ops::Fma(
+        forget_gate,
+        c_prev,
+        Ops::Mul(input_gate, VecTanh(Ops::Load(gates_g + i))));
+    V output_gate = VecSigmoid(
+        Ops::Fma(Ops::Load(w_oc + i), c_next, Ops::Load(gates_o + i)));
+    Ops::Store(c + i, c_next);
+    Ops::Store(m + i, Ops::Mul(output_gate, VecTanh(c_next)));
+  }
+  for (; i < n; ++i) {
+    float input_gate = 1.0f / (1.0f + expf(-gates_i[i] - w_ic[i] * c[i]));
+    float forget_gate = 1.0f / (1.0f + expf(-gates_f[i] - w_fc[i] * c[i]));
+    c[i] = forget_gate * c[i] + input_gate * tanhf(gates_g[i]);
+    float output_gate = 1.0f / (1.0f + expf(-gates_o[i] - w_oc[i] * c[i]));
+    m[i] = output_gate * tanhf(c[i]);
+  }
+}
+
+const Kernels kKernels = {
+  Ops::kIsa,
+  Ops::kName,
+  Dot,
+  Axpy,
+  MulElements,
+  Scale,
+  AddConst,
+  Floor,
+  Relu,
+  AddRelu,
+  Max,
+  ExpSum,
+  SumExp,
+  Log,
+  LstmCell
+};
@@ -16,11 +16,14 @@ SymbolTable::SymbolTable(): bos_id_(0), eos_id_(0) {}
 Status SymbolTable::Read(const std::string &filename) {
   util::ReadableFile fd;
   PK_CHECK_STATUS(fd.Open(filename));
+  return Read(&fd);
+}
 
+Status SymbolTable::Read(util::ReadableFile *fd) {
   Status status = Status::OK();
   std::string line;
   words_.reserve(65536);
-  while (fd.ReadLine(&line, &status) && status.ok()) {
+  while (fd->ReadLine(&line, &status) && status.ok()) {
     std::vector<std::string> fields = util::Split(line, " ");
     if (fields.size() != 2) {
       return Status::Corruption(util::Format(
@@ -21,6 +21,7 @@ class SymbolTable {
   
   // Read synbol table file
   Status Read(const std::string &filename);
+  Status Read(util::ReadableFile *fd);
 
   // Get symbol by id
   const char *Get(int symbol_id) const;
@@ -29,6 +30,9 @@ class SymbolTable {
   // kNotExist
   int GetId(const std::string &word) const;
 
+  // Number of symbols, ids are in [0, num_symbols())
+  int num_symbols() const { return words_.size(); }
+
   // Ids for BOS/EOS tag
   int bos_id() const { return bos_id_; }
   int eos_id() const { return eos_id_; }
@@ -59,6 +59,17 @@ Status StringToLong(const std::string &str, long *val) {
   return Status::OK();
 }
 
+Status StringToFloat(const std::string &str, float *val) {
+  std::string trim_str = Trim(str);
+  char *end = nullptr;
+  *val = strtof(trim_str.c_str(), &end);
+  if (trim_str.empty() || *end != '\0') {
+    return Status::Corruption(Format("unexpected number string: {}", trim_str));
+  }
+
+  return Status::OK();
+}
+
 
 ReadableFile::ReadableFile(): fd_(nullptr), file_size_(0), owned_(true) {
 }
@@ -87,6 +98,24 @@ Status ReadableFile::Open(const std::string &filename) {
   return Status::OK();
 }
 
+Status ReadableFile::OpenMemory(const char *data,
+                                int64_t size,
+                                const std::string &name) {
+  filename_ = name;
+  if (size == 0) {
+    return Status::IOError(util::Format("{} is empty", name));
+  }
+
+  // fmemopen() never writes the buffer in read mode
+  fd_ = fmemopen(const_cast<char *>(data), size, "rb");
+  if (fd_ == NULL) {
+    return Status::IOError(util::Format("Unable to open {}", name));
+  }
+  file_size_ = size;
+
+  return Status::OK();
+}
+
 bool ReadableFile::ReadLine(std::string *line, Status *status) {
   // Failed if it already reached EOF
   if (feof(fd_)) {
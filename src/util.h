@@ -108,6 +108,9 @@ std::string Tolower(const std::string &str);
 // Converts a string to long.
 Status StringToLong(const std::string &str, long *val);
 
+// Converts a string to float.
+Status StringToFloat(const std::string &str, float *val);
+
 // A wrapper of FILE in stdio.h
 class ReadableFile {
  public:
@@ -124,6 +127,10 @@ class ReadableFile {
   // status->ok() == false
   Status Open(const std::string &filename);
 
+  // Open a block of memory (size bytes) as a read-only file. name is used as
+  // the filename in error messages. data should be alive until Close()
+  Status OpenMemory(const char *data, int64_t size, const std::string &name);
+
   // Read n bytes (size) from file and put to *ptr
   Status Read(void *ptr, int size);
 
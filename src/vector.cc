@@ -4,10 +4,117 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include "simd.h"
 #include "util.h"
 
 namespace pocketkaldi {
 
+namespace {
+
+// Element-wise loops on arrays of n elements. The overloads for float use the
+// SIMD kernels of CPU, other types use the scalar loops
+
+template<typename Real, typename OtherReal>
+void Axpy(Real alpha, const OtherReal *x, Real *y, int n) {
+  for (int i = 0; i < n; i++) y[i] += alpha * x[i];
+}
+void Axpy(float alpha, const float *x, float *y, int n) {
+  simd::Best().axpy(alpha, x, y, n);
+}
+
+template<typename Real>
+Real Dot(const Real *x, const Real *y, int n) {
+  Real sum = 0.0;
+  for (int i = 0; i < n; i++) sum += x[i] * y[i];
+  return sum;
+}
+float Dot(const float *x, const float *y, int n) {
+  return simd::Best().dot(x, y, n);
+}
+
+template<typename Real>
+void MulElements(const Real *x, Real *y, int n) {
+  for (int i = 0; i < n; i++) y[i] *= x[i];
+}
+void MulElements(const float *x, float *y, int n) {
+  simd::Best().mul(x, y, n);
+}
+
+template<typename Real>
+void Scale(Real alpha, Real *x, int n) {
+  for (int i = 0; i < n; i++) x[i] *= alpha;
+}
+void Scale(float alpha, float *x, int n) {
+  simd::Best().scale(alpha, x, n);
+}
+
+template<typename Real>
+void AddConst(Real alpha, Real *x, int n) {
+  for (int i = 0; i < n; i++) x[i] += alpha;
+}
+void AddConst(float alpha, float *x, int n) {
+  simd::Best().add(alpha, x, n);
+}
+
+template<typename Real>
+int Floor(Real floor_val, Real *x, int n) {
+  int num_floored = 0;
+  for (int i = 0; i < n; i++) {
+    if (x[i] < floor_val) {
+      x[i] = floor_val;
+      num_floored++;
+    }
+  }
+  return num_floored;
+}
+int Floor(float floor_val, float *x, int n) {
+  return simd::Best().floor(floor_val, x, n);
+}
+
+template<typename Real>
+Real Max(const Real *x, int n) {
+  Real max = x[0];
+  for (int i = 1; i < n; i++) max = std::max(max, x[i]);
+  return max;
+}
+float Max(const float *x, int n) {
+  return simd::Best().max(x, n);
+}
+
+template<typename Real>
+Real ExpSum(Real shift, Real *x, int n) {
+  Real sum = 0;
+  for (int i = 0; i < n; i++) {
+    x[i] = exp(x[i] - shift);
+    sum += x[i];
+  }
+  return sum;
+}
+float ExpSum(float shift, float *x, int n) {
+  return simd::Best().exp_sum(shift, x, n);
+}
+
+template<typename Real>
+Real SumExp(Real shift, const Real *x, int n) {
+  Real sum = 0;
+  for (int i = 0; i < n; i++) sum += exp(x[i] - shift);
+  return sum;
+}
+float SumExp(float shift, const float *x, int n) {
+  return simd::Best().sum_exp(shift, x, n);
+}
+
+template<typename Real>
+void Log(Real *x, int n) {
+  for (int i = 0; i < n; i++) x[i] = log(x[i]);
+}
+void Log(float *x, int n) {
+  simd::Best().log(x, n);
+}
+
+}  // namespace
+
 template<typename Real>
 Vector<Real>::Vector(Vector<Real> &&v) {
   this->dim_ = v.dim_;
@@ -80,45 +187,27 @@ void VectorBase<Real>::CopyFromVec(const VectorBase<Real> &v) {
 
 template<typename Real>
 Real VectorBase<Real>::VecVec(const VectorBase<Real> &r) const {
-  int r_dim = r.Dim();
-  assert(r_dim == Dim());
-  const Real *l_data = Data();
-  const Real *r_data = r.Data();
-  Real sum = 0.0;
-  for (int i = 0; i < r_dim; i++) {
-    sum += l_data[i] * r_data[i];
-  }
-  return sum;
+  assert(r.Dim() == Dim());
+  return Dot(Data(), r.Data(), Dim());
 }
 
 template<typename Real>
 void VectorBase<Real>::ApplySoftMax() {
-  Real sum = 0;
-
-  for (int i = 0; i < Dim(); ++i) {
-    Real exp_d = expf((*this)(i));
-    (*this)(i) = exp_d;
-    sum += exp_d;
-  }
+  if (dim_ == 0) return;
 
-  for (int i = 0; i < Dim(); ++i) {
-    (*this)(i) /= sum;
-  }
+  // The max is subtracted before exp to avoid overflow
+  Real max = Max(data_, dim_);
+  Real sum = ExpSum(max, data_, dim_);
+  Scale(1 / sum);
 }
 
 template<typename Real>
 void VectorBase<Real>::ApplyLogSoftMax() {
-  Real sum = 0;
+  if (dim_ == 0) return;
 
-  for (int i = 0; i < Dim(); ++i) {
-    Real exp_d = exp((*this)(i));
-    sum += exp_d;
-  }
-  Real logsum = log(sum);
-  
-  for (int i = 0; i < Dim(); ++i) {
-    (*this)(i) -= logsum;
-  }
+  Real max = Max(data_, dim_);
+  Real logsum = max + log(SumExp(max, data_, dim_));
+  Add(-logsum);
 }
 
 template<typename Real>
@@ -165,22 +254,15 @@ void Vector<Real>::Resize(const int dim, int resize_type) {
 
 template<typename Real>
 int VectorBase<Real>::ApplyFloor(Real floor_val) {
-  int num_floored = 0;
-  for (int i = 0; i < dim_; i++) {
-    if (data_[i] < floor_val) {
-      data_[i] = floor_val;
-      num_floored++;
-    }
-  }
-  return num_floored;
+  return Floor(floor_val, data_, dim_);
 }
 
 template<typename Real>
 void VectorBase<Real>::ApplyLog() {
   for (int i = 0; i < dim_; i++) {
     assert(data_[i] >= 0.0);
-    data_[i] = log(data_[i]);
   }
+  Log(data_, dim_);
 }
 
 template<typename Real>
@@ -192,17 +274,13 @@ void VectorBase<Real>::ApplyPow(Real power) {
 
 template<typename Real>
 void VectorBase<Real>::Scale(Real alpha) {
-  for (int i = 0; i < dim_; i++) {
-    data_[i] *= alpha;
-  }
+  pocketkaldi::Scale(alpha, data_, dim_);
 }
 
 
 template<typename Real>
 void VectorBase<Real>::Add(Real val) {
-  for (int i = 0; i < dim_; i++) {
-    data_[i] += val;
-  }
+  AddConst(val, data_, dim_);
 }
 
 template<typename Real>
@@ -217,9 +295,7 @@ void VectorBase<Real>::PrintDebug() {
 template<typename Real>
 void VectorBase<Real>::MulElements(const VectorBase<Real> &v) {
   assert(v.Dim() == Dim() && "MulElements: vector size mismatch");
-  for (int i = 0; i < dim_; i++) {
-    data_[i] *= v(i);
-  }
+  pocketkaldi::MulElements(v.Data(), data_, dim_);
 }
 
 template<typename Real>
@@ -242,19 +318,7 @@ void VectorBase<Real>::AddVec(
     const Real alpha,
     const VectorBase<OtherReal> &v) {
   assert(dim_ == v.dim_);
-  // remove __restrict__ if it causes compilation problems.
-  Real *__restrict__ data = data_;
-  OtherReal *__restrict__ other_data = v.data_;
-  int dim = dim_;
-  if (alpha != 1.0) {
-    for (int i = 0; i < dim; i++) {
-      data[i] += alpha * other_data[i];
-    }
-  } else {
-    for (int i = 0; i < dim; i++) {
-      data[i] += other_data[i];
-    }
-  }
+  Axpy(alpha, v.data_, data_, dim_);
 }
 
 template
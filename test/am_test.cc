@@ -0,0 +1,336 @@
+// Created at 2026-10-18
+
+#include "am.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "configuration.h"
+#include "matrix.h"
+#include "nnet.h"
+
+using pocketkaldi::AcousticModel;
+using pocketkaldi::Configuration;
+using pocketkaldi::Layer;
+using pocketkaldi::Matrix;
+using pocketkaldi::Status;
+using pocketkaldi::SubVector;
+
+constexpr int kFeatDim = 2;
+constexpr int kHiddenDim = 128;
+constexpr int kCellDim = 256;
+constexpr int kRecurrentDim = 64;
+constexpr int kProjectionDim = 128;
+constexpr int kNumPdfs = 200;
+
+// Number of memory blocks allocated by operator new and by posix_memalign(),
+// which is used by Matrix and Vector
+std::atomic<int> num_allocs(0);
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  typedef int (*PosixMemalign)(void **, size_t, size_t);
+  static PosixMemalign next_posix_memalign = reinterpret_cast<PosixMemalign>(
+      dlsym(RTLD_NEXT, "posix_memalign"));
+  ++num_allocs;
+  return next_posix_memalign(ptr, alignment, size);
+}
+
+void *operator new(size_t size) {
+  ++num_allocs;
+  void *ptr = malloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+// Writes the model files in the format of convert_am.py
+class ModelWriter {
+ public:
+  explicit ModelWriter(const char *filename) {
+    fd_ = fopen(filename, "wb");
+    assert(fd_ != nullptr);
+  }
+  ~ModelWriter() { fclose(fd_); }
+
+  void WriteTag(const char *tag) { fwrite(tag, 1, 4, fd_); }
+  void WriteInt(int32_t val) { fwrite(&val, sizeof(val), 1, fd_); }
+  void WriteFloat(float val) { fwrite(&val, sizeof(val), 1, fd_); }
+
+  void WriteVector(int dim, float seed, float scale = 0.5f) {
+    WriteTag("VEC0");
+    WriteInt(dim * 4 + 4);
+    WriteInt(dim);
+    for (int i = 0; i < dim; ++i) WriteFloat(scale * sin(seed + i * 1.3f));
+  }
+
+  // The matrix is the transposed weight of a layer with num_rows inputs, its
+  // values are scaled to keep the outputs in range
+  void WriteMatrix(int num_rows, int num_cols, float seed) {
+    WriteTag("MAT0");
+    WriteInt(8);
+    WriteInt(num_rows);
+    WriteInt(num_cols);
+    for (int row = 0; row < num_rows; ++row) {
+      WriteVector(num_cols, seed + row * 0.7f, 1.0f / sqrt(num_rows));
+    }
+  }
+
+  void WriteLayer(int layer_type) {
+    WriteTag(PK_NNET_LAYER_SECTION);
+    WriteInt(layer_type);
+  }
+
+ private:
+  FILE *fd_;
+};
+
+// Writes a TDNN-LSTMP AM with left and right context 1 into am_test.nnet and
+// am_test.tid2pdf, and its config into am_test.conf. The AM is large enough
+// that a thread computing a chunk is still busy when the chunks of other
+// threads are ready
+void WriteModel(int batch_streams, bool int8) {
+  {
+    ModelWriter writer("am_test.nnet");
+    writer.WriteTag(PK_NNET_SECTION);
+    writer.WriteInt(1);
+    writer.WriteInt(1);
+    writer.WriteInt(7);
+
+    writer.WriteLayer(Layer::kSplice);
+    writer.WriteInt(3);
+    for (int index : {-1, 0, 1}) writer.WriteInt(index);
+    writer.WriteLayer(Layer::kNarrow);
+    writer.WriteInt(1);
+    writer.WriteInt(1);
+    writer.WriteLayer(Layer::kLinear);
+    writer.WriteMatrix(3 * kFeatDim, kHiddenDim, 0.1f);
+    writer.WriteVector(kHiddenDim, 0.2f);
+    writer.WriteLayer(Layer::kReLU);
+
+    // LSTMP with delay 2
+    writer.WriteLayer(Layer::kLSTMP);
+    writer.WriteMatrix(kHiddenDim, 4 * kCellDim, 0.3f);
+    writer.WriteMatrix(kRecurrentDim, 4 * kCellDim, 0.4f);
+    writer.WriteVector(4 * kCellDim, 0.5f);
+    writer.WriteMatrix(3, kCellDim, 0.6f);
+    writer.WriteMatrix(kCellDim, kProjectionDim, 0.7f);
+    writer.WriteVector(kProjectionDim, 0.8f);
+    writer.WriteInt(2);
+    writer.WriteFloat(0.75f);
+
+    writer.WriteLayer(Layer::kLinear);
+    writer.WriteMatrix(kProjectionDim, kNumPdfs, 0.9f);
+    writer.WriteVector(kNumPdfs, 1.0f);
+    writer.WriteLayer(Layer::kLogSoftmax);
+  }
+
+  {
+    ModelWriter writer("am_test.tid2pdf");
+    writer.WriteTag("VEC0");
+    writer.WriteInt(kNumPdfs * 4 + 4);
+    writer.WriteInt(kNumPdfs);
+    for (int pdf = 0; pdf < kNumPdfs; ++pdf) writer.WriteInt(pdf);
+  }
+
+  FILE *fd = fopen("am_test.conf", "w");
+  assert(fd != nullptr);
+  fprintf(fd, "nnet=am_test.nnet\n");
+  fprintf(fd, "tid2pdf=am_test.tid2pdf\n");
+  fprintf(fd, "num_pdfs=%d\n", kNumPdfs);
+  fprintf(fd, "left_context=1\n");
+  fprintf(fd, "right_context=1\n");
+  fprintf(fd, "chunk_size=4\n");
+  fprintf(fd, "am_batch_streams=%d\n", batch_streams);
+  fprintf(fd, "nnet_int8=%d\n", int8 ? 1 : 0);
+  fclose(fd);
+}
+
+void RemoveModel() {
+  remove("am_test.nnet");
+  remove("am_test.tid2pdf");
+  remove("am_test.conf");
+}
+
+// Reads the AM written by WriteModel()
+void ReadModel(int batch_streams, AcousticModel *am, bool int8 = false) {
+  WriteModel(batch_streams, int8);
+  Configuration conf;
+  Status status = conf.Read("am_test.conf");
+  assert(status.ok());
+  status = am->Read(conf);
+  assert(status.ok());
+  RemoveModel();
+}
+
+// Feature of frame t in stream
+void GetFrame(int stream, int t, Matrix<float> *frame) {
+  frame->Resize(1, kFeatDim, Matrix<float>::kUndefined);
+  (*frame)(0, 0) = sin(t * 0.3f + stream);
+  (*frame)(0, 1) = cos(t * 0.7f - stream);
+}
+
+// After the stream warms up, AcousticModel::Process() allocates no memory,
+// either with float or 8-bit linear layers
+void TestNoAllocation(bool int8) {
+  AcousticModel am;
+  ReadModel(1, &am, int8);
+  if (int8) {
+    assert(am.NnetPlan() == "Splice -> NarrowLayer -> "
+                            "QuantizedLinear+ReLU -> LSTMP -> "
+                            "QuantizedLinear -> LogSoftmax");
+  } else {
+    assert(am.NnetPlan() == "Tdnn+ReLU -> NarrowLayer -> LSTMP -> Linear -> "
+                            "LogSoftmax");
+  }
+
+  AcousticModel::Instance inst;
+  Matrix<float> frame, log_prob;
+  int num_frames = 0;
+  for (int t = 0; t < 12; ++t) {
+    GetFrame(0, t, &frame);
+    am.Process(&inst, frame.Row(0), &log_prob);
+    num_frames += log_prob.NumRows();
+  }
+  assert(num_frames == 10);
+
+  num_allocs = 0;
+  for (int t = 12; t < 100; ++t) {
+    GetFrame(0, t, &frame);
+    am.Process(&inst, frame.Row(0), &log_prob);
+    num_frames += log_prob.NumRows();
+  }
+  assert(num_allocs == 0);
+  assert(num_frames == 98);
+}
+
+// Lets the threads of streams process their frames in lock step, so that the
+// chunks of streams are ready at the same time
+class FrameBarrier {
+ public:
+  explicit FrameBarrier(int num_threads):
+      num_threads_(num_threads),
+      num_waiting_(0),
+      generation_(0) {}
+
+  // Waits until all the threads not left call Wait()
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    int generation = generation_;
+    ++num_waiting_;
+    if (num_waiting_ == num_threads_) {
+      Release();
+      return;
+    }
+    cond_.wait(lock, [this, generation] { return generation_ != generation; });
+  }
+
+  // The thread is not waited by Wait() any more
+  void Leave() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    --num_threads_;
+    if (num_waiting_ > 0 && num_waiting_ == num_threads_) Release();
+  }
+
+ private:
+  void Release() {
+    num_waiting_ = 0;
+    ++generation_;
+    cond_.notify_all();
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  int num_threads_;
+  int num_waiting_;
+  int generation_;
+};
+
+// Processes the frames of stream in am, and appends the log-likelihoods of all
+// its output frames into log_probs. If barrier is not nullptr, waits for the
+// other streams after each frame
+void ProcessStream(const AcousticModel &am,
+                   int stream,
+                   int num_frames,
+                   FrameBarrier *barrier,
+                   std::vector<float> *log_probs) {
+  AcousticModel::Instance inst;
+  Matrix<float> frame, log_prob;
+  for (int t = 0; t <= num_frames; ++t) {
+    if (t < num_frames) {
+      GetFrame(stream, t, &frame);
+      am.Process(&inst, frame.Row(0), &log_prob);
+    } else {
+      am.EndOfStream(&inst, &log_prob);
+    }
+    for (int r = 0; r < log_prob.NumRows(); ++r) {
+      for (int c = 0; c < log_prob.NumCols(); ++c) {
+        log_probs->push_back(log_prob(r, c));
+      }
+    }
+    if (barrier != nullptr && t < num_frames) barrier->Wait();
+  }
+  if (barrier != nullptr) barrier->Leave();
+}
+
+// Streams in different threads share the AM with am_batch_streams 3, and their
+// chunks are ready at the same time, so they are batched by the Scheduler. The
+// batches depend on the scheduling of threads, so it is repeated in rounds.
+// The streams have different lengths, so that some of them end while the
+// others are still in batches. The output of each stream is the same as
+// processing it alone
+void TestScheduler() {
+  AcousticModel am, batch_am;
+  ReadModel(1, &am);
+  ReadModel(3, &batch_am);
+
+  std::vector<int> lengths = {37, 9, 50, 22, 14, 41, 3};
+  int num_streams = lengths.size();
+  std::vector<std::vector<float>> ref_log_probs(num_streams);
+  for (int i = 0; i < num_streams; ++i) {
+    ProcessStream(am, i, lengths[i], nullptr, &ref_log_probs[i]);
+    assert(ref_log_probs[i].size() == lengths[i] * kNumPdfs);
+  }
+
+  for (int round = 0; round < 20; ++round) {
+    std::vector<std::vector<float>> log_probs(num_streams);
+    FrameBarrier barrier(num_streams);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_streams; ++i) {
+      threads.emplace_back(
+          ProcessStream,
+          std::cref(batch_am),
+          i,
+          lengths[i],
+          &barrier,
+          &log_probs[i]);
+    }
+    for (std::thread &thread : threads) thread.join();
+
+    for (int i = 0; i < num_streams; ++i) {
+      assert(log_probs[i].size() == ref_log_probs[i].size());
+      for (int j = 0; j < log_probs[i].size(); ++j) {
+        assert(fabs(log_probs[i][j] - ref_log_probs[i][j]) < 1e-4);
+      }
+    }
+  }
+}
+
+int main() {
+  TestNoAllocation(false);
+  TestNoAllocation(true);
+  TestScheduler();
+  return 0;
+}
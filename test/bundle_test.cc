@@ -0,0 +1,94 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "bundle.h"
+#include "fst.h"
+#include "symbol_table.h"
+#include "util.h"
+
+using pocketkaldi::Bundle;
+using pocketkaldi::Fst;
+using pocketkaldi::FstArc;
+using pocketkaldi::LmFst;
+using pocketkaldi::Status;
+using pocketkaldi::SymbolTable;
+using pocketkaldi::Vector;
+using pocketkaldi::util::ReadableFile;
+
+void TestBundle() {
+  Status status = Bundle::Write("bundle_test.bundle", {
+      {"large_lm", TESTDIR "data/G.pfst"},
+      {"original_lm", TESTDIR "data/lm.1order.bin"},
+      {"symbol_table", TESTDIR "data/lm.words.txt"}});
+  assert(status.ok());
+
+  Bundle bundle;
+  status = bundle.Open("bundle_test.bundle");
+  assert(status.ok());
+  assert(bundle.Has("large_lm"));
+  assert(bundle.Has("symbol_table"));
+  assert(!bundle.Has("nnet"));
+
+  // Entries are aligned
+  const char *data = nullptr;
+  int64_t size = 0;
+  int64_t offset = 0;
+  assert(bundle.Get("large_lm", &data, &size).ok());
+  assert(bundle.Offset("large_lm", &offset).ok());
+  assert(offset % Bundle::kAlignment == 0);
+  assert(bundle.Get("nnet", &data, &size).ok() == false);
+
+  // Map LM in place and compare with the one read from file
+  LmFst mapped_fst, lm_fst;
+  assert(bundle.Get("large_lm", &data, &size).ok());
+  assert(mapped_fst.Map(data, size).ok());
+  ReadableFile fd;
+  assert(fd.Open(TESTDIR "data/G.pfst").ok());
+  assert(lm_fst.Read(&fd).ok());
+  fd.Close();
+  assert(mapped_fst.StartState() == lm_fst.StartState());
+  for (int state = 0; state < 2254; ++state) {
+    assert(mapped_fst.Final(state) == lm_fst.Final(state));
+    Fst::ArcIterator arc_iter = lm_fst.IterateArcs(state);
+    const FstArc *ref_arc = nullptr;
+    while ((ref_arc = arc_iter.Next()) != nullptr) {
+      if (ref_arc->input_label == 0) continue;
+      FstArc arc;
+      assert(mapped_fst.GetArc(state, ref_arc->input_label, &arc));
+      assert(arc.next_state == ref_arc->next_state);
+      assert(arc.weight == ref_arc->weight);
+    }
+  }
+
+  // Truncated data
+  LmFst truncated_fst;
+  assert(truncated_fst.Map(data, size / 2).ok() == false);
+
+  // Read files in bundle
+  SymbolTable symbol_table;
+  assert(bundle.OpenFile("symbol_table", &fd).ok());
+  assert(symbol_table.Read(&fd).ok());
+  fd.Close();
+  assert(strcmp(symbol_table.Get(symbol_table.GetId("marisa")), "marisa") == 0);
+
+  Vector<float> original_lm, ref_original_lm;
+  assert(bundle.OpenFile("original_lm", &fd).ok());
+  assert(original_lm.Read(&fd).ok());
+  fd.Close();
+  assert(fd.Open(TESTDIR "data/lm.1order.bin").ok());
+  assert(ref_original_lm.Read(&fd).ok());
+  fd.Close();
+  assert(original_lm.Dim() == ref_original_lm.Dim());
+  for (int i = 0; i < original_lm.Dim(); ++i) {
+    assert(original_lm(i) == ref_original_lm(i));
+  }
+
+  remove("bundle_test.bundle");
+}
+
+int main() {
+  TestBundle();
+  return 0;
+}
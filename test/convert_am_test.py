@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+# Created at 2026-10-18
+#
+# Converts a Kaldi nnet3 TDNN-LSTMP model (fast-lstmp-layer in xconfig) by
+# tool/convert_am.py, then reads the layers back and checks them against the
+# components of the model
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+try:
+    import numpy as np
+except ImportError:
+    # Skipped by automake
+    sys.exit(77)
+
+CONVERT_AM = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), '..', 'tool', 'convert_am.py')
+
+SPLICE_LAYER = 6
+NARROW_LAYER = 9
+LINEAR_LAYER = 0
+RELU_LAYER = 1
+LOGSOFTMAX_LAYER = 8
+LSTMP_LAYER = 11
+
+INPUT_DIM = 2
+HIDDEN_DIM = 4
+CELL_DIM = 3
+RECURRENT_DIM = 2
+PROJECTION_DIM = 4
+OUTPUT_DIM = 5
+DELAY = 3
+
+NNET3_DESC = '''<Nnet3>
+input-node name=input dim={input_dim}
+component-node name=tdnn1.affine component=tdnn1.affine input=Append(Offset(input, -1), input)
+component-node name=tdnn1.relu component=tdnn1.relu input=tdnn1.affine
+component-node name=lstm1.W_all component=lstm1.W_all input=Append(tdnn1.relu, IfDefined(Offset(lstm1.r_trunc, -{delay})))
+component-node name=lstm1.lstm_nonlin component=lstm1.lstm_nonlin input=Append(lstm1.W_all, IfDefined(Offset(lstm1.c_trunc, -{delay})))
+dim-range-node name=lstm1.c input-node=lstm1.lstm_nonlin dim-offset=0 dim={cell_dim}
+dim-range-node name=lstm1.m input-node=lstm1.lstm_nonlin dim-offset={cell_dim} dim={cell_dim}
+component-node name=lstm1.W_rp component=lstm1.W_rp input=lstm1.m
+dim-range-node name=lstm1.r input-node=lstm1.W_rp dim-offset=0 dim={recurrent_dim}
+component-node name=lstm1.cr_trunc component=lstm1.cr_trunc input=Append(lstm1.c, lstm1.r)
+dim-range-node name=lstm1.c_trunc input-node=lstm1.cr_trunc dim-offset=0 dim={cell_dim}
+dim-range-node name=lstm1.r_trunc input-node=lstm1.cr_trunc dim-offset={cell_dim} dim={recurrent_dim}
+component-node name=output.affine component=output.affine input=lstm1.W_rp
+component-node name=output.log-softmax component=output.log-softmax input=output.affine
+output-node name=output input=output.log-softmax objective=linear
+
+<NumComponents> 7
+'''
+
+def format_matrix(mat):
+    rows = [' '.join(repr(float(v)) for v in row) for row in mat]
+    return '[\n' + '\n'.join(rows) + ' ]'
+
+def format_vector(vec):
+    return '[ ' + ' '.join(repr(float(v)) for v in vec) + ' ]'
+
+def format_affine(name, W, b):
+    return ('<ComponentName> {} <NaturalGradientAffineComponent> '
+            '<LinearParams> {}\n<BiasParams> {}\n'
+            '</NaturalGradientAffineComponent>\n').format(
+                name, format_matrix(W), format_vector(b))
+
+# Returns the text of model and its parameters. trunc_options are the options
+# of BackpropTruncationComponent after <Dim>
+def build_model(trunc_options):
+    rng = np.random.RandomState(0)
+    params = {
+        'tdnn1.affine': (rng.randn(HIDDEN_DIM, 2 * INPUT_DIM),
+                         rng.randn(HIDDEN_DIM)),
+        'lstm1.W_all': (rng.randn(4 * CELL_DIM, HIDDEN_DIM + RECURRENT_DIM),
+                        rng.randn(4 * CELL_DIM)),
+        'lstm1.peephole': rng.randn(3, CELL_DIM),
+        'lstm1.W_rp': (rng.randn(PROJECTION_DIM, CELL_DIM),
+                       rng.randn(PROJECTION_DIM)),
+        'output.affine': (rng.randn(OUTPUT_DIM, PROJECTION_DIM),
+                          rng.randn(OUTPUT_DIM)),
+    }
+
+    text = NNET3_DESC.format(
+        input_dim=INPUT_DIM,
+        delay=DELAY,
+        cell_dim=CELL_DIM,
+        recurrent_dim=RECURRENT_DIM)
+    text += format_affine('tdnn1.affine', *params['tdnn1.affine'])
+    text += ('<ComponentName> tdnn1.relu <RectifiedLinearComponent> '
+             '<Dim> {} </RectifiedLinearComponent>\n').format(HIDDEN_DIM)
+    text += format_affine('lstm1.W_all', *params['lstm1.W_all'])
+    text += ('<ComponentName> lstm1.lstm_nonlin <LstmNonlinearityComponent> '
+             '<MaxChange> 0.75 <Params> {}\n<ValueAvg> [ ] '
+             '</LstmNonlinearityComponent>\n').format(
+                 format_matrix(params['lstm1.peephole']))
+    text += format_affine('lstm1.W_rp', *params['lstm1.W_rp'])
+    text += ('<ComponentName> lstm1.cr_trunc <BackpropTruncationComponent> '
+             '<Dim> {} {}</BackpropTruncationComponent>\n').format(
+                 CELL_DIM + RECURRENT_DIM, trunc_options)
+    text += format_affine('output.affine', *params['output.affine'])
+    text += ('<ComponentName> output.log-softmax <LogSoftmaxComponent> '
+             '<Dim> {} </LogSoftmaxComponent>\n').format(OUTPUT_DIM)
+    text += '</Nnet3>\n<Priors> {}\n'.format(
+        format_vector(np.full(OUTPUT_DIM, 1.0 / OUTPUT_DIM)))
+    return text, params
+
+# Reads the tokens of the pocketkaldi format written by convert_am.py
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def read(self, fmt):
+        values = struct.unpack_from(fmt, self.data, self.offset)
+        self.offset += struct.calcsize(fmt)
+        return values[0] if len(values) == 1 else values
+
+    def read_tag(self):
+        tag = self.data[self.offset:self.offset + 4]
+        self.offset += 4
+        return tag
+
+    def read_vector(self):
+        assert(self.read_tag() == b'VEC0')
+        size, dim = self.read('<ii')
+        assert(size == dim * 4 + 4)
+        return np.array(self.read('<{}f'.format(dim)), ndmin=1)
+
+    def read_matrix(self):
+        assert(self.read_tag() == b'MAT0')
+        assert(self.read('<i') == 8)
+        num_rows, num_cols = self.read('<ii')
+        rows = [self.read_vector() for _ in range(num_rows)]
+        assert(all(len(row) == num_cols for row in rows))
+        return np.array(rows)
+
+    def read_layer(self):
+        assert(self.read_tag() == b'LAY0')
+        layer_type = self.read('<i')
+        layer = {'type': layer_type}
+        if layer_type == SPLICE_LAYER:
+            num_indices = self.read('<i')
+            layer['indices'] = [self.read('<i') for _ in range(num_indices)]
+        elif layer_type == NARROW_LAYER:
+            layer['narrow'] = self.read('<ii')
+        elif layer_type == LINEAR_LAYER:
+            layer['W'] = self.read_matrix()
+            layer['b'] = self.read_vector()
+        elif layer_type == LSTMP_LAYER:
+            for name in ['W_x', 'W_r', 'b', 'peephole', 'W_p', 'b_p']:
+                if name in {'b', 'b_p'}:
+                    layer[name] = self.read_vector()
+                else:
+                    layer[name] = self.read_matrix()
+            layer['delay'] = self.read('<i')
+            layer['recurrent_scale'] = self.read('<f')
+        else:
+            assert(layer_type in {RELU_LAYER, LOGSOFTMAX_LAYER})
+        return layer
+
+# Converts text by convert_am.py, returns the layers, or None if it failed
+def convert(text, workdir):
+    model_file = os.path.join(workdir, 'final.txt')
+    am_file = os.path.join(workdir, 'am')
+    with open(model_file, 'w') as fd:
+        fd.write(text)
+    result = subprocess.run(
+        [sys.executable, CONVERT_AM, model_file, am_file],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL)
+    if result.returncode != 0:
+        return None
+
+    with open(am_file + '.nnet', 'rb') as fd:
+        reader = Reader(fd.read())
+    assert(reader.read_tag() == b'NN02')
+    left_context, right_context, num_layers = reader.read('<iii')
+    assert((left_context, right_context) == (1, 0))
+    layers = [reader.read_layer() for _ in range(num_layers)]
+    assert(reader.offset == len(reader.data))
+    return layers
+
+def close(a, b):
+    return a.shape == b.shape and np.allclose(a, b, atol=1e-5)
+
+def test_lstmp(workdir, trunc_options, recurrent_scale):
+    text, params = build_model(trunc_options)
+    layers = convert(text, workdir)
+    assert(layers != None)
+    assert([layer['type'] for layer in layers] == [
+        SPLICE_LAYER,
+        NARROW_LAYER,
+        LINEAR_LAYER,
+        RELU_LAYER,
+        LSTMP_LAYER,
+        LINEAR_LAYER,
+        LOGSOFTMAX_LAYER])
+    assert(layers[0]['indices'] == [-1, 0])
+    assert(layers[1]['narrow'] == (1, 0))
+
+    # Parameters of LSTMP are transposed, and W_all is split into the parts
+    # of input and r
+    lstmp = layers[4]
+    W_all, b_all = params['lstm1.W_all']
+    W_rp, b_rp = params['lstm1.W_rp']
+    assert(close(lstmp['W_x'], W_all[:, :HIDDEN_DIM].T))
+    assert(close(lstmp['W_r'], W_all[:, HIDDEN_DIM:].T))
+    assert(close(lstmp['b'], b_all))
+    assert(close(lstmp['peephole'], params['lstm1.peephole']))
+    assert(close(lstmp['W_p'], W_rp.T))
+    assert(close(lstmp['b_p'], b_rp))
+    assert(lstmp['delay'] == DELAY)
+    assert(abs(lstmp['recurrent_scale'] - recurrent_scale) < 1e-6)
+
+    W_out, b_out = params['output.affine']
+    assert(close(layers[5]['W'], W_out.T))
+    assert(close(layers[5]['b'], b_out))
+
+def main():
+    with tempfile.TemporaryDirectory() as workdir:
+        # Models before decay-time have no Scale
+        test_lstmp(workdir, '', 1.0)
+
+        # Scale of decay-time is kept in LSTMP
+        test_lstmp(
+            workdir,
+            '<Scale> 0.75 <ClippingThreshold> 30 <ZeroingThreshold> 15 '
+            '<ZeroingInterval> 20 <RecurrenceInterval> 3 ',
+            0.75)
+
+        # Scale larger than 1 is rejected
+        text, _ = build_model('<Scale> 1.5 ')
+        assert(convert(text, workdir) == None)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,126 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "fst.h"
+#include "util.h"
+#undef DISALLOW_COPY_AND_ASSIGN
+#include "fst/fstlib.h"
+
+using pocketkaldi::Fst;
+using pocketkaldi::FstArc;
+using pocketkaldi::Status;
+using pocketkaldi::util::ReadableFile;
+
+// Builds an fst with unsorted arcs, duplicated input labels, a state without
+// arcs and a start state other than 0
+fst::StdVectorFst BuildFst() {
+  fst::StdVectorFst graph;
+  for (int i = 0; i < 6; ++i) graph.AddState();
+  graph.SetStart(2);
+  graph.SetFinal(4, 0.5f);
+  graph.SetFinal(5, 1.25f);
+
+  graph.AddArc(2, fst::StdArc(7, 70, 0.1f, 0));
+  graph.AddArc(2, fst::StdArc(3, 30, 0.2f, 1));
+  graph.AddArc(2, fst::StdArc(0, 0, 0.3f, 3));
+  graph.AddArc(2, fst::StdArc(3, 31, 0.4f, 4));
+  graph.AddArc(0, fst::StdArc(5, 50, 1.0f, 4));
+  graph.AddArc(1, fst::StdArc(2, 20, 2.0f, 5));
+  graph.AddArc(1, fst::StdArc(1, 10, 3.0f, 4));
+  graph.AddArc(4, fst::StdArc(9, 90, -0.5f, 2));
+
+  // A state with many arcs in reverse order
+  for (int label = 40; label > 10; --label) {
+    graph.AddArc(3, fst::StdArc(label, label + 1, label * 0.01f, 5));
+  }
+  return graph;
+}
+
+// Converts graph by convert_fstfmt and reads it into pk_fst
+void Convert(const fst::StdVectorFst &graph, Fst *pk_fst) {
+  assert(graph.Write("convert_fstfmt_test.fst"));
+  std::string command = CONVERT_FSTFMT " convert_fstfmt_test.fst "
+                        "convert_fstfmt_test.pfst > /dev/null";
+  assert(system(command.c_str()) == 0);
+
+  ReadableFile fd;
+  Status status = fd.Open("convert_fstfmt_test.pfst");
+  assert(status.ok());
+  status = pk_fst->Read(&fd);
+  assert(status.ok());
+
+  remove("convert_fstfmt_test.fst");
+  remove("convert_fstfmt_test.pfst");
+}
+
+// The converted fst has the same states, final weights and arcs, and the arcs
+// of each state are sorted by input label
+void TestRoundTrip() {
+  fst::StdVectorFst graph = BuildFst();
+  Fst pk_fst;
+  Convert(graph, &pk_fst);
+
+  int num_states = graph.NumStates();
+  assert(pk_fst.StartState() == graph.Start());
+  assert(pk_fst.final_region().size == num_states * sizeof(float));
+  assert(pk_fst.arcs_region().size == fst::CountArcs(graph) * sizeof(FstArc));
+
+  for (int state = 0; state < num_states; ++state) {
+    assert(pk_fst.Final(state) == graph.Final(state).Value());
+
+    std::vector<fst::StdArc> arcs;
+    for (fst::ArcIterator<fst::StdVectorFst> arc_iter(graph, state);
+         !arc_iter.Done();
+         arc_iter.Next()) {
+      arcs.push_back(arc_iter.Value());
+    }
+    std::stable_sort(
+        arcs.begin(),
+        arcs.end(),
+        [] (const fst::StdArc &l, const fst::StdArc &r) {
+          return l.ilabel < r.ilabel;
+        });
+
+    Fst::ArcIterator arc_iter = pk_fst.IterateArcs(state);
+    for (const fst::StdArc &arc : arcs) {
+      const FstArc *pk_arc = arc_iter.Next();
+      assert(pk_arc != nullptr);
+      assert(pk_arc->next_state == arc.nextstate);
+      assert(pk_arc->input_label == arc.ilabel);
+      assert(pk_arc->output_label == arc.olabel);
+      assert(pk_arc->weight == arc.weight.Value());
+
+      // GetArc() finds the first arc of each input label
+      FstArc found_arc;
+      assert(pk_fst.GetArc(state, arc.ilabel, &found_arc));
+      assert(found_arc.input_label == arc.ilabel);
+    }
+    assert(arc_iter.Next() == nullptr);
+  }
+
+  // Labels not in state
+  FstArc arc;
+  assert(!pk_fst.GetArc(2, 4, &arc));
+  assert(!pk_fst.GetArc(5, 1, &arc));
+}
+
+// The converter fails without writing output for a missing input
+void TestMissingInput() {
+  std::string command = CONVERT_FSTFMT " convert_fstfmt_test.missing "
+                        "convert_fstfmt_test.pfst > /dev/null";
+  assert(system(command.c_str()) != 0);
+
+  ReadableFile fd;
+  assert(!fd.Open("convert_fstfmt_test.pfst").ok());
+}
+
+int main() {
+  TestRoundTrip();
+  TestMissingInput();
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <stdio.h>
+#include <memory>
+#include <vector>
+#include "decoder.h"
+#include "hclg_fst.h"
+#include "vector.h"
+
+using pocketkaldi::Decoder;
+using pocketkaldi::HclLookAheadFst;
+using pocketkaldi::Vector;
+
+constexpr int kNumPdfs = 6;
+constexpr int kYes = 1;
+constexpr int kNo = 2;
+
+// HCL of words "yes" (transition-ids 1 and 2) and "no" (transition-id 3), with
+// self-loops on each HMM state and optional silence (transition-id 5) between
+// words
+fst::StdVectorFst BuildHcl() {
+  fst::StdVectorFst hcl;
+  for (int i = 0; i < 5; ++i) hcl.AddState();
+  hcl.SetStart(0);
+  hcl.SetFinal(0, fst::TropicalWeight::One());
+  hcl.AddArc(0, fst::StdArc(1, kYes, 0.0f, 1));
+  hcl.AddArc(1, fst::StdArc(1, 0, 0.0f, 1));
+  hcl.AddArc(1, fst::StdArc(2, 0, 0.0f, 2));
+  hcl.AddArc(2, fst::StdArc(2, 0, 0.0f, 2));
+  hcl.AddArc(2, fst::StdArc(0, 0, 0.0f, 0));
+  hcl.AddArc(0, fst::StdArc(3, kNo, 0.0f, 3));
+  hcl.AddArc(3, fst::StdArc(3, 0, 0.0f, 3));
+  hcl.AddArc(3, fst::StdArc(0, 0, 0.0f, 0));
+  hcl.AddArc(0, fst::StdArc(5, 0, 0.0f, 4));
+  hcl.AddArc(4, fst::StdArc(5, 0, 0.0f, 4));
+  hcl.AddArc(4, fst::StdArc(0, 0, 0.0f, 0));
+  return hcl;
+}
+
+void TestAlignment() {
+  HclLookAheadFst hcl(BuildHcl());
+
+  // Transcript "no yes"
+  fst::StdVectorFst g;
+  for (int i = 0; i < 3; ++i) g.AddState();
+  g.SetStart(0);
+  g.AddArc(0, fst::StdArc(kNo, kNo, 0.0f, 1));
+  g.AddArc(1, fst::StdArc(kYes, kYes, 0.0f, 2));
+  g.SetFinal(2, fst::TropicalWeight::One());
+  std::unique_ptr<fst::ComposeFst<fst::StdArc>> graph(
+      pocketkaldi::ComposeHclG(hcl, &g, 1024 * 1024, false));
+
+  Vector<int32_t> transition_pdf_id_map(kNumPdfs);
+  for (int i = 0; i < kNumPdfs; ++i) transition_pdf_id_map(i) = i;
+  Decoder decoder(graph.get(), transition_pdf_id_map, 1.0f);
+  decoder.set_alignment(true);
+  decoder.set_beam(10.0f);
+  decoder.Initialize();
+
+  // The frames are "no" with silence and "yes", and the pdf of "yes" is the
+  // best in frames 0, since it is not in transcript, "no" should still be
+  // aligned at frame 0
+  std::vector<std::vector<int>> best_pdfs = {
+      {1, 3}, {3}, {5}, {5}, {1}, {1}, {2}, {2}, {5}};
+  Vector<float> frame_logp(kNumPdfs);
+  for (const std::vector<int> &pdfs : best_pdfs) {
+    frame_logp.Set(-10.0f);
+    for (int pdf : pdfs) frame_logp(pdf) = pdf == 1 ? 0.0f : -1.0f;
+    assert(decoder.Process(frame_logp));
+  }
+  decoder.EndOfStream();
+
+  std::vector<int> transition_ids;
+  std::vector<Decoder::WordAlignment> words;
+  assert(decoder.BestAlignment(&transition_ids, &words));
+  assert(transition_ids == std::vector<int>({3, 3, 5, 5, 1, 1, 2, 2, 5}));
+  assert(words.size() == 2);
+  assert(words[0].word == kNo);
+  assert(words[0].begin_frame == 0 && words[0].num_frames == 4);
+  assert(words[1].word == kYes);
+  assert(words[1].begin_frame == 4 && words[1].num_frames == 5);
+
+  // BestAlignment() is only available in alignment mode
+  Decoder decoder_without_ali(graph.get(), transition_pdf_id_map, 1.0f);
+  decoder_without_ali.Initialize();
+  decoder_without_ali.EndOfStream();
+  assert(!decoder_without_ali.BestAlignment(&transition_ids, &words));
+}
+
+int main() {
+  TestAlignment();
+  return 0;
+}
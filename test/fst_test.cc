@@ -3,8 +3,11 @@
 #include <assert.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <chrono>
 #include <limits>
 #include <functional>
+#include <thread>
 #include "fst.h"
 #include "util.h"
 #include "symbol_table.h"
@@ -14,7 +17,9 @@ using pocketkaldi::SymbolTable;
 using pocketkaldi::Fst;
 using pocketkaldi::FstArc;
 using pocketkaldi::LmFst;
+using pocketkaldi::LmCache;
 using pocketkaldi::DeltaLmFst;
+using pocketkaldi::ClassWordMap;
 using pocketkaldi::Vector;
 using pocketkaldi::util::ReadableFile;
 using pocketkaldi::util::Split;
@@ -175,6 +180,107 @@ void TestLmFst() {
   assert(check_query(-6.2797366, "marisa"));
 }
 
+void TestLmFstDirectIndex() {
+  LmFst lm_fst;
+  ReadableFile fd_fst;
+  Status status = fd_fst.Open(TESTDIR "data/G.pfst");
+  assert(status.ok());
+  status = lm_fst.Read(&fd_fst);
+  assert(status.ok());
+
+  SymbolTable symbol_table;
+  status = symbol_table.Read(TESTDIR "data/lm.words.txt");
+  assert(status.ok());
+
+  // Reference arcs from binary search
+  LmFst ref_fst;
+  status = fd_fst.Open(TESTDIR "data/G.pfst");
+  assert(status.ok());
+  status = ref_fst.Read(&fd_fst);
+  assert(status.ok());
+
+  // Budget only fits part of the states, then all states
+  for (int64_t budget : {64 * 1024, 64 * 1024 * 1024}) {
+    lm_fst.InitDirectIndex(100000, budget);
+    assert(lm_fst.HasDirectIndex(0));
+    assert(lm_fst.direct_index_bytes() <= budget);
+    printf("direct-index: %d states, %d bytes\n",
+           lm_fst.num_direct_index_states(),
+           static_cast<int>(lm_fst.direct_index_bytes()));
+
+    // Every arc should be found in the same way as binary search
+    for (int state = 0; state < 2254; ++state) {
+      Fst::ArcIterator arc_iter = ref_fst.IterateArcs(state);
+      const FstArc *ref_arc = nullptr;
+      while ((ref_arc = arc_iter.Next()) != nullptr) {
+        if (ref_arc->input_label == 0) continue;
+        FstArc arc;
+        assert(lm_fst.GetArc(state, ref_arc->input_label, &arc));
+        assert(arc.next_state == ref_arc->next_state);
+        assert(arc.weight == ref_arc->weight);
+      }
+    }
+
+    std::function<bool(float, const std::string&)>
+    check_query = [&] (float score, const std::string &query) {
+      return fabs(score - LmScore(lm_fst, symbol_table, query)) < 1e-5;
+    };
+    assert(check_query(-38.767048, "marisa runs the kirisame magic shop"));
+    assert(check_query(-62.663559, "reimu and marisa are playable characters in the games of touhou"));
+  }
+}
+
+void TestLmFstFilter() {
+  LmFst lm_fst;
+  ReadableFile fd_fst;
+  Status status = fd_fst.Open(TESTDIR "data/G.pfst");
+  assert(status.ok());
+  status = lm_fst.Read(&fd_fst);
+  assert(status.ok());
+
+  SymbolTable symbol_table;
+  status = symbol_table.Read(TESTDIR "data/lm.words.txt");
+  assert(status.ok());
+
+  // Without direct-index tables, all lookups go through the filter
+  lm_fst.InitDirectIndex(0, 0);
+  lm_fst.InitFilter(10, 64 * 1024 * 1024);
+  assert(lm_fst.filter_bytes() > 0);
+  printf("filter: %d bytes, false positive rate %f\n",
+         static_cast<int>(lm_fst.filter_bytes()),
+         lm_fst.filter_false_positive_rate());
+  assert(lm_fst.filter_false_positive_rate() < 0.05);
+
+  // No false negatives
+  for (int state = 0; state < 2254; ++state) {
+    Fst::ArcIterator arc_iter = lm_fst.IterateArcs(state);
+    const FstArc *ref_arc = nullptr;
+    while ((ref_arc = arc_iter.Next()) != nullptr) {
+      if (ref_arc->input_label == 0) continue;
+      FstArc arc;
+      assert(lm_fst.GetArc(state, ref_arc->input_label, &arc));
+      assert(arc.next_state == ref_arc->next_state);
+      assert(arc.weight == ref_arc->weight);
+    }
+  }
+
+  std::function<bool(float, const std::string&)>
+  check_query = [&] (float score, const std::string &query) {
+    return fabs(score - LmScore(lm_fst, symbol_table, query)) < 1e-5;
+  };
+  assert(check_query(-38.767048, "marisa runs the kirisame magic shop"));
+  assert(check_query(-62.663559, "reimu and marisa are playable characters in the games of touhou"));
+
+  // A tiny budget still works, only with higher false positive rate
+  lm_fst.InitFilter(10, 4096);
+  assert(lm_fst.filter_bytes() <= 4096);
+  assert(check_query(-38.767048, "marisa runs the kirisame magic shop"));
+
+  // Disabled
+  lm_fst.InitFilter(0, 4096);
+  assert(lm_fst.filter_bytes() == 0);
+}
+
 void TestDeltaLmFst() {
   ReadableFile fd_small_lm;
   Status status = fd_small_lm.Open(TESTDIR "data/lm.1order.bin");
@@ -207,12 +313,322 @@ void TestDeltaLmFst() {
   assert(check_query(-1.433023, "reimu and marisa are friends"));
   assert(check_query(-0.688201, "reimu and marisa are playable characters in the games of touhou"));
   assert(check_query(-0.510554, "marisa"));
+
+  // Interpolation of the same LM should get the same scores
+  DeltaLmFst interpolated_fst(
+      &small_lm,
+      std::vector<const LmFst *>{&lm_fst, &lm_fst},
+      std::vector<float>{0.3f, 0.7f},
+      &symbol_table);
+  assert(interpolated_fst.num_lms() == 2);
+  assert(!interpolated_fst.HasDirectIndex(interpolated_fst.StartState()));
+  check_query = [&] (float score, const std::string &query) {
+    float delta_score = DeltaLmScore(interpolated_fst, symbol_table, query);
+    return fabs(score - delta_score) < 1e-4;
+  };
+  assert(check_query(0.886695, "marisa runs the kirisame magic shop"));
+  assert(check_query(-1.433023, "reimu and marisa are friends"));
+  assert(check_query(-0.510554, "marisa"));
+  assert(interpolated_fst.num_tuple_states() > 1);
 }
 
-int main() {
+void TestLmCache() {
+  ReadableFile fd_small_lm;
+  Status status = fd_small_lm.Open(TESTDIR "data/lm.1order.bin");
+  assert(status.ok());
+  Vector<float> small_lm;
+  status = small_lm.Read(&fd_small_lm);
+  assert(status.ok());
+
+  ReadableFile fd_fst;
+  LmFst lm_fst;
+  status = fd_fst.Open(TESTDIR "data/G.pfst");
+  assert(status.ok());
+  status = lm_fst.Read(&fd_fst);
+  assert(status.ok());
+
+  SymbolTable symbol_table;
+  status = symbol_table.Read(TESTDIR "data/lm.words.txt");
+  assert(status.ok());
+
+  // A small table, so that entries are replaced. Queries of all words from
+  // each state are run by threads twice, the results should be the same as
+  // LmFst. Each thread counts its own hits and misses
+  LmCache cache(&lm_fst, 64 * 1024);
+  assert(cache.bytes() <= 64 * 1024);
+  std::vector<LmCache::Stats> thread_stats(4);
+  std::function<void(int, int, LmCache::Stats *)> check_states = [&] (
+      int begin,
+      int end,
+      LmCache::Stats *stats) {
+    for (int state = begin; state < end; ++state) {
+      for (int ilabel = 1; ilabel < 1800; ilabel += 7) {
+        FstArc arc, cached_arc;
+        bool found = lm_fst.GetArc(state, ilabel, &arc);
+        for (int i = 0; i < 2; ++i) {
+          assert(cache.GetArc(state, ilabel, &cached_arc, stats) == found);
+          if (!found) continue;
+          assert(cached_arc.next_state == arc.next_state);
+          assert(cached_arc.weight == arc.weight);
+        }
+      }
+      assert(cache.Final(state, stats) == lm_fst.Final(state));
+      assert(cache.Final(state, stats) == lm_fst.Final(state));
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back(
+        check_states,
+        i * 500,
+        (i + 1) * 500,
+        &thread_stats[i]);
+  }
+  for (std::thread &thread : threads) thread.join();
+  int64_t hits = 0, misses = 0;
+  for (const LmCache::Stats &stats : thread_stats) {
+    hits += stats.hits;
+    misses += stats.misses;
+  }
+  assert(hits > 0 && misses > 0);
+
+  // DeltaLmFst with memo gets the same scores, the second utterance hits the
+  // entries stored by the first one
+  LmCache delta_cache(&lm_fst, 16 * 1024 * 1024);
+  for (int i = 0; i < 2; ++i) {
+    DeltaLmFst delta_lm_fst(&small_lm, &lm_fst, &symbol_table);
+    delta_lm_fst.set_lm_caches({&delta_cache});
+    float delta_score = DeltaLmScore(
+        delta_lm_fst,
+        symbol_table,
+        "marisa runs the kirisame magic shop");
+    assert(fabs(0.886695 - delta_score) < 1e-5);
+    assert(delta_lm_fst.lm_cache_stats().hits +
+           delta_lm_fst.lm_cache_stats().misses > 0);
+    if (i == 1) assert(delta_lm_fst.lm_cache_stats().hits > 0);
+  }
+}
+
+void TestClassWordMap() {
+  ReadableFile fd_small_lm;
+  Status status = fd_small_lm.Open(TESTDIR "data/lm.1order.bin");
+  assert(status.ok());
+  Vector<float> small_lm;
+  status = small_lm.Read(&fd_small_lm);
+  assert(status.ok());
+
+  ReadableFile fd_fst;
+  LmFst lm_fst;
+  status = fd_fst.Open(TESTDIR "data/G.pfst");
+  assert(status.ok());
+  status = lm_fst.Read(&fd_fst);
+  assert(status.ok());
+
+  SymbolTable symbol_table;
+  status = symbol_table.Read(TESTDIR "data/lm.words.txt");
+  assert(status.ok());
+
+  // Use "marisa" as the class nonterminal, and "reimu", "touhou" as words in
+  // class
+  int class_label = symbol_table.GetId("marisa");
+  int reimu = symbol_table.GetId("reimu");
+  int touhou = symbol_table.GetId("touhou");
+  ClassWordMap class_words;
+  assert(class_words.Add(class_label, reimu, 1.0f).ok());
+  assert(class_words.Add(class_label, touhou, 3.0f).ok());
+  assert(class_words.Add(class_label + 1, reimu, 1.0f).ok() == false);
+  assert(class_words.Add(class_label, touhou, 0.0f).ok() == false);
+  assert(class_words.num_words() == 2);
+  class_words.Seal();
+
+  int lookup_class = 0;
+  float cost = 0.0f;
+  assert(class_words.Lookup(reimu, &lookup_class, &cost));
+  assert(lookup_class == class_label && fabs(cost + log(0.25)) < 1e-5);
+  assert(class_words.Lookup(touhou, &lookup_class, &cost));
+  assert(fabs(cost + log(0.75)) < 1e-5);
+  assert(!class_words.Lookup(class_label, &lookup_class, &cost));
+
+  // Words added after Seal() are normalized by the next Seal()
+  ClassWordMap more_words;
+  assert(more_words.Add(class_label, reimu, 1.0f).ok());
+  more_words.Seal();
+  assert(more_words.Add(class_label, touhou, 1.0f).ok());
+  assert(more_words.Add(class_label, reimu, 2.0f).ok());
+  more_words.Seal();
+  assert(more_words.Lookup(reimu, &lookup_class, &cost));
+  assert(fabs(cost + log(0.75)) < 1e-5);
+  assert(more_words.Lookup(touhou, &lookup_class, &cost));
+  assert(fabs(cost + log(0.25)) < 1e-5);
+
+  DeltaLmFst delta_lm_fst(&small_lm, &lm_fst, &symbol_table);
+  delta_lm_fst.set_class_words(&class_words);
+  int state = delta_lm_fst.StartState();
+  FstArc class_arc, arc;
+  assert(lm_fst.GetArc(state, class_label, &class_arc));
+  assert(delta_lm_fst.GetArc(state, reimu, &arc));
+  assert(arc.next_state == class_arc.next_state);
+  assert(arc.input_label == reimu);
+  assert(fabs(arc.weight - (class_arc.weight - log(0.25) - small_lm(reimu)))
+         < 1e-5);
+
+  // Other words are not changed
+  int shop = symbol_table.GetId("shop");
+  assert(lm_fst.GetArc(state, shop, &class_arc));
+  assert(delta_lm_fst.GetArc(state, shop, &arc));
+  assert(fabs(arc.weight - (class_arc.weight - small_lm(shop))) < 1e-5);
+}
+
+// Builds pk::fst_0 data in memory. states[s] are the arcs of state s sorted by
+// ilabel
+std::vector<char> BuildFstData(const std::vector<std::vector<FstArc>> &states) {
+  int num_arcs = 0;
+  for (const std::vector<FstArc> &arcs : states) num_arcs += arcs.size();
+
+  std::vector<char> data(32);
+  strncpy(data.data(), Fst::kSectionName, 31);
+  auto append = [&data] (const void *ptr, int size) {
+    const char *bytes = reinterpret_cast<const char *>(ptr);
+    data.insert(data.end(), bytes, bytes + size);
+  };
+  int32_t header[] = {
+      static_cast<int32_t>(Fst::SectionSize(states.size(), num_arcs)),
+      static_cast<int32_t>(states.size()),
+      num_arcs,
+      0};
+  append(header, sizeof(header));
+  for (int state = 0; state < states.size(); ++state) {
+    float final = INFINITY;
+    append(&final, sizeof(float));
+  }
+  int32_t arc_idx = 0;
+  for (const std::vector<FstArc> &arcs : states) {
+    int32_t state_idx = arcs.empty() ? -1 : arc_idx;
+    append(&state_idx, sizeof(int32_t));
+    arc_idx += arcs.size();
+  }
+  for (const std::vector<FstArc> &arcs : states) {
+    append(arcs.data(), arcs.size() * sizeof(FstArc));
+  }
+  return data;
+}
+
+// Arcs with fanout random labels in [1, fanout * 4]
+std::vector<FstArc> RandomArcs(int fanout, int max_label) {
+  std::vector<FstArc> arcs;
+  int label = 0;
+  for (int i = 0; i < fanout; ++i) {
+    label += 1 + rand() % (max_label / fanout);
+    arcs.emplace_back(i, label, label, 0.5f * i);
+  }
+  return arcs;
+}
+
+void TestFstLabelIndex() {
+  srand(22);
+  std::vector<int> fanouts = {0, 1, 3, 4, 5, 15, 16, 17, 33, 100, 1000, 0};
+  std::vector<std::vector<FstArc>> states;
+  for (int fanout : fanouts) states.emplace_back(RandomArcs(fanout, fanout * 4));
+  std::vector<char> data = BuildFstData(states);
+
+  Fst ref_fst, fst;
+  assert(ref_fst.Map(data.data(), data.size()).ok());
+  assert(fst.Map(data.data(), data.size()).ok());
+  fst.InitLabelIndex(Fst::kDefaultLinearScanMax);
+  assert(fst.label_index_bytes() > 0);
+
+  for (int state = 0; state < states.size(); ++state) {
+    int max_label = states[state].empty() ? 0 : states[state].back().input_label;
+    for (int ilabel = 0; ilabel <= max_label + 2; ++ilabel) {
+      FstArc ref_arc, arc;
+      bool found = ref_fst.GetArc(state, ilabel, &ref_arc);
+      assert(fst.GetArc(state, ilabel, &arc) == found);
+      if (found) {
+        assert(arc.next_state == ref_arc.next_state);
+        assert(arc.input_label == ilabel);
+        assert(arc.weight == ref_arc.weight);
+      }
+    }
+  }
+
+  // LM with label index
+  LmFst lm_fst;
+  ReadableFile fd_fst;
+  Status status = fd_fst.Open(TESTDIR "data/G.pfst");
+  assert(status.ok());
+  status = lm_fst.Read(&fd_fst);
+  assert(status.ok());
+  lm_fst.InitDirectIndex(0, 0);
+  lm_fst.InitLabelIndex(Fst::kDefaultLinearScanMax);
+
+  SymbolTable symbol_table;
+  status = symbol_table.Read(TESTDIR "data/lm.words.txt");
+  assert(status.ok());
+  std::function<bool(float, const std::string&)>
+  check_query = [&] (float score, const std::string &query) {
+    return fabs(score - LmScore(lm_fst, symbol_table, query)) < 1e-5;
+  };
+  assert(check_query(-38.767048, "marisa runs the kirisame magic shop"));
+  assert(check_query(-62.663559, "reimu and marisa are playable characters in the games of touhou"));
+}
+
+// Compares binary search and label index across fanout sizes
+void BenchmarkFstLabelIndex() {
+  constexpr int kTotalArcs = 4 * 1024 * 1024;
+  constexpr int kNumQueries = 4 * 1024 * 1024;
+  srand(22);
+  for (int fanout : {2, 4, 8, 16, 32, 64, 128, 256, 1024, 4096, 16384}) {
+    std::vector<std::vector<FstArc>> states;
+    for (int i = 0; i < kTotalArcs / fanout; ++i) {
+      states.emplace_back(RandomArcs(fanout, fanout * 4));
+    }
+    std::vector<char> data = BuildFstData(states);
+    Fst fst;
+    assert(fst.Map(data.data(), data.size()).ok());
+
+    // Half of the queries hit
+    std::vector<std::pair<int, int>> queries;
+    for (int i = 0; i < kNumQueries; ++i) {
+      int state = rand() % states.size();
+      int ilabel = i % 2 ? states[state][rand() % fanout].input_label
+                         : 1 + rand() % (fanout * 4);
+      queries.emplace_back(state, ilabel);
+    }
+
+    double elapsed[2];
+    int found[2] = {0, 0};
+    for (int with_index = 0; with_index < 2; ++with_index) {
+      if (with_index) fst.InitLabelIndex(Fst::kDefaultLinearScanMax);
+      auto t0 = std::chrono::steady_clock::now();
+      FstArc arc;
+      for (const std::pair<int, int> &query : queries) {
+        found[with_index] += fst.GetArc(query.first, query.second, &arc);
+      }
+      auto t1 = std::chrono::steady_clock::now();
+      elapsed[with_index] = std::chrono::duration<double>(t1 - t0).count();
+    }
+    assert(found[0] == found[1]);
+    printf("fanout %5d: binary search %.1fns, label index %.1fns\n",
+           fanout,
+           elapsed[0] * 1e9 / kNumQueries,
+           elapsed[1] * 1e9 / kNumQueries);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && std::string(argv[1]) == "benchmark") {
+    BenchmarkFstLabelIndex();
+    return 0;
+  }
+
   TestFst();
   TestLmFst();
+  TestLmFstDirectIndex();
+  TestLmFstFilter();
   TestDeltaLmFst();
+  TestLmCache();
+  TestClassWordMap();
+  TestFstLabelIndex();
 
   return 0;
 }
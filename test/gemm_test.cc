@@ -2,9 +2,11 @@
 
 #include <math.h>
 #include <random>
+#include <thread>
 #include <tuple>
 #include "matrix.h"
 
+using pocketkaldi::GemmContext;
 using pocketkaldi::Matrix;
 using pocketkaldi::MatrixBase;
 using pocketkaldi::SimpleMatMat;
@@ -103,6 +105,12 @@ void TestSgemm() {
 
     assert(CompareMatrix(C, CRef) < 0.01);
 
+    // With beta = 1, A * B is added to C
+    MatMat(A, B, &C, nullptr, 1.0f);
+    CRef.Scale(2.0f);
+    assert(CompareMatrix(C, CRef) < 0.02);
+    CRef.Scale(0.5f);
+
     // Check 8-bit gemm  
     Matrix<u_int8_t> A_8bit, B_8bit;
     QuantizationParams quant_params_A, quant_params_B;
@@ -121,7 +129,115 @@ void TestSgemm() {
   }
 }
 
+void TestReserve() {
+  Matrix<float> A;
+  A.Reserve(10, 6);
+  const float *data = A.Data();
+  assert(data != nullptr && A.NumRows() == 0);
+
+  // Resizing within the reserved size reuses the memory block
+  A.Resize(10, 6);
+  assert(A.Data() == data && A.Stride() == 6);
+  A.Resize(4, 5, Matrix<float>::kUndefined, Matrix<float>::kDefaultStride);
+  assert(A.Data() == data && A.Stride() == 8);
+  A.Resize(0, 0);
+  assert(A.Data() == data && A.NumRows() == 0);
+  A.Resize(10, 3);
+  assert(A.Data() == data);
+  for (int row = 0; row < 10; ++row) {
+    for (int col = 0; col < 3; ++col) assert(A(row, col) == 0.0f);
+  }
+
+  // Reserve keeps the data
+  A(9, 2) = 1.0f;
+  A.Reserve(20, 20);
+  assert(A.NumRows() == 10 && A.NumCols() == 3 && A(9, 2) == 1.0f);
+
+  // Resizing with kUndefined and the same stride keeps the shared rows
+  A.Resize(20, 3, Matrix<float>::kUndefined);
+  assert(A.Stride() == 3 && A(9, 2) == 1.0f);
+  A.Resize(10, 3, Matrix<float>::kUndefined);
+  assert(A(9, 2) == 1.0f);
+
+  // Swap also swaps the memory block
+  Matrix<float> B;
+  B.Swap(&A);
+  assert(A.Data() == nullptr && B(9, 2) == 1.0f);
+  data = B.Data();
+  B.Resize(20, 20);
+  assert(B.Data() == data);
+}
+
+void TestGemmContext() {
+  Matrix<float> A, B, C, CRef;
+  Matrix<float> C_8bit, CRef_8bit;
+  Matrix<u_int8_t> A_8bit, B_8bit;
+  QuantizationParams quant_params_A, quant_params_B;
+
+  GemmContext single_thread(1), multi_thread(3);
+  std::vector<std::tuple<int, int, int>> test_sizes {
+    std::make_tuple(5, 3, 2),
+    std::make_tuple(1, 100, 30),
+    std::make_tuple(100, 517, 80),
+    std::make_tuple(121, 233, 17)
+  };
+  for (const std::tuple<int, int, int> &test_size : test_sizes) {
+    int m = std::get<0>(test_size);
+    int n = std::get<1>(test_size);
+    int k = std::get<2>(test_size);
+
+    GenerateRandomMatrix(m, k, -0.5, 0.5, &A);
+    GenerateRandomMatrix(k, n, 1, 2, &B);
+    CRef.Resize(m, n);
+    SimpleMatMat(A, B, &CRef);
+    Quantize(A, &A_8bit, &quant_params_A);
+    Quantize(B, &B_8bit, &quant_params_B);
+    CRef_8bit.Resize(m, n);
+    MatMat_U8U8F32(A_8bit, quant_params_A, B_8bit, quant_params_B, &CRef_8bit);
+
+    for (GemmContext *context : {&single_thread, &multi_thread}) {
+      // C is in the default stride, which is larger than its columns
+      C.Resize(m, n, Matrix<float>::kSetZero, Matrix<float>::kDefaultStride);
+      MatMat(A, B, &C, context);
+      assert(CompareMatrix(C, CRef) < 0.01);
+
+      // 8-bit GEMM is exactly the same in all threads
+      C_8bit.Resize(m, n);
+      MatMat_U8U8F32(
+          A_8bit,
+          quant_params_A,
+          B_8bit,
+          quant_params_B,
+          &C_8bit,
+          context);
+      assert(CompareMatrix(C_8bit, CRef_8bit) == 0.0f);
+    }
+  }
+
+  // GEMMs from several threads share the context
+  GenerateRandomMatrix(64, 80, -0.5, 0.5, &A);
+  GenerateRandomMatrix(80, 300, -0.5, 0.5, &B);
+  CRef.Resize(64, 300);
+  SimpleMatMat(A, B, &CRef);
+  std::vector<Matrix<float>> outputs(4);
+  std::vector<std::thread> threads;
+  for (Matrix<float> &output : outputs) {
+    threads.emplace_back([&A, &B, &output, &multi_thread]() {
+      for (int i = 0; i < 20; ++i) {
+        output.Resize(A.NumRows(), B.NumCols());
+        MatMat(A, B, &output, &multi_thread);
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+  for (const Matrix<float> &output : outputs) {
+    assert(CompareMatrix(output, CRef) < 0.01);
+  }
+}
+
 int main() {
   TestSgemm();
+  TestReserve();
+  TestGemmContext();
   return 0;
 }
@@ -0,0 +1,120 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <stdio.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "decoder.h"
+#include "grammar.h"
+#include "vector.h"
+
+using pocketkaldi::Decoder;
+using pocketkaldi::Grammar;
+using pocketkaldi::Status;
+using pocketkaldi::Vector;
+
+constexpr int kNumPdfs = 5;
+constexpr int kCall = 10;
+constexpr int kNow = 11;
+constexpr int kMenu = 20;
+constexpr int kAlice = 30;
+constexpr int kBob = 31;
+
+// Carrier "call #nonterm:menu now" where transition-ids 1 and 2 are "call" and
+// "now"
+fst::StdVectorFst BuildCarrier() {
+  fst::StdVectorFst carrier;
+  for (int i = 0; i < 4; ++i) carrier.AddState();
+  carrier.SetStart(0);
+  carrier.AddArc(0, fst::StdArc(1, kCall, 0.0f, 1));
+  carrier.AddArc(1, fst::StdArc(0, kMenu, 0.5f, 2));
+  carrier.AddArc(2, fst::StdArc(2, kNow, 0.0f, 3));
+  carrier.SetFinal(3, 0.0f);
+  return carrier;
+}
+
+// Sub-graph of two words "alice" and "bob" with transition-id 3 and 4
+fst::StdVectorFst BuildSubGraph() {
+  fst::StdVectorFst subgraph;
+  for (int i = 0; i < 2; ++i) subgraph.AddState();
+  subgraph.SetStart(0);
+  subgraph.AddArc(0, fst::StdArc(3, kAlice, 1.0f, 1));
+  subgraph.AddArc(0, fst::StdArc(4, kBob, 1.0f, 1));
+  subgraph.SetFinal(1, 0.25f);
+  return subgraph;
+}
+
+// Decodes frames where the pdf of each transition-id in pdfs is the best one.
+// Returns the words in order
+std::vector<int> Decode(const fst::StdVectorFst &carrier,
+                        const Grammar *grammar,
+                        const std::vector<int> &pdfs) {
+  Vector<int32_t> transition_pdf_id_map(kNumPdfs);
+  for (int i = 0; i < kNumPdfs; ++i) transition_pdf_id_map(i) = i;
+
+  Decoder decoder(&carrier, transition_pdf_id_map, 1.0f);
+  decoder.set_grammar(grammar);
+  decoder.Initialize();
+  Vector<float> frame_logp(kNumPdfs);
+  for (int pdf : pdfs) {
+    frame_logp.Set(-10.0f);
+    frame_logp(pdf) = 0.0f;
+    if (!decoder.Process(frame_logp)) break;
+  }
+  decoder.EndOfStream();
+
+  std::vector<int> words = decoder.BestPath().words();
+  std::reverse(words.begin(), words.end());
+  return words;
+}
+
+void TestGrammar() {
+  fst::StdVectorFst carrier = BuildCarrier();
+
+  Grammar grammar;
+  grammar.AddNonterminal(kMenu);
+  assert(grammar.num_nonterminals() == 1);
+  const fst::Fst<fst::StdArc> *subgraph = nullptr;
+  assert(grammar.Lookup(kMenu, &subgraph) && subgraph == nullptr);
+  assert(!grammar.Lookup(kCall, &subgraph));
+
+  // Unbound nonterminal is not followed
+  assert(Decode(carrier, &grammar, {1, 4, 2}).empty());
+
+  // Sub-graph in ConstFst
+  Status status = grammar.SetSubGraph(
+      kMenu,
+      Grammar::SubGraph(new fst::ConstFst<fst::StdArc>(BuildSubGraph())));
+  assert(status.ok());
+  assert(!grammar.SetSubGraph(
+      kCall,
+      Grammar::SubGraph(new fst::StdVectorFst(BuildSubGraph()))).ok());
+  std::vector<int> words = Decode(carrier, &grammar, {1, 4, 2});
+  assert(words == std::vector<int>({kCall, kBob, kNow}));
+  words = Decode(carrier, &grammar, {1, 3, 2});
+  assert(words == std::vector<int>({kCall, kAlice, kNow}));
+
+  // Replacing the sub-graph of a copy does not affect the original one
+  fst::StdVectorFst alice_only = BuildSubGraph();
+  alice_only.DeleteArcs(0);
+  alice_only.AddArc(0, fst::StdArc(3, kAlice, 1.0f, 1));
+  Grammar session_grammar = grammar;
+  status = session_grammar.SetSubGraph(
+      kMenu,
+      Grammar::SubGraph(new fst::StdVectorFst(alice_only)));
+  assert(status.ok());
+  words = Decode(carrier, &session_grammar, {1, 4, 2});
+  assert(words == std::vector<int>({kCall, kAlice, kNow}));
+  words = Decode(carrier, &grammar, {1, 4, 2});
+  assert(words == std::vector<int>({kCall, kBob, kNow}));
+
+  // Without grammar the nonterminal is just a word
+  words = Decode(carrier, nullptr, {1, 2});
+  assert(words == std::vector<int>({kCall, kMenu, kNow}));
+}
+
+int main() {
+  TestGrammar();
+  return 0;
+}
@@ -0,0 +1,132 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <stdio.h>
+#include <vector>
+#include "graph_order.h"
+
+using pocketkaldi::GraphOrder;
+using pocketkaldi::Status;
+
+// Build a graph with states numbered in scrambled order:
+//   0 -> {1, 2, 3}, 1 -> 4, 2 -> 5, 3 -> 6, {4, 5, 6} -> 7 (final)
+// And state 8 is unreachable
+fst::VectorFst<fst::StdArc> BuildGraph(const std::vector<int> &ids) {
+  fst::VectorFst<fst::StdArc> graph;
+  for (int i = 0; i < ids.size(); ++i) graph.AddState();
+  graph.SetStart(ids[0]);
+  graph.SetFinal(ids[7], 0.5f);
+
+  auto add_arc = [&graph, &ids] (int from, int to, int label, float weight) {
+    graph.AddArc(ids[from], fst::StdArc(label, label, weight, ids[to]));
+  };
+  add_arc(0, 1, 1, 1.0f);
+  add_arc(0, 2, 2, 2.0f);
+  add_arc(0, 3, 3, 3.0f);
+  add_arc(1, 4, 4, 1.0f);
+  add_arc(2, 5, 5, 0.5f);
+  add_arc(3, 6, 6, 0.1f);
+  add_arc(4, 7, 7, 1.0f);
+  add_arc(5, 7, 8, 1.0f);
+  add_arc(6, 7, 9, 1.0f);
+  add_arc(8, 7, 10, 1.0f);
+  return graph;
+}
+
+// Checks that order is a permutation and the renumbered graph has the same
+// distances as the original one
+void CheckOrder(const fst::StdVectorFst &graph,
+                const std::vector<int32_t> &order) {
+  assert(order.size() == graph.NumStates());
+  std::vector<bool> used(order.size(), false);
+  for (int32_t new_state : order) {
+    assert(new_state >= 0 && new_state < order.size());
+    assert(used[new_state] == false);
+    used[new_state] = true;
+  }
+
+  fst::ConstFst<fst::StdArc> *sorted = GraphOrder::Apply(graph, order);
+  assert(sorted->Start() == order[graph.Start()]);
+
+  std::vector<fst::TropicalWeight> distance, sorted_distance;
+  fst::ShortestDistance(graph, &distance);
+  fst::ShortestDistance(*sorted, &sorted_distance);
+  for (int state = 0; state < graph.NumStates(); ++state) {
+    assert(sorted->Final(order[state]) == graph.Final(state));
+    assert(sorted->NumArcs(order[state]) == graph.NumArcs(state));
+    if (state < distance.size() &&
+        distance[state] != fst::TropicalWeight::Zero()) {
+      assert(fst::ApproxEqual(distance[state],
+                              sorted_distance[order[state]]));
+    }
+  }
+
+  delete sorted;
+}
+
+void TestBfsDfs() {
+  std::vector<int> ids = {5, 8, 0, 3, 7, 1, 6, 2, 4};
+  fst::StdVectorFst graph = BuildGraph(ids);
+
+  std::vector<int32_t> order;
+  GraphOrder::Bfs(graph, &order);
+  CheckOrder(graph, order);
+  for (int i = 0; i < ids.size(); ++i) {
+    assert(order[ids[i]] == i);
+  }
+
+  GraphOrder::Dfs(graph, &order);
+  CheckOrder(graph, order);
+  std::vector<int> dfs_expected = {0, 1, 4, 6, 2, 5, 7, 3, 8};
+  for (int i = 0; i < ids.size(); ++i) {
+    assert(order[ids[i]] == dfs_expected[i]);
+  }
+}
+
+void TestProfile() {
+  std::vector<int> ids = {5, 8, 0, 3, 7, 1, 6, 2, 4};
+  fst::StdVectorFst graph = BuildGraph(ids);
+
+  // Path 0 -> 3 -> 6 -> 7 is the hottest, 0 -> 2 -> 5 is also visited
+  std::vector<int64_t> visits(ids.size(), 0);
+  visits[ids[0]] = 100;
+  visits[ids[3]] = 80;
+  visits[ids[6]] = 80;
+  visits[ids[7]] = 80;
+  visits[ids[2]] = 10;
+  visits[ids[5]] = 10;
+
+  std::vector<int32_t> order;
+  GraphOrder::Profile(graph, visits, &order);
+  CheckOrder(graph, order);
+  std::vector<int> expected = {0, 6, 2, 1, 7, 4, 3, 5, 8};
+  for (int i = 0; i < ids.size(); ++i) {
+    assert(order[ids[i]] == expected[i]);
+  }
+
+  // Write and read the profile
+  Status status = GraphOrder::WriteVisits("graph_order_test.prof", visits);
+  assert(status.ok());
+  std::vector<int64_t> read_visits;
+  status = GraphOrder::ReadVisits("graph_order_test.prof", &read_visits);
+  assert(status.ok());
+  read_visits.resize(visits.size(), 0);
+  assert(read_visits == visits);
+  remove("graph_order_test.prof");
+}
+
+void TestParseName() {
+  int order_type = -1;
+  assert(GraphOrder::ParseName("BFS", &order_type).ok());
+  assert(order_type == GraphOrder::kBfs);
+  assert(GraphOrder::ParseName("profile", &order_type).ok());
+  assert(order_type == GraphOrder::kProfile);
+  assert(GraphOrder::ParseName("random", &order_type).ok() == false);
+}
+
+int main() {
+  TestBfsDfs();
+  TestProfile();
+  TestParseName();
+  return 0;
+}
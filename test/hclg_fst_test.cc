@@ -0,0 +1,203 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include "hclg_fst.h"
+
+using pocketkaldi::HclgCompactFst;
+using pocketkaldi::HclgCompactor;
+
+// A small graph with epsilon arcs, two final states and an olabel of max_label
+fst::StdVectorFst BuildGraph(int max_label) {
+  fst::StdVectorFst graph;
+  for (int i = 0; i < 5; ++i) graph.AddState();
+  graph.SetStart(0);
+  graph.AddArc(0, fst::StdArc(1, 0, 0.5f, 1));
+  graph.AddArc(0, fst::StdArc(2, 3, 1.5f, 2));
+  graph.AddArc(1, fst::StdArc(0, max_label, 0.25f, 3));
+  graph.AddArc(1, fst::StdArc(4, 0, 2.0f, 1));
+  graph.AddArc(2, fst::StdArc(5, 6, 0.0f, 3));
+  graph.AddArc(3, fst::StdArc(7, 0, 1.0f, 4));
+  graph.SetFinal(3, 0.75f);
+  graph.SetFinal(4, 0.0f);
+  return graph;
+}
+
+// Checks that fst has the same states, arcs and final weights as graph
+void CheckSameGraph(const fst::StdVectorFst &graph,
+                    const fst::ExpandedFst<fst::StdArc> &fst) {
+  assert(fst.Start() == graph.Start());
+  assert(fst.NumStates() == graph.NumStates());
+  for (int state = 0; state < graph.NumStates(); ++state) {
+    assert(fst.Final(state) == graph.Final(state));
+    assert(fst.NumArcs(state) == graph.NumArcs(state));
+    fst::ArcIterator<fst::StdVectorFst> ref_iter(graph, state);
+    for (fst::ArcIterator<fst::Fst<fst::StdArc>> arc_iter(fst, state);
+         !arc_iter.Done();
+         arc_iter.Next(), ref_iter.Next()) {
+      const fst::StdArc &arc = arc_iter.Value();
+      const fst::StdArc &ref_arc = ref_iter.Value();
+      assert(arc.ilabel == ref_arc.ilabel);
+      assert(arc.olabel == ref_arc.olabel);
+      assert(arc.weight == ref_arc.weight);
+      assert(arc.nextstate == ref_arc.nextstate);
+    }
+  }
+}
+
+void TestHclgCompactFst() {
+  fst::StdVectorFst graph = BuildGraph(65534);
+  assert(HclgCompactor<fst::StdArc>().Compatible(graph));
+  assert(!HclgCompactor<fst::StdArc>().Compatible(BuildGraph(65535)));
+
+  HclgCompactFst compact_graph(graph);
+  assert(compact_graph.Type() == "compact_hclg16");
+  CheckSameGraph(graph, compact_graph);
+
+  // Iterates with the specialized ArcIterator as decoder does
+  int num_arcs = 0;
+  for (fst::ArcIterator<HclgCompactFst> arc_iter(compact_graph, 1);
+       !arc_iter.Done();
+       arc_iter.Next()) {
+    assert(arc_iter.Value().nextstate == (num_arcs == 0 ? 3 : 1));
+    ++num_arcs;
+  }
+  assert(num_arcs == 2);
+
+  // ReadHclg() reads both compact and const fst
+  std::stringstream compact_strm;
+  assert(compact_graph.Write(
+      compact_strm,
+      fst::FstWriteOptions("compact", true, true, true, true)));
+  std::unique_ptr<fst::ExpandedFst<fst::StdArc>> fst(pocketkaldi::ReadHclg(
+      compact_strm,
+      fst::FstReadOptions("compact")));
+  assert(fst != nullptr);
+  assert(fst->Type() == "compact_hclg16");
+  CheckSameGraph(graph, *fst);
+
+  std::stringstream const_strm;
+  fst::ConstFst<fst::StdArc> const_graph(graph);
+  assert(const_graph.Write(const_strm, fst::FstWriteOptions("const")));
+  fst.reset(pocketkaldi::ReadHclg(const_strm, fst::FstReadOptions("const")));
+  assert(fst != nullptr);
+  assert(fst->Type() == "const");
+  CheckSameGraph(graph, *fst);
+}
+
+// HCL of 3 words with pronunciations: 1 -> "1 2", 2 -> "1 3", 3 -> "4". The
+// word label is on the first arc
+fst::StdVectorFst BuildHcl() {
+  fst::StdVectorFst hcl;
+  for (int i = 0; i < 4; ++i) hcl.AddState();
+  hcl.SetStart(0);
+  hcl.SetFinal(0, fst::TropicalWeight::One());
+  hcl.AddArc(0, fst::StdArc(1, 1, 0.0f, 1));
+  hcl.AddArc(1, fst::StdArc(2, 0, 0.0f, 0));
+  hcl.AddArc(0, fst::StdArc(1, 2, 0.0f, 2));
+  hcl.AddArc(2, fst::StdArc(3, 0, 0.0f, 0));
+  hcl.AddArc(0, fst::StdArc(4, 3, 0.0f, 3));
+  hcl.AddArc(3, fst::StdArc(0, 0, 0.0f, 0));
+  return hcl;
+}
+
+// Bigram-like G: word 1 must be followed by word 2 or 3
+fst::StdVectorFst BuildG() {
+  fst::StdVectorFst g;
+  for (int i = 0; i < 3; ++i) g.AddState();
+  g.SetStart(0);
+  g.SetFinal(2, 0.5f);
+  g.AddArc(0, fst::StdArc(1, 1, 1.0f, 1));
+  g.AddArc(1, fst::StdArc(2, 2, 2.0f, 2));
+  g.AddArc(1, fst::StdArc(3, 3, 0.5f, 2));
+  g.AddArc(2, fst::StdArc(1, 1, 1.5f, 1));
+  return g;
+}
+
+// Distance of the best path and its labels
+float BestPath(const fst::Fst<fst::StdArc> &fst,
+               std::vector<int> *ilabels,
+               std::vector<int> *olabels) {
+  fst::StdVectorFst best_path;
+  fst::ShortestPath(fst, &best_path);
+  fst::TopSort(&best_path);
+  ilabels->clear();
+  olabels->clear();
+  float weight = 0.0f;
+  for (int state = best_path.Start(); ; ) {
+    if (best_path.NumArcs(state) == 0) {
+      weight += best_path.Final(state).Value();
+      break;
+    }
+    fst::ArcIterator<fst::StdVectorFst> arc_iter(best_path, state);
+    const fst::StdArc &arc = arc_iter.Value();
+    if (arc.ilabel) ilabels->push_back(arc.ilabel);
+    if (arc.olabel) olabels->push_back(arc.olabel);
+    weight += arc.weight.Value();
+    state = arc.nextstate;
+  }
+  return weight;
+}
+
+void TestComposeHclG() {
+  fst::StdVectorFst hcl = BuildHcl();
+  fst::StdVectorFst g = BuildG();
+
+  // Reference of static composition
+  fst::StdVectorFst sorted_hcl = hcl;
+  fst::ArcSort(&sorted_hcl, fst::OLabelCompare<fst::StdArc>());
+  fst::StdVectorFst hclg;
+  fst::Compose(sorted_hcl, g, &hclg);
+  std::vector<int> ref_ilabels, ref_olabels;
+  float ref_weight = BestPath(hclg, &ref_ilabels, &ref_olabels);
+  assert(ref_olabels == std::vector<int>({1, 3}));
+
+  // HCL from ConstFst and from hcl_lookahead fst
+  std::stringstream const_strm;
+  fst::ConstFst<fst::StdArc>(hcl).Write(
+      const_strm,
+      fst::FstWriteOptions("const"));
+  std::unique_ptr<pocketkaldi::HclLookAheadFst> lookahead_hcl(
+      pocketkaldi::ReadLookAheadHcl(const_strm, fst::FstReadOptions("const")));
+  assert(lookahead_hcl != nullptr);
+  std::stringstream lookahead_strm;
+  assert(lookahead_hcl->Write(
+      lookahead_strm,
+      fst::FstWriteOptions("lookahead")));
+  lookahead_hcl.reset(pocketkaldi::ReadLookAheadHcl(
+      lookahead_strm,
+      fst::FstReadOptions("lookahead")));
+  assert(lookahead_hcl != nullptr);
+  assert(lookahead_hcl->Type() == "hcl_lookahead");
+
+  std::stringstream g_strm;
+  assert(g.Write(g_strm, fst::FstWriteOptions("g")));
+  std::unique_ptr<fst::StdVectorFst> read_g(
+      pocketkaldi::ReadG(g_strm, fst::FstReadOptions("g")));
+  assert(read_g != nullptr);
+
+  // Lazy composition with a small cache, hcl and g are deleted before using it
+  std::unique_ptr<fst::ComposeFst<fst::StdArc>> composed(
+      pocketkaldi::ComposeHclG(*lookahead_hcl, read_g.get(), 1024));
+  lookahead_hcl.reset();
+  read_g.reset();
+  std::unique_ptr<fst::Fst<fst::StdArc>> utt_fst(composed->Copy(true));
+
+  std::vector<int> ilabels, olabels;
+  float weight = BestPath(*utt_fst, &ilabels, &olabels);
+  // Lookahead weights are accumulated in log semiring, so there is a small
+  // difference of total weight
+  assert(fabs(weight - ref_weight) < 1e-3);
+  assert(ilabels == ref_ilabels);
+  assert(olabels == ref_olabels);
+}
+
+int main() {
+  TestHclgCompactFst();
+  TestComposeHclG();
+  return 0;
+}
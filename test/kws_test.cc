@@ -0,0 +1,85 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+#include "kws.h"
+#include "vector.h"
+
+using pocketkaldi::KeywordSpotter;
+using pocketkaldi::KwsGraph;
+using pocketkaldi::Vector;
+
+constexpr int kNumPdfs = 6;
+constexpr int kHey = 7;
+constexpr int kFiller = 5;
+
+// Hub 0 with a filler loop (transition-id 5) and the keyword "hey" of
+// transition-ids 1 and 2
+fst::StdVectorFst BuildGraph() {
+  fst::StdVectorFst graph;
+  for (int i = 0; i < 4; ++i) graph.AddState();
+  graph.SetStart(0);
+  graph.AddArc(0, fst::StdArc(kFiller, 0, 0.0f, 3));
+  graph.AddArc(3, fst::StdArc(0, 0, 0.0f, 0));
+  graph.AddArc(0, fst::StdArc(1, kHey, 0.0f, 1));
+  graph.AddArc(1, fst::StdArc(1, 0, 0.0f, 1));
+  graph.AddArc(1, fst::StdArc(2, 0, 0.0f, 2));
+  graph.AddArc(2, fst::StdArc(2, 0, 0.0f, 2));
+  graph.AddArc(2, fst::StdArc(0, 0, 0.0f, 0));
+  return graph;
+}
+
+// Runs spotter over frames where pdfs[i] is the best pdf of frame i
+std::vector<KeywordSpotter::Detection> Spot(KeywordSpotter *spotter,
+                                            const std::vector<int> &pdfs) {
+  std::vector<KeywordSpotter::Detection> detections;
+  Vector<float> frame_logp(kNumPdfs);
+  for (int pdf : pdfs) {
+    frame_logp.Set(-5.0f);
+    frame_logp(kFiller) = -2.0f;
+    frame_logp(pdf) = 0.0f;
+    spotter->Process(frame_logp, &detections);
+  }
+  return detections;
+}
+
+void TestKeywordSpotter() {
+  KwsGraph graph;
+  assert(graph.Init(BuildGraph()).ok());
+  assert(graph.num_states() == 4);
+  Vector<int32_t> transition_pdf_id_map(kNumPdfs);
+  for (int i = 0; i < kNumPdfs; ++i) transition_pdf_id_map(i) = i;
+
+  // Filler, "hey" and filler again. Keyword is reported after kDelayFrames
+  KeywordSpotter spotter(&graph, &transition_pdf_id_map, 1.0f);
+  std::vector<int> pdfs = {5, 5, 5, 5, 1, 1, 1, 2, 2, 2};
+  pdfs.insert(pdfs.end(), KeywordSpotter::kDelayFrames + 20, 5);
+  std::vector<KeywordSpotter::Detection> detections = Spot(&spotter, pdfs);
+  assert(detections.size() == 1);
+  assert(detections[0].keyword == kHey);
+  assert(detections[0].begin_frame == 4);
+  assert(detections[0].end_frame == 10);
+  assert(fabs(detections[0].score - 2.0f) < 1e-5);
+  assert(spotter.NumFramesDecoded() == pdfs.size());
+
+  // Only filler
+  detections = Spot(&spotter, std::vector<int>(100, 5));
+  assert(detections.empty());
+
+  // Keyword below threshold, and keyword pending at the end of stream
+  spotter.set_threshold(kHey, 2.5f);
+  detections = Spot(&spotter, {5, 1, 1, 2, 2, 5, 5});
+  assert(detections.empty());
+  spotter.set_threshold(kHey, 1.5f);
+  detections = Spot(&spotter, {5, 1, 1, 2, 2, 5, 5});
+  assert(detections.empty());
+  spotter.EndOfStream(&detections);
+  assert(detections.size() == 1 && detections[0].keyword == kHey);
+}
+
+int main() {
+  TestKeywordSpotter();
+  return 0;
+}
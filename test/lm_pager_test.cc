@@ -0,0 +1,83 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <stdio.h>
+#include "fst.h"
+#include "lm_pager.h"
+#include "util.h"
+
+using pocketkaldi::Fst;
+using pocketkaldi::FstArc;
+using pocketkaldi::LmFst;
+using pocketkaldi::LmPager;
+using pocketkaldi::Status;
+using pocketkaldi::util::ReadableFile;
+
+void TestLmPager() {
+  LmFst lm_fst;
+  LmPager pager;
+  Status status = pager.Open(TESTDIR "data/G.pfst", &lm_fst);
+  assert(status.ok());
+
+  // Reference LM read into memory
+  LmFst ref_fst;
+  ReadableFile fd_fst;
+  status = fd_fst.Open(TESTDIR "data/G.pfst");
+  assert(status.ok());
+  status = ref_fst.Read(&fd_fst);
+  assert(status.ok());
+
+  // Hot arcs grows with order
+  pager.AdviseHot(0);
+  assert(pager.hot_bytes() == 0);
+  pager.AdviseHot(1);
+  int64_t unigram_bytes = pager.hot_bytes();
+  assert(unigram_bytes > 0);
+  pager.AdviseHot(2);
+  assert(pager.hot_bytes() >= unigram_bytes);
+  printf("lm_pager: hot arcs of order 1: %d bytes, order 2: %d bytes\n",
+         static_cast<int>(unigram_bytes),
+         static_cast<int>(pager.hot_bytes()));
+
+  // Every arc should be the same as the LM in memory
+  int64_t minor_faults = 0, major_faults = 0;
+  LmPager::GetPageFaults(&minor_faults, &major_faults);
+  for (int state = 0; state < 2254; ++state) {
+    Fst::ArcIterator arc_iter = ref_fst.IterateArcs(state);
+    const FstArc *ref_arc = nullptr;
+    while ((ref_arc = arc_iter.Next()) != nullptr) {
+      if (ref_arc->input_label == 0) continue;
+      FstArc arc;
+      assert(lm_fst.GetArc(state, ref_arc->input_label, &arc));
+      assert(arc.next_state == ref_arc->next_state);
+      assert(arc.weight == ref_arc->weight);
+    }
+    assert(lm_fst.Final(state) == ref_fst.Final(state));
+  }
+  int64_t minor_faults_after = 0, major_faults_after = 0;
+  LmPager::GetPageFaults(&minor_faults_after, &major_faults_after);
+  assert(minor_faults_after >= minor_faults);
+  assert(major_faults_after >= major_faults);
+
+  // All the arcs are touched, so they should be resident
+  std::vector<LmPager::SectionStats> stats = pager.Residency();
+  assert(stats.size() == 4);
+  assert(stats[0].name == "final");
+  assert(stats[1].name == "state_idx");
+  assert(stats[2].name == "arcs");
+  assert(stats[3].name == "hot_arcs");
+  assert(stats[3].bytes == pager.hot_bytes());
+  for (const LmPager::SectionStats &section : stats) {
+    printf("lm_pager: %s: %d bytes, %d resident\n",
+           section.name.c_str(),
+           static_cast<int>(section.bytes),
+           static_cast<int>(section.resident_bytes));
+    assert(section.resident_bytes <= section.bytes);
+  }
+  assert(stats[2].resident_bytes == stats[2].bytes);
+}
+
+int main() {
+  TestLmPager();
+  return 0;
+}
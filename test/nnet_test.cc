@@ -14,11 +14,17 @@ using pocketkaldi::NormalizeLayer;
 using pocketkaldi::BatchNormLayer;
 using pocketkaldi::LogSoftmaxLayer;
 using pocketkaldi::SpliceLayer;
+using pocketkaldi::TdnnLayer;
 using pocketkaldi::Matrix;
 using pocketkaldi::SubMatrix;
 using pocketkaldi::Vector;
 using pocketkaldi::SubVector;
 using pocketkaldi::NarrowLayer;
+using pocketkaldi::QuantizedLinearLayer;
+using pocketkaldi::LSTMPLayer;
+using pocketkaldi::Nnet;
+using pocketkaldi::LayerHistory;
+using pocketkaldi::MatrixBase;
 
 bool CheckEq(float a, float b) {
   return fabs(a - b) < 1e-3;
@@ -89,6 +95,45 @@ void TestLinearLayer() {
   assert(CheckEq(y(0, 3), 0.07f));
 }
 
+void TestQuantizedLinearLayer() {
+  float W_data[] = {
+    0.1, 0.8, 0.9,
+    0.4, 0.2, 0.7,
+    0.2, 0.1, -0.1,
+    -0.4, 0.3, 0.2
+  };
+  SubMatrix<float> W(W_data, 4, 3, 3);
+  float b_data[] = {0.1, -0.1, 0.2, -0.2};
+  SubVector<float> b(b_data, 4);
+
+  // x is a sub-matrix whose stride is not its number of columns
+  float x_data[] = {
+    0.3, -0.1, 0.9, 100.0,
+    -0.5, 0.6, 0.2, 100.0
+  };
+  SubMatrix<float> x(x_data, 2, 3, 4);
+
+  LinearLayer linear(W, b);
+  Matrix<float> y_ref;
+  linear.Propagate(x, &y_ref);
+
+  // Quantized from W directly and from LinearLayer
+  QuantizedLinearLayer quantized_linear(W, b);
+  std::unique_ptr<Layer> quantized_layer = linear.Quantize();
+  assert(quantized_layer->Type() == "QuantizedLinear");
+  for (const Layer *layer : {
+           static_cast<const Layer *>(&quantized_linear),
+           static_cast<const Layer *>(quantized_layer.get())}) {
+    Matrix<float> y;
+    layer->Propagate(x, &y);
+    assert(y.NumCols() == 4 && y.NumRows() == 2);
+    for (int row = 0; row < y.NumRows(); ++row) {
+      for (int col = 0; col < y.NumCols(); ++col) {
+        assert(fabs(y(row, col) - y_ref(row, col)) < 0.02);
+      }
+    }
+  }
+}
 
 void TestSoftmaxLayer() {
   // Create the Softmax layer
@@ -223,8 +268,535 @@ void TestNarrowLayer() {
   assert(CheckVector(y.Row(2), {0.2, 0.1, 0.1}));
 }
 
+// Nnet with layers of TDNN: Linear, BatchNorm, ReLU and BatchNorm before
+// splice
+void BuildTdnn(Nnet *nnet) {
+  Matrix<float> W1(3, 6), W2(2, 6);
+  Vector<float> b1(3), b2(2);
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 6; ++col) W1(row, col) = 0.1f * (row - col);
+    b1(row) = 0.1f * row;
+  }
+  for (int row = 0; row < 2; ++row) {
+    for (int col = 0; col < 6; ++col) W2(row, col) = 0.05f * (row + col);
+    b2(row) = -0.1f * row;
+  }
+  float scale1_data[] = {0.5, 2.0, -1.0}, offset1_data[] = {0.1, 0.0, 0.3};
+  float scale2_data[] = {1.5, 0.2, 0.8}, offset2_data[] = {-0.2, 0.4, 0.1};
+  SubVector<float> scale1(scale1_data, 3), offset1(offset1_data, 3);
+  SubVector<float> scale2(scale2_data, 3), offset2(offset2_data, 3);
+
+  nnet->AddLayer(std::unique_ptr<Layer>(new SpliceLayer({-1, 0, 1})));
+  nnet->AddLayer(std::unique_ptr<Layer>(new NarrowLayer(1, 1)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new LinearLayer(W1, b1)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new BatchNormLayer(scale1, offset1)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new ReLULayer()));
+  nnet->AddLayer(std::unique_ptr<Layer>(new BatchNormLayer(scale2, offset2)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new SpliceLayer({-2, 0})));
+  nnet->AddLayer(std::unique_ptr<Layer>(new NarrowLayer(2, 0)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new LinearLayer(W2, b2)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new LogSoftmaxLayer()));
+}
+
+void TestIncrementalPropagate() {
+  // Splice frames [-1, 1] and then [-2, 0], so the context is (3, 1)
+  Nnet nnet;
+  BuildTdnn(&nnet);
+  assert(nnet.SupportsIncremental());
+
+  Matrix<float> x(20, 2);
+  for (int row = 0; row < x.NumRows(); ++row) {
+    x(row, 0) = sin(row);
+    x(row, 1) = cos(row * 0.5f);
+  }
+  Matrix<float> y_ref;
+  nnet.Propagate(x, &y_ref);
+  assert(y_ref.NumRows() == 16 && y_ref.NumCols() == 2);
+
+  // Propagate with workspace gives the same output
+  Nnet::Instance batch_inst;
+  nnet.Reserve(&batch_inst, 20, 2);
+  for (int i = 0; i < 2; ++i) {
+    Matrix<float> y;
+    nnet.Propagate(&batch_inst, x, &y);
+    assert(y.NumRows() == 16 && y.NumCols() == 2);
+    for (int r = 0; r < y.NumRows(); ++r) {
+      assert(CheckVector(y.Row(r), {y_ref(r, 0), y_ref(r, 1)}));
+    }
+  }
+
+  // Propagate x in chunks of 3 frames
+  Nnet::Instance inst;
+  std::vector<float> y_data;
+  for (int row = 0; row < x.NumRows(); row += 3) {
+    int num_rows = std::min(3, x.NumRows() - row);
+    SubMatrix<float> chunk(x, row, num_rows, 0, 2);
+    Matrix<float> y;
+    nnet.PropagateIncremental(&inst, chunk, &y);
+
+    // The first chunk has no frame with all its context
+    assert(row != 0 || y.NumRows() == 0);
+    for (int r = 0; r < y.NumRows(); ++r) {
+      for (int c = 0; c < y.NumCols(); ++c) y_data.push_back(y(r, c));
+    }
+  }
+  assert(y_data.size() == 32);
+  for (int r = 0; r < y_ref.NumRows(); ++r) {
+    assert(CheckVector(y_ref.Row(r), {y_data[r * 2], y_data[r * 2 + 1]}));
+  }
+
+  // Splice without narrow is not supported
+  Nnet unsupported_nnet;
+  unsupported_nnet.AddLayer(std::unique_ptr<Layer>(new SpliceLayer({-1, 0})));
+  unsupported_nnet.AddLayer(std::unique_ptr<Layer>(new ReLULayer()));
+  assert(!unsupported_nnet.SupportsIncremental());
+}
+
+void TestFuse() {
+  Nnet nnet, fused_nnet;
+  BuildTdnn(&nnet);
+  BuildTdnn(&fused_nnet);
+
+  float log_prior_data[] = {-0.5, -1.5};
+  SubVector<float> log_prior(log_prior_data, 2);
+  assert(fused_nnet.Fuse(&log_prior));
+  assert(fused_nnet.Plan() == "Splice -> NarrowLayer -> Linear+ReLU -> "
+                              "Splice -> NarrowLayer -> Linear -> "
+                              "LogSoftmax-Prior");
+  assert(fused_nnet.SupportsIncremental());
+
+  Matrix<float> x(10, 2);
+  for (int row = 0; row < x.NumRows(); ++row) {
+    x(row, 0) = sin(row);
+    x(row, 1) = cos(row * 0.5f);
+  }
+  Matrix<float> y_ref, y;
+  nnet.Propagate(x, &y_ref);
+  fused_nnet.Propagate(x, &y);
+  assert(y.NumRows() == 6 && y.NumCols() == 2);
+  for (int row = 0; row < y.NumRows(); ++row) {
+    assert(CheckEq(y(row, 0), y_ref(row, 0) + 0.5f));
+    assert(CheckEq(y(row, 1), y_ref(row, 1) + 1.5f));
+  }
+
+  // Prior is not fused without LogSoftmax
+  Nnet linear_nnet;
+  linear_nnet.AddLayer(std::unique_ptr<Layer>(new ReLULayer()));
+  assert(!linear_nnet.Fuse(&log_prior));
+  assert(linear_nnet.Plan() == "ReLU");
+}
+
+void TestFrameSubsampling() {
+  Nnet nnet, subsampled_nnet;
+  BuildTdnn(&nnet);
+  BuildTdnn(&subsampled_nnet);
+  assert(subsampled_nnet.SetFrameSubsampling(3));
+  assert(subsampled_nnet.Plan() == "Splice -> NarrowLayer -> Linear -> "
+                                   "BatchNorm -> ReLU -> BatchNorm -> "
+                                   "Splice/3 -> Linear -> LogSoftmax");
+  assert(subsampled_nnet.SupportsIncremental());
+
+  Matrix<float> x(20, 2);
+  for (int row = 0; row < x.NumRows(); ++row) {
+    x(row, 0) = sin(row);
+    x(row, 1) = cos(row * 0.5f);
+  }
+  Matrix<float> y_ref;
+  nnet.Propagate(x, &y_ref);
+
+  // Frame 0, 3, 6, ... of the output without subsampling
+  Matrix<float> y;
+  subsampled_nnet.Propagate(x, &y);
+  assert(y.NumRows() == 6 && y.NumCols() == 2);
+  for (int r = 0; r < y.NumRows(); ++r) {
+    assert(CheckVector(y.Row(r), {y_ref(r * 3, 0), y_ref(r * 3, 1)}));
+  }
+
+  // Chunks of 4 frames are not aligned with the subsampling factor
+  Nnet::Instance inst;
+  std::vector<float> y_data;
+  for (int row = 0; row < x.NumRows(); row += 4) {
+    SubMatrix<float> chunk(x, row, 4, 0, 2);
+    subsampled_nnet.PropagateIncremental(&inst, chunk, &y);
+    for (int r = 0; r < y.NumRows(); ++r) {
+      for (int c = 0; c < y.NumCols(); ++c) y_data.push_back(y(r, c));
+    }
+  }
+  assert(y_data.size() == 12);
+  for (int r = 0; r < 6; ++r) {
+    assert(CheckVector(y_ref.Row(r * 3), {y_data[r * 2], y_data[r * 2 + 1]}));
+  }
+
+  // No SpliceLayer to subsample
+  Nnet unsupported_nnet;
+  unsupported_nnet.AddLayer(std::unique_ptr<Layer>(new ReLULayer()));
+  assert(unsupported_nnet.SetFrameSubsampling(1));
+  assert(!unsupported_nnet.SetFrameSubsampling(2));
+}
+
+void TestPropagateStreams() {
+  Nnet nnet;
+  BuildTdnn(&nnet);
+
+  // Input and reference output of 3 streams
+  std::vector<Matrix<float>> x(3), y_ref(3);
+  for (int i = 0; i < 3; ++i) {
+    x[i].Resize(20, 2);
+    for (int row = 0; row < 20; ++row) {
+      x[i](row, 0) = sin(row + i);
+      x[i](row, 1) = cos(row * 0.5f * i);
+    }
+    nnet.Propagate(x[i], &y_ref[i]);
+  }
+
+  // Stream i sends chunks of i + 2 frames, the streams that have sent all
+  // their frames send 0 frames
+  Nnet::Instance batch_inst;
+  std::vector<Nnet::Instance> insts(3);
+  std::vector<Nnet::Instance *> streams = {&insts[0], &insts[1], &insts[2]};
+  std::vector<int> offsets(3, 0);
+  std::vector<std::vector<float>> y_data(3);
+  while (offsets[0] < 20) {
+    std::vector<int> num_rows(3);
+    Matrix<float> in(9, 2);
+    int in_row = 0;
+    for (int i = 0; i < 3; ++i) {
+      num_rows[i] = std::min(i + 2, 20 - offsets[i]);
+      for (int r = 0; r < num_rows[i]; ++r) {
+        in.Row(in_row++).CopyFromVec(x[i].Row(offsets[i] + r));
+      }
+      offsets[i] += num_rows[i];
+    }
+    SubMatrix<float> batch(in, 0, in_row, 0, 2);
+
+    Matrix<float> y;
+    nnet.PropagateIncremental(&batch_inst, streams, batch, &num_rows, &y);
+    int out_row = 0;
+    for (int i = 0; i < 3; ++i) {
+      for (int r = 0; r < num_rows[i]; ++r, ++out_row) {
+        for (int c = 0; c < 2; ++c) y_data[i].push_back(y(out_row, c));
+      }
+    }
+    assert(out_row == y.NumRows());
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    assert(y_data[i].size() == 32);
+    for (int r = 0; r < y_ref[i].NumRows(); ++r) {
+      assert(CheckVector(
+          y_ref[i].Row(r),
+          {y_data[i][r * 2], y_data[i][r * 2 + 1]}));
+    }
+  }
+}
+
+// Checks if the output of nnet is the same as ref_nnet, in batch and in
+// chunks of chunk_size frames
+void CheckSameOutput(const Nnet &nnet,
+                     const Nnet &ref_nnet,
+                     const MatrixBase<float> &x,
+                     int chunk_size) {
+  Matrix<float> y_ref, y;
+  ref_nnet.Propagate(x, &y_ref);
+  nnet.Propagate(x, &y);
+  assert(y.NumRows() == y_ref.NumRows() && y.NumCols() == y_ref.NumCols());
+  for (int r = 0; r < y.NumRows(); ++r) {
+    for (int c = 0; c < y.NumCols(); ++c) assert(CheckEq(y(r, c), y_ref(r, c)));
+  }
+
+  Nnet::Instance inst, ref_inst;
+  Matrix<float> y_chunk, y_ref_chunk;
+  for (int row = 0; row < x.NumRows(); row += chunk_size) {
+    int num_rows = std::min(chunk_size, x.NumRows() - row);
+    SubMatrix<float> chunk(x, row, num_rows, 0, x.NumCols());
+    ref_nnet.PropagateIncremental(&ref_inst, chunk, &y_ref_chunk);
+    nnet.PropagateIncremental(&inst, chunk, &y_chunk);
+    assert(y_chunk.NumRows() == y_ref_chunk.NumRows());
+    for (int r = 0; r < y_chunk.NumRows(); ++r) {
+      for (int c = 0; c < y_chunk.NumCols(); ++c) {
+        assert(CheckEq(y_chunk(r, c), y_ref_chunk(r, c)));
+      }
+    }
+  }
+}
+
+void TestFuseTdnn() {
+  Matrix<float> x(20, 2);
+  for (int row = 0; row < x.NumRows(); ++row) {
+    x(row, 0) = sin(row);
+    x(row, 1) = cos(row * 0.5f);
+  }
+
+  Nnet nnet, tdnn_nnet;
+  BuildTdnn(&nnet);
+  BuildTdnn(&tdnn_nnet);
+  tdnn_nnet.FuseTdnn();
+  assert(tdnn_nnet.Plan() == "Tdnn -> NarrowLayer -> BatchNorm -> ReLU -> "
+                             "BatchNorm -> Tdnn -> NarrowLayer -> LogSoftmax");
+  assert(tdnn_nnet.SupportsIncremental());
+  CheckSameOutput(tdnn_nnet, nnet, x, 3);
+
+  // Fused with ReLU
+  Nnet fused_nnet;
+  BuildTdnn(&fused_nnet);
+  assert(!fused_nnet.Fuse(nullptr));
+  fused_nnet.FuseTdnn();
+  assert(fused_nnet.Plan() == "Tdnn+ReLU -> NarrowLayer -> Tdnn -> "
+                              "NarrowLayer -> LogSoftmax");
+  CheckSameOutput(fused_nnet, nnet, x, 3);
+
+  // Strided TdnnLayer from frame subsampling
+  Nnet subsampled_nnet, subsampled_tdnn_nnet;
+  BuildTdnn(&subsampled_nnet);
+  BuildTdnn(&subsampled_tdnn_nnet);
+  assert(subsampled_nnet.SetFrameSubsampling(3));
+  assert(subsampled_tdnn_nnet.SetFrameSubsampling(3));
+  subsampled_tdnn_nnet.FuseTdnn();
+  assert(subsampled_tdnn_nnet.Plan() == "Tdnn -> NarrowLayer -> BatchNorm -> "
+                                        "ReLU -> BatchNorm -> Tdnn/3 -> "
+                                        "LogSoftmax");
+  CheckSameOutput(subsampled_tdnn_nnet, subsampled_nnet, x, 4);
+
+  // SetFrameSubsampling() after FuseTdnn() strides the last TdnnLayer
+  Nnet late_subsampled_nnet;
+  BuildTdnn(&late_subsampled_nnet);
+  late_subsampled_nnet.FuseTdnn();
+  assert(late_subsampled_nnet.SetFrameSubsampling(3));
+  assert(late_subsampled_nnet.Plan() == subsampled_tdnn_nnet.Plan());
+  CheckSameOutput(late_subsampled_nnet, subsampled_nnet, x, 4);
+
+  // Fuse() after FuseTdnn() folds no BatchNorm across a TdnnLayer
+  assert(!tdnn_nnet.Fuse(nullptr));
+  assert(tdnn_nnet.Plan() == "Tdnn -> NarrowLayer -> BatchNorm -> ReLU -> "
+                             "BatchNorm -> Tdnn -> NarrowLayer -> LogSoftmax");
+  CheckSameOutput(tdnn_nnet, nnet, x, 3);
+
+  // Frames out of input are clamped as SpliceLayer, including the offsets
+  // beyond the whole input
+  Matrix<float> W(2, 8);
+  Vector<float> b(2);
+  for (int col = 0; col < 8; ++col) {
+    W(0, col) = 0.1f * col;
+    W(1, col) = -0.2f * col + 0.3f;
+  }
+  b(0) = 0.5f;
+  b(1) = -0.5f;
+  SpliceLayer splice({-3, -1, 0, 4});
+  LinearLayer linear(W, b);
+  TdnnLayer tdnn(splice, linear);
+  assert(tdnn.Type() == "Tdnn");
+  for (int num_rows : {1, 2, 5, 20}) {
+    SubMatrix<float> x_sub(x, 0, num_rows, 0, 2);
+    Matrix<float> spliced, y_ref, y;
+    splice.Propagate(x_sub, &spliced);
+    linear.Propagate(spliced, &y_ref);
+    tdnn.Propagate(x_sub, &y);
+    assert(y.NumRows() == num_rows && y.NumCols() == 2);
+    for (int r = 0; r < num_rows; ++r) {
+      assert(CheckVector(y.Row(r), {y_ref(r, 0), y_ref(r, 1)}));
+    }
+  }
+
+  // A SpliceLayer without LinearLayer is not fused
+  Nnet unfused_nnet;
+  unfused_nnet.AddLayer(std::unique_ptr<Layer>(new SpliceLayer({-1, 0})));
+  unfused_nnet.AddLayer(std::unique_ptr<Layer>(new NarrowLayer(1, 0)));
+  unfused_nnet.AddLayer(std::unique_ptr<Layer>(new ReLULayer()));
+  unfused_nnet.FuseTdnn();
+  assert(unfused_nnet.Plan() == "Splice -> NarrowLayer -> ReLU");
+}
+
+// Parameters of LSTMP with 3 inputs, 5 cells, 2 recurrent and 3 outputs
+struct LstmpParams {
+  LstmpParams(): W_x(20, 3), W_r(20, 2), b(20), peephole(3, 5), W_p(3, 5),
+                 b_p(3) {
+    for (int row = 0; row < 20; ++row) {
+      for (int col = 0; col < 3; ++col) W_x(row, col) = sin(row * 3 + col);
+      for (int col = 0; col < 2; ++col) W_r(row, col) = cos(row * 2 + col);
+      b(row) = 0.1f * (row % 7) - 0.3f;
+    }
+    for (int row = 0; row < 3; ++row) {
+      for (int col = 0; col < 5; ++col) {
+        peephole(row, col) = 0.2f * sin(row + col * 5);
+        W_p(row, col) = 0.5f * cos(row * 5 + col);
+      }
+      b_p(row) = 0.1f * row;
+    }
+  }
+
+  Matrix<float> W_x, W_r;
+  Vector<float> b;
+  Matrix<float> peephole, W_p;
+  Vector<float> b_p;
+};
+
+float Sigmoid(float x) {
+  return 1.0f / (1.0f + expf(-x));
+}
+
+// Computes LSTMP frame by frame, as the formulas in LSTMPLayer
+void LstmpReference(const LstmpParams &params,
+                    const MatrixBase<float> &x,
+                    int delay,
+                    float recurrent_scale,
+                    Matrix<float> *y) {
+  std::vector<std::vector<float>> c(x.NumRows(), std::vector<float>(5));
+  y->Resize(x.NumRows(), 3);
+  for (int t = 0; t < x.NumRows(); ++t) {
+    std::vector<float> c_prev(5, 0.0f), r_prev(2, 0.0f);
+    if (t >= delay) {
+      c_prev = c[t - delay];
+      r_prev = {(*y)(t - delay, 0), (*y)(t - delay, 1)};
+      for (float &v : c_prev) v *= recurrent_scale;
+      for (float &v : r_prev) v *= recurrent_scale;
+    }
+
+    std::vector<float> gates(20);
+    for (int k = 0; k < 20; ++k) {
+      gates[k] = params.b(k);
+      for (int j = 0; j < 3; ++j) gates[k] += params.W_x(k, j) * x(t, j);
+      for (int j = 0; j < 2; ++j) gates[k] += params.W_r(k, j) * r_prev[j];
+    }
+
+    std::vector<float> m(5);
+    for (int k = 0; k < 5; ++k) {
+      float i = Sigmoid(gates[k] + params.peephole(0, k) * c_prev[k]);
+      float f = Sigmoid(gates[5 + k] + params.peephole(1, k) * c_prev[k]);
+      c[t][k] = f * c_prev[k] + i * tanhf(gates[10 + k]);
+      float o = Sigmoid(gates[15 + k] + params.peephole(2, k) * c[t][k]);
+      m[k] = o * tanhf(c[t][k]);
+    }
+    for (int p = 0; p < 3; ++p) {
+      (*y)(t, p) = params.b_p(p);
+      for (int k = 0; k < 5; ++k) (*y)(t, p) += params.W_p(p, k) * m[k];
+    }
+  }
+}
+
+void TestLSTMPLayer() {
+  LstmpParams params;
+  Matrix<float> x(12, 3);
+  for (int row = 0; row < x.NumRows(); ++row) {
+    for (int col = 0; col < 3; ++col) x(row, col) = sin(row * 0.7f + col);
+  }
+
+  // Delay 1 and 3, and delay 3 with the scale of decay-time
+  std::vector<std::pair<int, float>> configs = {
+      {1, 1.0f},
+      {3, 1.0f},
+      {3, 0.6f}};
+  for (const std::pair<int, float> &config : configs) {
+    int delay = config.first;
+    LSTMPLayer layer(
+        params.W_x,
+        params.W_r,
+        params.b,
+        params.peephole,
+        params.W_p,
+        params.b_p,
+        delay,
+        config.second);
+    assert(layer.OutputDim(3) == 3);
+
+    Matrix<float> y_ref, y;
+    LstmpReference(params, x, delay, config.second, &y_ref);
+    layer.Propagate(x, &y);
+    assert(y.NumRows() == 12 && y.NumCols() == 3);
+    for (int r = 0; r < y.NumRows(); ++r) {
+      assert(CheckVector(y.Row(r), {y_ref(r, 0), y_ref(r, 1), y_ref(r, 2)}));
+    }
+
+    // The state is kept across chunks of 5 frames
+    LayerHistory history;
+    for (int row = 0; row < x.NumRows(); row += 5) {
+      int num_rows = std::min(5, x.NumRows() - row);
+      SubMatrix<float> chunk(x, row, num_rows, 0, 3);
+      layer.PropagateIncremental(&history, chunk, &y);
+      assert(y.NumRows() == num_rows);
+      for (int r = 0; r < num_rows; ++r) {
+        assert(CheckVector(
+            y.Row(r),
+            {y_ref(row + r, 0), y_ref(row + r, 1), y_ref(row + r, 2)}));
+      }
+    }
+  }
+}
+
+// Splice -> NarrowLayer -> Linear -> LSTMP with delay -> LogSoftmax
+void BuildRecurrentNnet(int delay, Nnet *nnet) {
+  LstmpParams params;
+  Matrix<float> W(3, 6);
+  Vector<float> b(3);
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 6; ++col) W(row, col) = 0.3f * sin(row + col);
+  }
+  nnet->AddLayer(std::unique_ptr<Layer>(new SpliceLayer({-1, 0})));
+  nnet->AddLayer(std::unique_ptr<Layer>(new NarrowLayer(1, 0)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new LinearLayer(W, b)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new LSTMPLayer(
+      params.W_x,
+      params.W_r,
+      params.b,
+      params.peephole,
+      params.W_p,
+      params.b_p,
+      delay)));
+  nnet->AddLayer(std::unique_ptr<Layer>(new LogSoftmaxLayer()));
+}
+
+void TestRecurrentNnet() {
+  Nnet nnet, subsampled_nnet;
+  BuildRecurrentNnet(3, &nnet);
+  BuildRecurrentNnet(3, &subsampled_nnet);
+  assert(nnet.HasRecurrentLayer() && nnet.SupportsIncremental());
+  assert(nnet.Plan() == "Splice -> NarrowLayer -> Linear -> LSTMP -> "
+                        "LogSoftmax");
+
+  Matrix<float> x(19, 3);
+  for (int row = 0; row < x.NumRows(); ++row) {
+    for (int col = 0; col < 3; ++col) x(row, col) = cos(row * 0.3f + col);
+  }
+  Matrix<float> y_ref, y;
+  nnet.Propagate(x, &y_ref);
+  assert(y_ref.NumRows() == 18 && y_ref.NumCols() == 3);
+
+  // Chunks of 4 frames
+  Nnet::Instance inst;
+  std::vector<float> y_data;
+  for (int row = 0; row < x.NumRows(); row += 4) {
+    int num_rows = std::min(4, x.NumRows() - row);
+    SubMatrix<float> chunk(x, row, num_rows, 0, 3);
+    nnet.PropagateIncremental(&inst, chunk, &y);
+    for (int r = 0; r < y.NumRows(); ++r) {
+      for (int c = 0; c < y.NumCols(); ++c) y_data.push_back(y(r, c));
+    }
+  }
+  assert(y_data.size() == 54);
+  for (int r = 0; r < y_ref.NumRows(); ++r) {
+    assert(CheckVector(
+        y_ref.Row(r),
+        {y_data[r * 3], y_data[r * 3 + 1], y_data[r * 3 + 2]}));
+  }
+
+  // With frame subsampling, LSTMP recurs on the previous output frame, which
+  // is 3 frames before
+  assert(subsampled_nnet.SetFrameSubsampling(3));
+  subsampled_nnet.Propagate(x, &y);
+  assert(y.NumRows() == 6);
+  for (int r = 0; r < y.NumRows(); ++r) {
+    assert(CheckVector(
+        y.Row(r),
+        {y_ref(r * 3, 0), y_ref(r * 3, 1), y_ref(r * 3, 2)}));
+  }
+
+  Nnet undivisible_nnet;
+  BuildRecurrentNnet(2, &undivisible_nnet);
+  assert(!undivisible_nnet.SetFrameSubsampling(3));
+}
+
 int main() {
   TestLinearLayer();
+  TestQuantizedLinearLayer();
   TestSoftmaxLayer();
   TestLogSoftmaxLayer();
   TestReLULayer();
@@ -232,5 +804,12 @@ int main() {
   TestSpliceLayer();
   TestBatchNormLayer();
   TestNarrowLayer();
+  TestIncrementalPropagate();
+  TestFuse();
+  TestFrameSubsampling();
+  TestPropagateStreams();
+  TestFuseTdnn();
+  TestLSTMPLayer();
+  TestRecurrentNnet();
   return 0;
 }
@@ -0,0 +1,176 @@
+// Created at 2026-10-18
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "simd.h"
+#include "vector.h"
+
+using pocketkaldi::Vector;
+namespace simd = pocketkaldi::simd;
+
+// Lengths to check both the vectorized loop and the scalar tail
+const int kLengths[] = {0, 1, 3, 4, 7, 15, 16, 17, 33, 100};
+
+std::vector<float> RandomArray(int n, float min, float max) {
+  static std::mt19937 generator(7);
+  std::uniform_real_distribution<float> distribution(min, max);
+  std::vector<float> x(n);
+  for (float &v : x) v = distribution(generator);
+  return x;
+}
+
+// Relative error for |b| > 1, absolute error otherwise
+bool CheckClose(float a, float b, float rel_tol) {
+  return fabs(a - b) <= rel_tol * std::max(1.0f, fabs(b));
+}
+
+bool CheckArray(const std::vector<float> &x,
+                const std::vector<float> &ref,
+                float rel_tol) {
+  assert(x.size() == ref.size());
+  for (int i = 0; i < x.size(); ++i) {
+    if (!CheckClose(x[i], ref[i], rel_tol)) return false;
+  }
+  return true;
+}
+
+// Checks the kernels against the scalar kernels
+void TestKernels(const simd::Kernels &kernels) {
+  const simd::Kernels &ref = *simd::Get(simd::kScalar);
+  for (int n : kLengths) {
+    std::vector<float> x = RandomArray(n, -10.0f, 10.0f);
+    std::vector<float> y = RandomArray(n, -10.0f, 10.0f);
+    std::vector<float> out, ref_out;
+
+    assert(CheckClose(
+        kernels.dot(x.data(), y.data(), n),
+        ref.dot(x.data(), y.data(), n),
+        1e-3));
+
+    out = y, ref_out = y;
+    kernels.axpy(0.5f, x.data(), out.data(), n);
+    ref.axpy(0.5f, x.data(), ref_out.data(), n);
+    assert(CheckArray(out, ref_out, 1e-6));
+
+    out = y, ref_out = y;
+    kernels.mul(x.data(), out.data(), n);
+    ref.mul(x.data(), ref_out.data(), n);
+    assert(out == ref_out);
+
+    out = x, ref_out = x;
+    kernels.scale(-1.5f, out.data(), n);
+    ref.scale(-1.5f, ref_out.data(), n);
+    assert(out == ref_out);
+
+    out = x, ref_out = x;
+    kernels.add(2.5f, out.data(), n);
+    ref.add(2.5f, ref_out.data(), n);
+    assert(out == ref_out);
+
+    out = x, ref_out = x;
+    assert(kernels.floor(1.0f, out.data(), n) ==
+           ref.floor(1.0f, ref_out.data(), n));
+    assert(out == ref_out);
+
+    out = x, ref_out = x;
+    kernels.relu(out.data(), n);
+    ref.relu(ref_out.data(), n);
+    assert(out == ref_out);
+
+    out = y, ref_out = y;
+    kernels.add_relu(x.data(), out.data(), n);
+    ref.add_relu(x.data(), ref_out.data(), n);
+    assert(out == ref_out);
+
+    if (n == 0) continue;
+    assert(kernels.max(x.data(), n) == ref.max(x.data(), n));
+
+    // exp of [-80, 80] and its sum
+    std::vector<float> z = RandomArray(n, -80.0f, 80.0f);
+    out = z, ref_out = z;
+    float sum = kernels.exp_sum(-2.0f, out.data(), n);
+    float ref_sum = ref.exp_sum(-2.0f, ref_out.data(), n);
+    assert(fabs(sum - ref_sum) <= 1e-5 * ref_sum);
+    for (int i = 0; i < n; ++i) {
+      assert(fabs(out[i] - ref_out[i]) <= 1e-6 * ref_out[i]);
+    }
+    sum = kernels.sum_exp(-2.0f, z.data(), n);
+    assert(fabs(sum - ref_sum) <= 1e-5 * ref_sum);
+
+    // log of small and large positive numbers
+    std::vector<float> p = RandomArray(n, 0.0f, 1.0f);
+    for (int i = 0; i < n; ++i) p[i] = ldexpf(p[i], i % 64 - 32);
+    out = p, ref_out = p;
+    kernels.log(out.data(), n);
+    ref.log(ref_out.data(), n);
+    assert(CheckArray(out, ref_out, 1e-6));
+
+    // LSTM cells
+    std::vector<float> gates = RandomArray(4 * n, -5.0f, 5.0f);
+    std::vector<float> peephole = RandomArray(3 * n, -1.0f, 1.0f);
+    std::vector<float> c = RandomArray(n, -3.0f, 3.0f), ref_c = c;
+    std::vector<float> m(n), ref_m(n);
+    kernels.lstm_cell(gates.data(), peephole.data(), c.data(), m.data(), n);
+    ref.lstm_cell(
+        gates.data(),
+        peephole.data(),
+        ref_c.data(),
+        ref_m.data(),
+        n);
+    assert(CheckArray(c, ref_c, 1e-5));
+    assert(CheckArray(m, ref_m, 1e-5));
+  }
+
+  // Special values of log in the vectorized loop
+  std::vector<float> x(32, 1.0f);
+  x[1] = 0.0f;
+  x[2] = -1.0f;
+  kernels.log(x.data(), x.size());
+  assert(x[0] == 0.0f);
+  assert(x[1] == -INFINITY);
+  assert(std::isnan(x[2]));
+
+  // exp of vectorized kernels is clamped instead of overflow
+  if (kernels.isa != simd::kScalar) {
+    std::vector<float> y(32, 200.0f);
+    kernels.exp_sum(0.0f, y.data(), 16);
+    assert(!std::isinf(y[0]) && y[0] > 1e38);
+  }
+}
+
+void TestVector() {
+  Vector<float> v(20);
+  for (int i = 0; i < v.Dim(); ++i) v(i) = i * 10.0f;
+
+  // Softmax of large values does not overflow
+  v.ApplySoftMax();
+  float sum = 0.0f;
+  for (int i = 0; i < v.Dim(); ++i) sum += v(i);
+  assert(fabs(sum - 1.0f) < 1e-5);
+  assert(fabs(v(19) - 1.0f / (1.0f + expf(-10.0f))) < 1e-5);
+
+  for (int i = 0; i < v.Dim(); ++i) v(i) = i * 10.0f;
+  v.ApplyLogSoftMax();
+  assert(fabs(v(19) + log1pf(expf(-10.0f))) < 1e-5);
+  assert(fabs(v(0) + 190.0f) < 1e-3);
+}
+
+int main() {
+  printf("best kernels: %s\n", simd::Best().name);
+  for (simd::Isa isa : {simd::kScalar,
+                        simd::kSse2,
+                        simd::kAvx2,
+                        simd::kAvx512,
+                        simd::kNeon}) {
+    const simd::Kernels *kernels = simd::Get(isa);
+    if (kernels == nullptr) continue;
+    assert(kernels->isa == isa);
+    TestKernels(*kernels);
+  }
+  TestVector();
+  return 0;
+}
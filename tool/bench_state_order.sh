@@ -0,0 +1,47 @@
+#!/bin/bash
+# Created at 2026-10-18
+#
+# Compares the decoding time of fst_state_order none, bfs, dfs and profile on
+# the same HCLG and audios. Usage:
+#   bench_state_order.sh <pocketkaldi> <model-conf> <scp-file>
+# The visits for profile order are collected by decoding scp-file first. The
+# hyps of each order are compared with none, since renumbering states should
+# not change the result
+
+pocketkaldi=$1
+conf=$2
+scp=$3
+if [ $# -ne 3 ]; then
+  echo "Usage: $0 <pocketkaldi> <model-conf> <scp-file>"
+  exit 1
+fi
+
+# Relative paths in config are resolved from its directory, so the configs
+# with fst_state_order are written next to it
+conf_dir=`dirname $conf`
+tmp_prefix=$conf_dir/.bench_state_order.$$
+trap "rm -f $tmp_prefix.*" EXIT
+
+# Collect the visits of states
+grep -iv "^ *\(fst_state_order\|fst_profile\|fst_profile_output\) *=" $conf \
+    > $tmp_prefix.base.conf
+cp $tmp_prefix.base.conf $tmp_prefix.collect.conf
+echo "fst_profile_output=`basename $tmp_prefix`.visits" \
+    >> $tmp_prefix.collect.conf
+$pocketkaldi $tmp_prefix.collect.conf $scp > /dev/null || exit 22
+
+for order in none bfs dfs profile; do
+  order_conf=$tmp_prefix.$order.conf
+  cp $tmp_prefix.base.conf $order_conf
+  echo "fst_state_order=$order" >> $order_conf
+  if [ $order == profile ]; then
+    echo "fst_profile=`basename $tmp_prefix`.visits" >> $order_conf
+  fi
+
+  $pocketkaldi --benchmark $order_conf $scp \
+      > $tmp_prefix.$order.hyp 2> $tmp_prefix.$order.log || exit 22
+  echo "$order: `grep '^benchmark:' $tmp_prefix.$order.log`"
+  if ! cmp -s $tmp_prefix.none.hyp $tmp_prefix.$order.hyp; then
+    echo "$order: hyps differ from none"
+  fi
+done
@@ -0,0 +1,46 @@
+// Created at 2026-10-18
+//
+// Converts HCLG into the compact format with 16-bit labels (HclgCompactFst).
+// The output is aligned, so that it could be mapped in place from a bundle.
+// It fails when any label of HCLG does not fit in 16 bits. Usage:
+//   compact_hclg <in-fst> <out-fst>
+
+#include <stdio.h>
+#include <fstream>
+#include <memory>
+#include "hclg_fst.h"
+
+using pocketkaldi::HclgCompactFst;
+using pocketkaldi::HclgCompactor;
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    printf("Usage: %s <in-fst> <out-fst>\n", argv[0]);
+    return 22;
+  }
+
+  std::unique_ptr<fst::StdFst> graph(fst::StdFst::Read(argv[1]));
+  if (graph == nullptr) {
+    printf("compact_hclg: unable to read %s\n", argv[1]);
+    return 1;
+  }
+  if (!HclgCompactor<fst::StdArc>().Compatible(*graph)) {
+    printf("compact_hclg: labels of %s exceed %d\n",
+           argv[1],
+           HclgCompactor<fst::StdArc>::kMaxLabel - 1);
+    return 1;
+  }
+
+  HclgCompactFst compact_graph(*graph);
+  std::ofstream strm(argv[2], std::ios_base::out | std::ios_base::binary);
+  fst::FstWriteOptions opts(argv[2], true, true, true, true);
+  if (!strm || !compact_graph.Write(strm, opts) || !strm.flush()) {
+    printf("compact_hclg: unable to write %s\n", argv[2]);
+    return 1;
+  }
+
+  printf("compact_hclg: %d states, %d arcs\n",
+         static_cast<int>(compact_graph.NumStates()),
+         static_cast<int>(fst::CountArcs(compact_graph)));
+  return 0;
+}
@@ -4,14 +4,20 @@ import struct
 import math
 import numpy as np
 
-if len(sys.argv) != 3:
-    print("Usage: python3 {}: <text-nnet2-am> <am-bin>".format(sys.argv[0]))
+args = sys.argv[1:]
+int8 = '--int8' in args
+if int8:
+    args.remove('--int8')
+
+if len(args) != 2:
+    print("Usage: python3 {}: [--int8] <text-nnet2-am> <am-bin>".format(sys.argv[0]))
     print("Convert Kaldi nnet2 AM to pocketkaldi format.")
     print("    text-nnet2-am: The text format of nnet2 AM file could be obtained by kaldi/src/nnet2bin/nnet-am-copy.")
+    print("    --int8: Quantize the weights of linear layers into 8-bit.")
     sys.exit(1)
 
-from_file = sys.argv[1]
-to_file = sys.argv[2]
+from_file = args[0]
+to_file = args[1]
 
 
 # Ids for different layers
@@ -21,6 +27,8 @@ SPLICE_LAYER = 6
 BATCHNORM_LAYER = 7
 LOGSOFTMAX_LAYER = 8
 NARROW_LAYER = 9
+QUANTIZED_LINEAR_LAYER = 10
+LSTMP_LAYER = 11
 
 class Layer:
     def write_vector(self, fd, vec):
@@ -74,6 +82,80 @@ class LinearLayer(Layer):
         return "{}: W = ({}, {}), b = ({})".format(
             self.layer_name, self.W.shape[0], self.W.shape[1], self.b.shape[0])
 
+class QuantizedLinearLayer(LinearLayer):
+    def __init__(self, W, b):
+        super().__init__(W, b)
+        self.layer_name = 'QuantizedLinearLayer'
+        self.layer_type = QUANTIZED_LINEAR_LAYER
+
+    def write(self, fd):
+        fd.write(b"LAY0")
+        fd.write(struct.pack("<i", self.layer_type))
+
+        # The same quantization as pocketkaldi::Quantize, the range of W
+        # always contains 0
+        W_min = min(float(self.W.min()), 0.0)
+        W_max = max(float(self.W.max()), 0.0)
+        scale = (W_max - W_min) / 255.0
+        if scale == 0.0:
+            scale = 1.0
+        zero_point = int(round(-W_min / scale))
+        W_8bit = np.clip(np.round(self.W / scale + zero_point), 0, 255)
+        fd.write(struct.pack("<f", scale))
+        fd.write(struct.pack("<i", zero_point))
+        fd.write(struct.pack("<i", self.W.shape[0]))
+        fd.write(struct.pack("<i", self.W.shape[1]))
+        fd.write(W_8bit.astype(np.uint8).tobytes(order='C'))
+        self.write_vector(fd, self.b)
+
+class LstmpLayer(Layer):
+    # W_all: affine of Append(x, r) to the 4 gates in the order of i, f, g, o.
+    # peephole: (3, cell_dim) of w_ic, w_fc, w_oc. W_rp: affine of m to the
+    # output, whose first recurrent_dim dimensions are r. recurrent_scale: the
+    # scale of c and r in cr_trunc (less than 1 with decay-time)
+    def __init__(self, W_all, peephole, W_rp, recurrent_dim, delay,
+                 recurrent_scale):
+        assert(W_all.W.shape[1] == 4 * peephole.shape[1])
+        assert(W_rp.W.shape[0] == peephole.shape[1])
+        self.layer_name = 'LstmpLayer'
+        self.layer_type = LSTMP_LAYER
+        input_dim = W_all.W.shape[0] - recurrent_dim
+        self.W_x = W_all.W[:input_dim]
+        self.W_r = W_all.W[input_dim:]
+        self.b = W_all.b
+        self.peephole = peephole
+        self.W_p = W_rp.W
+        self.b_p = W_rp.b
+        self.delay = delay
+        self.recurrent_scale = recurrent_scale
+
+    def write(self, fd):
+        super().write(fd)
+        self.write_matrix(fd, self.W_x)
+        self.write_matrix(fd, self.W_r)
+        self.write_vector(fd, self.b)
+        self.write_matrix(fd, self.peephole)
+        self.write_matrix(fd, self.W_p)
+        self.write_vector(fd, self.b_p)
+        fd.write(struct.pack("<i", self.delay))
+        fd.write(struct.pack("<f", self.recurrent_scale))
+
+    def input_dim(self):
+        return self.W_x.shape[0]
+
+    def output_dim(self, input_dim):
+        return self.W_p.shape[1]
+
+    def __str__(self):
+        return "{}: input = {}, cell = {}, recurrent = {}, output = {}, delay = {}, scale = {}".format(
+            self.layer_name,
+            self.W_x.shape[0],
+            self.peephole.shape[1],
+            self.W_r.shape[0],
+            self.W_p.shape[1],
+            self.delay,
+            self.recurrent_scale)
+
 class ReluLayer(Layer):
     def __init__(self):
         self.layer_name = 'ReluLayer'
@@ -235,24 +317,63 @@ re_component = re.compile(r'^component-node name=(.*?) component=(.*?) input=(.*
 re_input = re.compile(r'^Append\((.*)\)$')
 re_split = re.compile(r'(Offset\([\w\.]+, *-?\d+\)|[\w\.]+)')
 re_offset = re.compile(r'^Offset\(([\w\.]+), *(-?\d+)\)$')
+re_node_name = re.compile(r'name=([\w\.]+)')
+re_dim = re.compile(r' dim=(\d+)')
+re_lstmp_input = re.compile(
+    r'^Append\(([\w\.]+), *IfDefined\(Offset\(([\w\.]+)\.r_trunc, *(-\d+)\)\)\)$')
+
+# LSTMP of Kaldi xconfig (fast-lstmp-layer) is a group of nodes named
+# <name>.W_all, <name>.lstm_nonlin, <name>.W_rp, <name>.cr_trunc, ... They are
+# converted into one LstmpLayer named <name>, which is built from the
+# components in build_lstmp_layers()
 def parse_nnet3_desc(desc_text):
     lines = desc_text.split('\n')
     prev_name = 'input'
     layers = []
     layer_dict = {}
+    lstmp_groups = {}
     context_left = 0
     context_right = 0
+
+    # The output of LSTMP is one of the nodes in its group
+    def is_prev(name):
+        if prev_name in lstmp_groups:
+            return name.startswith(prev_name + '.')
+        return name == prev_name
+
     for line in lines:
         line = line.strip()
         if line == '':
             continue
         node_type = line.split()[0]
-        assert(node_type in {'component-node', 'input-node', 'output-node'})
+        assert(node_type in {'component-node', 'input-node', 'output-node', 'dim-range-node'})
+        m_name = re_node_name.search(line)
+        if prev_name in lstmp_groups and m_name != None and \
+                m_name.group(1).startswith(prev_name + '.'):
+            # r_trunc is the recurrent part of the output
+            if m_name.group(1) == prev_name + '.r_trunc':
+                m_dim = re_dim.search(line)
+                assert(m_dim != None)
+                lstmp_groups[prev_name]['recurrent_dim'] = int(m_dim.group(1))
+            continue
         if node_type == 'component-node':
             m = re_component.match(line)
             assert(m != None)
             layer_input = m.group(3).strip()
             layer_comp = m.group(2)
+
+            m_lstmp = re_lstmp_input.match(layer_input)
+            if m_lstmp != None and layer_comp.endswith('.W_all'):
+                group = layer_comp[:-len('.W_all')]
+                assert(is_prev(m_lstmp.group(1)) and m_lstmp.group(2) == group)
+                lstmp_groups[group] = {
+                    'delay': -int(m_lstmp.group(3)),
+                    'recurrent_dim': None
+                }
+                layers.append(group)
+                prev_name = group
+                continue
+
             m_input = re_input.match(layer_input)
             if m_input != None:
                 indices = []
@@ -262,12 +383,12 @@ def parse_nnet3_desc(desc_text):
                     if m_offset:
                         from_comp = m_offset.group(1)
                         index = int(m_offset.group(2))
-                        assert(from_comp == prev_name)
+                        assert(is_prev(from_comp))
                         indices.append(index)
                     elif field.strip() in {',', ''}:
                         pass
                     else:
-                        assert(field.strip() == prev_name)
+                        assert(is_prev(field.strip()))
                         indices.append(0)
                 layer_name = layer_comp + '_splice'
                 layer_dict[layer_name] = SpliceLayer(indices)
@@ -284,10 +405,33 @@ def parse_nnet3_desc(desc_text):
                 context_right += narrow_right
                 context_left += narrow_left
             else:
-                assert(layer_input == prev_name)
+                assert(is_prev(layer_input))
             layers.append(layer_comp)
             prev_name = layer_comp
-    return layers, layer_dict, (context_left, context_right)
+    return layers, layer_dict, lstmp_groups, (context_left, context_right)
+
+def build_lstmp_layers(layer_dict, lstmp_groups):
+    for group, info in lstmp_groups.items():
+        W_all = layer_dict.pop(group + '.W_all')
+        peephole = layer_dict.pop(group + '.lstm_nonlin')
+        W_rp = layer_dict.pop(group + '.W_rp')
+        recurrent_scale = layer_dict.pop(group + '.cr_trunc', 1.0)
+
+        if info['recurrent_dim'] == None:
+            raise Exception('r_trunc not found in LSTMP: ' + group)
+        for name in layer_dict:
+            if name.startswith(group + '.'):
+                raise Exception('unexpected component in LSTMP: ' + name)
+        if int8:
+            print('LSTMP {} is kept in float'.format(group))
+        layer_dict[group] = LstmpLayer(
+            W_all,
+            peephole,
+            W_rp,
+            info['recurrent_dim'],
+            info['delay'],
+            recurrent_scale)
+        print(str(layer_dict[group]))
 
 # Nnet token
 def read_nnet(model_text):
@@ -300,7 +444,7 @@ def read_nnet(model_text):
     print('num_components = {}'.format(num_components))
     print('------------------ nnet3_desc ------------------')
     print(nnet3_desc)
-    layers, layer_dict, context = parse_nnet3_desc(nnet3_desc)
+    layers, layer_dict, lstmp_groups, context = parse_nnet3_desc(nnet3_desc)
 
     # Tokens in Components
     print('------------------ read_layer ------------------')
@@ -320,7 +464,10 @@ def read_nnet(model_text):
             W, content_text = read_matrix(content_text)
             content_text = goto_token('BiasParams', content_text)
             b, content_text = read_matrix(content_text)
-            layer_dict[comp_name] = LinearLayer(W.T, b[0])
+            if int8:
+                layer_dict[comp_name] = QuantizedLinearLayer(W.T, b[0])
+            else:
+                layer_dict[comp_name] = LinearLayer(W.T, b[0])
         elif token_tag == 'RectifiedLinearComponent':
             layer_dict[comp_name] = ReluLayer()
         elif token_tag == 'BatchNormComponent':
@@ -336,9 +483,28 @@ def read_nnet(model_text):
             layer_dict[comp_name] = BatchNormLayer(scale, offset)
         elif token_tag == 'LogSoftmaxComponent':
             layer_dict[comp_name] = LogSoftmaxLayer()
+        elif token_tag == 'LstmNonlinearityComponent':
+            # The peephole weights w_ic, w_fc, w_oc
+            content_text = goto_token('Params', content_text)
+            peephole, content_text = read_matrix(content_text)
+            assert(peephole.shape[0] == 3)
+            layer_dict[comp_name] = peephole
+            continue
+        elif token_tag == 'BackpropTruncationComponent':
+            # Output is input * Scale in inference. Scale is missing in the
+            # models before decay-time, which is 1
+            scale = 1.0
+            if re.search(r'<Scale>', content_text):
+                content_text = goto_token('Scale', content_text)
+                scale, content_text = read_float(content_text)
+            if not 0.0 < scale <= 1.0:
+                raise Exception('unexpected Scale {} in {}'.format(scale, comp_name))
+            layer_dict[comp_name] = scale
+            continue
         else:
             raise Exception('unexpected layer name: ' + token_tag)
         print(str(layer_dict[comp_name]))
+    build_lstmp_layers(layer_dict, lstmp_groups)
 
     print('------------------ layers ------------------')
     layer_objects = []
@@ -0,0 +1,250 @@
+// Created at 2026-10-18
+//
+// Converts an OpenFST binary file into pocketkaldi Fst format (pk::fst_0).
+// States are streamed from the input fst, so besides the input itself only
+// the arcs of one state are kept in memory. Usage:
+//   convert_fstfmt <openfst-binfile> <output-binfile> [text|binary]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+#include "fst.h"
+#include "status.h"
+#include "util.h"
+#undef DISALLOW_COPY_AND_ASSIGN
+#include "fst/fstlib.h"
+
+using pocketkaldi::Fst;
+using pocketkaldi::FstArc;
+using pocketkaldi::Status;
+using pocketkaldi::util::Format;
+
+namespace {
+
+void CheckStatus(const Status &status) {
+  if (!status.ok()) {
+    printf("convert_fstfmt: %s\n", status.what().c_str());
+    exit(1);
+  }
+}
+
+// Writes fst in pk::fst_0 format
+class FstWriter {
+ public:
+  FstWriter(): fd_(nullptr), text_(false) {}
+  ~FstWriter() {
+    if (fd_) fclose(fd_);
+    fd_ = nullptr;
+  }
+
+  Status Open(const std::string &filename, bool text) {
+    filename_ = filename;
+    text_ = text;
+    fd_ = fopen(filename.c_str(), text ? "w" : "wb");
+    if (fd_ == nullptr) {
+      return Status::IOError(Format("Unable to open {}", filename));
+    }
+
+    // Writes are large sequential, so use a large buffer
+    setvbuf(fd_, nullptr, _IOFBF, kBufferSize);
+    return Status::OK();
+  }
+
+  // Converts fst and writes it into file
+  Status Write(const fst::StdFst &fst) {
+    // First pass: count states and arcs, and get the arc index of each state
+    std::vector<int32_t> state_idx;
+    int64_t arc_number = 0;
+    for (fst::StateIterator<fst::StdFst> state_iter(fst);
+         !state_iter.Done();
+         state_iter.Next()) {
+      int state = state_iter.Value();
+      if (state != state_idx.size()) {
+        return Status::Corruption("state ids are not contiguous");
+      }
+      int num_arcs = fst.NumArcs(state);
+      state_idx.push_back(num_arcs ? arc_number : Fst::kNoState);
+      arc_number += num_arcs;
+    }
+    int64_t state_number = state_idx.size();
+
+    // Verify section size the same way Fst::Read() does
+    int64_t section_size = Fst::SectionSize(state_number, arc_number);
+    if (section_size > std::numeric_limits<int32_t>::max()) {
+      return Status::Corruption(Format(
+          "fst too large for {}: section_size = {}",
+          Fst::kSectionName,
+          section_size));
+    }
+
+    // Header
+    PK_CHECK_STATUS(WriteHeader(
+        section_size,
+        state_number,
+        arc_number,
+        fst.Start()));
+
+    // Final weights
+    if (text_) fprintf(fd_, "============ final =============\n");
+    for (int state = 0; state < state_number; ++state) {
+      float final = fst.Final(state).Value();
+      if (text_) {
+        fprintf(fd_, "%d -> %g\n", state, final);
+      } else {
+        PK_CHECK_STATUS(WriteValue(final));
+      }
+    }
+
+    // State idx
+    if (text_) fprintf(fd_, "============ state_arcidx =============\n");
+    for (int state = 0; state < state_number; ++state) {
+      if (text_) {
+        fprintf(fd_, "%d -> %d\n", state, state_idx[state]);
+      } else {
+        PK_CHECK_STATUS(WriteValue(state_idx[state]));
+      }
+    }
+
+    // Second pass: arcs of each state sorted by ilabel
+    if (text_) fprintf(fd_, "============ arcs =============\n");
+    std::vector<FstArc> arcs;
+    int64_t arc_idx = 0;
+    for (int state = 0; state < state_number; ++state) {
+      arcs.clear();
+      for (fst::ArcIterator<fst::StdFst> arc_iter(fst, state);
+           !arc_iter.Done();
+           arc_iter.Next()) {
+        const fst::StdArc &arc = arc_iter.Value();
+        arcs.emplace_back(
+            arc.nextstate,
+            arc.ilabel,
+            arc.olabel,
+            arc.weight.Value());
+      }
+      std::stable_sort(
+          arcs.begin(),
+          arcs.end(),
+          [] (const FstArc &l, const FstArc &r) {
+            return l.input_label < r.input_label;
+          });
+
+      if (text_) {
+        for (const FstArc &arc : arcs) {
+          fprintf(
+              fd_,
+              "%lld -> next_state(%d), input_label(%d), output_label(%d), "
+              "weight(%g)\n",
+              static_cast<long long>(arc_idx),
+              arc.next_state,
+              arc.input_label,
+              arc.output_label,
+              arc.weight);
+          ++arc_idx;
+        }
+      } else if (!arcs.empty()) {
+        if (fwrite(arcs.data(), sizeof(FstArc), arcs.size(), fd_) !=
+            arcs.size()) {
+          return Status::IOError(Format("Unable to write {}", filename_));
+        }
+        arc_idx += arcs.size();
+      }
+    }
+
+    if (fflush(fd_) != 0) {
+      return Status::IOError(Format("Unable to write {}", filename_));
+    }
+
+    // Check the total size of binary file
+    if (!text_) {
+      int64_t expected_size = kSectionNameSize + sizeof(int32_t) + section_size;
+      int64_t file_size = ftell(fd_);
+      if (file_size != expected_size) {
+        return Status::Corruption(Format(
+            "file_size == {} expected, but {} found",
+            expected_size,
+            file_size));
+      }
+    }
+
+    return Status::OK();
+  }
+
+ private:
+  static constexpr int kBufferSize = 4 * 1024 * 1024;
+  static constexpr int kSectionNameSize = 32;
+
+  Status WriteHeader(int64_t section_size,
+                     int32_t state_number,
+                     int32_t arc_number,
+                     int32_t start_state) {
+    if (text_) {
+      fprintf(fd_, "state_number = %d\n", state_number);
+      fprintf(fd_, "arc_number = %d\n", arc_number);
+      fprintf(fd_, "start_state = %d\n", start_state);
+      return Status::OK();
+    }
+
+    char section_name[kSectionNameSize];
+    memset(section_name, 0, sizeof(section_name));
+    strncpy(section_name, Fst::kSectionName, sizeof(section_name) - 1);
+    if (fwrite(section_name, 1, kSectionNameSize, fd_) != kSectionNameSize) {
+      return Status::IOError(Format("Unable to write {}", filename_));
+    }
+    PK_CHECK_STATUS(WriteValue<int32_t>(section_size));
+    PK_CHECK_STATUS(WriteValue(state_number));
+    PK_CHECK_STATUS(WriteValue(arc_number));
+    PK_CHECK_STATUS(WriteValue(start_state));
+    return Status::OK();
+  }
+
+  template<typename T>
+  Status WriteValue(T val) {
+    if (fwrite(&val, sizeof(T), 1, fd_) != 1) {
+      return Status::IOError(Format("Unable to write {}", filename_));
+    }
+    return Status::OK();
+  }
+
+  std::string filename_;
+  FILE *fd_;
+  bool text_;
+};
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 3 && argc != 4) {
+    printf("Usage: %s <openfst-binfile> <output-binfile> [text|binary]\n",
+           argv[0]);
+    return 22;
+  }
+
+  bool text = false;
+  if (argc == 4) {
+    if (std::string(argv[3]) == "text") {
+      text = true;
+    } else if (std::string(argv[3]) != "binary") {
+      printf("Usage: %s <openfst-binfile> <output-binfile> [text|binary]\n",
+             argv[0]);
+      return 22;
+    }
+  }
+
+  fst::StdFst *input_fst = fst::StdFst::Read(argv[1]);
+  if (input_fst == nullptr) {
+    printf("convert_fstfmt: unable to read %s\n", argv[1]);
+    return 1;
+  }
+
+  FstWriter writer;
+  CheckStatus(writer.Open(argv[2], text));
+  CheckStatus(writer.Write(*input_fst));
+  delete input_fst;
+
+  printf("Success\n");
+  return 0;
+}
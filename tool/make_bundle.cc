@@ -0,0 +1,46 @@
+// Created at 2026-10-18
+//
+// Packs model files into a single bundle file. Usage:
+//   make_bundle <output-bundle> <key>=<file> [<key>=<file> ...]
+// Keys are the same as in configuration file, for example:
+//   make_bundle model.bundle fst=HCLG.fst nnet=final.nnet prior=prior.bin \
+//       tid2pdf=t2pdf.bin symbol_table=words.txt large_lm=G.pfst \
+//       original_lm=lm.1order.bin
+// Then set "bundle = model.bundle" in configuration file instead of the paths
+
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "bundle.h"
+
+using pocketkaldi::Bundle;
+using pocketkaldi::Status;
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    printf("Usage: %s <output-bundle> <key>=<file> [<key>=<file> ...]\n",
+           argv[0]);
+    return 22;
+  }
+
+  std::vector<std::pair<std::string, std::string>> files;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t pos = arg.find('=');
+    if (pos == std::string::npos || pos == 0) {
+      printf("make_bundle: <key>=<file> expected, but '%s' found\n", argv[i]);
+      return 22;
+    }
+    files.emplace_back(arg.substr(0, pos), arg.substr(pos + 1));
+  }
+
+  Status status = Bundle::Write(argv[1], files);
+  if (!status.ok()) {
+    printf("make_bundle: %s\n", status.what().c_str());
+    return 1;
+  }
+
+  printf("Success\n");
+  return 0;
+}
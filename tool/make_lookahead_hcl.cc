@@ -0,0 +1,32 @@
+// Created at 2026-10-18
+//
+// Converts HCL into an hcl_lookahead fst for dynamic composition with G
+// (hcl_fst in config), so that recognizer does not need to compute the
+// label-reachability data at every startup. The output labels of HCL are
+// relabeled, G is relabeled to match them when recognizer loads it. Usage:
+//   make_lookahead_hcl <in-fst> <out-fst>
+
+#include <stdio.h>
+#include <memory>
+#include "hclg_fst.h"
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    printf("Usage: %s <in-fst> <out-fst>\n", argv[0]);
+    return 22;
+  }
+
+  std::unique_ptr<fst::StdFst> hcl(fst::StdFst::Read(argv[1]));
+  if (hcl == nullptr) {
+    printf("make_lookahead_hcl: unable to read %s\n", argv[1]);
+    return 1;
+  }
+
+  pocketkaldi::HclLookAheadFst lookahead_hcl(*hcl);
+  if (!lookahead_hcl.Write(argv[2])) {
+    printf("make_lookahead_hcl: unable to write %s\n", argv[2]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -48,4 +48,4 @@ utils/mkgraph.sh pasco_graph/lang_test exp/tri5a pasco_graph || exit 22
 gunzip -c $lm | python3 $POCKETKALDI_ROOT/tool/prune_lm.py > $lm_1order_arpa || exit 22
 python3 $POCKETKALDI_ROOT/tool/convert_unigram.py $lm_1order_arpa pasco_graph/lang_test/words.txt lm.1order.bin
 gunzip -c $lm | arpa2fst --read-symbol-table=pasco_graph/lang_test/words.txt - G_raw.fst
-python $POCKETKALDI_ROOT/tool/convert_fstfmt.py G_raw.fst G.pfst
+${POCKETKALDI_BIN:-$POCKETKALDI_ROOT/build}/convert_fstfmt G_raw.fst G.pfst
@@ -0,0 +1,66 @@
+// Created at 2026-10-18
+//
+// Renumbers the states of HCLG offline, so that recognizer does not need to
+// reorder it at every startup. Usage:
+//   reorder_graph <bfs|dfs|profile> <in-fst> <out-fst> [<profile>]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "graph_order.h"
+
+using pocketkaldi::GraphOrder;
+using pocketkaldi::Status;
+
+void CheckStatus(const Status &status) {
+  if (!status.ok()) {
+    printf("reorder_graph: %s\n", status.what().c_str());
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4 && argc != 5) {
+    printf("Usage: %s <bfs|dfs|profile> <in-fst> <out-fst> [<profile>]\n",
+           argv[0]);
+    return 22;
+  }
+
+  int order_type = GraphOrder::kNone;
+  CheckStatus(GraphOrder::ParseName(argv[1], &order_type));
+
+  fst::StdFst *graph = fst::StdFst::Read(argv[2]);
+  if (graph == nullptr) {
+    printf("reorder_graph: unable to read %s\n", argv[2]);
+    return 1;
+  }
+
+  std::vector<int32_t> order;
+  if (order_type == GraphOrder::kBfs) {
+    GraphOrder::Bfs(*graph, &order);
+  } else if (order_type == GraphOrder::kDfs) {
+    GraphOrder::Dfs(*graph, &order);
+  } else if (order_type == GraphOrder::kProfile) {
+    if (argc != 5) {
+      printf("reorder_graph: profile expected\n");
+      return 22;
+    }
+    std::vector<int64_t> visits;
+    CheckStatus(GraphOrder::ReadVisits(argv[4], &visits));
+    GraphOrder::Profile(*graph, visits, &order);
+  } else {
+    printf("reorder_graph: nothing to do\n");
+    return 22;
+  }
+
+  fst::ConstFst<fst::StdArc> *sorted_graph = GraphOrder::Apply(*graph, order);
+  if (!sorted_graph->Write(argv[3])) {
+    printf("reorder_graph: unable to write %s\n", argv[3]);
+    return 1;
+  }
+
+  delete sorted_graph;
+  delete graph;
+  return 0;
+}